@@ -16,7 +16,7 @@ void verify_int(int expected, int result, char test[]) {
   }
 }
 
-void verify_str(char expected[], char result[], char test[]) {
+void verify_str(const char expected[], const char result[], char test[]) {
   if ((NULL == expected && NULL == result) ||
       (NULL != expected && NULL != result && strcmp(expected, result) == 0)) {
     printf("Passed: expected '%s', got '%s' for: %s\n", expected, result, test);
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "a5_bench.h"
+
+static uint64_t Rand_State = 0x9E3779B97F4A7C15ULL;
+
+double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_seed(uint64_t seed) {
+  Rand_State = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// xorshift64*: fast and reproducible across platforms
+uint64_t bench_rand(void) {
+  Rand_State ^= Rand_State >> 12;
+  Rand_State ^= Rand_State << 25;
+  Rand_State ^= Rand_State >> 27;
+  return Rand_State * 0x2545F4914F6CDD1DULL;
+}
+
+uint64_t bench_rand_below(uint64_t limit) {
+  assert(limit > 0);
+  return bench_rand() % limit;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+void bench_sort(double samples[], int count) {
+  qsort(samples, count, sizeof(double), compare_doubles);
+}
+
+double bench_percentile(double sorted[], int count, double p) {
+  assert(count > 0);
+  int pos = (int)(p * (count - 1) + 0.5);
+  return sorted[pos];
+}
+
+void bench_print_header(void) {
+  printf("benchmark,params,warmup,reps,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+}
+
+void bench_report(char *benchmark, char *params, int warmup, double samples[], int count) {
+  assert(NULL != benchmark && NULL != params);
+  assert(NULL != samples || 0 == count);
+
+  double sum = 0;
+
+  if (count <= 0) {
+    printf("%s,%s,%d,0,,,,,,\n", benchmark, params, warmup);
+  } else {
+    bench_sort(samples, count);
+    for (int i = 0; i < count; i++) {
+      sum += samples[i];
+    }
+    printf("%s,%s,%d,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n", benchmark, params, warmup, count,
+           samples[0] * 1e9, sum / count * 1e9,
+           bench_percentile(samples, count, 0.50) * 1e9, bench_percentile(samples, count, 0.90) * 1e9,
+           bench_percentile(samples, count, 0.99) * 1e9, samples[count - 1] * 1e9);
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,418 @@
+// Benchmarks for the IMFFS operations at several file-size mixes and fill
+// levels, printed as CSV, followed by a sweep over block sizes and one over
+// device sizes.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "a5_imffs.h"
+#include "a5_bench.h"
+
+#define BENCH_BLOCKS 16384
+#define SWEEP_FILES 1000
+#define POOL_FILES 64
+#define DEFAULT_WARMUP 20
+#define DEFAULT_REPS 200
+#define DEFRAG_REPS 5
+#define MAX_NAME 64
+#define COPY_BLOCK_SIZE 4096
+#define COPY_CHUNK (1024 * 1024)      // bytes per imffs_read call
+#define MAX_COPY_BYTES (256ULL << 20) // copied into a device, at most half of it
+
+typedef struct {
+  char *name;
+  uint32_t min_size;
+  uint32_t max_size;
+} SizeMix;
+
+static SizeMix Mixes[] = {
+  { "small", 1, 256 },
+  { "medium", 1024, 16384 },
+  { "large", 65536, 262144 },
+  { "mixed", 1, 262144 },
+};
+
+static int Fills[] = { 25, 50, 90 };
+
+static uint32_t Block_Sizes[] = { 64, 256, 1024, 4096, 65536, 1048576 };
+
+static uint64_t Device_Sizes[] = { 16ULL << 20, 256ULL << 20, 1ULL << 30, 4ULL << 30 };
+
+static char Pool_Dir[] = "/tmp/a5_bench_XXXXXX";
+static char Pool_Names[POOL_FILES][MAX_NAME];
+static uint32_t Pool_Sizes[POOL_FILES];
+
+typedef struct {
+  int pool;     // which pool file it was saved from, -1 if the slot is empty
+  char name[MAX_NAME];
+} Slot;
+
+// blocks used by a saved file: a file always ends with a partial (or empty)
+// block, unless it's smaller than a block and stored inline
+static uint32_t blocks_for(uint32_t size) {
+  return size < IMFFS_DEFAULT_BLOCK_SIZE ? 0 : size / IMFFS_DEFAULT_BLOCK_SIZE + 1;
+}
+
+// picks a power-of-two range first and then a size inside it, so that a
+// wide mix still has plenty of small files
+static uint32_t random_size(SizeMix *mix) {
+  uint32_t lo = mix->min_size, hi;
+  int ranges = 0;
+
+  for (uint32_t s = mix->min_size; s < mix->max_size; s *= 2) {
+    ranges++;
+  }
+  if (ranges > 0) {
+    lo = mix->min_size << bench_rand_below(ranges);
+  }
+  hi = lo * 2 > mix->max_size ? mix->max_size : lo * 2;
+
+  return lo + bench_rand_below(hi - lo + 1);
+}
+
+static int make_pool(SizeMix *mix) {
+  FILE *out;
+  uint8_t buffer[4096];
+  uint32_t left, chunk;
+  int result = 0;
+
+  for (int i = 0; i < POOL_FILES && 0 == result; i++) {
+    Pool_Sizes[i] = random_size(mix);
+    snprintf(Pool_Names[i], MAX_NAME, "%s/%d", Pool_Dir, i);
+    out = fopen(Pool_Names[i], "w");
+    if (NULL == out) {
+      fprintf(stderr, "Error: unable to create '%s'.\n", Pool_Names[i]);
+      result = -1;
+    } else {
+      for (left = Pool_Sizes[i]; left > 0; left -= chunk) {
+        chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        for (uint32_t j = 0; j < chunk; j++) {
+          buffer[j] = (uint8_t)bench_rand();
+        }
+        fwrite(buffer, 1, chunk, out);
+      }
+      fclose(out);
+    }
+  }
+
+  return result;
+}
+
+static void remove_pool(void) {
+  for (int i = 0; i < POOL_FILES; i++) {
+    unlink(Pool_Names[i]);
+  }
+}
+
+// saves a random pool file that fits in the free blocks, -1 if none does
+static int save_random(IMFFSPtr fs, Slot *slot, uint32_t free_blocks, double *elapsed) {
+  int pool = -1;
+  double start;
+
+  for (int tries = 0; tries < POOL_FILES && pool < 0; tries++) {
+    int p = bench_rand_below(POOL_FILES);
+    if (blocks_for(Pool_Sizes[p]) <= free_blocks) {
+      pool = p;
+    }
+  }
+  for (int p = 0; p < POOL_FILES && pool < 0; p++) {
+    if (blocks_for(Pool_Sizes[p]) <= free_blocks) {
+      pool = p;
+    }
+  }
+
+  if (pool >= 0) {
+    start = bench_now();
+    if (IMFFS_OK != imffs_save(fs, Pool_Names[pool], slot->name)) {
+      pool = -1;
+    }
+    *elapsed = bench_now() - start;
+  }
+  slot->pool = pool;
+
+  return pool;
+}
+
+static void bench_mix_fill(SizeMix *mix, int fill, int warmup, int reps) {
+  IMFFSPtr fs = NULL;
+  Slot *slots = NULL;
+  int total = warmup + reps, slot_count = 0, live;
+  double *save_samples = malloc(total * sizeof(double));
+  double *delete_samples = malloc(total * sizeof(double));
+  double *samples = malloc(total * sizeof(double));
+  uint32_t free_blocks = BENCH_BLOCKS;
+  uint32_t target = (uint64_t)BENCH_BLOCKS * fill / 100;
+  char params[64], tmp_name[] = "renamed";
+  double start, elapsed;
+  int s, old_pool;
+
+  snprintf(params, sizeof(params), "mix=%s;fill=%d", mix->name, fill);
+
+  if (NULL == save_samples || NULL == delete_samples || NULL == samples ||
+      NULL == (slots = calloc(BENCH_BLOCKS, sizeof(Slot))) ||
+      IMFFS_OK != imffs_create(BENCH_BLOCKS, IMFFS_DEFAULT_BLOCK_SIZE, &fs)) {
+    fprintf(stderr, "Error: unable to set up %s.\n", params);
+  } else {
+
+    // fill to the target level
+    while (free_blocks > BENCH_BLOCKS - target && slot_count < BENCH_BLOCKS) {
+      Slot *slot = &slots[slot_count];
+      snprintf(slot->name, MAX_NAME, "f%d", slot_count);
+      if (save_random(fs, slot, free_blocks - (BENCH_BLOCKS - target), &elapsed) < 0) {
+        break;
+      }
+      free_blocks -= blocks_for(Pool_Sizes[slot->pool]);
+      slot_count++;
+    }
+    live = slot_count;
+
+    if (0 == live) {
+      fprintf(stderr, "Error: no files fit for %s.\n", params);
+    } else {
+
+      for (int i = 0; i < total; i++) {
+        s = bench_rand_below(slot_count);
+        start = bench_now();
+        imffs_load(fs, slots[s].name, "/dev/null");
+        samples[i] = bench_now() - start;
+      }
+      bench_report("imffs_load", params, warmup, samples + warmup, reps);
+
+      for (int i = 0; i < total; i++) {
+        s = bench_rand_below(slot_count);
+        start = bench_now();
+        imffs_rename(fs, slots[s].name, tmp_name);
+        samples[i] = bench_now() - start;
+        imffs_rename(fs, tmp_name, slots[s].name);
+      }
+      bench_report("imffs_rename", params, warmup, samples + warmup, reps);
+
+      // churn at a constant fill level: delete a file, save another in its place
+      int saves = 0;
+      for (int i = 0; i < total; i++) {
+        s = bench_rand_below(slot_count);
+        old_pool = slots[s].pool;
+        free_blocks += blocks_for(Pool_Sizes[old_pool]);
+        start = bench_now();
+        imffs_delete(fs, slots[s].name);
+        delete_samples[i] = bench_now() - start;
+        if (save_random(fs, &slots[s], free_blocks, &elapsed) < 0) {
+          // keep the slot occupied so every slot stays loadable
+          slots[s].pool = old_pool;
+          imffs_save(fs, Pool_Names[old_pool], slots[s].name);
+        } else {
+          save_samples[saves++] = elapsed;
+        }
+        free_blocks -= blocks_for(Pool_Sizes[slots[s].pool]);
+      }
+      bench_report("imffs_delete", params, warmup, delete_samples + warmup, reps);
+      if (saves > warmup) {
+        bench_report("imffs_save", params, warmup, save_samples + warmup, saves - warmup);
+      } else {
+        bench_report("imffs_save", params, warmup, save_samples, 0);
+      }
+
+      // defragment after re-fragmenting a tenth of the files each time
+      for (int i = 0; i < DEFRAG_REPS + 1; i++) {
+        for (int j = 0; j < slot_count / 10; j++) {
+          s = bench_rand_below(slot_count);
+          old_pool = slots[s].pool;
+          free_blocks += blocks_for(Pool_Sizes[old_pool]);
+          imffs_delete(fs, slots[s].name);
+          if (save_random(fs, &slots[s], free_blocks, &elapsed) < 0) {
+            slots[s].pool = old_pool;
+            imffs_save(fs, Pool_Names[old_pool], slots[s].name);
+          }
+          free_blocks -= blocks_for(Pool_Sizes[slots[s].pool]);
+        }
+        start = bench_now();
+        imffs_defrag(fs);
+        samples[i] = bench_now() - start;
+      }
+      bench_report("imffs_defrag", params, 1, samples + 1, DEFRAG_REPS);
+    }
+
+    imffs_destroy(fs);
+  }
+
+  free(slots);
+  free(save_samples);
+  free(delete_samples);
+  free(samples);
+}
+
+// saves SWEEP_FILES files from the pool into a device just big enough for
+// them, loads them all back, and reports throughput and space overheads
+static void bench_block_size(SizeMix *mix, uint32_t block_size) {
+  IMFFSPtr fs = NULL;
+  IMFFSUsage usage;
+  uint64_t blocks = 0, bytes = 0, used_bytes;
+  char name[MAX_NAME];
+  double start, save_time, load_time;
+  int failed = 0;
+
+  for (int i = 0; i < SWEEP_FILES; i++) {
+    blocks += Pool_Sizes[i % POOL_FILES] / block_size + 1;
+    bytes += Pool_Sizes[i % POOL_FILES];
+  }
+
+  if (IMFFS_OK != imffs_create(blocks, block_size, &fs)) {
+    fprintf(stderr, "Error: unable to create a device of %llu blocks of %u bytes.\n",
+            (unsigned long long)blocks, block_size);
+    return;
+  }
+  // every file in blocks, so that only the block size changes
+  imffs_set_inline_limit(fs, 0);
+
+  start = bench_now();
+  for (int i = 0; i < SWEEP_FILES; i++) {
+    snprintf(name, MAX_NAME, "s%d", i);
+    failed += IMFFS_OK != imffs_save(fs, Pool_Names[i % POOL_FILES], name);
+  }
+  save_time = bench_now() - start;
+
+  start = bench_now();
+  for (int i = 0; i < SWEEP_FILES; i++) {
+    snprintf(name, MAX_NAME, "s%d", i);
+    failed += IMFFS_OK != imffs_load(fs, name, "/dev/null");
+  }
+  load_time = bench_now() - start;
+
+  imffs_usage(fs, &usage);
+  used_bytes = usage.used_blocks * block_size;
+  printf("%s,%u,%d,%llu,%llu,%.1f,%llu,%.2f,%.2f,%.1f,%.1f%s\n", mix->name, block_size, SWEEP_FILES,
+         (unsigned long long)bytes, (unsigned long long)used_bytes, 100.0 * (used_bytes - bytes) / used_bytes,
+         (unsigned long long)usage.metadata_bytes, 100.0 * usage.metadata_bytes / bytes,
+         (double)usage.extent_count / usage.file_count, bytes / save_time / 1e6, bytes / load_time / 1e6,
+         failed > 0 ? ",failed" : "");
+
+  imffs_destroy(fs);
+}
+
+// creates a device, then saves a file into it, saves it again over the
+// blocks it freed, and reads it back a chunk at a time: the first save is
+// the one that commits the pages
+static void bench_device_size(uint64_t device_bytes, uint8_t *chunk) {
+  IMFFSPtr fs = NULL;
+  uint64_t copy_bytes = device_bytes / 2 < MAX_COPY_BYTES ? device_bytes / 2 : MAX_COPY_BYTES;
+  uint64_t got;
+  char source[MAX_NAME], name[] = "copy";
+  double start, create_time, save_time, resave_time, read_time;
+  int failed = 0;
+  FILE *out;
+
+  snprintf(source, MAX_NAME, "%s/copy", Pool_Dir);
+  out = fopen(source, "w");
+  if (NULL == out) {
+    fprintf(stderr, "Error: unable to create '%s'.\n", source);
+    return;
+  }
+  for (uint64_t at = 0; at < copy_bytes; at += COPY_CHUNK) {
+    fwrite(chunk, 1, COPY_CHUNK, out);
+  }
+  fclose(out);
+
+  start = bench_now();
+  if (IMFFS_OK != imffs_create(device_bytes / COPY_BLOCK_SIZE, COPY_BLOCK_SIZE, &fs)) {
+    fprintf(stderr, "Error: unable to create a device of %llu bytes.\n", (unsigned long long)device_bytes);
+    unlink(source);
+    return;
+  }
+  create_time = bench_now() - start;
+
+  start = bench_now();
+  failed += IMFFS_OK != imffs_save(fs, source, name);
+  save_time = bench_now() - start;
+
+  failed += IMFFS_OK != imffs_delete(fs, name);
+  start = bench_now();
+  failed += IMFFS_OK != imffs_save(fs, source, name);
+  resave_time = bench_now() - start;
+
+  start = bench_now();
+  for (uint64_t at = 0; at < copy_bytes; at += COPY_CHUNK) {
+    failed += IMFFS_OK != imffs_read(fs, name, at, chunk, COPY_CHUNK, &got) || COPY_CHUNK != got;
+  }
+  read_time = bench_now() - start;
+
+  printf("%llu,%u,%llu,%.1f,%.1f,%.1f,%.1f%s\n", (unsigned long long)device_bytes, COPY_BLOCK_SIZE,
+         (unsigned long long)copy_bytes, create_time * 1e6, copy_bytes / save_time / 1e6,
+         copy_bytes / resave_time / 1e6, copy_bytes / read_time / 1e6, failed > 0 ? ",failed" : "");
+
+  imffs_destroy(fs);
+  unlink(source);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, result = 0;
+  int warmup = DEFAULT_WARMUP, reps = DEFAULT_REPS;
+  uint64_t seed = 1;
+  uint8_t *chunk = NULL;
+
+  while (0 == result && (opt = getopt(argc, argv, "w:r:s:h")) != -1) {
+    switch (opt) {
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      result = -1;
+      break;
+    }
+  }
+
+  if (result < 0 || argc > optind || warmup < 0 || reps < 1) {
+    fprintf(stderr, "Usage: %s [-w warmup] [-r reps] [-s seed]\n", argv[0]);
+    return 1;
+  }
+
+  if (NULL == mkdtemp(Pool_Dir)) {
+    fprintf(stderr, "Error: unable to create a directory for the source files.\n");
+    return 1;
+  }
+
+  bench_seed(seed);
+  bench_print_header();
+  for (size_t m = 0; m < sizeof(Mixes) / sizeof(Mixes[0]) && 0 == result; m++) {
+    result = make_pool(&Mixes[m]);
+    for (size_t f = 0; f < sizeof(Fills) / sizeof(Fills[0]) && 0 == result; f++) {
+      bench_mix_fill(&Mixes[m], Fills[f], warmup, reps);
+    }
+    remove_pool();
+  }
+
+  printf("\n# block size sweep: %d files per mix, throughput in MB/s\n", SWEEP_FILES);
+  printf("mix,block_size,files,data_bytes,used_bytes,slack_pct,metadata_bytes,metadata_pct,extents_per_file,save_mb_s,load_mb_s\n");
+  for (size_t m = 0; m < sizeof(Mixes) / sizeof(Mixes[0]) && 0 == result; m++) {
+    result = make_pool(&Mixes[m]);
+    for (size_t b = 0; b < sizeof(Block_Sizes) / sizeof(Block_Sizes[0]) && 0 == result; b++) {
+      bench_block_size(&Mixes[m], Block_Sizes[b]);
+    }
+    remove_pool();
+  }
+
+  printf("\n# device size sweep: creating a device and copying into it, throughput in MB/s\n");
+  printf("device_bytes,block_size,copy_bytes,create_us,first_save_mb_s,resave_mb_s,read_mb_s\n");
+  if (0 == result && NULL == (chunk = malloc(COPY_CHUNK))) {
+    result = -1;
+  }
+  for (int i = 0; i < COPY_CHUNK && 0 == result; i++) {
+    chunk[i] = (uint8_t)bench_rand();
+  }
+  for (size_t d = 0; d < sizeof(Device_Sizes) / sizeof(Device_Sizes[0]) && 0 == result; d++) {
+    bench_device_size(Device_Sizes[d], chunk);
+  }
+  free(chunk);
+  rmdir(Pool_Dir);
+
+  return 0 == result ? 0 : 1;
+}
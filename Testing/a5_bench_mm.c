@@ -0,0 +1,161 @@
+// Microbenchmarks for the multimap, printed as CSV.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "a5_multimap.h"
+#include "a5_bench.h"
+
+#define DEFAULT_MAX_KEYS 100000
+#define DEFAULT_WARMUP 100
+#define DEFAULT_REPS 1000
+#define ITERATION_KEYS 1000000 // keys visited per size, to size the iteration reps
+
+static int compare_ints(void *a, void *b) {
+  assert(NULL != a && NULL != b);
+  int *ia = a, *ib = b;
+  return (*ia > *ib) - (*ia < *ib);
+}
+
+// same value ordering as the IMFFS index: append in insertion order
+static int compare_always_greater(void *a, void *b) {
+  assert(NULL != a && NULL != b);
+  return 1;
+}
+
+static void bench_size(int n, int warmup, int reps) {
+  int total = warmup + reps;
+  int *keys = malloc(n * sizeof(int));
+  int *new_keys = malloc(total * sizeof(int));
+  int *order = malloc(n * sizeof(int));
+  double *samples = malloc(total * sizeof(double));
+  double *remove_samples = malloc(total * sizeof(double));
+  Value *values = malloc(2 * sizeof(Value));
+  Multimap *mm;
+  char params[64];
+  double start;
+  void *key;
+  int tmp, pos, iterations;
+
+  if (NULL == keys || NULL == new_keys || NULL == order || NULL == samples || NULL == remove_samples || NULL == values) {
+    fprintf(stderr, "Error: not enough memory to benchmark %d keys.\n", n);
+  } else if (NULL == (mm = mm_create(n + total, compare_ints, compare_always_greater))) {
+    fprintf(stderr, "Error: unable to create a multimap with %d keys.\n", n + total);
+  } else {
+    snprintf(params, sizeof(params), "keys=%d", n);
+
+    // even keys are in the map, odd keys are used for insert/remove pairs
+    for (int i = 0; i < n; i++) {
+      keys[i] = 2 * i;
+      order[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+      pos = bench_rand_below(i + 1);
+      tmp = order[i];
+      order[i] = order[pos];
+      order[pos] = tmp;
+    }
+    start = bench_now();
+    for (int i = 0; i < n; i++) {
+      mm_insert_value(mm, &keys[order[i]], 1, &keys[order[i]]);
+    }
+    fprintf(stderr, "built %d keys in %.3f s\n", n, bench_now() - start);
+
+    for (int i = 0; i < total; i++) {
+      pos = bench_rand_below(n);
+      start = bench_now();
+      mm_get_values(mm, &keys[pos], values, 2);
+      samples[i] = bench_now() - start;
+    }
+    bench_report("mm_get_values", params, warmup, samples + warmup, reps);
+
+    for (int i = 0; i < total; i++) {
+      new_keys[i] = 2 * bench_rand_below(n) + 1;
+      start = bench_now();
+      mm_insert_value(mm, &new_keys[i], 1, &new_keys[i]);
+      samples[i] = bench_now() - start;
+      start = bench_now();
+      mm_remove_key(mm, &new_keys[i]);
+      remove_samples[i] = bench_now() - start;
+    }
+    bench_report("mm_insert_value(new key)", params, warmup, samples + warmup, reps);
+    bench_report("mm_remove_key", params, warmup, remove_samples + warmup, reps);
+
+    for (int i = 0; i < total; i++) {
+      pos = bench_rand_below(n);
+      start = bench_now();
+      mm_insert_value(mm, &keys[pos], 2, &keys[pos]);
+      samples[i] = bench_now() - start;
+    }
+    bench_report("mm_insert_value(existing key)", params, warmup, samples + warmup, reps);
+
+    // one sample per full traversal, reported per key visited
+    iterations = ITERATION_KEYS / n;
+    if (iterations < 3) {
+      iterations = 3;
+    }
+    if (iterations > total) {
+      iterations = total;
+    }
+    for (int i = 0; i < iterations; i++) {
+      start = bench_now();
+      if (mm_get_first_key(mm, &key) > 0) {
+        while (mm_get_next_key(mm, &key) > 0) {
+        }
+      }
+      samples[i] = (bench_now() - start) / n;
+    }
+    bench_report("mm_get_next_key", params, 1, samples + 1, iterations - 1);
+
+    mm_destroy(mm);
+  }
+
+  free(keys);
+  free(new_keys);
+  free(order);
+  free(samples);
+  free(remove_samples);
+  free(values);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, result = 0;
+  int max_keys = DEFAULT_MAX_KEYS, warmup = DEFAULT_WARMUP, reps = DEFAULT_REPS;
+  uint64_t seed = 1;
+
+  while (0 == result && (opt = getopt(argc, argv, "n:w:r:s:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      max_keys = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      result = -1;
+      break;
+    }
+  }
+
+  if (result < 0 || argc > optind || max_keys < 1000 || warmup < 0 || reps < 1) {
+    fprintf(stderr, "Usage: %s [-n max_keys (>= 1000)] [-w warmup] [-r reps] [-s seed]\n", argv[0]);
+    return 1;
+  }
+
+  bench_seed(seed);
+  bench_print_header();
+  for (int n = 1000; n <= max_keys; n *= 10) {
+    bench_size(n, warmup, reps);
+  }
+
+  return 0;
+}
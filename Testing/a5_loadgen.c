@@ -0,0 +1,255 @@
+// Load generator for a5_imffs -s: opens many connections to the server,
+// one thread each, and has each send requests back to back for a while:
+// GETs of the same few files, and writes of a file of its own, which it
+// PUTs and DELETEs in turn. It prints the requests per second, and a CSV
+// row of the latencies of each kind of request.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "a5_client.h"
+#include "a5_bench.h"
+
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_SECONDS 5
+#define DEFAULT_FILES 64
+#define DEFAULT_SIZE 4096
+#define DEFAULT_WRITE_PERCENT 10
+#define MAX_CONNECTIONS 4096
+#define THREAD_STACK (256 * 1024)
+#define MAX_NAME 32
+
+typedef enum { OP_GET, OP_PUT, OP_DELETE, NUM_OPS } Op;
+
+static char *Op_Names[NUM_OPS] = { "server_get", "server_put", "server_delete" };
+
+typedef struct {
+  pthread_t thread;
+  uint64_t rng;           // bench_rand isn't for more than one thread
+  double *samples[NUM_OPS];
+  int sample_count[NUM_OPS];
+  int sample_capacity[NUM_OPS];
+  int index;
+  int have_file;          // its own file is there, so the next write deletes it
+  long errors;
+  int failed;             // couldn't connect, or lost the connection
+} LoadThread;
+
+static char *Socket_Path;
+static uint32_t File_Count = DEFAULT_FILES, File_Size = DEFAULT_SIZE;
+static int Write_Percent = DEFAULT_WRITE_PERCENT;
+static pthread_barrier_t Start;
+static double Deadline;   // set by the main thread between the barriers
+
+static uint64_t next_rand(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static int add_sample(LoadThread *load, Op op, double seconds) {
+  double *grown;
+
+  if (load->sample_count[op] == load->sample_capacity[op]) {
+    load->sample_capacity[op] = load->sample_capacity[op] > 0 ? load->sample_capacity[op] * 2 : 1024;
+    grown = realloc(load->samples[op], load->sample_capacity[op] * sizeof(double));
+    if (NULL == grown) {
+      return -1;
+    }
+    load->samples[op] = grown;
+  }
+  load->samples[op][load->sample_count[op]++] = seconds;
+  return 0;
+}
+
+static void *run_connection(void *arg) {
+  LoadThread *load = arg;
+  IMFFSClientPtr client = NULL;
+  IMFFSResult result;
+  uint8_t *buffer = malloc(File_Size + 1);
+  char name[MAX_NAME], own[MAX_NAME];
+  uint64_t got;
+  double start;
+  Op op;
+
+  snprintf(own, MAX_NAME, "own%d", load->index);
+
+  if (NULL == buffer || IMFFS_OK != imffs_client_connect(Socket_Path, &client)) {
+    load->failed = 1;
+  } else {
+    memset(buffer, 'p', File_Size);
+  }
+  // everyone is connected before the clock starts, and the deadline is set
+  pthread_barrier_wait(&Start);
+  pthread_barrier_wait(&Start);
+
+  while (!load->failed && bench_now() < Deadline) {
+    snprintf(name, MAX_NAME, "load%u", (uint32_t)(next_rand(&load->rng) % File_Count));
+    op = next_rand(&load->rng) % 100 >= (uint64_t)Write_Percent ? OP_GET : load->have_file ? OP_DELETE : OP_PUT;
+
+    start = bench_now();
+    if (OP_PUT == op) {
+      result = imffs_client_put(client, own, buffer, File_Size);
+      load->have_file = IMFFS_OK == result;
+    } else if (OP_DELETE == op) {
+      result = imffs_client_delete(client, own);
+      load->have_file = IMFFS_OK != result;
+    } else {
+      result = imffs_client_get(client, name, 0, buffer, File_Size, &got);
+      if (IMFFS_OK == result && got != File_Size) {
+        result = IMFFS_ERROR;
+      }
+    }
+    if (0 != add_sample(load, op, bench_now() - start) || IMFFS_FATAL == result) {
+      load->failed = 1;
+    } else if (IMFFS_OK != result) {
+      load->errors++;
+    }
+  }
+
+  if (NULL != client) {
+    if (load->have_file && !load->failed) {
+      imffs_client_delete(client, own);
+    }
+    imffs_client_close(client);
+  }
+  free(buffer);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int opt, result = 0, connections = DEFAULT_CONNECTIONS, seconds = DEFAULT_SECONDS, started = 0;
+  uint64_t seed = 1;
+  long requests = 0, errors = 0, failed = 0;
+  LoadThread *loads;
+  IMFFSClientPtr client = NULL;
+  pthread_attr_t attr;
+  char name[MAX_NAME], params[128];
+  uint8_t *contents;
+  double start, elapsed, *samples;
+  int count;
+
+  while (0 == result && (opt = getopt(argc, argv, "s:c:d:n:z:w:r:h")) != -1) {
+    switch (opt) {
+    case 's':
+      Socket_Path = optarg;
+      break;
+    case 'c':
+      connections = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atoi(optarg);
+      break;
+    case 'n':
+      File_Count = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      File_Size = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      Write_Percent = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      result = -1;
+      break;
+    }
+  }
+
+  if (result < 0 || argc > optind || NULL == Socket_Path || connections < 1 || connections > MAX_CONNECTIONS ||
+      seconds < 1 || File_Count < 1 || Write_Percent < 0 || Write_Percent > 100) {
+    fprintf(stderr, "Usage: %s -s socket [-c connections] [-d seconds] [-n files] [-z size]\n"
+                    "       [-w write_percent] [-r seed]\n", argv[0]);
+    return 1;
+  }
+
+  // every connection reads the same files, so they're there from the start
+  contents = malloc(File_Size + 1);
+  loads = calloc(connections, sizeof(LoadThread));
+  if (NULL == contents || NULL == loads || IMFFS_OK != imffs_client_connect(Socket_Path, &client)) {
+    fprintf(stderr, "Error: unable to set up the load.\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < File_Size; i++) {
+    contents[i] = 'a' + i % 26;
+  }
+  for (uint32_t i = 0; 0 == result && i < File_Count; i++) {
+    snprintf(name, MAX_NAME, "load%u", i);
+    if (IMFFS_OK != imffs_client_put(client, name, contents, File_Size)) {
+      fprintf(stderr, "Error: unable to put '%s'.\n", name);
+      result = -1;
+    }
+  }
+  imffs_client_close(client);
+  free(contents);
+  if (0 != result) {
+    return 1;
+  }
+
+  pthread_barrier_init(&Start, NULL, connections + 1);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK);
+  for (started = 0; started < connections; started++) {
+    loads[started].index = started;
+    loads[started].rng = (seed + started) * 0x9E3779B97F4A7C15ULL | 1;
+    if (0 != pthread_create(&loads[started].thread, &attr, run_connection, &loads[started])) {
+      fprintf(stderr, "Error: unable to start connection %d.\n", started);
+      return 1;
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  pthread_barrier_wait(&Start);
+  start = bench_now();
+  Deadline = start + seconds;
+  pthread_barrier_wait(&Start);
+  for (int i = 0; i < connections; i++) {
+    pthread_join(loads[i].thread, NULL);
+  }
+  elapsed = bench_now() - start;
+  pthread_barrier_destroy(&Start);
+
+  for (int i = 0; i < connections; i++) {
+    for (int op = 0; op < NUM_OPS; op++) {
+      requests += loads[i].sample_count[op];
+    }
+    errors += loads[i].errors;
+    failed += loads[i].failed;
+  }
+  printf("# connections=%d seconds=%d files=%u size=%u write_percent=%d requests=%ld rps=%.0f errors=%ld "
+         "failed_connections=%ld\n", connections, seconds, File_Count, File_Size, Write_Percent, requests,
+         requests / elapsed, errors, failed);
+  bench_print_header();
+  snprintf(params, sizeof(params), "connections=%d;size=%u;rps=%.0f", connections, File_Size, requests / elapsed);
+  for (int op = 0; op < NUM_OPS; op++) {
+    count = 0;
+    for (int i = 0; i < connections; i++) {
+      count += loads[i].sample_count[op];
+    }
+    samples = malloc((count + 1) * sizeof(double));
+    if (NULL == samples) {
+      fprintf(stderr, "Error: not enough memory for the samples.\n");
+      return 1;
+    }
+    count = 0;
+    for (int i = 0; i < connections; i++) {
+      if (loads[i].sample_count[op] > 0) {
+        memcpy(&samples[count], loads[i].samples[op], loads[i].sample_count[op] * sizeof(double));
+        count += loads[i].sample_count[op];
+      }
+      free(loads[i].samples[op]);
+    }
+    bench_report(Op_Names[op], params, 0, samples, count);
+    free(samples);
+  }
+  free(loads);
+
+  return 0 == failed && 0 == errors ? 0 : 1;
+}
@@ -4,6 +4,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "a4_tests.h"
 #include "a5_multimap.h"
@@ -11,6 +15,22 @@
 
 
 #include "a5_imffs.c"
+#include "a5_trace.h"
+#include "a5_server.h"
+#include "a5_client.h"
+#include "a5_protocol.h"
+
+// Linked with --wrap=malloc, so every malloc in the program's own code comes
+// here; setting Failing_Malloc to n makes the nth one from then on fail.
+void *__real_malloc(size_t size);
+static int Failing_Malloc = 0;
+
+void *__wrap_malloc(size_t size) {
+  if (Failing_Malloc > 0 && 0 == --Failing_Malloc) {
+    return NULL;
+  }
+  return __real_malloc(size);
+}
 
 void test_multimap() {
   Multimap *mm;
@@ -120,7 +140,7 @@ void test_multimap() {
 }
 
 void test_find_next_free_block() {
-  uint32_t pos;
+  uint64_t pos;
   
   printf("\n*** Testing find_next_free_block:\n\n");
 
@@ -147,18 +167,2171 @@ void test_find_next_free_block() {
   VERIFY_INT(0, pos);
 }
 
-void test_block_ptr_to_index() {
-  uint8_t base[1000];
+void test_extents() {
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  ExtentReader reader;
+  Extent extent;
+  Value list, copy;
+  File file = { "extents", 0 };
+
+  printf("\n*** Testing extent lists:\n\n");
+
+  VERIFY_INT(TRUE, extent_write(&writer, 0, 1, 0));
+  VERIFY_INT(2, writer.length); // a short chunk right after the last one is 2 bytes
+  VERIFY_INT(TRUE, extent_write(&writer, 1000, 5, 0));
+  VERIFY_INT(TRUE, extent_write(&writer, 3, 2, 0)); // before the previous chunk
+  VERIFY_INT(TRUE, extent_write(&writer, 5000000000LL, 1ULL << 40, 0));
+  VERIFY_INT(TRUE, extent_write(&writer, 7, 0, 40));
+  VERIFY_INT(TRUE, extent_writer_finish(&writer, &list));
+  VERIFY_NULL(writer.bytes);
+  VERIFY_INT(1, list.num < 5 * 8); // under 8 bytes a chunk
+
+  extent_reader_init(&reader, &list);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(0, extent.start);
+  VERIFY_INT(1, extent.count);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(1000, extent.start);
+  VERIFY_INT(5, extent.count);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(3, extent.start);
+  VERIFY_INT(2, extent.count);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(1, 5000000000ULL == extent.start && 1ULL << 40 == extent.count);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(7, extent.start);
+  VERIFY_INT(0, extent.count);
+  VERIFY_INT(40, extent.offset);
+  VERIFY_INT(FALSE, extent_read(&reader, &extent));
+  VERIFY_INT(5, file_chunks(&file, &list));
+
+  // a copy of the bytes is the same list
+  copy.num = list.num;
+  copy.data = malloc(list.num);
+  memcpy(copy.data, list.data, list.num);
+  free(list.data);
+  VERIFY_INT(5, file_chunks(&file, &copy));
+  extent_reader_init(&reader, &copy);
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(TRUE, extent_read(&reader, &extent));
+  VERIFY_INT(1000, extent.start);
+  free(copy.data);
+}
+
+// writes a disk file of the given size with a repeating pattern
+static void make_disk_file(char *name, uint32_t size) {
+  FILE *out = fopen(name, "w");
+  assert(NULL != out);
+  for (uint32_t i = 0; i < size; i++) {
+    fputc('a' + i % 26, out);
+  }
+  fclose(out);
+}
+
+static int count_chunks(IMFFSPtr fs, char *name) {
+  File *file = find_matching_file(fs->index, name);
+  Value list;
+
+  if (NULL == file || !get_extents(fs, file, &list)) {
+    return -1;
+  }
+  return file_chunks(file, &list);
+}
+
+static int count_used_blocks(IMFFSPtr fs) {
+  int count = 0;
+  for (uint64_t i = 0; i < fs->block_count; i++) {
+    if (BLOCK_USED == fs->used[i]) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void test_defrag() {
+  IMFFSPtr fs;
+  char small[] = "/tmp/a5_test_small", large[] = "/tmp/a5_test_large", out[] = "/tmp/a5_test_out";
+  FILE *in;
+  int same;
+
+  printf("\n*** Testing imffs_defrag:\n\n");
+
+  make_disk_file(small, 300);      // 2 blocks
+  make_disk_file(large, 300 * 256); // 301 blocks, past what a uint8_t can index
+
+  VERIFY_INT(IMFFS_OK, imffs_create(400, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, large, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "c"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+
+  // the used map must match the compacted layout
+  VERIFY_INT(303, count_used_blocks(fs));
+  VERIFY_INT(BLOCK_USED, fs->used[0]);
+  VERIFY_INT(BLOCK_USED, fs->used[302]);
+  VERIFY_INT(BLOCK_FREE, fs->used[303]);
+  VERIFY_INT(1, count_chunks(fs, "b"));
+
+  // a save after defrag must not overwrite the moved files
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  in = fopen(out, "r");
+  same = NULL != in;
+  for (uint32_t i = 0; same && i < 300 * 256; i++) {
+    same = fgetc(in) == 'a' + i % 26;
+  }
+  same = same && EOF == fgetc(in);
+  if (NULL != in) {
+    fclose(in);
+  }
+  VERIFY_INT(1, same);
+
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  unlink(small);
+  unlink(large);
+  unlink(out);
+}
+
+void test_usage() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  char small[] = "/tmp/a5_test_small";
+
+  printf("\n*** Testing imffs_usage:\n\n");
+
+  make_disk_file(small, 300); // 2 blocks
+
+  VERIFY_INT(IMFFS_OK, imffs_create(10, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "c"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "d")); // reuses the hole left by b
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(10, usage.block_count);
+  VERIFY_INT(4, usage.used_blocks);
+  VERIFY_INT(4, usage.largest_free_run);
+  VERIFY_INT(2, usage.file_count);
+  VERIFY_INT(2, usage.extent_count);
+  VERIFY_INT(1, usage.max_file_extents);
+  VERIFY_INT(600, usage.total_bytes);
+
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  unlink(small);
+}
+
+void test_metrics() {
+  Histogram h;
+
+  printf("\n*** Testing the latency histogram:\n\n");
+
+  memset(&h, 0, sizeof(h));
+  VERIFY_INT(0, histogram_percentile(&h, 0.5));
+  for (int i = 1; i <= 100; i++) {
+    histogram_record(&h, i);
+  }
+  VERIFY_INT(100, h.count);
+  VERIFY_INT(100, h.max_ns);
+  VERIFY_INT(1, histogram_percentile(&h, 0));
+  VERIFY_INT(1, histogram_percentile(&h, 0.5) >= 47 && histogram_percentile(&h, 0.5) <= 50);
+  VERIFY_INT(1, histogram_percentile(&h, 1) >= 94 && histogram_percentile(&h, 1) <= 100);
+  
+  // large values land in a bucket within 1/16 of the value
+  histogram_record(&h, 1000000007);
+  VERIFY_INT(1, histogram_percentile(&h, 1) <= 1000000007 && histogram_percentile(&h, 1) > 1000000007 / 16 * 15);
+  histogram_record(&h, UINT64_MAX);
+  VERIFY_INT(1, UINT64_MAX == h.max_ns);
+
+#ifdef IMFFS_METRICS
+  IMFFSPtr fs;
+  char small[] = "/tmp/a5_test_small";
+
+  printf("\n*** Testing the filesystem metrics:\n\n");
+
+  make_disk_file(small, 300);
+  VERIFY_INT(IMFFS_OK, imffs_create(10, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", "/dev/null"));
+  VERIFY_INT(2, fs->metrics.ops[METRIC_SAVE].calls);
+  VERIFY_INT(1, fs->metrics.ops[METRIC_SAVE].errors);
+  VERIFY_INT(300, fs->metrics.ops[METRIC_SAVE].bytes);
+  VERIFY_INT(1, fs->metrics.ops[METRIC_LOAD].calls);
+  VERIFY_INT(300, fs->metrics.ops[METRIC_LOAD].bytes);
+  VERIFY_INT(2, fs->metrics.blocks_scanned); // the first free block, then the rest of its run
+  VERIFY_INT(1, fs->metrics.comparisons > 0);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  unlink(small);
+#endif
+}
+
+static Boolean same_contents(char *name_a, char *name_b) {
+  FILE *a = fopen(name_a, "r"), *b = fopen(name_b, "r");
+  Boolean same = NULL != a && NULL != b;
+  int ch;
+
+  while (same && EOF != (ch = fgetc(a))) {
+    same = ch == fgetc(b);
+  }
+  same = same && EOF == fgetc(b);
+  if (NULL != a) {
+    fclose(a);
+  }
+  if (NULL != b) {
+    fclose(b);
+  }
+  return same;
+}
+
+void test_block_size() {
+  IMFFSPtr fs = NULL;
+  IMFFSUsage usage;
+  char small[] = "/tmp/a5_test_small", large[] = "/tmp/a5_test_large", out[] = "/tmp/a5_test_out";
+
+  printf("\n*** Testing block sizes:\n\n");
+
+  VERIFY_INT(IMFFS_INVALID, imffs_create(10, 32, &fs));
+  VERIFY_NULL(fs);
+  VERIFY_INT(IMFFS_INVALID, imffs_create(10, 100, &fs));
+  VERIFY_INT(IMFFS_INVALID, imffs_create(10, 2 * IMFFS_MAX_BLOCK_SIZE, &fs));
+
+  make_disk_file(small, 300);
+  make_disk_file(large, 5000);
+
+  // 64 byte blocks: 300 bytes take 5 blocks, 5000 take 79
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_MIN_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, large, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "c"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(IMFFS_MIN_BLOCK_SIZE, usage.block_size);
+  VERIFY_INT(89, usage.used_blocks);
+  VERIFY_INT(1, usage.metadata_bytes > 100);
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, large, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(84, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(TRUE, same_contents(large, out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // 1 MB blocks: every file fits in one
+  VERIFY_INT(IMFFS_OK, imffs_create(3, IMFFS_MAX_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, large, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(BLOCK_USED, fs->used[0]);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(TRUE, same_contents(large, out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(small);
+  unlink(large);
+  unlink(out);
+}
+
+void test_inline() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  char names[][32] = { "/tmp/a5_test_0", "/tmp/a5_test_1", "/tmp/a5_test_200", "/tmp/a5_test_255", "/tmp/a5_test_256" };
+  uint32_t sizes[] = { 0, 1, 200, 255, 256 };
+  char out[] = "/tmp/a5_test_out", big[] = "/tmp/a5_test_1000", name[] = "A";
+  uint8_t buffer[10];
+  uint64_t bytes_read;
+  File *file;
+
+  printf("\n*** Testing inline files:\n\n");
+
+  for (int i = 0; i < 5; i++) {
+    make_disk_file(names[i], sizes[i]);
+  }
+
+  // everything smaller than a block is inline by default
+  VERIFY_INT(IMFFS_OK, imffs_create(10, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "0"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[1], "1"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[2], "200"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[3], "255"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[4], "256"));
+  VERIFY_INT(2, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, names[1], "200"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(4, usage.inline_files);
+  VERIFY_INT(712, usage.total_bytes);
+
+  VERIFY_NOT_NULL(file = find_matching_file(fs->index, "200"));
+  VERIFY_INT(TRUE, file->inlined);
+  VERIFY_INT(1, count_chunks(fs, "200"));
+
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "200", out));
+  VERIFY_INT(TRUE, same_contents(names[2], out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "0", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+
+  // rename and defrag keep inline files as they are
+  VERIFY_INT(IMFFS_OK, imffs_rename(fs, "255", "renamed"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "1"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(3, usage.inline_files);
+  VERIFY_INT(4, usage.file_count);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "renamed", out));
+  VERIFY_INT(TRUE, same_contents(names[3], out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "256", out));
+  VERIFY_INT(TRUE, same_contents(names[4], out));
+
+  // with no inlining every file takes at least a block
+  VERIFY_INT(IMFFS_INVALID, imffs_set_inline_limit(fs, IMFFS_MAX_INLINE_SIZE + 1));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "blocks"));
+  VERIFY_INT(3, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "blocks", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // an inline file can be longer than a block, and written into blocks
+  // between other files' it takes as many as it needs, in order
+  make_disk_file(big, 1000);
+  VERIFY_INT(IMFFS_OK, imffs_create(20, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  for (int i = 0; i < 10; i++) {
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, names[3], name));
+    name[0]++;
+  }
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "B"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "D"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "F"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "H"));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, IMFFS_MAX_INLINE_SIZE));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "big", "grown"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.inline_files);
+  VERIFY_INT(6, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "grown", 1000, "!", 1));
+  VERIFY_NOT_NULL(file = find_matching_file(fs->index, "grown"));
+  VERIFY_INT(FALSE, file->inlined);
+  VERIFY_INT(4, count_chunks(fs, "grown"));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "grown", 995, buffer, sizeof(buffer), &bytes_read));
+  VERIFY_INT(6, bytes_read);
+  VERIFY_INT(0, memcmp("hijkl!", buffer, 6));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "big", out));
+  VERIFY_INT(TRUE, same_contents(big, out));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "grown"));
+  for (int i = 0; i < 10; i += 2) {
+    name[0] = 'A' + i;
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, name, out));
+    VERIFY_INT(TRUE, same_contents(names[3], out));
+  }
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  for (int i = 0; i < 5; i++) {
+    unlink(names[i]);
+  }
+  unlink(big);
+  unlink(out);
+}
+
+void test_tail_packing() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  char names[][32] = { "/tmp/a5_test_100", "/tmp/a5_test_600", "/tmp/a5_test_512", "/tmp/a5_test_0", "/tmp/a5_test_250" };
+  uint32_t sizes[] = { 100, 600, 512, 0, 250 };
+  char out[] = "/tmp/a5_test_out";
+  File *file;
+
+  printf("\n*** Testing tail packing:\n\n");
+
+  for (int i = 0; i < 5; i++) {
+    make_disk_file(names[i], sizes[i]);
+  }
+
+  VERIFY_INT(IMFFS_OK, imffs_create(20, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "a"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[1], "b"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[2], "c"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[3], "e"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[4], "f"));
+
+  // a and b share a tail block, c has no tail, and e and f keep their last block
+  VERIFY_INT(6, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, usage.tail_blocks);
+  VERIFY_INT(2, usage.packed_tails);
+  VERIFY_INT(7, usage.used_blocks);
+  VERIFY_NOT_NULL(file = find_matching_file(fs->index, "a"));
+  VERIFY_INT(TRUE, file->packed);
+  VERIFY_INT(1, count_chunks(fs, "a"));
+  VERIFY_NOT_NULL(file = find_matching_file(fs->index, "f"));
+  VERIFY_INT(FALSE, file->packed);
+
+  for (int i = 0; i < 5; i++) {
+    char name[] = { "abcef"[i], '\0' };
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, name, out));
+    VERIFY_INT(TRUE, same_contents(names[i], out));
+  }
+
+  // no room left in the first tail block
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "g"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.tail_blocks);
+
+  // defrag repacks the two half empty tail blocks into one
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "b"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.tail_blocks);
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, usage.tail_blocks);
+  VERIFY_INT(5, usage.used_blocks);
+  VERIFY_INT(15, usage.largest_free_run);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "g", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "c", out));
+  VERIFY_INT(TRUE, same_contents(names[2], out));
+
+  // the tail block is freed with the last tail in it
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "g"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(0, usage.tail_blocks);
+  VERIFY_INT(4, usage.used_blocks);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  for (int i = 0; i < 5; i++) {
+    unlink(names[i]);
+  }
+  unlink(out);
+}
+
+void test_dedup() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  // the letters repeat every 13 blocks, and the last block of "big" is empty
+  char names[][32] = { "/tmp/a5_test_big", "/tmp/a5_test_100", "/tmp/a5_test_600" };
+  uint32_t sizes[] = { 26 * 256, 100, 600 };
+  char out[] = "/tmp/a5_test_out";
+
+  printf("\n*** Testing deduplication:\n\n");
+
+  for (int i = 0; i < 3; i++) {
+    make_disk_file(names[i], sizes[i]);
+  }
+
+  VERIFY_INT(IMFFS_OK, imffs_create(40, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_dedup(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[1], "z"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "x"));
+  VERIFY_INT(15, count_used_blocks(fs));
+
+  // a second copy takes no blocks at all
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "y"));
+  VERIFY_INT(15, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(40, usage.shared_blocks);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "y", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+
+  // blocks are only freed when nothing uses them; the 600 byte file shares
+  // its first two blocks and its partial block goes in the hole z leaves
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "z"));
+  VERIFY_INT(14, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[2], "v"));
+  VERIFY_INT(15, count_used_blocks(fs));
+  VERIFY_INT(2, count_chunks(fs, "v"));
+
+  // defrag keeps shared blocks shared, and they can still be matched after
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(15, usage.used_blocks);
+  VERIFY_INT(25, usage.largest_free_run);
+  VERIFY_INT(1, count_chunks(fs, "v"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "v", out));
+  VERIFY_INT(TRUE, same_contents(names[2], out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "x", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[0], "w"));
+  VERIFY_INT(15, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "w", out));
+  VERIFY_INT(TRUE, same_contents(names[0], out));
+
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "x"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "y"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "w"));
+  VERIFY_INT(3, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "v", out));
+  VERIFY_INT(TRUE, same_contents(names[2], out));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "v"));
+  VERIFY_INT(0, count_used_blocks(fs));
+  VERIFY_INT(0, fs->dedup_count);
+
+  // with it off again, copies take their own blocks
+  VERIFY_INT(IMFFS_OK, imffs_set_dedup(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[2], "v"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, names[2], "u"));
+  VERIFY_INT(6, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  for (int i = 0; i < 3; i++) {
+    unlink(names[i]);
+  }
+  unlink(out);
+}
+
+void test_compression() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  char text[] = "/tmp/a5_test_text", noise[] = "/tmp/a5_test_noise", out[] = "/tmp/a5_test_out";
+  uint8_t raw[1000], packed[LZ_BOUND(1000)], unpacked[1000], buffer[100];
+  uint32_t length;
+  uint64_t bytes_read;
+  FILE *file;
+  File *stored;
+  Value list;
+
+  printf("\n*** Testing compression:\n\n");
+
+  for (int i = 0; i < 1000; i++) {
+    raw[i] = 'a' + i % 26;
+  }
+  VERIFY_INT(TRUE, (length = lz_compress(raw, 1000, packed, sizeof(packed))) < 100);
+  VERIFY_INT(1000, lz_decompress(packed, length, unpacked, sizeof(unpacked)));
+  VERIFY_INT(0, memcmp(raw, unpacked, 1000));
+  VERIFY_INT(0, lz_compress(raw, 1000, packed, length - 1));
+  VERIFY_INT(-1, lz_decompress(packed, length, unpacked, 999));
+  VERIFY_INT(1, lz_compress(raw, 0, packed, sizeof(packed)));
+  VERIFY_INT(0, lz_decompress(packed, 1, unpacked, sizeof(unpacked)));
+
+  // three groups of letters, and bytes that don't compress
+  make_disk_file(text, 150000);
+  file = fopen(noise, "w");
+  srand(42);
+  for (int i = 0; i < 1000; i++) {
+    fputc(rand() & 0xff, file);
+  }
+  fclose(file);
+
+  VERIFY_INT(IMFFS_OK, imffs_create(1024, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, noise, "noise"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.compressed_files);
+  VERIFY_INT(151000, usage.total_bytes);
+  VERIFY_INT(TRUE, usage.used_blocks < 10);
+  VERIFY_INT(TRUE, usage.stored_bytes < 2000);
+
+  // stored as it is, behind its header
+  VERIFY_NOT_NULL(stored = find_matching_file(fs->index, "noise"));
+  VERIFY_INT(TRUE, get_extents(fs, stored, &list));
+  VERIFY_INT(1004, compressed_length(fs, stored, &list));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "noise", out));
+  VERIFY_INT(TRUE, same_contents(noise, out));
+
+  // ranged reads, across the end of the first group and past the end of the file
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "text", 65530, buffer, 20, &bytes_read));
+  VERIFY_INT(20, bytes_read);
+  VERIFY_INT('a' + 65530 % 26, buffer[0]);
+  VERIFY_INT('a' + 65549 % 26, buffer[19]);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "text", 149990, buffer, 100, &bytes_read));
+  VERIFY_INT(10, bytes_read);
+  VERIFY_INT('a' + 149999 % 26, buffer[9]);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "text", 200000, buffer, 100, &bytes_read));
+  VERIFY_INT(0, bytes_read);
+  VERIFY_INT(IMFFS_ERROR, imffs_read(fs, "missing", 0, buffer, 100, &bytes_read));
+
+  // compression is chosen file by file, and reads work the same without it
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "plain"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.compressed_files);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "plain", 1000, buffer, 100, &bytes_read));
+  VERIFY_INT(100, bytes_read);
+  VERIFY_INT('a' + 1000 % 26, buffer[0]);
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "noise", out));
+  VERIFY_INT(TRUE, same_contents(noise, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "plain", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(noise);
+  unlink(out);
+}
+
+void test_checksums() {
+  IMFFSPtr fs;
+  char first[] = "/tmp/a5_test_first", second[] = "/tmp/a5_test_second", out[] = "/tmp/a5_test_out";
+  uint8_t buffer[1000];
+  uint64_t checked, bad, bytes_read;
+
+  printf("\n*** Testing checksums:\n\n");
+
+  // the standard check value, and the instruction agrees with the tables
+  VERIFY_INT(0xe3069283, crc32c(0, "123456789", 9));
+  for (int i = 0; i < 1000; i++) {
+    buffer[i] = i * 7;
+  }
+  VERIFY_INT(crc32c_portable(0, buffer, 1000), crc32c(0, buffer, 1000));
+  VERIFY_INT(crc32c(crc32c(0, buffer, 3), &buffer[3], 997), crc32c(0, buffer, 1000));
+
+  make_disk_file(first, 1000);  // 4 blocks
+  make_disk_file(second, 600);  // 3 blocks
+
+  // blocks saved before checksums are on get one when they're turned on
+  VERIFY_INT(IMFFS_OK, imffs_create(16384, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_ERROR, imffs_scrub(fs, 1, &checked, &bad));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, first, "first"));
+  VERIFY_INT(IMFFS_OK, imffs_set_checksums(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, second, "second"));
+  VERIFY_INT(IMFFS_OK, imffs_scrub(fs, 4, &checked, &bad));
+  VERIFY_INT(7, checked);
+  VERIFY_INT(0, bad);
+
+  // a damaged block fails whatever reads it, and only that
+  fs->data[IMFFS_DEFAULT_BLOCK_SIZE + 5] ^= 1;
+  VERIFY_INT(IMFFS_ERROR, imffs_load(fs, "first", out));
+  VERIFY_INT(IMFFS_ERROR, imffs_read(fs, "first", 300, buffer, 10, &bytes_read));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "first", 600, buffer, 100, &bytes_read));
+  VERIFY_INT(100, bytes_read);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "second", out));
+  VERIFY_INT(TRUE, same_contents(second, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_scrub(fs, 0, &checked, &bad));
+  VERIFY_INT(7, checked);
+  VERIFY_INT(1, bad);
+  fs->data[IMFFS_DEFAULT_BLOCK_SIZE + 5] ^= 1;
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "first", out));
+  VERIFY_INT(TRUE, same_contents(first, out));
+
+  // checksums move with their blocks
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "first"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_scrub(fs, 2, &checked, &bad));
+  VERIFY_INT(3, checked);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "second", out));
+  VERIFY_INT(TRUE, same_contents(second, out));
+
+  VERIFY_INT(IMFFS_OK, imffs_set_checksums(fs, 0));
+  VERIFY_INT(IMFFS_ERROR, imffs_scrub(fs, 1, &checked, &bad));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(first);
+  unlink(second);
+  unlink(out);
+}
+
+void test_etags() {
+  IMFFSPtr fs;
+  IMFFSStat stat, other;
+  char text[] = "/tmp/a5_test_text", small[] = "/tmp/a5_test_small", out[] = "/tmp/a5_test_out";
+  uint8_t buffer[1000];
+  XXH64State state;
+  int changed;
+  FILE *file;
+
+  printf("\n*** Testing etags:\n\n");
+
+  // the reference values, and the same hash however the data is split
+  VERIFY_INT(TRUE, 0xef46db3751d8e999ULL == xxh64("", 0, 0));
+  VERIFY_INT(TRUE, 0x44bc2cf5ad770999ULL == xxh64("abc", 3, 0));
+  for (int i = 0; i < 1000; i++) {
+    buffer[i] = 'a' + i % 26;
+  }
+  xxh64_init(&state, 0);
+  for (int i = 0; i < 1000; i += 37) {
+    xxh64_update(&state, &buffer[i], i + 37 <= 1000 ? 37 : 1000 - i);
+  }
+  VERIFY_INT(TRUE, xxh64(buffer, 1000, 0) == xxh64_digest(&state));
+
+  make_disk_file(text, 1000);
+  make_disk_file(small, 100);
+
+  // however a file is stored, its etag is the hash of its contents
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "small"));
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "packed"));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &stat));
+  VERIFY_INT(1000, stat.byte_len);
+  VERIFY_INT(4, stat.blocks);
+  VERIFY_INT(1, stat.extents);
+  VERIFY_INT(TRUE, xxh64(buffer, 1000, 0) == stat.etag);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "packed", &other));
+  VERIFY_INT(TRUE, stat.etag == other.etag);
+  VERIFY_INT(1, other.compressed);
+  VERIFY_INT(TRUE, other.stored_bytes < 1000);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "small", &other));
+  VERIFY_INT(1, other.inlined);
+  VERIFY_INT(TRUE, xxh64(buffer, 100, 0) == other.etag);
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "missing", &other));
+
+  // an unchanged file isn't saved again, a changed one replaces it
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, text, "text", &changed));
+  VERIFY_INT(0, changed);
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, small, "text", &changed));
+  VERIFY_INT(1, changed);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &stat));
+  VERIFY_INT(100, stat.byte_len);
+  VERIFY_INT(TRUE, xxh64(buffer, 100, 0) == stat.etag);
+  file = fopen(small, "r+");
+  fputc('z', file);
+  fclose(file);
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, small, "text", &changed));
+  VERIFY_INT(1, changed);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, small, "new", &changed));
+  VERIFY_INT(1, changed);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "new", &other));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &stat));
+  VERIFY_INT(TRUE, stat.etag == other.etag);
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, TEMP_FILE, &other));
+
+  // a file named like the one an update stages through is left alone
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, TEMP_FILE));
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, text, "new", &changed));
+  VERIFY_INT(1, changed);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, TEMP_FILE, out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, small, TEMP_FILE, &changed));
+  VERIFY_INT(1, changed);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, TEMP_FILE, out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "new", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, TEMP_FILE "1", &other));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(small);
+  unlink(out);
+}
+
+void test_clones() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  IMFFSStat stat, other;
+  char text[] = "/tmp/a5_test_text", small[] = "/tmp/a5_test_small", out[] = "/tmp/a5_test_out";
+  uint8_t buffer[300], zs[10];
+  uint64_t bytes_read;
+  IMFFSResult result;
+  Boolean intact;
+  int failures;
+
+  printf("\n*** Testing clones:\n\n");
+
+  make_disk_file(text, 1000);   // 4 blocks
+  make_disk_file(small, 100);
+  memset(zs, 'Z', sizeof(zs));
+
+  // a clone shares every block
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "small"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "small", "small copy"));
+  VERIFY_INT(4, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(4, usage.shared_blocks);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "copy", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_ERROR, imffs_clone(fs, "missing", "other"));
+
+  // writing copies only the block it changes, and only for that file
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "copy", 300, zs, 10));
+  VERIFY_INT(5, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "copy", 295, buffer, 20, &bytes_read));
+  VERIFY_INT('a' + 295 % 26, buffer[0]);
+  VERIFY_INT('Z', buffer[5]);
+  VERIFY_INT('Z', buffer[14]);
+  VERIFY_INT('a' + 310 % 26, buffer[15]);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &stat));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &other));
+  VERIFY_INT(TRUE, stat.etag != other.etag);
+
+  // appending copies the shared last block and adds two new ones
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "text", 1000, buffer, 300));
+  VERIFY_INT(8, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &stat));
+  VERIFY_INT(1300, stat.byte_len);
+  VERIFY_INT(6, stat.blocks);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "text", 1000, buffer, 300, &bytes_read));
+  VERIFY_INT(300, bytes_read);
+  VERIFY_INT('a' + 295 % 26, buffer[0]);
+  VERIFY_INT(IMFFS_ERROR, imffs_write(fs, "text", 1301, buffer, 1));
+
+  // an inline file is written in place, or moved to blocks to grow
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "small", 0, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "small copy", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "small copy", 100, buffer, 300));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "small copy", &stat));
+  VERIFY_INT(0, stat.inlined);
+  VERIFY_INT(2, stat.blocks);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "small copy", 90, buffer, 20, &bytes_read));
+  VERIFY_INT('a' + 90 % 26, buffer[0]);
+  VERIFY_INT('a' + 295 % 26, buffer[10]);
+
+  // shared blocks stay shared through defrag, and go with the last file
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "small copy"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(8, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "text"));
+  VERIFY_INT(4, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "copy", 300, buffer, 10, &bytes_read));
+  VERIFY_INT(0, memcmp(buffer, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "copy"));
+  VERIFY_INT(0, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // a packed tail is copied, and written to it leaves the tail block
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2, usage.packed_tails);
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "copy", 990, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, usage.packed_tails);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "copy", 980, buffer, 20, &bytes_read));
+  VERIFY_INT(20, bytes_read);
+  VERIFY_INT('a' + 989 % 26, buffer[9]);
+  VERIFY_INT('Z', buffer[10]);
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(0, usage.used_blocks);
+
+  // a write that runs out of memory part way gives back the blocks it
+  // reserved, and leaves both copies as they were
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  memset(buffer, 'W', sizeof(buffer));
+  failures = 0;
+  intact = TRUE;
+  for (int n = 1; IMFFS_OK != (result = (Failing_Malloc = n, imffs_write(fs, "copy", 900, buffer, 300))); n++) {
+    failures++;
+    intact = intact && 4 == count_used_blocks(fs) && IMFFS_OK == imffs_load(fs, "copy", out) && same_contents(text, out);
+  }
+  Failing_Malloc = 0;
+  VERIFY_INT(TRUE, failures > 0);
+  VERIFY_INT(TRUE, intact);
+  VERIFY_INT(6, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "copy", 890, buffer, 20, &bytes_read));
+  VERIFY_INT('a' + 890 % 26, buffer[0]);
+  VERIFY_INT('W', buffer[10]);
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "copy"));
+
+  // compressed files can be cloned but not written
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "copy", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_write(fs, "copy", 0, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // an inline file longer than a block goes into blocks that aren't next
+  // to each other a block at a time, and the files between keep theirs
+  VERIFY_INT(IMFFS_OK, imffs_create(12, 64, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  for (int i = 0; i < 12; i++) {
+    memset(buffer, 'A' + i, 63);
+    snprintf((char *)zs, sizeof(zs), "fill%d", i);
+    VERIFY_INT(IMFFS_OK, imffs_put(fs, (char *)zs, buffer, 63));
+  }
+  for (int i = 1; i < 12; i += 2) {
+    snprintf((char *)zs, sizeof(zs), "fill%d", i);
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, (char *)zs));
+  }
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 200));
+  for (int i = 0; i < 150; i++) {
+    buffer[i] = 'a' + i % 26;
+  }
+  VERIFY_INT(IMFFS_OK, imffs_put(fs, "long", buffer, 150));
+  VERIFY_INT(IMFFS_OK, imffs_put(fs, "wide", buffer, 150));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "long", 150, "!", 1));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "long", &stat));
+  VERIFY_INT(0, stat.inlined);
+  VERIFY_INT(3, stat.blocks);
+  memset(buffer, 'W', 150);
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "wide", 10, buffer, 150));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "long", 0, buffer, sizeof(buffer), &bytes_read));
+  VERIFY_INT(151, bytes_read);
+  intact = '!' == buffer[150];
+  for (int i = 0; i < 150; i++) {
+    intact = intact && 'a' + i % 26 == buffer[i];
+  }
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "wide", 0, buffer, sizeof(buffer), &bytes_read));
+  VERIFY_INT(160, bytes_read);
+  for (int i = 0; i < 160; i++) {
+    intact = intact && (i < 10 ? 'a' + i : 'W') == buffer[i];
+  }
+  for (int i = 0; i < 12; i += 2) {
+    snprintf((char *)zs, sizeof(zs), "fill%d", i);
+    intact = intact && IMFFS_OK == imffs_read(fs, (char *)zs, 0, buffer, sizeof(buffer), &bytes_read) &&
+             63 == bytes_read && 'A' + i == buffer[0] && 'A' + i == buffer[62];
+  }
+  VERIFY_INT(TRUE, intact);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(small);
+  unlink(out);
+}
+
+void test_journal() {
+  IMFFSPtr fs;
+  IMFFSStat info, other;
+  char text[] = "/tmp/a5_test_text", small[] = "/tmp/a5_test_small", out[] = "/tmp/a5_test_out";
+  char journal[] = "/tmp/a5_test_journal", image[] = "/tmp/a5_test_image", name[] = "0";
+  uint8_t zs[10];
+  uint64_t records, bytes, syncs, copy_etag, text_etag;
+  struct stat st;
+  FILE *file;
+
+  printf("\n*** Testing the journal:\n\n");
+
+  make_disk_file(text, 1000);
+  make_disk_file(small, 100);
+  memset(zs, 'Z', sizeof(zs));
+  unlink(journal);
+  unlink(image);
+
+  // every change is logged, and replayed onto a new filesystem
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_set_dedup(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "small"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "gone"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "copy", 300, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_rename(fs, "small", "tiny"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "gone"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_delete(fs, "gone"));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  copy_etag = info.etag;
+  VERIFY_INT(10, journal_seq(fs->journal));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(TRUE, fs->dedup && fs->tail_packing);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "tiny", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "gone", &other));
+  VERIFY_INT(IMFFS_ERROR, imffs_journal(fs, journal, 0));
+
+  // a checkpoint has everything, so the journal starts again after it
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(0, stat(journal, &st));
+  VERIFY_INT(32, st.st_size);
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "after"));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(100, fs->block_count);
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "after", &other));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "after", &other));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &info));
+  text_etag = info.etag;
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "text", 300, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // a record torn by a crash is cut off, and the ones before it replayed
+  file = fopen(journal, "a");
+  fwrite("torn", 1, 4, file);
+  fclose(file);
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "after", &other));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(0, stat(journal, &st));
+  VERIFY_INT(0, truncate(journal, st.st_size - 1));
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "after", &other));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "text", &info));
+  VERIFY_INT(TRUE, text_etag == info.etag);
+
+  // with group commit, changes share syncs
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  unlink(journal);
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 50));
+  for (int i = 0; i < 10; i++) {
+    name[0] = '0' + i;
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, small, name));
+  }
+  VERIFY_INT(IMFFS_OK, imffs_journal_sync(fs));
+  journal_stats(fs->journal, &records, &bytes, &syncs);
+  VERIFY_INT(10, records);
+  VERIFY_INT(TRUE, syncs < records);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 50));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "9", &other));
+
+  // a journal can only be replayed onto what it started from
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_create(200, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // and a damaged image isn't opened
+  file = fopen(image, "r+");
+  fseek(file, -10, SEEK_END);
+  fputc('!', file);
+  fclose(file);
+  VERIFY_INT(IMFFS_ERROR, imffs_open_image(image, &fs));
+  VERIFY_INT(TRUE, NULL == fs);
+
+  unlink(text);
+  unlink(small);
+  unlink(out);
+  unlink(journal);
+  unlink(image);
+}
+
+void test_incremental_checkpoints() {
+  IMFFSPtr fs;
+  IMFFSStat info;
+  char text[] = "/tmp/a5_test_text", small[] = "/tmp/a5_test_small", out[] = "/tmp/a5_test_out";
+  char journal[] = "/tmp/a5_test_journal", image[] = "/tmp/a5_test_image", merged[] = "/tmp/a5_test_merged";
+  char first[] = "/tmp/a5_test_delta1", second[] = "/tmp/a5_test_delta2";
+  char *deltas[] = { first, second }, *backwards[] = { second, first };
+  uint8_t zs[10];
+  uint64_t copy_etag, used;
+  struct stat image_st, delta_st;
+
+  printf("\n*** Testing incremental checkpoints:\n\n");
+
+  make_disk_file(text, 20000);
+  make_disk_file(small, 100);
+  memset(zs, 'Z', sizeof(zs));
+  unlink(journal);
+
+  // there's nothing to build on until a full checkpoint
+  VERIFY_INT(IMFFS_OK, imffs_create(1000, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_dedup(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "same"));
+  VERIFY_INT(IMFFS_ERROR, imffs_checkpoint_incremental(fs, first));
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+
+  // only what changed is written
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "small"));
+  VERIFY_INT(IMFFS_OK, imffs_clone(fs, "text", "copy"));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "copy", 300, zs, 10));
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint_incremental(fs, first));
+  VERIFY_INT(0, fs->dirty.count);
+  VERIFY_INT(0, stat(image, &image_st));
+  VERIFY_INT(0, stat(first, &delta_st));
+  VERIFY_INT(TRUE, delta_st.st_size < image_st.st_size / 10);
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "same"));
+  VERIFY_INT(IMFFS_OK, imffs_rename(fs, "small", "tiny"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint_incremental(fs, second));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  copy_etag = info.etag;
+  used = count_used_blocks(fs);
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "after"));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // the image and its deltas, in order, are the filesystem as it was
+  VERIFY_INT(IMFFS_OK, imffs_open_checkpoints(image, deltas, 2, &fs));
+  VERIFY_INT(used, count_used_blocks(fs));
+  VERIFY_INT(TRUE, fs->dedup);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "tiny", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "same", &info));
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "small", &info));
+  VERIFY_INT(IMFFS_ERROR, imffs_stat(fs, "after", &info));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "after", &info));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // but not out of order, or with one missing
+  VERIFY_INT(IMFFS_ERROR, imffs_open_checkpoints(image, backwards, 2, &fs));
+  VERIFY_INT(TRUE, NULL == fs);
+  VERIFY_INT(IMFFS_ERROR, imffs_open_checkpoints(image, &deltas[1], 1, &fs));
+  VERIFY_INT(TRUE, NULL == fs);
+
+  // compacting them makes an image the journal goes on from
+  VERIFY_INT(IMFFS_OK, imffs_compact(image, deltas, 2, merged));
+  VERIFY_INT(IMFFS_OK, imffs_open_image(merged, &fs));
+  VERIFY_INT(used, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "copy", &info));
+  VERIFY_INT(TRUE, copy_etag == info.etag);
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "after", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(small);
+  unlink(out);
+  unlink(journal);
+  unlink(image);
+  unlink(merged);
+  unlink(first);
+  unlink(second);
+}
+
+// bytes of the device's blocks that are in memory
+static uint64_t resident_bytes(IMFFSPtr fs) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = ((size_t)fs->block_count * fs->block_size + page - 1) / page;
+  unsigned char *in_memory = malloc(pages);
+  uint64_t resident = 0;
+
+  if (NULL != in_memory && 0 == mincore(fs->data, pages * page, in_memory)) {
+    for (size_t i = 0; i < pages; i++) {
+      resident += (in_memory[i] & 1) * page;
+    }
+  }
+  free(in_memory);
+
+  return resident;
+}
+
+void test_trim() {
+  IMFFSPtr fs;
+  char big[] = "/tmp/a5_test_big", small[] = "/tmp/a5_test_small", out[] = "/tmp/a5_test_out";
+  char name[16];
+  uint64_t trimmed, resident;
+
+  printf("\n*** Testing trim:\n\n");
+
+  make_disk_file(big, 8 * 1024 * 1024);
+  make_disk_file(small, 3000);
+
+  // nothing is in memory until it's written, and a big delete gives it back
+  VERIFY_INT(IMFFS_OK, imffs_create(16384, 1024, &fs));
+  VERIFY_INT(TRUE, resident_bytes(fs) < 1024 * 1024);
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(TRUE, resident_bytes(fs) >= 8 * 1024 * 1024);
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "big"));
+  VERIFY_INT(TRUE, resident_bytes(fs) < 1024 * 1024);
+
+  // small deletes wait for a trim, which keeps the blocks still in use
+  for (int i = 0; i < 100; i++) {
+    sprintf(name, "s%d", i);
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, small, name));
+  }
+  for (int i = 0; i < 50; i++) {
+    sprintf(name, "s%d", i);
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, name));
+  }
+  resident = resident_bytes(fs);
+  VERIFY_INT(IMFFS_OK, imffs_trim(fs, &trimmed));
+  VERIFY_INT(TRUE, trimmed >= 100 * 1024);
+  VERIFY_INT(TRUE, resident_bytes(fs) < resident);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "s50", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "s99", out));
+  VERIFY_INT(TRUE, same_contents(small, out));
+
+  // and the pages come back when the blocks are used again
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "big", out));
+  VERIFY_INT(TRUE, same_contents(big, out));
+  VERIFY_INT(IMFFS_INVALID, imffs_trim(NULL, &trimmed));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(big);
+  unlink(small);
+  unlink(out);
+}
+
+void test_resize() {
+  IMFFSPtr fs;
+  IMFFSUsage usage;
+  char text[] = "/tmp/a5_test_text", big[] = "/tmp/a5_test_big", out[] = "/tmp/a5_test_out";
+  char journal[] = "/tmp/a5_test_journal", image[] = "/tmp/a5_test_image", delta[] = "/tmp/a5_test_delta";
+  char name[32];
+  uint64_t used, checked, bad, got, rng = 80;
+  uint8_t contents[500], buffer[500];
+  Boolean intact;
+  int file;
+
+  printf("\n*** Testing resize:\n\n");
+
+  make_disk_file(text, 20000);
+  make_disk_file(big, 200000);
+  unlink(journal);
+
+  // growing makes room for files that didn't fit
+  VERIFY_INT(IMFFS_OK, imffs_create(200, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_set_checksums(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "first"));
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_resize(fs, 2000));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(2000, usage.block_count);
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "last"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "first", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+
+  // shrinking moves the files past the new end, if they fit
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "big"));
+  used = count_used_blocks(fs);
+  VERIFY_INT(IMFFS_ERROR, imffs_resize(fs, used - 1));
+  VERIFY_INT(IMFFS_OK, imffs_resize(fs, used + 10));
+  VERIFY_INT(used, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "last", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_scrub(fs, 1, &checked, &bad));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // a replay resizes too
+  VERIFY_INT(IMFFS_OK, imffs_create(200, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(used + 10, fs->block_count);
+  VERIFY_INT(used, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "last", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+
+  // the journal goes on from an image of the new size, but not a delta
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(IMFFS_OK, imffs_resize(fs, 1000));
+  VERIFY_INT(IMFFS_ERROR, imffs_checkpoint_incremental(fs, delta));
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(1000, fs->block_count);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "big", out));
+  VERIFY_INT(TRUE, same_contents(big, out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // after churn, packed tails and shared blocks still shrink to exactly
+  // the blocks in use
+  VERIFY_INT(IMFFS_OK, imffs_create(400, 64, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_set_dedup(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  intact = TRUE;
+  for (int i = 0; i < 150; i++) {
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    file = (rng >> 33) % 40;
+    sprintf(name, "churn%d", file);
+    for (int j = 0; j < (int)sizeof(contents); j++) {
+      contents[j] = 'a' + (j + file) % 26;
+    }
+    if (IMFFS_OK != imffs_delete(fs, name)) {
+      intact = IMFFS_OK == imffs_put(fs, name, contents, (rng >> 40) % sizeof(contents) + 1) && intact;
+    }
+  }
+  VERIFY_INT(TRUE, intact);
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  used = usage.used_blocks;
+  VERIFY_INT(IMFFS_OK, imffs_resize(fs, used));
+  VERIFY_INT(used, fs->block_count);
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(TRUE, usage.used_blocks <= used);
+  for (int i = 0; i < 40; i++) {
+    sprintf(name, "churn%d", i);
+    if (IMFFS_OK == imffs_read(fs, name, 0, buffer, sizeof(buffer), &got)) {
+      for (uint64_t j = 0; j < got; j++) {
+        intact = intact && buffer[j] == 'a' + (j + i) % 26;
+      }
+    }
+  }
+  VERIFY_INT(TRUE, intact);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // every file needs a key, even one that's inline
+  VERIFY_INT(IMFFS_OK, imffs_create(4, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  for (int i = 0; i < 5; i++) {
+    sprintf(name, "/tmp/a5_test_%d", i);
+    make_disk_file(name, 10);
+    VERIFY_INT(i < 4 ? IMFFS_OK : IMFFS_ERROR, imffs_save(fs, name, name));
+  }
+  VERIFY_INT(0, count_used_blocks(fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_resize(fs, 3));
+  VERIFY_INT(IMFFS_OK, imffs_resize(fs, 8));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, name, name));
+  for (int i = 0; i < 5; i++) {
+    sprintf(name, "/tmp/a5_test_%d", i);
+    unlink(name);
+  }
+  VERIFY_INT(IMFFS_INVALID, imffs_resize(NULL, 8));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(big);
+  unlink(out);
+  unlink(journal);
+  unlink(image);
+}
+
+void test_cache() {
+  IMFFSPtr fs;
+  char text[] = "/tmp/a5_test_text", other[] = "/tmp/a5_test_other", big[] = "/tmp/a5_test_big";
+  char out[] = "/tmp/a5_test_out", journal[] = "/tmp/a5_test_journal";
+  char *names[] = { "a", "b", "c", "d", "e" };
+  int changed;
+
+  printf("\n*** Testing cache mode:\n\n");
+
+  make_disk_file(text, 5000);  // 20 blocks, so five fill the device
+  make_disk_file(other, 4900);
+  make_disk_file(big, 30000);
+  unlink(journal);
+
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  for (int i = 0; i < 5; i++) {
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, text, names[i]));
+  }
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, text, "f"));
+
+  // the least recently used file goes, and using one keeps it
+  VERIFY_INT(IMFFS_OK, imffs_set_cache(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "f"));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "a", 0 }));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "g"));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "c", 0 }));
+  VERIFY_INT(1, mm_count_values(fs->index, &(File){ "b", 0 }));
+
+  // pinned files are skipped, until they're unpinned as often as pinned
+  VERIFY_INT(IMFFS_OK, imffs_pin(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_pin(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "h"));
+  VERIFY_INT(1, mm_count_values(fs->index, &(File){ "d", 0 }));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "e", 0 }));
+  VERIFY_INT(IMFFS_OK, imffs_unpin(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "i"));
+  VERIFY_INT(1, mm_count_values(fs->index, &(File){ "d", 0 }));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "f", 0 }));
+  VERIFY_INT(IMFFS_OK, imffs_unpin(fs, "d"));
+  VERIFY_INT(IMFFS_ERROR, imffs_unpin(fs, "d"));
+  VERIFY_INT(IMFFS_ERROR, imffs_pin(fs, "a"));
+
+  // an update doesn't evict the copy it replaces, even if it's the coldest
+  VERIFY_INT(IMFFS_OK, imffs_update(fs, other, "b", &changed));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(TRUE, same_contents(other, out));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "g", 0 }));
+
+  // nothing goes for a file the device can't hold
+  VERIFY_INT(IMFFS_ERROR, imffs_save(fs, big, "big"));
+  VERIFY_INT(4, mm_count_keys(fs->index));
+
+  // evictions are deletes, so a replay gets the same files back
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(4, mm_count_keys(fs->index));
+  VERIFY_INT(0, mm_count_values(fs->index, &(File){ "g", 0 }));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(TRUE, same_contents(other, out));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "d", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_INVALID, imffs_pin(NULL, "d"));
+  VERIFY_INT(IMFFS_INVALID, imffs_set_cache(NULL, 1));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(other);
+  unlink(big);
+  unlink(out);
+  unlink(journal);
+}
+
+void test_tiering() {
+  IMFFSPtr fs;
+  IMFFSStat stat;
+  IMFFSUsage usage;
+  char text[] = "/tmp/a5_test_text", out[] = "/tmp/a5_test_out", journal[] = "/tmp/a5_test_journal";
+  char backing[] = "/tmp/a5_test_backing", image[] = "/tmp/a5_test_image";
+  char *names[] = { "a", "b", "c", "d", "e" };
+  uint8_t buffer[100];
+  uint64_t got, in_use, file_bytes, largest;
+
+  printf("\n*** Testing tiering:\n\n");
+
+  make_disk_file(text, 5000); // 20 blocks, so five fill the device
+  unlink(journal);
+  unlink(backing);
+  unlink(image);
+
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_spill(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_set_backing(fs, backing));
+  VERIFY_INT(IMFFS_ERROR, imffs_set_backing(fs, backing));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  for (int i = 0; i < 5; i++) {
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, text, names[i]));
+  }
+
+  // the coldest file is spilled to make room, and keeps its record
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "f"));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "a", &stat));
+  VERIFY_INT(1, stat.spilled);
+  VERIFY_INT(0, stat.blocks);
+  VERIFY_INT(5000, stat.stored_bytes);
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, usage.spilled_files);
+  VERIFY_INT(5000, usage.spilled_bytes);
+  VERIFY_INT(100, usage.used_blocks);
+
+  // with no room to bring it back, it's read from the backing file
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "a", 4990, buffer, sizeof(buffer), &got));
+  VERIFY_INT(10, got);
+  VERIFY_INT('a' + 4990 % 26, buffer[0]);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "a", &stat));
+  VERIFY_INT(1, stat.spilled);
+
+  // a write brings it back, spilling the next coldest
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "a", 0, "a", 1));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "a", &stat));
+  VERIFY_INT(0, stat.spilled);
+  VERIFY_INT(20, stat.blocks);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "b", &stat));
+  VERIFY_INT(1, stat.spilled);
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+
+  // with room, a load brings it back
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "f"));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "b", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "b", &stat));
+  VERIFY_INT(0, stat.spilled);
+  VERIFY_INT(100, count_used_blocks(fs));
+
+  // spilling by hand, but not twice, nor pinned files
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "c"));
+  VERIFY_INT(IMFFS_ERROR, imffs_spill(fs, "c"));
+  VERIFY_INT(IMFFS_ERROR, imffs_spill(fs, "nothing"));
+  VERIFY_INT(IMFFS_OK, imffs_pin(fs, "d"));
+  VERIFY_INT(IMFFS_ERROR, imffs_spill(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_unpin(fs, "d"));
+  VERIFY_INT(80, count_used_blocks(fs));
+
+  // a checkpoint keeps where spilled files are, in the same backing file
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(IMFFS_ERROR, imffs_load(fs, "c", out));
+  VERIFY_INT(IMFFS_OK, imffs_set_backing(fs, backing));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "c", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "g"));
+
+  // spills and faults are logged, so a replay finds each file where it was
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_open_image(image, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_backing(fs, backing));
+  VERIFY_INT(IMFFS_OK, imffs_journal(fs, journal, 0));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "c", &stat));
+  VERIFY_INT(0, stat.spilled);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "d", &stat));
+  VERIFY_INT(1, stat.spilled);
+  VERIFY_INT(100, count_used_blocks(fs));
+  for (int i = 0; i < 5; i++) {
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, names[i], out));
+    VERIFY_INT(TRUE, same_contents(text, out));
+  }
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "g", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+
+  // a compressed file is spilled as it's stored, and always brought back
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "d"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "e"));
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "z"));
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "z", &stat));
+  got = stat.stored_bytes;
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "z"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, usage.spilled_files);
+  VERIFY_INT(got, usage.spilled_bytes);
+  VERIFY_INT(IMFFS_OK, imffs_read(fs, "z", 4990, buffer, sizeof(buffer), &got));
+  VERIFY_INT('a' + 4990 % 26, buffer[0]);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "z", &stat));
+  VERIFY_INT(0, stat.spilled);
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "z"));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "z"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(0, usage.spilled_files);
+#ifdef IMFFS_METRICS
+  VERIFY_INT(1, fs->metrics.backing_hits > 0 && fs->metrics.memory_hits > 0);
+#endif
+  VERIFY_INT(IMFFS_INVALID, imffs_spill(NULL, "a"));
+  VERIFY_INT(IMFFS_INVALID, imffs_set_backing(NULL, backing));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  // space no checkpoint refers to is reused as soon as it's freed, so
+  // spilling the same file over and over doesn't grow the backing file
+  unlink(backing);
+  VERIFY_INT(IMFFS_OK, imffs_create(100, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_backing(fs, backing));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "a"));
+  largest = 0;
+  for (int i = 0; i < 50; i++) {
+    imffs_spill(fs, "a");
+    backing_stats(fs->backing, &in_use, &file_bytes);
+    largest = file_bytes > largest ? file_bytes : largest;
+    imffs_load(fs, "a", out);
+  }
+  VERIFY_INT(5000, largest);
+  backing_stats(fs->backing, &in_use, &file_bytes);
+  VERIFY_INT(0, in_use);
+  VERIFY_INT(0, file_bytes);
+  VERIFY_INT(TRUE, same_contents(text, out));
+
+  // space the last checkpoint refers to waits for the next one
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "a"));
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  largest = 0;
+  for (int i = 0; i < 50; i++) {
+    imffs_load(fs, "a", out);
+    imffs_spill(fs, "a");
+    backing_stats(fs->backing, &in_use, &file_bytes);
+    largest = file_bytes > largest ? file_bytes : largest;
+  }
+  VERIFY_INT(10000, largest);
+  VERIFY_INT(IMFFS_OK, imffs_checkpoint(fs, image));
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_OK, imffs_spill(fs, "a"));
+  backing_stats(fs->backing, &in_use, &file_bytes);
+  VERIFY_INT(5000, in_use);
+  VERIFY_INT(10000, file_bytes);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+
+  unlink(text);
+  unlink(out);
+  unlink(journal);
+  unlink(backing);
+  unlink(image);
+}
+
+void test_shared() {
+  IMFFSPtr fs;
+  IMFFSReaderPtr reader;
+  IMFFSStat stat;
+  IMFFSChunk chunks[8];
+  char text[] = "/tmp/a5_test_text", small[] = "/tmp/a5_test_small", name[] = "/a5_test_shared";
+  uint8_t expected[5000], buffer[5000];
+  uint64_t got, version, published = 0;
+  uint32_t count;
+  int status, torn;
+  pid_t child;
+  char file_name[32];
+  Boolean intact;
+
+  printf("\n*** Testing sharing:\n\n");
+
+  make_disk_file(text, 5000);
+  make_disk_file(small, 100);
+  for (int i = 0; i < 5000; i++) {
+    expected[i] = 'a' + i % 26;
+  }
+
+  VERIFY_INT(IMFFS_OK, imffs_create(200, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "inline"));
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 0));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "plain"));
+  VERIFY_INT(IMFFS_OK, imffs_set_tail_packing(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "Packed"));
+  VERIFY_INT(IMFFS_OK, imffs_set_compression(fs, 1));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "zipped"));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_open(name, &reader));
+  VERIFY_INT(IMFFS_OK, imffs_share(fs, name));
+  VERIFY_INT(IMFFS_ERROR, imffs_share(fs, name));
+  VERIFY_INT(IMFFS_OK, imffs_reader_open(name, &reader));
+
+  // every kind of file reads the same through a reader, looked up the way the index is
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "plain", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(5000, got);
+  VERIFY_INT(0, memcmp(expected, buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "PACKED", 4990, buffer, sizeof(buffer), &got));
+  VERIFY_INT(10, got);
+  VERIFY_INT(0, memcmp(&expected[4990], buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "zipped", 100, buffer, 4000, &got));
+  VERIFY_INT(4000, got);
+  VERIFY_INT(0, memcmp(&expected[100], buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "inline", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(100, got);
+  VERIFY_INT(0, memcmp(expected, buffer, got));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_read(reader, "nothing", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(IMFFS_OK, imffs_reader_stat(reader, "Packed", &stat));
+  VERIFY_INT(5000, stat.byte_len);
+  VERIFY_INT(1, stat.packed);
+  VERIFY_INT(19, stat.blocks);
+  VERIFY_INT(IMFFS_OK, imffs_stat(fs, "Packed", &stat));
+  got = stat.etag;
+  VERIFY_INT(IMFFS_OK, imffs_reader_stat(reader, "packed", &stat));
+  VERIFY_INT(got, stat.etag);
+
+  // zero copy: the chunks are the blocks themselves, in order
+  VERIFY_INT(IMFFS_OK, imffs_reader_chunks(reader, "packed", chunks, 8, &count, &version));
+  VERIFY_INT(2, count);
+  VERIFY_INT(4864, chunks[0].length);
+  VERIFY_INT(136, chunks[1].length);
+  VERIFY_INT(0, memcmp(expected, chunks[0].data, chunks[0].length));
+  VERIFY_INT(0, memcmp(&expected[4864], chunks[1].data, chunks[1].length));
+  VERIFY_INT(0, imffs_reader_changed(reader, version));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_chunks(reader, "packed", chunks, 1, &count, &version));
+  VERIFY_INT(2, count);
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_chunks(reader, "zipped", chunks, 8, &count, &version));
+  VERIFY_INT(IMFFS_OK, imffs_reader_chunks(reader, "inline", chunks, 8, &count, &version));
+  VERIFY_INT(1, count);
+  VERIFY_INT(0, memcmp(expected, chunks[0].data, 100));
+
+  // a change is seen by the next lookup, and tells chunks taken before it apart
+  VERIFY_INT(IMFFS_OK, imffs_reader_chunks(reader, "plain", chunks, 8, &count, &version));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "plain", 0, "Z", 1));
+  VERIFY_INT(1, imffs_reader_changed(reader, version));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "plain", 0, buffer, 2, &got));
+  VERIFY_INT('Z', buffer[0]);
+  VERIFY_INT('b', buffer[1]);
+  VERIFY_INT(IMFFS_OK, imffs_rename(fs, "plain", "renamed"));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_stat(reader, "plain", &stat));
+  VERIFY_INT(IMFFS_OK, imffs_reader_stat(reader, "renamed", &stat));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "zipped"));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_stat(reader, "zipped", &stat));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "packed", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(0, memcmp(expected, buffer, got));
+  VERIFY_INT(IMFFS_ERROR, imffs_resize(fs, 400));
+
+  // a directory that outgrows its space is moved, and readers follow it
+  VERIFY_INT(IMFFS_OK, imffs_set_inline_limit(fs, 4096));
+  for (int i = 0; i < 100; i++) {
+    snprintf((char *)buffer, sizeof(buffer), "inline%03d", i);
+    VERIFY_INT(IMFFS_OK, imffs_write(fs, "inline", 0, buffer, 0));
+    VERIFY_INT(IMFFS_OK, imffs_clone(fs, "inline", (char *)buffer));
+  }
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, text, "big0"));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "inline099", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(100, got);
+
+  // another process never sees a write half done
+  memset(buffer, 'x', sizeof(buffer));
+  VERIFY_INT(IMFFS_OK, imffs_write(fs, "renamed", 0, buffer, sizeof(buffer)));
+  child = fork();
+  if (0 == child) {
+    IMFFSReaderPtr other;
+
+    torn = IMFFS_OK != imffs_reader_open(name, &other);
+    for (int i = 0; !torn && i < 2000; i++) {
+      torn = IMFFS_OK != imffs_reader_read(other, "renamed", 0, buffer, sizeof(buffer), &got) ||
+             sizeof(buffer) != got;
+      for (uint64_t j = 1; !torn && j < got; j++) {
+        torn = buffer[j] != buffer[0];
+      }
+    }
+    imffs_reader_close(other);
+    _exit(torn ? 1 : 0);
+  }
+  VERIFY_INT(TRUE, child > 0);
+  for (int i = 0; child > 0 && 0 == waitpid(child, &status, WNOHANG); i++) {
+    memset(buffer, i & 1 ? 'x' : 'y', sizeof(buffer));
+    imffs_write(fs, "renamed", 0, buffer, sizeof(buffer));
+  }
+  VERIFY_INT(TRUE, WIFEXITED(status));
+  VERIFY_INT(0, WEXITSTATUS(status));
+
+  // the object goes with the filesystem, but a reader keeps what it had
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(IMFFS_OK, imffs_reader_read(reader, "inline", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(100, got);
+  VERIFY_INT(IMFFS_OK, imffs_reader_close(reader));
+  VERIFY_INT(IMFFS_ERROR, imffs_reader_open(name, &reader));
+
+  // a change publishes the entries of the files it changed, not the whole
+  // directory, so it costs the same however many files there are
+  VERIFY_INT(IMFFS_OK, imffs_create(4000, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_share(fs, name));
+  VERIFY_INT(IMFFS_OK, imffs_reader_open(name, &reader));
+  intact = TRUE;
+  for (int i = 0; i < 1000; i++) {
+    snprintf(file_name, sizeof(file_name), "many%04d", i);
+    intact = IMFFS_OK == imffs_put(fs, file_name, expected, 100) && intact;
+  }
+#ifdef IMFFS_METRICS
+  published = fs->metrics.published_bytes;
+#endif
+  for (int i = 0; i < 1000; i++) {
+    snprintf(file_name, sizeof(file_name), "many%04d", i);
+    intact = IMFFS_OK == imffs_delete(fs, file_name) && intact;
+    if (0 == i % 2) {
+      intact = IMFFS_OK == imffs_put(fs, file_name, &expected[1], 200) && intact;
+    }
+  }
+#ifdef IMFFS_METRICS
+  VERIFY_INT(TRUE, (fs->metrics.published_bytes - published) / 1500 < 1024);
+#endif
+  for (int i = 0; i < 1000; i++) {
+    snprintf(file_name, sizeof(file_name), "MANY%04d", i);
+    if (0 == i % 2) {
+      intact = IMFFS_OK == imffs_reader_read(reader, file_name, 0, buffer, sizeof(buffer), &got) && 200 == got &&
+               0 == memcmp(&expected[1], buffer, got) && intact;
+    } else {
+      intact = IMFFS_ERROR == imffs_reader_stat(reader, file_name, &stat) && intact;
+    }
+  }
+  VERIFY_INT(TRUE, intact);
+  VERIFY_INT(IMFFS_OK, imffs_reader_close(reader));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+}
+
+static void *serve(void *server) {
+  return server_run(server) ? "failed" : NULL;
+}
+
+static void count_listed(const char *name, uint64_t byte_len, void *context) {
+  uint64_t *totals = context;
+
+  (void)name;
+  totals[0]++;
+  totals[1] += byte_len;
+}
+
+// puts, gets and deletes a file of its own over and over; NULL if each get matched the put before it
+static void *busy_client(void *socket_path) {
+  static int next_id;
+  IMFFSClientPtr client;
+  char name[16], put[300], got[300];
+  int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+  uint64_t length;
+  void *failed = NULL;
+
+  if (IMFFS_OK != imffs_client_connect(socket_path, &client)) {
+    return "unconnected";
+  }
+  snprintf(name, sizeof(name), "busy%d", id);
+  for (int i = 0; NULL == failed && i < 100; i++) {
+    memset(put, 'a' + (id + i) % 26, sizeof(put));
+    if (IMFFS_OK != imffs_client_put(client, name, put, 100 + i * 2) ||
+        IMFFS_OK != imffs_client_get(client, name, 0, got, sizeof(got), &length) || 100 + i * 2 != length ||
+        0 != memcmp(put, got, length) || IMFFS_OK != imffs_client_delete(client, name)) {
+      failed = "mismatched";
+    }
+  }
+  imffs_client_close(client);
+
+  return failed;
+}
+
+void test_server() {
+  IMFFSPtr fs;
+  IMFFSClientPtr client;
+  IMFFSUsage usage;
+  Server *server;
+  pthread_t thread, clients[4];
+  ProtocolHeader requests[2] = { { 0, PROTOCOL_STATS, { 0 }, 1 }, { 0, 99, { 0 }, 2 } }, response;
+  struct sockaddr_un address = { AF_UNIX };
+  char path[] = "/tmp/a5_test_socket", text[] = "/tmp/a5_test_text", out[] = "/tmp/a5_test_out";
+  char name[] = "/a5_test_served", expected[5000], buffer[6000];
+  uint64_t got, totals[2] = { 0, 0 }, connections, served;
+  struct stat st;
+  void *failed;
+  int fd;
+
+  printf("\n*** Testing the server:\n\n");
+
+  make_disk_file(text, 5000);
+  for (int i = 0; i < 5000; i++) {
+    expected[i] = 'a' + i % 26;
+  }
+  strcpy(address.sun_path, path);
+
+  VERIFY_INT(IMFFS_OK, imffs_create(200, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_NOT_NULL(server = server_create(fs, path, NULL, 4));
+  VERIFY_INT(0, pthread_create(&thread, NULL, serve, server));
+  VERIFY_INT(IMFFS_OK, imffs_client_connect(path, &client));
+
+  // every request does what the call it's named after does
+  VERIFY_INT(IMFFS_OK, imffs_client_put(client, "hello", "hi there", 8));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "hello", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(8, got);
+  VERIFY_INT(0, memcmp("hi there", buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "hello", 3, buffer, 2, &got));
+  VERIFY_INT(2, got);
+  VERIFY_INT(0, memcmp("th", buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_client_save(client, text, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "text", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(5000, got);
+  VERIFY_INT(0, memcmp(expected, buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_client_load(client, "text", out));
+  VERIFY_INT(TRUE, same_contents(text, out));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_save(client, "/tmp/a5_test_nothing", "nothing"));
+  VERIFY_INT(IMFFS_OK, imffs_client_rename(client, "hello", "greeting"));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_get(client, "hello", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(0, got);
+  VERIFY_INT(IMFFS_OK, imffs_client_put(client, "empty", NULL, 0));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "empty", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(0, got);
+  VERIFY_INT(IMFFS_OK, imffs_client_dir(client, count_listed, totals));
+  VERIFY_INT(3, totals[0]);
+  VERIFY_INT(5008, totals[1]);
+  VERIFY_INT(IMFFS_OK, imffs_client_delete(client, "text"));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_delete(client, "text"));
+  VERIFY_INT(IMFFS_OK, imffs_client_stats(client, &usage));
+  VERIFY_INT(2, usage.file_count);
+
+  // requests can be sent before the responses to earlier ones are read, and
+  // one that makes no sense is answered like any other
+  VERIFY_INT(TRUE, (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+  VERIFY_INT(0, connect(fd, (struct sockaddr *)&address, sizeof(address)));
+  VERIFY_INT(sizeof(requests), send(fd, requests, sizeof(requests), 0));
+  VERIFY_INT(sizeof(response), recv(fd, &response, sizeof(response), MSG_WAITALL));
+  VERIFY_INT(1, response.tag);
+  VERIFY_INT(IMFFS_OK, response.op);
+  VERIFY_INT(sizeof(IMFFSUsage), recv(fd, &usage, sizeof(usage), MSG_WAITALL));
+  VERIFY_INT(sizeof(response), recv(fd, &response, sizeof(response), MSG_WAITALL));
+  VERIFY_INT(2, response.tag);
+  VERIFY_INT(IMFFS_INVALID, response.op);
+  VERIFY_INT(0, response.body_length);
+  requests[0].op = PROTOCOL_GET;
+  requests[0].body_length = 9;
+  VERIFY_INT(sizeof(requests[0]), send(fd, requests, sizeof(requests[0]), 0));
+  VERIFY_INT(9, send(fd, "greeting", 9, 0));
+  VERIFY_INT(sizeof(response), recv(fd, &response, sizeof(response), MSG_WAITALL));
+  VERIFY_INT(IMFFS_INVALID, response.op);
+  // too long to be read, so the connection is closed
+  requests[0].body_length = PROTOCOL_MAX_BODY + 1;
+  VERIFY_INT(sizeof(requests[0]), send(fd, requests, sizeof(requests[0]), 0));
+  VERIFY_INT(0, recv(fd, &response, sizeof(response), MSG_WAITALL));
+  close(fd);
+
+  // connections are served at the same time
+  for (int i = 0; i < 4; i++) {
+    VERIFY_INT(0, pthread_create(&clients[i], NULL, busy_client, path));
+  }
+  for (int i = 0; i < 4; i++) {
+    VERIFY_INT(0, pthread_join(clients[i], &failed));
+    VERIFY_NULL(failed);
+  }
+  server_stats(server, &connections, &served);
+  VERIFY_INT(6, connections);
+  VERIFY_INT(TRUE, served > 800);
+
+  // stopping closes the connections and removes the socket
+  server_stop(server);
+  VERIFY_INT(0, pthread_join(thread, &failed));
+  VERIFY_NULL(failed);
+  server_destroy(server);
+  VERIFY_INT(IMFFS_FATAL, imffs_client_get(client, "greeting", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(IMFFS_OK, imffs_client_close(client));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_connect(path, &client));
+
+  // a shared filesystem is read through readers, which see every change
+  VERIFY_INT(IMFFS_OK, imffs_share(fs, name));
+  VERIFY_NOT_NULL(server = server_create(fs, path, name, 2));
+  VERIFY_INT(0, pthread_create(&thread, NULL, serve, server));
+  VERIFY_INT(IMFFS_OK, imffs_client_connect(path, &client));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "greeting", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(0, memcmp("hi there", buffer, got));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_put(client, "greeting", expected, 5000));
+  VERIFY_INT(IMFFS_OK, imffs_client_delete(client, "greeting"));
+  VERIFY_INT(IMFFS_OK, imffs_client_put(client, "greeting", expected, 5000));
+  VERIFY_INT(IMFFS_OK, imffs_client_get(client, "greeting", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(5000, got);
+  VERIFY_INT(0, memcmp(expected, buffer, got));
+  VERIFY_INT(IMFFS_OK, imffs_client_delete(client, "greeting"));
+  VERIFY_INT(IMFFS_ERROR, imffs_client_get(client, "greeting", 0, buffer, sizeof(buffer), &got));
+  VERIFY_INT(IMFFS_OK, imffs_client_close(client));
+  server_stop(server);
+  VERIFY_INT(0, pthread_join(thread, &failed));
+  server_destroy(server);
+
+  // a socket left behind is replaced, but nothing else at the path is
+  VERIFY_INT(TRUE, (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+  VERIFY_INT(0, bind(fd, (struct sockaddr *)&address, sizeof(address)));
+  close(fd);
+  VERIFY_NOT_NULL(server = server_create(fs, path, NULL, 1));
+  server_destroy(server);
+  VERIFY_NULL(server_create(fs, text, NULL, 1));
+  VERIFY_INT(0, stat(text, &st));
+  VERIFY_INT(TRUE, S_ISREG(st.st_mode));
+  VERIFY_INT(5000, st.st_size);
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+}
+
+// Runs ./a5_imffs -p, built next to the tests, with saves from FIFOs in the
+// commands: reading ahead must leave them to the saves, or a save waits for
+// a writer that has already gone.
+void test_pipeline() {
+  char first[] = "/tmp/a5_test_fifo1", fifo[] = "/tmp/a5_test_fifo2", out[] = "/tmp/a5_test_out";
+  char commands[] = "save /tmp/a5_test_fifo1 first\nsave /tmp/a5_test_fifo2 piped\n"
+                    "load piped /tmp/a5_test_out\nquit\n";
+  char expected[5000], buffer[6000];
+  pid_t writer, shell;
+  int input[2], status = 0, quiet;
+  FILE *file;
+  size_t got = 0;
+
+  printf("\n*** Testing pipelined commands:\n\n");
+
+  for (int i = 0; i < 5000; i++) {
+    expected[i] = 'a' + i % 26;
+  }
+  unlink(first);
+  unlink(fifo);
+  unlink(out);
+  VERIFY_INT(0, mkfifo(first, 0600));
+  VERIFY_INT(0, mkfifo(fifo, 0600));
+  VERIFY_INT(0, pipe(input));
+
+  // both give up after a while, rather than the tests waiting for good
+  writer = fork();
+  if (0 == writer) {
+    alarm(10);
+    file = fopen(fifo, "w");
+    _exit(NULL != file && 5000 == fwrite(expected, 1, 5000, file) && 0 == fclose(file) ? 0 : 1);
+  }
+  shell = fork();
+  if (0 == shell) {
+    alarm(10);
+    quiet = open("/dev/null", O_WRONLY);
+    dup2(input[0], STDIN_FILENO);
+    dup2(quiet, STDOUT_FILENO);
+    close(input[0]);
+    close(input[1]);
+    execl("./a5_imffs", "a5_imffs", "-p", (char *)NULL);
+    _exit(127);
+  }
+  close(input[0]);
+  VERIFY_INT(TRUE, writer > 0 && shell > 0);
+  VERIFY_INT(sizeof(commands) - 1, write(input[1], commands, sizeof(commands) - 1));
+  close(input[1]);
+
+  // the shell waits on the first save while the second one's file is read ahead
+  usleep(200000);
+  VERIFY_NOT_NULL(file = fopen(first, "w"));
+  if (NULL != file) {
+    fputs("first", file);
+    fclose(file);
+  }
+
+  VERIFY_INT(shell, waitpid(shell, &status, 0));
+  VERIFY_INT(TRUE, WIFEXITED(status));
+  VERIFY_INT(0, WEXITSTATUS(status));
+  VERIFY_INT(writer, waitpid(writer, &status, 0));
+  VERIFY_INT(TRUE, WIFEXITED(status));
+  VERIFY_INT(0, WEXITSTATUS(status));
+  VERIFY_NOT_NULL(file = fopen(out, "r"));
+  if (NULL != file) {
+    got = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+  }
+  VERIFY_INT(5000, got);
+  VERIFY_INT(0, memcmp(expected, buffer, 5000));
+  unlink(first);
+  unlink(fifo);
+}
+
+// files past 4 GB need that much memory, so they only run when asked for
+void test_large_files() {
+  IMFFSPtr fs = NULL;
+  IMFFSUsage usage;
+  char big[] = "/tmp/a5_test_big", out[] = "/tmp/a5_test_out";
+  const uint64_t size = (1ULL << 32) + 300;
+  char ends[5] = "";
+  struct stat st;
+  FILE *file;
+
+  printf("\n*** Testing 64-bit sizes:\n\n");
+
+  // the size of the device in bytes can't wrap around
+  VERIFY_INT(IMFFS_FATAL, imffs_create(UINT64_MAX / 2, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_NULL(fs);
+
+  if (NULL == getenv("IMFFS_TEST_LARGE")) {
+    printf("Skipping files past 4 GB, set IMFFS_TEST_LARGE to run them.\n");
+    return;
+  }
+
+  // sparse, apart from the first and last few bytes
+  file = fopen(big, "w");
+  assert(NULL != file);
+  fputs("head", file);
+  fseeko(file, size - 4, SEEK_SET);
+  fputs("tail", file);
+  fclose(file);
+
+  VERIFY_INT(IMFFS_OK, imffs_create(size / IMFFS_DEFAULT_BLOCK_SIZE + 2, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, big, "big"));
+  VERIFY_INT(IMFFS_OK, imffs_usage(fs, &usage));
+  VERIFY_INT(1, size == usage.total_bytes);
+  VERIFY_INT(1, size / IMFFS_DEFAULT_BLOCK_SIZE + 1 == usage.used_blocks);
+  VERIFY_INT(1, usage.extent_count);
+  unlink(big);
+
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "big", out));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  VERIFY_INT(0, stat(out, &st));
+  VERIFY_INT(1, size == (uint64_t)st.st_size);
+  file = fopen(out, "r");
+  VERIFY_NOT_NULL(file);
+  if (NULL != file) {
+    VERIFY_INT(4, fread(ends, 1, 4, file));
+    VERIFY_STR("head", ends);
+    fseeko(file, size - 4, SEEK_SET);
+    VERIFY_INT(4, fread(ends, 1, 4, file));
+    VERIFY_STR("tail", ends);
+    fclose(file);
+  }
+  unlink(out);
+}
+
+#define MAX_TEST_EVENTS 64
+
+typedef struct {
+  int count;
+  int depth, max_depth;
+  Boolean balanced;
+  IMFFSTraceEvent events[MAX_TEST_EVENTS];
+} TestTrace;
+
+static void test_tracer(const IMFFSTraceEvent *event, void *context) {
+  TestTrace *trace = context;
+
+  if (IMFFS_TRACE_BEGIN == event->phase) {
+    trace->depth++;
+    if (trace->depth > trace->max_depth) {
+      trace->max_depth = trace->depth;
+    }
+  } else {
+    trace->depth--;
+    if (trace->depth < 0) {
+      trace->balanced = FALSE;
+    }
+  }
+  if (trace->count < MAX_TEST_EVENTS) {
+    trace->events[trace->count] = *event;
+  }
+  trace->count++;
+}
+
+void test_trace() {
+  IMFFSPtr fs;
+  TestTrace trace = { 0, 0, 0, TRUE };
+  TraceRing *ring;
+  char small[] = "/tmp/a5_test_small", json[] = "/tmp/a5_test_trace.json";
+  FILE *out;
+  int last;
+
+  printf("\n*** Testing tracing:\n\n");
+
+  make_disk_file(small, 600); // 3 blocks
+  VERIFY_INT(IMFFS_OK, imffs_create(10, IMFFS_DEFAULT_BLOCK_SIZE, &fs));
+  VERIFY_INT(IMFFS_OK, imffs_set_tracer(fs, test_tracer, &trace));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "a"));
+
+  // save, open, reserve, copy and index insert, each with a begin and end
+  VERIFY_INT(10, trace.count);
+  VERIFY_INT(0, trace.depth);
+  VERIFY_INT(2, trace.max_depth);
+  VERIFY_STR("save", trace.events[0].name);
+  VERIFY_STR("a", trace.events[0].file);
+  VERIFY_STR("open", trace.events[1].name);
+  VERIFY_STR("reserve", trace.events[3].name);
+  VERIFY_INT(3, trace.events[4].blocks);
+  VERIFY_STR("index insert", trace.events[7].name);
+  VERIFY_INT(IMFFS_TRACE_END, trace.events[9].phase);
+  VERIFY_STR("save", trace.events[9].name);
+  VERIFY_INT(3, trace.events[9].blocks);
+  VERIFY_INT(1, trace.events[9].extents);
+  VERIFY_INT(1, trace.events[9].timestamp_ns >= trace.events[0].timestamp_ns);
+
+  VERIFY_INT(IMFFS_OK, imffs_load(fs, "a", "/dev/null"));
+  VERIFY_INT(IMFFS_OK, imffs_rename(fs, "a", "b"));
+  VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+  VERIFY_INT(IMFFS_OK, imffs_delete(fs, "b"));
+  VERIFY_INT(IMFFS_ERROR, imffs_delete(fs, "b"));
+  VERIFY_INT(0, trace.depth);
+  VERIFY_INT(1, trace.balanced);
+  last = trace.count - 1;
+  VERIFY_INT(1, last < MAX_TEST_EVENTS);
+  VERIFY_STR("delete", trace.events[last].name);
+
+  // removing the tracer stops the events
+  last = trace.count;
+  VERIFY_INT(IMFFS_OK, imffs_set_tracer(fs, NULL, &trace));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "c"));
+  VERIFY_INT(last, trace.count);
 
-  printf("\n*** Testing block_ptr_to_index:\n\n");
+  // the ring keeps only the most recent events
+  ring = trace_ring_create(4);
+  VERIFY_NOT_NULL(ring);
+  VERIFY_INT(IMFFS_OK, imffs_set_tracer(fs, trace_ring_record, ring));
+  VERIFY_INT(IMFFS_OK, imffs_save(fs, small, "d"));
+  VERIFY_INT(10, trace_ring_count(ring));
+  out = fopen(json, "w");
+  VERIFY_NOT_NULL(out);
+  VERIFY_INT(4, trace_ring_dump_json(ring, out));
+  fclose(out);
+  trace_ring_destroy(ring);
 
-  VERIFY_INT(0, block_ptr_to_index(base, &base[0]));
-  VERIFY_INT(1, block_ptr_to_index(base, &base[256]));
-  VERIFY_INT(2, block_ptr_to_index(base, &base[512]));
-  VERIFY_INT(1, block_ptr_to_index(&base[256], &base[512]));
-  VERIFY_INT(0, block_ptr_to_index(&base[512], &base[512]));
-  VERIFY_INT(3, block_ptr_to_index(base, &base[768]));
-  VERIFY_INT(2, block_ptr_to_index(&base[256], &base[768]));
+  VERIFY_INT(IMFFS_OK, imffs_destroy(fs));
+  unlink(small);
+  unlink(json);
 }
 
 int main() {
@@ -166,7 +2339,29 @@ int main() {
   
   test_multimap();
   test_find_next_free_block();
-  test_block_ptr_to_index();
+  test_extents();
+  test_defrag();
+  test_usage();
+  test_metrics();
+  test_trace();
+  test_block_size();
+  test_inline();
+  test_tail_packing();
+  test_dedup();
+  test_compression();
+  test_checksums();
+  test_etags();
+  test_clones();
+  test_journal();
+  test_incremental_checkpoints();
+  test_trim();
+  test_resize();
+  test_cache();
+  test_tiering();
+  test_shared();
+  test_server();
+  test_pipeline();
+  test_large_files();
   
   if (0 == Tests_Failed) {
     printf("\nAll %d tests passed.\n", Tests_Passed);
@@ -18,7 +18,7 @@ static int void_strcasecmp(void *a, void *b) {
 static int compare_values_num_part(void *a, void *b) {
   assert(NULL != a && NULL != b);
   Value *va = a, *vb = b;
-  return va->num - vb->num;
+  return (va->num > vb->num) - (va->num < vb->num);
 }
 
 static int compare_ints(void *a, void *b) {
@@ -54,6 +54,7 @@ static int compare_always_less(void *a, void *b) {
 void test_example() {
   Multimap *mm;
   Value arr[3]; // using one extra space
+  void *key;
   
   printf("\n*** Example tests:\n\n");
   
@@ -72,6 +73,9 @@ void test_example() {
   VERIFY_INT(1, mm_count_values(mm, "world"));
   VERIFY_INT(2, mm_count_values(mm, "!"));
   VERIFY_INT(0, mm_count_values(mm, "?"));
+  VERIFY_INT(1, mm_get_key(mm, "HELLO", &key));
+  VERIFY_STR("hello", key);
+  VERIFY_INT(0, mm_get_key(mm, "?", &key));
   
   VERIFY_INT(2, mm_get_values(mm, "!", arr, 2));
   VERIFY_INT(5, arr[0].num);
@@ -665,6 +669,50 @@ void test_get_invalid() {
   VERIFY_INT(4, mm_destroy(mm));
 }
 
+void test_large()
+{
+  Multimap *mm;
+  Value arr[2];
+  int keys[1000], inserted = 0;
+  
+  printf("\n*** Large keys and values:\n\n");
+  
+  // max_keys is only a limit, the keys are allocated as they're added
+  VERIFY_NOT_NULL(mm = mm_create(1000, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 1000; i++) {
+    keys[i] = 999 - i;
+    inserted += mm_insert_value(mm, &keys[i], i, "x");
+  }
+  VERIFY_INT(1000, inserted);
+  VERIFY_INT(1000, mm_count_keys(mm));
+  VERIFY_INT(-1, mm_insert_value(mm, &(int){ 1000 }, 1, "x"));
+  VERIFY_INT(1, mm_get_values(mm, &(int){ 0 }, arr, 2));
+  VERIFY_INT(999, arr[0].num);
+  VERIFY_INT(2000, mm_destroy(mm));
+  
+  // the limit can change, but not to fewer keys than there are
+  VERIFY_NOT_NULL(mm = mm_create(2, compare_ints, compare_values_num_part));
+  VERIFY_INT(1, mm_insert_value(mm, &keys[0], 0, "x"));
+  VERIFY_INT(1, mm_insert_value(mm, &keys[1], 1, "x"));
+  VERIFY_INT(-1, mm_insert_value(mm, &keys[2], 2, "x"));
+  VERIFY_INT(1, mm_set_max_keys(mm, 4));
+  VERIFY_INT(1, mm_insert_value(mm, &keys[2], 2, "x"));
+  VERIFY_INT(-1, mm_set_max_keys(mm, 2));
+  VERIFY_INT(1, mm_set_max_keys(mm, 3));
+  VERIFY_INT(-1, mm_insert_value(mm, &keys[3], 3, "x"));
+  VERIFY_INT(3, mm_count_keys(mm));
+  VERIFY_INT(6, mm_destroy(mm));
+  
+  // chunk sizes past 2^31 and 2^32
+  VERIFY_NOT_NULL(mm = mm_create(INT64_MAX, void_strcasecmp, compare_values_num_part));
+  VERIFY_INT(1, mm_insert_value(mm, "big", 5000000000LL, "five"));
+  VERIFY_INT(2, mm_insert_value(mm, "big", 3000000000LL, "three"));
+  VERIFY_INT(2, mm_get_values(mm, "big", arr, 2));
+  VERIFY_INT(1, 3000000000LL == arr[0].num);
+  VERIFY_INT(1, 5000000000LL == arr[1].num);
+  VERIFY_INT(3, mm_destroy(mm));
+}
+
 int main() {
   printf("*** Starting tests...\n");
   
@@ -675,6 +723,7 @@ int main() {
   test_empty();
   test_edge();
   test_multiple();
+  test_large();
 #ifdef NDEBUG
   test_invalid();
 #endif
@@ -0,0 +1,385 @@
+// Synthetic churn workload for IMFFS: random saves, deletes, loads and
+// renames drawn from configurable distributions, held around a target fill
+// level. Every interval it prints a CSV row with the latencies of that
+// interval and the fragmentation of the device.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "a5_imffs.h"
+#include "a5_bench.h"
+
+#define DEFAULT_BLOCKS 65536
+#define DEFAULT_OPS 1000000
+#define DEFAULT_INTERVAL 10000
+#define DEFAULT_FILL 75
+#define DEFAULT_MIN_SIZE 1
+#define DEFAULT_MAX_SIZE 65536
+#define DEFAULT_MIX "40:40:15:5"
+#define MAX_SIZES 4096   // distinct source file sizes, to bound the files on disk
+#define ZIPF_EXPONENT 1.1
+#define MAX_NAME 32
+
+typedef enum { OP_SAVE, OP_DELETE, OP_LOAD, OP_RENAME, NUM_OPS } Op;
+
+static char *Op_Names[NUM_OPS] = { "save", "delete", "load", "rename" };
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF, DIST_BIMODAL } Distribution;
+
+typedef struct {
+  uint32_t id;
+  uint32_t size;
+} LiveFile;
+
+static char Source_Dir[] = "/tmp/a5_workload_XXXXXX";
+static uint8_t *Source_Made;  // one flag per size step
+static uint32_t Min_Size, Max_Size, Size_Step;
+static uint32_t Block_Size = IMFFS_DEFAULT_BLOCK_SIZE;
+static double *Zipf_Cdf;
+
+// files smaller than a block are stored inline, without blocks
+static uint32_t blocks_for(uint32_t size) {
+  return size < Block_Size && size <= IMFFS_MAX_INLINE_SIZE ? 0 : size / Block_Size + 1;
+}
+
+static double rand_unit(void) {
+  return (bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t step_count(void) {
+  return (Max_Size - Min_Size) / Size_Step + 1;
+}
+
+// rank k (from 0) has probability proportional to 1 / (k + 1)^s, and the
+// smallest sizes get the lowest ranks
+static int make_zipf_cdf(void) {
+  uint32_t steps = step_count();
+  double sum = 0;
+
+  Zipf_Cdf = malloc(steps * sizeof(double));
+  if (NULL == Zipf_Cdf) {
+    return -1;
+  }
+  for (uint32_t k = 0; k < steps; k++) {
+    sum += 1.0 / pow(k + 1, ZIPF_EXPONENT);
+    Zipf_Cdf[k] = sum;
+  }
+  for (uint32_t k = 0; k < steps; k++) {
+    Zipf_Cdf[k] /= sum;
+  }
+  return 0;
+}
+
+static uint32_t random_step(Distribution dist) {
+  uint32_t steps = step_count(), lo, hi, mid;
+  double r;
+
+  switch (dist) {
+  case DIST_ZIPF:
+    r = rand_unit();
+    lo = 0;
+    hi = steps - 1;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (Zipf_Cdf[mid] < r) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  case DIST_BIMODAL:
+    // 80% from the smallest tenth of the range, 20% from the largest tenth
+    if (bench_rand_below(10) < 8) {
+      return bench_rand_below(steps / 10 + 1);
+    }
+    return steps - 1 - bench_rand_below(steps / 10 + 1);
+  default:
+    return bench_rand_below(steps);
+  }
+}
+
+static void source_name(uint32_t size, char *name, size_t length) {
+  snprintf(name, length, "%s/%u", Source_Dir, size);
+}
+
+// source files are only written the first time a size is drawn
+static int make_source(uint32_t step, uint32_t size) {
+  char name[sizeof(Source_Dir) + 16];
+  FILE *out;
+
+  if (!Source_Made[step]) {
+    source_name(size, name, sizeof(name));
+    out = fopen(name, "w");
+    if (NULL == out) {
+      fprintf(stderr, "Error: unable to create '%s'.\n", name);
+      return -1;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+      fputc('a' + (i + size) % 26, out);
+    }
+    fclose(out);
+    Source_Made[step] = 1;
+  }
+  return 0;
+}
+
+static void remove_sources(void) {
+  char name[sizeof(Source_Dir) + 16];
+
+  for (uint32_t step = 0; NULL != Source_Made && step < step_count(); step++) {
+    if (Source_Made[step]) {
+      source_name(Min_Size + step * Size_Step, name, sizeof(name));
+      unlink(name);
+    }
+  }
+  rmdir(Source_Dir);
+}
+
+static int parse_mix(char *text, int weights[NUM_OPS]) {
+  char *end;
+  int total = 0;
+
+  for (int i = 0; i < NUM_OPS; i++) {
+    weights[i] = strtol(text, &end, 10);
+    if (end == text || weights[i] < 0 || (i < NUM_OPS - 1 && ':' != *end) || (i == NUM_OPS - 1 && '\0' != *end)) {
+      return -1;
+    }
+    total += weights[i];
+    text = end + 1;
+  }
+  return total > 0 ? 0 : -1;
+}
+
+static void print_percentiles(double samples[], int count) {
+  if (count > 0) {
+    bench_sort(samples, count);
+    printf(",%.1f,%.1f", bench_percentile(samples, count, 0.5) * 1e6, bench_percentile(samples, count, 0.99) * 1e6);
+  } else {
+    printf(",,");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt, result = 0;
+  uint32_t block_count = DEFAULT_BLOCKS;
+  long ops = DEFAULT_OPS, interval = DEFAULT_INTERVAL, defrag_every = 0;
+  int fill = DEFAULT_FILL, weights[NUM_OPS], total_weight = 0;
+  char *mix = DEFAULT_MIX, *dist_name = "uniform";
+  Distribution dist = DIST_UNIFORM;
+  uint64_t seed = 1;
+
+  Min_Size = DEFAULT_MIN_SIZE;
+  Max_Size = DEFAULT_MAX_SIZE;
+
+  while (0 == result && (opt = getopt(argc, argv, "b:B:n:i:f:d:m:M:x:D:s:h")) != -1) {
+    switch (opt) {
+    case 'b':
+      block_count = strtoul(optarg, NULL, 10);
+      break;
+    case 'B':
+      Block_Size = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      ops = atol(optarg);
+      break;
+    case 'i':
+      interval = atol(optarg);
+      break;
+    case 'f':
+      fill = atoi(optarg);
+      break;
+    case 'd':
+      dist_name = optarg;
+      break;
+    case 'm':
+      Min_Size = strtoul(optarg, NULL, 10);
+      break;
+    case 'M':
+      Max_Size = strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      mix = optarg;
+      break;
+    case 'D':
+      defrag_every = atol(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      result = -1;
+      break;
+    }
+  }
+
+  if (0 == strcmp("uniform", dist_name)) {
+    dist = DIST_UNIFORM;
+  } else if (0 == strcmp("zipf", dist_name)) {
+    dist = DIST_ZIPF;
+  } else if (0 == strcmp("bimodal", dist_name)) {
+    dist = DIST_BIMODAL;
+  } else {
+    result = -1;
+  }
+
+  if (0 == result && 0 != parse_mix(mix, weights)) {
+    result = -1;
+  }
+
+  if (result < 0 || argc > optind || block_count < 1 || ops < 1 || interval < 1 || fill < 1 || fill > 100 ||
+      Max_Size < Min_Size || defrag_every < 0) {
+    fprintf(stderr, "Usage: %s [-b blocks] [-B block_size] [-n ops] [-i interval] [-f fill_percent]\n"
+                    "       [-d uniform|zipf|bimodal] [-m min_size] [-M max_size]\n"
+                    "       [-x save:delete:load:rename] [-D defrag_every] [-s seed]\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 0; i < NUM_OPS; i++) {
+    total_weight += weights[i];
+  }
+
+  Size_Step = (Max_Size - Min_Size) / MAX_SIZES + 1;
+  Source_Made = calloc(step_count(), 1);
+  IMFFSPtr fs = NULL;
+  LiveFile *live = malloc(block_count * sizeof(LiveFile));
+  double *samples[NUM_OPS];
+  int sample_count[NUM_OPS];
+  for (int i = 0; i < NUM_OPS; i++) {
+    samples[i] = malloc(interval * sizeof(double));
+    if (NULL == samples[i]) {
+      result = -1;
+    }
+  }
+
+  if (0 != result || NULL == Source_Made || NULL == live || NULL == mkdtemp(Source_Dir) ||
+      (DIST_ZIPF == dist && 0 != make_zipf_cdf()) || IMFFS_OK != imffs_create(block_count, Block_Size, &fs)) {
+    fprintf(stderr, "Error: unable to set up the workload.\n");
+    return 1;
+  }
+
+  bench_seed(seed);
+  printf("# blocks=%u block_size=%u dist=%s sizes=%u..%u fill=%d%% mix=%s defrag_every=%ld seed=%llu\n",
+         block_count, Block_Size, dist_name,
+         Min_Size, Max_Size, fill, mix, defrag_every, (unsigned long long)seed);
+  printf("ops,elapsed_s,files,fill_pct,largest_free_run,extents_per_file,max_extents,failed_saves,defrag_ms");
+  for (int i = 0; i < NUM_OPS; i++) {
+    printf(",%s_p50_us,%s_p99_us", Op_Names[i], Op_Names[i]);
+  }
+  printf("\n");
+
+  uint32_t live_count = 0, next_id = 0, used_blocks = 0, target = (uint64_t)block_count * fill / 100;
+  long failed_saves = 0;
+  double start_time = bench_now(), start, defrag_time = 0;
+  char name[MAX_NAME], new_name[MAX_NAME], source[sizeof(Source_Dir) + 16];
+  IMFFSUsage usage;
+  memset(sample_count, 0, sizeof(sample_count));
+
+  for (long n = 1; n <= ops && 0 == result; n++) {
+    uint64_t r = bench_rand_below(total_weight);
+    Op op = OP_SAVE;
+    while (r >= (uint64_t)weights[op]) {
+      r -= weights[op];
+      op++;
+    }
+
+    // hold the device around the target fill; inline files take no blocks,
+    // so the number of files is capped at the number of blocks as well
+    if (OP_SAVE == op && (used_blocks >= target || live_count >= block_count) && live_count > 0) {
+      op = OP_DELETE;
+    } else if (OP_DELETE == op && used_blocks < target && live_count < block_count) {
+      op = OP_SAVE;
+    } else if (0 == live_count) {
+      op = OP_SAVE;
+    }
+
+    uint32_t pick = live_count > 0 ? bench_rand_below(live_count) : 0;
+    if (live_count > 0) {
+      snprintf(name, MAX_NAME, "w%u", live[pick].id);
+    }
+
+    start = bench_now();
+    switch (op) {
+    case OP_SAVE: {
+      uint32_t step = random_step(dist);
+      uint32_t size = Min_Size + step * Size_Step;
+      if (0 != make_source(step, size)) {
+        result = -1;
+        break;
+      }
+      source_name(size, source, sizeof(source));
+      snprintf(name, MAX_NAME, "w%u", next_id);
+      start = bench_now();
+      if (IMFFS_OK == imffs_save(fs, source, name)) {
+        live[live_count].id = next_id;
+        live[live_count].size = size;
+        live_count++;
+        used_blocks += blocks_for(size);
+      } else {
+        failed_saves++;
+      }
+      next_id++;
+      break;
+    }
+    case OP_DELETE:
+      if (IMFFS_OK == imffs_delete(fs, name)) {
+        used_blocks -= blocks_for(live[pick].size);
+        live[pick] = live[--live_count];
+      }
+      break;
+    case OP_LOAD:
+      imffs_load(fs, name, "/dev/null");
+      break;
+    case OP_RENAME:
+      snprintf(new_name, MAX_NAME, "w%u", next_id);
+      if (IMFFS_OK == imffs_rename(fs, name, new_name)) {
+        live[pick].id = next_id;
+      }
+      next_id++;
+      break;
+    default:
+      assert(0);
+      break;
+    }
+    samples[op][sample_count[op]++] = bench_now() - start;
+
+    if (defrag_every > 0 && 0 == n % defrag_every) {
+      start = bench_now();
+      imffs_defrag(fs);
+      defrag_time += bench_now() - start;
+    }
+
+    if (0 == n % interval || n == ops) {
+      imffs_usage(fs, &usage);
+      printf("%ld,%.3f,%llu,%.1f,%llu,%.2f,%llu,%ld,%.3f", n, bench_now() - start_time,
+             (unsigned long long)usage.file_count, 100.0 * usage.used_blocks / usage.block_count,
+             (unsigned long long)usage.largest_free_run,
+             usage.file_count > 0 ? (double)usage.extent_count / usage.file_count : 0.0,
+             (unsigned long long)usage.max_file_extents,
+             failed_saves, defrag_time * 1000);
+      for (int i = 0; i < NUM_OPS; i++) {
+        print_percentiles(samples[i], sample_count[i]);
+        sample_count[i] = 0;
+      }
+      printf("\n");
+      fflush(stdout);
+      defrag_time = 0;
+    }
+  }
+
+  imffs_destroy(fs);
+  remove_sources();
+  free(Source_Made);
+  free(Zipf_Cdf);
+  free(live);
+  for (int i = 0; i < NUM_OPS; i++) {
+    free(samples[i]);
+  }
+
+  return 0 == result ? 0 : 1;
+}
@@ -7,6 +7,6 @@ extern int Tests_Passed;
 extern int Tests_Failed;
 
 void verify_int(int expected, int result, char test[]);
-void verify_str(char expected[], char result[], char test[]);
+void verify_str(const char expected[], const char result[], char test[]);
 void verify_null(void *result, char test[]);
 void verify_not_null(void *result, char test[]);
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "a5_backing.h"
+
+#define MIN_REGIONS 16
+
+typedef struct {
+  BackingRegion *regions;
+  uint64_t count;
+  uint64_t capacity;
+} RegionList;
+
+struct BACKING {
+  int fd;
+  uint64_t end;      // bytes in the file
+  uint64_t in_use;   // handed out and not released
+  RegionList free;     // can be handed out, in order, with no two touching
+  RegionList released; // only after the next checkpoint
+  RegionList fresh;    // handed out since the last checkpoint, in order
+};
+
+static int add_region(RegionList *list, uint64_t offset, uint64_t length) {
+  BackingRegion *grown;
+  uint64_t capacity;
+
+  if (0 == length) {
+    return 0;
+  }
+  if (list->count == list->capacity) {
+    capacity = list->capacity > 0 ? list->capacity * 2 : MIN_REGIONS;
+    grown = realloc(list->regions, capacity * sizeof(BackingRegion));
+    if (NULL == grown) {
+      return -1;
+    }
+    list->regions = grown;
+    list->capacity = capacity;
+  }
+  list->regions[list->count].offset = offset;
+  list->regions[list->count].length = length;
+  list->count++;
+
+  return 0;
+}
+
+static int compare_regions(const void *a, const void *b) {
+  const BackingRegion *x = a, *y = b;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// where a region at offset is, or would go, in a list in order
+static uint64_t find_region(RegionList *list, uint64_t offset) {
+  uint64_t low = 0, high = list->count, middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (list->regions[middle].offset < offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+static int insert_region(RegionList *list, uint64_t at, uint64_t offset, uint64_t length) {
+  assert(at <= list->count);
+
+  if (0 != add_region(list, offset, length)) {
+    return -1;
+  }
+  memmove(&list->regions[at + 1], &list->regions[at], (list->count - 1 - at) * sizeof(BackingRegion));
+  list->regions[at].offset = offset;
+  list->regions[at].length = length;
+
+  return 0;
+}
+
+static void remove_region(RegionList *list, uint64_t at) {
+  assert(at < list->count);
+
+  memmove(&list->regions[at], &list->regions[at + 1], (list->count - 1 - at) * sizeof(BackingRegion));
+  list->count--;
+}
+
+// the free space at the end of the file is cut off
+static void cut_end(Backing *backing) {
+  RegionList *free_list = &backing->free;
+  BackingRegion *last;
+
+  if (0 == free_list->count) {
+    return;
+  }
+  last = &free_list->regions[free_list->count - 1];
+  if (last->offset + last->length == backing->end && 0 == ftruncate(backing->fd, last->offset)) {
+    backing->end = last->offset;
+    free_list->count--;
+  }
+}
+
+// can be handed out again right away, merged with the free space around it
+static void free_region(Backing *backing, uint64_t offset, uint64_t length) {
+  RegionList *free_list = &backing->free;
+  uint64_t at = find_region(free_list, offset);
+  BackingRegion *before = at > 0 ? &free_list->regions[at - 1] : NULL;
+
+  if (NULL != before && before->offset + before->length == offset) {
+    before->length += length;
+    if (at < free_list->count && before->offset + before->length == free_list->regions[at].offset) {
+      before->length += free_list->regions[at].length;
+      remove_region(free_list, at);
+    }
+  } else if (at < free_list->count && offset + length == free_list->regions[at].offset) {
+    free_list->regions[at].offset = offset;
+    free_list->regions[at].length += length;
+  } else if (0 != insert_region(free_list, at, offset, length)) {
+    return; // lost
+  }
+  cut_end(backing);
+}
+
+Backing *backing_open(const char *path, BackingRegion *in_use, uint64_t count) {
+  assert(NULL != path);
+  assert(NULL != in_use || 0 == count);
+
+  Backing *backing = calloc(1, sizeof(Backing));
+  struct stat st;
+  uint64_t next = 0;
+  int failed = 0;
+
+  if (NULL == backing) {
+    fprintf(stderr, "Error: not enough memory to open backing file '%s'.\n", path);
+    return NULL;
+  }
+  if ((backing->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || 0 != fstat(backing->fd, &st)) {
+    fprintf(stderr, "Error: unable to open backing file '%s'.\n", path);
+    failed = 1;
+  } else {
+    backing->end = st.st_size;
+
+    // what's between the regions in use is released
+    qsort(in_use, count, sizeof(BackingRegion), compare_regions);
+    for (uint64_t i = 0; !failed && i < count; i++) {
+      if (in_use[i].offset < next || in_use[i].offset > backing->end ||
+          in_use[i].length > backing->end - in_use[i].offset) {
+        fprintf(stderr, "Error: backing file '%s' doesn't hold the files spilled to it.\n", path);
+        failed = 1;
+      } else {
+        failed = add_region(&backing->released, next, in_use[i].offset - next);
+        next = in_use[i].offset + in_use[i].length;
+        backing->in_use += in_use[i].length;
+      }
+    }
+    failed = failed || add_region(&backing->released, next, backing->end - next);
+  }
+
+  if (failed) {
+    backing_close(backing);
+    return NULL;
+  }
+
+  return backing;
+}
+
+uint64_t backing_alloc(Backing *backing, uint64_t length) {
+  assert(NULL != backing);
+
+  BackingRegion *region;
+  uint64_t offset;
+
+  int found = 0;
+
+  backing->in_use += length;
+  for (uint64_t i = 0; !found && length > 0 && i < backing->free.count; i++) {
+    region = &backing->free.regions[i];
+    if (region->length >= length) {
+      offset = region->offset;
+      region->offset += length;
+      region->length -= length;
+      if (0 == region->length) {
+        remove_region(&backing->free, i);
+      }
+      found = 1;
+    }
+  }
+  if (!found) {
+    offset = backing->end;
+    backing->end += length;
+  }
+
+  // no checkpoint refers to it yet; without the memory to remember that,
+  // it's only released at the next one
+  if (length > 0) {
+    insert_region(&backing->fresh, find_region(&backing->fresh, offset), offset, length);
+  }
+
+  return offset;
+}
+
+void backing_release(Backing *backing, uint64_t offset, uint64_t length) {
+  assert(NULL != backing);
+  assert(length <= backing->in_use);
+
+  uint64_t at = find_region(&backing->fresh, offset);
+
+  backing->in_use -= length;
+  if (at < backing->fresh.count && offset == backing->fresh.regions[at].offset) {
+    remove_region(&backing->fresh, at);
+    free_region(backing, offset, length);
+  } else {
+    add_region(&backing->released, offset, length);
+  }
+}
+
+int backing_write(Backing *backing, uint64_t offset, const void *bytes, size_t length) {
+  assert(NULL != backing && (NULL != bytes || 0 == length));
+
+  const uint8_t *next = bytes;
+  ssize_t written;
+
+  while (length > 0) {
+    written = pwrite(backing->fd, next, length, offset);
+    if (written < 0 && EINTR == errno) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    next += written;
+    length -= written;
+    offset += written;
+  }
+
+  return 0;
+}
+
+int backing_read(Backing *backing, uint64_t offset, void *bytes, size_t length) {
+  assert(NULL != backing && (NULL != bytes || 0 == length));
+
+  uint8_t *next = bytes;
+  ssize_t got;
+
+  while (length > 0) {
+    got = pread(backing->fd, next, length, offset);
+    if (got < 0 && EINTR == errno) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    next += got;
+    length -= got;
+    offset += got;
+  }
+
+  return 0;
+}
+
+int backing_sync(Backing *backing) {
+  assert(NULL != backing);
+
+  return 0 == fdatasync(backing->fd) ? 0 : -1;
+}
+
+void backing_checkpointed(Backing *backing) {
+  assert(NULL != backing);
+
+  RegionList *free_list = &backing->free;
+  uint64_t kept = 0;
+
+  // the checkpoint refers to everything in use now
+  backing->fresh.count = 0;
+  for (uint64_t i = 0; i < backing->released.count; i++) {
+    if (0 != add_region(free_list, backing->released.regions[i].offset, backing->released.regions[i].length)) {
+      break;
+    }
+  }
+  backing->released.count = 0;
+
+  // neighbours are merged, so the free space at the end is one region
+  qsort(free_list->regions, free_list->count, sizeof(BackingRegion), compare_regions);
+  for (uint64_t i = 0; i < free_list->count; i++) {
+    if (kept > 0 && free_list->regions[kept - 1].offset + free_list->regions[kept - 1].length ==
+                    free_list->regions[i].offset) {
+      free_list->regions[kept - 1].length += free_list->regions[i].length;
+    } else {
+      free_list->regions[kept++] = free_list->regions[i];
+    }
+  }
+  free_list->count = kept;
+  cut_end(backing);
+}
+
+void backing_stats(Backing *backing, uint64_t *in_use, uint64_t *file_bytes) {
+  assert(NULL != backing && NULL != in_use && NULL != file_bytes);
+
+  *in_use = backing->in_use;
+  *file_bytes = backing->end;
+}
+
+void backing_close(Backing *backing) {
+  if (NULL == backing) {
+    return;
+  }
+  if (backing->fd >= 0) {
+    close(backing->fd);
+  }
+  free(backing->free.regions);
+  free(backing->released.regions);
+  free(backing->fresh.regions);
+  free(backing);
+}
@@ -0,0 +1,55 @@
+#ifndef _A5_BACKING
+#define _A5_BACKING
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A file on disk that cold files' contents are moved to, to free their
+// blocks, and read back from. Space is handed out first fit from what's
+// free, or from the end of the file.
+//
+// Space the last checkpoint may refer to isn't handed out again, once it's
+// released, until the next checkpoint: replaying a journal onto the last
+// one has to find each file's bytes where they were. Space handed out since
+// then (or since the file was opened) is free as soon as it's released,
+// since a replay spills those files again. Free space at the end of the
+// file is cut off.
+
+typedef struct BACKING Backing;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} BackingRegion;
+
+// Opens the backing file at path, creating it if it isn't there. in_use are
+// the regions files already refer to, in any order (they're sorted in
+// place); the rest of the file counts as released. Returns NULL, with an
+// error, if it can't be opened, or the regions overlap or run past its end.
+Backing *backing_open(const char *path, BackingRegion *in_use, uint64_t count);
+
+// where to put length bytes
+uint64_t backing_alloc(Backing *backing, uint64_t length);
+
+// Gives back what backing_alloc handed out, to be used again right away or
+// after the next checkpoint; without the memory to keep track of it, it's
+// only lost.
+void backing_release(Backing *backing, uint64_t offset, uint64_t length);
+
+// 0 on success, -1 if the bytes couldn't all be written or read
+int backing_write(Backing *backing, uint64_t offset, const void *bytes, size_t length);
+int backing_read(Backing *backing, uint64_t offset, void *bytes, size_t length);
+
+// syncs what's been written, before a checkpoint refers to it; 0 on success
+int backing_sync(Backing *backing);
+
+// once a checkpoint is on disk: the space released before it can be handed
+// out again, and the file is cut back to the last byte in use
+void backing_checkpointed(Backing *backing);
+
+// bytes handed out and not released, and the size of the file
+void backing_stats(Backing *backing, uint64_t *in_use, uint64_t *file_bytes);
+
+void backing_close(Backing *backing);
+
+#endif
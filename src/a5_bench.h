@@ -0,0 +1,28 @@
+#ifndef _A5_BENCH
+#define _A5_BENCH
+
+#include <stdint.h>
+
+// Shared helpers for the benchmark programs. Results are printed as CSV,
+// one row per benchmark, with latencies in nanoseconds per operation.
+
+double bench_now(void);
+
+void bench_seed(uint64_t seed);
+
+uint64_t bench_rand(void);
+
+// uniform in [0, limit)
+uint64_t bench_rand_below(uint64_t limit);
+
+void bench_sort(double samples[], int count);
+
+// p in [0, 1], the samples must already be sorted
+double bench_percentile(double sorted[], int count, double p);
+
+void bench_print_header(void);
+
+// sorts the samples (seconds per operation) and prints one CSV row
+void bench_report(char *benchmark, char *params, int warmup, double samples[], int count);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "a5_client.h"
+#include "a5_protocol.h"
+
+#define MAX_PARTS 4
+
+struct IMFFS_CLIENT {
+  int fd;          // -1 once the connection has failed
+  uint64_t tag;
+  uint8_t *body;   // responses that aren't read into the caller's buffer
+  uint64_t capacity;
+};
+
+static IMFFSResult lost(IMFFSClientPtr client) {
+  fprintf(stderr, "Error: lost the connection to the server.\n");
+  close(client->fd);
+  client->fd = -1;
+
+  return IMFFS_FATAL;
+}
+
+static int send_all(int fd, struct iovec *iov, int count) {
+  struct msghdr message = { 0 };
+  ssize_t sent;
+
+  while (count > 0) {
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    if (sent < 0 && EINTR == errno) {
+      continue;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    for (; count > 0 && (size_t)sent >= iov->iov_len; iov++, count--) {
+      sent -= iov->iov_len;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+
+  return 0;
+}
+
+static int receive_all(int fd, void *buffer, uint64_t length) {
+  uint8_t *bytes = buffer;
+  ssize_t got;
+
+  while (length > 0) {
+    got = recv(fd, bytes, length, 0);
+    if (got < 0 && EINTR == errno) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    bytes += got;
+    length -= got;
+  }
+
+  return 0;
+}
+
+// Sends op with a body of parts 1 to count - 1 (iov[0] is the header's),
+// and reads the response's body into into, which has room bytes, or
+// client->body if into is NULL.
+static IMFFSResult call(IMFFSClientPtr client, ProtocolOp op, struct iovec *iov, int count, void *into, uint64_t room,
+                        uint64_t *length) {
+  ProtocolHeader header = { 0, op, { 0 }, ++client->tag };
+  uint64_t body_length = 0;
+  uint8_t *grown;
+
+  if (client->fd < 0) {
+    return IMFFS_FATAL;
+  }
+  for (int i = 1; i < count; i++) {
+    body_length += iov[i].iov_len;
+  }
+  if (body_length > PROTOCOL_MAX_BODY) {
+    fprintf(stderr, "Error: a request of %llu bytes is too long.\n", (unsigned long long)body_length);
+    return IMFFS_INVALID;
+  }
+  header.body_length = body_length;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  if (0 != send_all(client->fd, iov, count) || 0 != receive_all(client->fd, &header, sizeof(header)) ||
+      client->tag != header.tag || header.body_length > PROTOCOL_MAX_BODY) {
+    return lost(client);
+  }
+
+  if (NULL == into) {
+    if (header.body_length > client->capacity) {
+      if (NULL == (grown = realloc(client->body, header.body_length))) {
+        fprintf(stderr, "Error: not enough memory for a response.\n");
+        return lost(client);
+      }
+      client->body = grown;
+      client->capacity = header.body_length;
+    }
+    into = client->body;
+  } else if (header.body_length > room) {
+    return lost(client);
+  }
+  if (0 != receive_all(client->fd, into, header.body_length)) {
+    return lost(client);
+  }
+  if (NULL != length) {
+    *length = header.body_length;
+  }
+
+  return header.op;
+}
+
+// a request whose body is just names
+static IMFFSResult call_names(IMFFSClientPtr client, ProtocolOp op, char *first, char *second) {
+  struct iovec iov[MAX_PARTS] = { { 0 }, { first, strlen(first) + 1 } };
+
+  if (NULL != second) {
+    iov[2].iov_base = second;
+    iov[2].iov_len = strlen(second) + 1;
+  }
+
+  return call(client, op, iov, NULL == second ? 2 : 3, NULL, 0, NULL);
+}
+
+IMFFSResult imffs_client_connect(const char *path, IMFFSClientPtr *client) {
+  assert(NULL != path && NULL != client);
+
+  struct sockaddr_un address = { AF_UNIX };
+  IMFFSClientPtr connected;
+
+  if (NULL == path || NULL == client) {
+    return IMFFS_INVALID;
+  }
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: the socket path '%s' is too long.\n", path);
+    return IMFFS_INVALID;
+  }
+  strcpy(address.sun_path, path);
+
+  if (NULL == (connected = calloc(1, sizeof(struct IMFFS_CLIENT)))) {
+    fprintf(stderr, "Error: not enough memory to connect.\n");
+    return IMFFS_FATAL;
+  }
+  connected->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connected->fd < 0 || 0 != connect(connected->fd, (struct sockaddr *)&address, sizeof(address))) {
+    fprintf(stderr, "Error: unable to connect to '%s'.\n", path);
+    if (connected->fd >= 0) {
+      close(connected->fd);
+    }
+    free(connected);
+    return IMFFS_ERROR;
+  }
+  *client = connected;
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_client_save(IMFFSClientPtr client, char *diskfile, char *imffsfile) {
+  assert(NULL != client && NULL != diskfile && NULL != imffsfile);
+
+  if (NULL == client || NULL == diskfile || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  return call_names(client, PROTOCOL_SAVE, diskfile, imffsfile);
+}
+
+IMFFSResult imffs_client_load(IMFFSClientPtr client, char *imffsfile, char *diskfile) {
+  assert(NULL != client && NULL != imffsfile && NULL != diskfile);
+
+  if (NULL == client || NULL == imffsfile || NULL == diskfile) {
+    return IMFFS_INVALID;
+  }
+
+  return call_names(client, PROTOCOL_LOAD, imffsfile, diskfile);
+}
+
+IMFFSResult imffs_client_put(IMFFSClientPtr client, char *imffsfile, const void *buffer, uint64_t length) {
+  assert(NULL != client && NULL != imffsfile);
+  assert(NULL != buffer || 0 == length);
+
+  struct iovec iov[MAX_PARTS] = { { 0 }, { imffsfile, 0 }, { (void *)buffer, length } };
+
+  if (NULL == client || NULL == imffsfile || (NULL == buffer && length > 0)) {
+    return IMFFS_INVALID;
+  }
+  iov[1].iov_len = strlen(imffsfile) + 1;
+
+  return call(client, PROTOCOL_PUT, iov, 3, NULL, 0, NULL);
+}
+
+IMFFSResult imffs_client_get(IMFFSClientPtr client, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                             uint64_t *bytes_read) {
+  assert(NULL != client && NULL != imffsfile && NULL != bytes_read);
+  assert(NULL != buffer || 0 == length);
+
+  uint64_t numbers[2] = { offset, length };
+  struct iovec iov[MAX_PARTS] = { { 0 }, { imffsfile, 0 }, { numbers, sizeof(numbers) } };
+  IMFFSResult result;
+
+  if (NULL == client || NULL == imffsfile || NULL == bytes_read || (NULL == buffer && length > 0)) {
+    return IMFFS_INVALID;
+  }
+  // the server sends at most PROTOCOL_MAX_BODY bytes at a time
+  if (length > PROTOCOL_MAX_BODY) {
+    numbers[1] = PROTOCOL_MAX_BODY;
+  }
+  iov[1].iov_len = strlen(imffsfile) + 1;
+  *bytes_read = 0;
+  result = call(client, PROTOCOL_GET, iov, 3, buffer, numbers[1], bytes_read);
+
+  return result;
+}
+
+IMFFSResult imffs_client_delete(IMFFSClientPtr client, char *imffsfile) {
+  assert(NULL != client && NULL != imffsfile);
+
+  if (NULL == client || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  return call_names(client, PROTOCOL_DELETE, imffsfile, NULL);
+}
+
+IMFFSResult imffs_client_rename(IMFFSClientPtr client, char *imffsold, char *imffsnew) {
+  assert(NULL != client && NULL != imffsold && NULL != imffsnew);
+
+  if (NULL == client || NULL == imffsold || NULL == imffsnew) {
+    return IMFFS_INVALID;
+  }
+
+  return call_names(client, PROTOCOL_RENAME, imffsold, imffsnew);
+}
+
+IMFFSResult imffs_client_dir(IMFFSClientPtr client, IMFFSLister lister, void *context) {
+  assert(NULL != client && NULL != lister);
+
+  struct iovec iov[MAX_PARTS];
+  IMFFSResult result;
+  uint64_t length = 0, at = 0, byte_len;
+  uint8_t *end;
+
+  if (NULL == client || NULL == lister) {
+    return IMFFS_INVALID;
+  }
+
+  result = call(client, PROTOCOL_DIR, iov, 1, NULL, 0, &length);
+  while (IMFFS_OK == result && at < length) {
+    if (length - at <= sizeof(byte_len) ||
+        NULL == (end = memchr(&client->body[at + sizeof(byte_len)], '\0', length - at - sizeof(byte_len)))) {
+      return lost(client);
+    }
+    memcpy(&byte_len, &client->body[at], sizeof(byte_len));
+    lister((char *)&client->body[at + sizeof(byte_len)], byte_len, context);
+    at = end + 1 - client->body;
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_client_stats(IMFFSClientPtr client, IMFFSUsage *usage) {
+  assert(NULL != client && NULL != usage);
+
+  struct iovec iov[MAX_PARTS];
+  IMFFSResult result;
+  uint64_t length = 0;
+
+  if (NULL == client || NULL == usage) {
+    return IMFFS_INVALID;
+  }
+
+  result = call(client, PROTOCOL_STATS, iov, 1, NULL, 0, &length);
+  if (IMFFS_OK == result) {
+    if (sizeof(IMFFSUsage) != length) {
+      return lost(client);
+    }
+    memcpy(usage, client->body, sizeof(IMFFSUsage));
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_client_close(IMFFSClientPtr client) {
+  if (NULL == client) {
+    return IMFFS_INVALID;
+  }
+  if (client->fd >= 0) {
+    close(client->fd);
+  }
+  free(client->body);
+  free(client);
+
+  return IMFFS_OK;
+}
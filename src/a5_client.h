@@ -0,0 +1,33 @@
+#ifndef _A5_CLIENT
+#define _A5_CLIENT
+
+#include <stdint.h>
+
+#include "a5_imffs.h"
+
+// A connection to a5_imffs -s, speaking a5_protocol.h. Each call sends one
+// request and waits for its response, and returns what the imffs_ call
+// it's named after returned in the server, or IMFFS_FATAL if the connection
+// failed, after which it can only be closed. A client is for one thread at
+// a time; connect one per thread.
+
+typedef struct IMFFS_CLIENT *IMFFSClientPtr;
+
+IMFFSResult imffs_client_connect(const char *path, IMFFSClientPtr *client);
+
+// diskfile is on the server's side
+IMFFSResult imffs_client_save(IMFFSClientPtr client, char *diskfile, char *imffsfile);
+IMFFSResult imffs_client_load(IMFFSClientPtr client, char *imffsfile, char *diskfile);
+
+IMFFSResult imffs_client_put(IMFFSClientPtr client, char *imffsfile, const void *buffer, uint64_t length);
+IMFFSResult imffs_client_get(IMFFSClientPtr client, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                             uint64_t *bytes_read);
+
+IMFFSResult imffs_client_delete(IMFFSClientPtr client, char *imffsfile);
+IMFFSResult imffs_client_rename(IMFFSClientPtr client, char *imffsold, char *imffsnew);
+IMFFSResult imffs_client_dir(IMFFSClientPtr client, IMFFSLister lister, void *context);
+IMFFSResult imffs_client_stats(IMFFSClientPtr client, IMFFSUsage *usage);
+
+IMFFSResult imffs_client_close(IMFFSClientPtr client);
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "a5_crc.h"
+
+#define POLYNOMIAL 0x82f63b78U // reversed
+
+static uint32_t Tables[8][256];
+static pthread_once_t Tables_Once = PTHREAD_ONCE_INIT; // scrub threads may get here at once
+
+static void make_tables(void) {
+  uint32_t crc;
+
+  for (int i = 0; i < 256; i++) {
+    crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+    }
+    Tables[0][i] = crc;
+  }
+  // Tables[k][i] is i followed by k zero bytes
+  for (int i = 0; i < 256; i++) {
+    crc = Tables[0][i];
+    for (int k = 1; k < 8; k++) {
+      crc = Tables[0][crc & 0xff] ^ (crc >> 8);
+      Tables[k][i] = crc;
+    }
+  }
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len) {
+  assert(NULL != data || 0 == len);
+
+  const uint8_t *next = data;
+  uint64_t word;
+
+  pthread_once(&Tables_Once, make_tables);
+
+  crc = ~crc;
+  // eight bytes at a time, each through its own table
+  while (len >= 8) {
+    memcpy(&word, next, 8);
+    word ^= crc;
+    crc = Tables[7][word & 0xff] ^ Tables[6][(word >> 8) & 0xff] ^ Tables[5][(word >> 16) & 0xff] ^
+          Tables[4][(word >> 24) & 0xff] ^ Tables[3][(word >> 32) & 0xff] ^ Tables[2][(word >> 40) & 0xff] ^
+          Tables[1][(word >> 48) & 0xff] ^ Tables[0][word >> 56];
+    next += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = Tables[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *next = data;
+  uint64_t crc64 = ~crc, word;
+
+  while (len >= 8) {
+    memcpy(&word, next, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    next += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *next++);
+    len--;
+  }
+
+  return ~crc;
+}
+
+int crc32c_hardware(void) {
+  return __builtin_cpu_supports("sse4.2") ? 1 : 0;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  assert(NULL != data || 0 == len);
+
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32c_sse42(crc, data, len);
+  }
+  return crc32c_portable(crc, data, len);
+}
+
+#else
+
+int crc32c_hardware(void) {
+  return 0;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  return crc32c_portable(crc, data, len);
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _A5_CRC
+#define _A5_CRC
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it, and slicing-by-8 tables otherwise. crc is the result for the data so
+// far, 0 to start with.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// the table-driven version, whatever the CPU
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len);
+
+// 1 if crc32c uses the crc32 instruction
+int crc32c_hardware(void);
+
+#endif
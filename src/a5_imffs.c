@@ -4,32 +4,237 @@
 #include <assert.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "a4_boolean.h"
 #include "a5_multimap.h"
 #include "a5_imffs.h"
+#include "a5_metrics.h"
+#include "a5_lz.h"
+#include "a5_crc.h"
+#include "a5_xxhash.h"
+#include "a5_journal.h"
+#include "a5_backing.h"
+#include "a5_shared.h"
 
-const int BYTES_PER_BLOCK = 256;
 const uint8_t BLOCK_FREE = ' ';
 const uint8_t BLOCK_USED = 'X';
+const uint8_t BLOCK_TAIL = 'T'; // holds the packed tails of several files
 #define TEMP_FILE ".temp"
+#define MAX_STAGING_NAME 32
+#define MAX_SHARED_PENDING 16 // files an operation changes that are published one by one
+#define MIN_SHARED_SLOTS 64
+#define MAX_RUN_BYTES (256 * 1024) // most read at once when saving a file of unknown size
+#define MIN_DEDUP_ENTRIES 1024
+#define COMPRESS_GROUP (64 * 1024)  // bytes of a compressed file that are compressed together
+#define GROUP_STORED 0x80000000U    // in a group's header: it didn't compress, so it's stored as it is
+#define GROUP_HEADER 4
+#define MAX_SCRUB_THREADS 64
+#define MIN_SCRUB_BLOCKS 4096 // per thread, below that starting one costs more than it saves
+#define IMAGE_MAGIC "IMFFSIMG"
+#define IMAGE_VERSION 1
+#define MAX_IMAGE_NAME 65536 // longest file name an image is trusted with
+#define DELTA_MAGIC "IMFFSDLT"
+#define DELTA_VERSION 1
+#define DELTA_DEDUP 1    // in a delta, a block dedup can find
+#define DELTA_CONTENTS 2 // and one whose contents follow
+#define MIN_DIRTY_BLOCKS 1024
+#define HUGE_PAGE (2 * 1024 * 1024) // what transparent huge pages are on x86-64 and most arm64
+#define TRIM_MIN_BYTES HUGE_PAGE    // a chunk a delete frees that's this big is given back at once
+#define SPILL_CHUNK (256 * 1024)    // most copied at once from the backing file to a load
+#ifdef MADV_REMOVE
+#define SHARED_TRIM MADV_REMOVE // MADV_DONTNEED only drops shared memory from the mapping, it doesn't free it
+#else
+#define SHARED_TRIM MADV_DONTNEED
+#endif
+
+// what each journal record is for, see apply_record
+typedef enum {
+  RECORD_SETTINGS = 1, // inline limit, tail packing, dedup, compression, checksums
+  RECORD_SAVE,         // name, whether it was a regular file, its size then, the contents
+  RECORD_DELETE,       // name
+  RECORD_RENAME,       // old and new names
+  RECORD_DEFRAG,
+  RECORD_CLONE,        // source and destination
+  RECORD_WRITE,        // name, offset, the bytes written
+  RECORD_RESIZE,       // the new block count
+  RECORD_SPILL,        // name of a file moved to the backing file
+  RECORD_FAULT         // name of a file brought back from it
+} RecordType;
+
+// What's changed since the last checkpoint, which an incremental one
+// writes: nothing is kept before the first checkpoint
+typedef struct {
+  uint64_t *bits;    // a bit per block whose contents, use or references changed, NULL until a checkpoint
+  uint64_t *written; // and a bit per block whose contents changed
+  uint64_t *blocks;  // the same blocks, in the order they changed
+  uint64_t count;
+  uint64_t capacity;
+  Multimap *names;   // files saved, written, renamed or deleted, as Files with just a name
+  Boolean all_files; // a defrag changed every file's blocks
+  Boolean dedup_dropped; // the dedup table was emptied
+  Boolean lost;      // a change couldn't be kept, so only a full checkpoint will do
+  uint32_t base;     // CRC32C of the last checkpoint, which the next one builds on
+} Dirty;
+
+// a block whose contents are already in the filesystem, see dedup_block
+typedef struct {
+  uint64_t hash;
+  uint64_t block; // plus one, 0 for an empty slot
+} DedupEntry;
 
 struct IMFFS {
   uint8_t *data;
   uint8_t *used; // one byte per free space marker
-  uint32_t block_count;
+  uint64_t used_count; // blocks that aren't free
+  uint64_t block_count;
+  uint32_t block_size;
+  uint8_t block_shift; // block_size is 1 << block_shift
+  uint32_t inline_limit;
+  Boolean tail_packing;
+  uint64_t open_tail; // tail block new tails are added to, block_count if none
+  Boolean dedup;
+  Boolean compression;
+  uint32_t *refs;     // files using each used block, NULL until dedup or a clone first needs them
+  DedupEntry *dedup_table; // open addressing by hash, only while dedup is on
+  uint64_t dedup_capacity; // a power of two
+  uint64_t dedup_count;
+  uint32_t *checksums; // CRC32C of every used and tail block, NULL when they're off
   Multimap *index;
+  Boolean cache;    // saves evict the least recently used files to make room
+  struct FILE_RECORD *coldest; // every unpinned file in the index, least recently used first
+  struct FILE_RECORD *hottest;
+  Backing *backing; // spilled files' contents, NULL if there's no backing file
+  Shared *shared;   // the blocks and a directory other processes read, NULL unless imffs_share
+  Boolean shared_changed; // a file changed since the directory was last published
+  Boolean shared_all;     // and not only the files in shared_pending
+  char *shared_pending[MAX_SHARED_PENDING];
+  uint32_t shared_pending_count;
+  uint64_t shared_slots;   // entries the directory has room for the offsets of
+  uint64_t shared_length;  // bytes of the directory, counting entries no offset points to
+  uint64_t shared_garbage; // and the bytes of those
+  char *shared_name;
+  Journal *journal; // every change is logged to it, NULL if there's none
+  uint64_t seq;     // the last journal record in the state
+  Dirty dirty;
+  IMFFSTracer tracer;
+  void *tracer_context;
+#ifdef IMFFS_METRICS
+  Metrics metrics;
+#endif
 };
 
-typedef struct {
+// a probe with no tracer installed is a single, predicted branch
+#define TRACE_BEGIN(fs, name, file) do { \
+    if (__builtin_expect(NULL != (fs)->tracer, 0)) { \
+      trace_event(fs, IMFFS_TRACE_BEGIN, name, file, 0, 0); \
+    } \
+  } while (0)
+#define TRACE_END(fs, name, file, blocks, extents) do { \
+    if (__builtin_expect(NULL != (fs)->tracer, 0)) { \
+      trace_event(fs, IMFFS_TRACE_END, name, file, blocks, extents); \
+    } \
+  } while (0)
+
+#ifdef IMFFS_METRICS
+// the comparison callbacks don't know their filesystem, so each operation
+// adds the change in this counter to its own filesystem's metrics
+static uint64_t Comparisons = 0;
+
+#define METRICS_BEGIN() uint64_t metrics_start = metrics_now_ns(), metrics_comparisons = Comparisons
+#define METRICS_END(fs, op, result, bytes) do { \
+    (fs)->metrics.comparisons += Comparisons - metrics_comparisons; \
+    metrics_record(&(fs)->metrics, op, IMFFS_OK != (result), bytes, metrics_start); \
+  } while (0)
+#define METRICS_COUNT(fs, counter, n) ((fs)->metrics.counter += (n))
+#else
+#define METRICS_BEGIN()
+#define METRICS_END(fs, op, result, bytes)
+#define METRICS_COUNT(fs, counter, n)
+#endif
+
+typedef struct FILE_RECORD {
   char *name;
-  uint32_t byte_len;
+  uint64_t byte_len;
+  Boolean inlined; // the contents are in data, and it has no extents
+  Boolean packed;  // no partial last block: the tail, if any, is the last extent
+  Boolean compressed; // the blocks hold compressed groups, byte_len is the size before
+  uint64_t etag;      // XXH64 of the contents, taken as they're saved
+  Boolean spilled;    // the contents are in the backing file, and it has no extents
+  uint64_t backing;   // where they are there: the blocks' bytes, up to the end of the file
+  uint64_t backing_len;
+  uint32_t pins;      // a pinned file is never evicted, and isn't on the recency list
+  struct FILE_RECORD *older; // neighbours on the recency list, see cache_touch
+  struct FILE_RECORD *newer;
+  uint8_t data[];
 } File;
 
+// Each file has a single value in the index: its extent list, num bytes at
+// data. The list has no pointers in it, so it stays valid wherever the blocks
+// are and can be copied out as it is: for each chunk, the zigzag encoded
+// distance from the end of the previous chunk to its first block, then its
+// length in blocks, as varints. A length of 0 is the packed tail, in that
+// block, at the offset that follows. An inline file's list is empty, with
+// data pointing at its contents.
+//
+// A compressed file's blocks are read as one run of bytes: a group for each
+// COMPRESS_GROUP bytes of the file, each a 4-byte little endian header with
+// its compressed length, then the group compressed on its own with
+// lz_compress. Reading part of the file only decompresses the groups it
+// needs, and skips the others by their headers.
+
+typedef struct {
+  uint64_t start;  // first block
+  uint64_t count;  // blocks, 0 for a packed tail
+  uint32_t offset; // of a packed tail within its block
+} Extent;
+
+typedef struct {
+  const uint8_t *next;
+  const uint8_t *stop;
+  uint64_t end; // block after the last chunk read
+} ExtentReader;
+
+typedef struct {
+  uint8_t *bytes;
+  uint32_t length;
+  uint32_t capacity;
+  uint64_t end; // block after the last chunk written
+} ExtentWriter;
+
+#define MAX_EXTENT_BYTES 30 // three 10-byte varints
+
+// a file's chunks read as one run of bytes, for compressed files
+typedef struct {
+  ExtentReader reader;
+  uint64_t at;        // next byte in data
+  uint64_t available; // bytes from at to the end of its chunk
+  uint64_t checked;   // the blocks before this byte in the chunk have been verified
+} BlockStream;
+
+// at the start of every tail block; tails are added at fill, and the block
+// is freed when the last of them is deleted
+typedef struct {
+  uint32_t live; // bytes of tails still in use
+  uint32_t fill; // offset of the next tail
+} TailHeader;
+
+static void trace_event(IMFFSPtr fs, IMFFSTracePhase phase, const char *name, const char *file,
+                        uint64_t blocks, uint32_t extents) {
+  IMFFSTraceEvent event = { phase, name, file, metrics_now_ns(), blocks, extents };
+  fs->tracer(&event, fs->tracer_context);
+}
+
 static int compare_files_by_name(void *a, void *b) {
   assert(NULL != a && NULL != b);
   File *fa = a, *fb = b;
   assert(NULL != fa->name && NULL != fb->name);
+#ifdef IMFFS_METRICS
+  Comparisons++;
+#endif
 
   return strcasecmp(fa->name, fb->name);
 
@@ -40,11 +245,17 @@ static int compare_always_greater(void *a, void *b) {
   return 1;
 }
 
+#ifndef NDEBUG
+// cheap enough for every call in debug builds; a NULL fs is left to the
+// callers, which return IMFFS_INVALID
 static Boolean validate_fs(IMFFSPtr fs) {
-  return TRUE;
+  return NULL == fs || (NULL != fs->data && NULL != fs->used && NULL != fs->index &&
+                        fs->block_size == 1U << fs->block_shift && fs->open_tail <= fs->block_count &&
+                        (!fs->dedup || NULL != fs->refs));
 }
+#endif
 
-static Boolean find_next_free_block(uint8_t *used, uint32_t block_count, uint32_t *pos) {
+static Boolean find_next_free_block(uint8_t *used, uint64_t block_count, uint64_t *pos) {
 
   assert(NULL != pos && *pos < block_count);
 
@@ -58,6 +269,26 @@ static Boolean find_next_free_block(uint8_t *used, uint32_t block_count, uint32_
 
 }
 
+// find_next_free_block, counting the blocks it looks at
+static Boolean find_free_block(IMFFSPtr fs, uint64_t *pos) {
+  assert(NULL != fs && NULL != pos);
+
+#ifdef IMFFS_METRICS
+  uint64_t start = *pos;
+  Boolean found = find_next_free_block(fs->used, fs->block_count, pos);
+  fs->metrics.blocks_scanned += *pos - start + (found ? 1 : 0);
+  return found;
+#else
+  return find_next_free_block(fs->used, fs->block_count, pos);
+#endif
+}
+
+static IMFFSResult delete_file(IMFFSPtr fs, char *imffsfile);
+static void stop_dirty(IMFFSPtr fs);
+static Boolean reserve_blocks(IMFFSPtr fs, uint64_t near, uint64_t count, uint64_t *blocks);
+static Boolean replace_extents(IMFFSPtr fs, File *file, Value *old_list, Value *new_list);
+static int compare_shared_name(const char *name, size_t name_len, const uint8_t *other, uint64_t len);
+
 static File *find_matching_file(Multimap *index, char *name) {
 
   assert(NULL != index && NULL != name);
@@ -78,835 +309,5798 @@ static File *find_matching_file(Multimap *index, char *name) {
 
 }
 
-static uint32_t block_ptr_to_index(void *base, void *block) {
-  
-  assert(NULL != base && NULL != block);
-  assert(block >= base);
+// Every file in the index that isn't pinned or spilled is on the recency
+// list, from the coldest to the hottest, which cache mode evicts from the
+// cold end of. A file goes on at the hot end when it's saved and moves back
+// there whenever it's used, each in constant time.
+static void cache_unlink(IMFFSPtr fs, File *file) {
+  assert(NULL != fs && NULL != file);
 
-  uint8_t *base8 = base;
-  uint8_t *block8 = block;
+  if (file->pins > 0 || file->spilled) {
+    return;
+  }
+  if (NULL != file->older) {
+    file->older->newer = file->newer;
+  } else {
+    fs->coldest = file->newer;
+  }
+  if (NULL != file->newer) {
+    file->newer->older = file->older;
+  } else {
+    fs->hottest = file->older;
+  }
+  file->older = NULL;
+  file->newer = NULL;
+}
 
-  uint32_t pos = block8 - base8;
-  assert(pos % BYTES_PER_BLOCK == 0);
-  pos = pos / BYTES_PER_BLOCK;
+static void cache_link(IMFFSPtr fs, File *file) {
+  assert(NULL != fs && NULL != file);
 
-  return pos;
+  if (file->pins > 0 || file->spilled) {
+    return;
+  }
+  file->older = fs->hottest;
+  file->newer = NULL;
+  if (NULL != fs->hottest) {
+    fs->hottest->newer = file;
+  } else {
+    fs->coldest = file;
+  }
+  fs->hottest = file;
 }
 
-static void restore_free_space(IMFFSPtr fs, Value *values, int num_values) {
-  assert(validate_fs(fs));
-  assert(NULL != values && num_values > 0);
+static void cache_touch(IMFFSPtr fs, File *file) {
+  if (file != fs->hottest) {
+    cache_unlink(fs, file);
+    cache_link(fs, file);
+  }
+}
 
-  for (int i = 0; i < num_values; i++) {
-    uint32_t pos = block_ptr_to_index(fs->data, values[i].data);
+static uint8_t *block_address(IMFFSPtr fs, uint64_t block) {
+  assert(block < fs->block_count);
 
-    for (int j = 0; j < values[i].num; j++) {
-      assert(pos + j < fs->block_count);
-      assert(BLOCK_USED == fs->used[pos + j]);
-      fs->used[pos + j] = BLOCK_FREE;
-    }
+  return &fs->data[block << fs->block_shift];
+}
+
+// keeps the block's checksum up to date after it's written, if checksums are on
+static void update_checksum(IMFFSPtr fs, uint64_t block) {
+  assert(block < fs->block_count);
+
+  if (NULL != fs->checksums) {
+#ifdef IMFFS_METRICS
+    uint64_t checksum_start = metrics_now_ns();
+#endif
+    fs->checksums[block] = crc32c(0, block_address(fs, block), fs->block_size);
+    METRICS_COUNT(fs, checksum_ns, metrics_now_ns() - checksum_start);
+    METRICS_COUNT(fs, bytes_checksummed, fs->block_size);
   }
 }
 
-static int make_values_array(Multimap *index, File *file, Value **values, int old_value_size) {
-  assert(NULL != file && NULL != values);
+// Keeps the block for the next incremental checkpoint, once there's been a
+// checkpoint, with its contents if they changed. Only its first change since
+// then is listed.
+static void mark_changed(IMFFSPtr fs, uint64_t block, Boolean contents) {
+  assert(block < fs->block_count);
 
-  int new_value_size = -1, count;
-  Value *temp;
+  Dirty *dirty = &fs->dirty;
+  uint64_t *grown, capacity, bit = 1ULL << (block & 63);
 
-  count = mm_count_values(index, file);
-  assert(count > 0);
-  if (count > 0) {
-    new_value_size = count;
-    if (count > old_value_size || NULL == *values) {
-      temp = malloc(count * sizeof(Value));
-      if (NULL == temp) {
-        new_value_size = -1;
-      } else {
-        free(*values);
-        *values = temp;
+  if (NULL == dirty->bits) {
+    return;
+  }
+  if (0 == (dirty->bits[block >> 6] & bit)) {
+    if (dirty->count == dirty->capacity) {
+      capacity = dirty->capacity > 0 ? dirty->capacity * 2 : MIN_DIRTY_BLOCKS;
+      grown = realloc(dirty->blocks, capacity * sizeof(uint64_t));
+      METRICS_COUNT(fs, allocations, 1);
+      if (NULL == grown) {
+        dirty->lost = TRUE;
+        return;
       }
+      dirty->blocks = grown;
+      dirty->capacity = capacity;
     }
+    dirty->bits[block >> 6] |= bit;
+    dirty->blocks[dirty->count++] = block;
+  }
+  if (contents) {
+    dirty->written[block >> 6] |= bit;
   }
-
-  return new_value_size;
 }
 
-IMFFSResult imffs_create(uint32_t block_count, IMFFSPtr *fs) {
-  assert(NULL != fs);
+// the same for a file's record, when it's saved, changed or removed
+static void mark_file(IMFFSPtr fs, char *name) {
+  assert(NULL != fs && NULL != name);
 
-  if (NULL == fs) {
-    return IMFFS_INVALID;
-  } else {
+  File temp_file = { name, 0 }, *copy;
 
-    *fs = malloc(sizeof(struct IMFFS));
-    if (NULL == *fs) {
-      fprintf(stderr, "Error: not enough memory to create filesystem.\n");
-      return IMFFS_FATAL;
+  fs->shared_changed = TRUE;
+  if (NULL != fs->shared && !fs->shared_all) {
+    if (MAX_SHARED_PENDING == fs->shared_pending_count ||
+        NULL == (fs->shared_pending[fs->shared_pending_count] = strdup(name))) {
+      fs->shared_all = TRUE;
     } else {
+      fs->shared_pending_count++;
+    }
+  }
+  if (NULL == fs->dirty.names || mm_count_values(fs->dirty.names, &temp_file) > 0) {
+    return;
+  }
+  // kept like an empty inline file, so it's freed like one
+  copy = calloc(1, sizeof(File));
+  METRICS_COUNT(fs, allocations, 2);
+  if (NULL != copy) {
+    copy->inlined = TRUE;
+  }
+  if (NULL == copy || NULL == (copy->name = strdup(name)) ||
+      mm_insert_value(fs->dirty.names, copy, 0, copy->data) <= 0) {
+    if (NULL != copy) {
+      free(copy->name);
+    }
+    free(copy);
+    fs->dirty.lost = TRUE;
+  }
+}
 
-      (*fs)->data = malloc(block_count * BYTES_PER_BLOCK);
-
-      (*fs)->used = malloc(block_count + 1);
-      for (uint32_t i = 0; i < block_count; i++) {
-        (*fs)->used[i] = BLOCK_FREE;
-      }
-      (*fs)->used[block_count] = '\0';
-
-      (*fs)->block_count = block_count;
-      (*fs)->index = mm_create(block_count, compare_files_by_name, compare_always_greater);
+// after a block's contents change
+static void block_changed(IMFFSPtr fs, uint64_t block) {
+  mark_changed(fs, block, TRUE);
+  update_checksum(fs, block);
+}
 
-      if (NULL == (*fs)->data || NULL == (*fs)->used || NULL == (*fs)->index) {
-        fprintf(stderr, "Error: not enough memory to create filesystem data.\n");
-        free((*fs)->data);
-        free((*fs)->used);
-        free((*fs)->index);
-        free(*fs);
-        return IMFFS_FATAL;
-      }
+// FALSE, with an error, if the block was changed since its checksum was taken
+static Boolean verify_block(IMFFSPtr fs, uint64_t block) {
+  assert(block < fs->block_count);
+
+  Boolean valid = TRUE;
+
+  if (NULL != fs->checksums) {
+#ifdef IMFFS_METRICS
+    uint64_t checksum_start = metrics_now_ns();
+#endif
+    valid = fs->checksums[block] == crc32c(0, block_address(fs, block), fs->block_size);
+    METRICS_COUNT(fs, checksum_ns, metrics_now_ns() - checksum_start);
+    METRICS_COUNT(fs, bytes_checksummed, fs->block_size);
+    if (!valid) {
+      METRICS_COUNT(fs, checksum_errors, 1);
+      fprintf(stderr, "Error: block %llu doesn't match its checksum.\n", (unsigned long long)block);
     }
   }
 
-  return IMFFS_OK;
+  return valid;
 }
 
+static Boolean verify_blocks(IMFFSPtr fs, uint64_t start, uint64_t count) {
+  Boolean valid = TRUE;
 
-/*
+  for (uint64_t block = start; block < start + count && NULL != fs->checksums; block++) {
+    valid = verify_block(fs, block) && valid;
+  }
 
+  return valid;
+}
 
-IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile) {
-    // Implementation to load a file from IMFFS to the system
-    // You need to read the content of 'imffsfile' in IMFFS and save it to 'diskfile'
-    // Use the Multimap and block_usage to retrieve the file content
+static uint32_t put_varint(uint8_t *out, uint64_t value) {
+  uint32_t len = 0;
 
-    // Find the file info in the files_and_chunks Multimap
-    int key_index = find_key_index(fs->files_and_chunks, imffsfile);
-    if (key_index == -1) {
-        fprintf(stderr, "File not found: %s\n", imffsfile);
-        return IMFFS_ERROR;  // File not found
-    }
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  out[len++] = (uint8_t)value;
 
-    // Get the file info
-    FileInfo *info;
-    mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&info, 1);
+  return len;
+}
 
-    FILE *file = fopen(diskfile, "wb");
-    if (file == NULL) {
-        perror("Error opening file");
-        return IMFFS_ERROR;
-    }
+static uint64_t get_varint(const uint8_t **in) {
+  uint64_t value = 0;
+  uint32_t shift = 0;
 
-    for (int i = 0; i < info->size; ++i) {
-        Chunk *chunk;
-        mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&chunk, 1);
+  while (**in & 0x80) {
+    value |= (uint64_t)(**in & 0x7f) << shift;
+    shift += 7;
+    (*in)++;
+  }
+  value |= (uint64_t)**in << shift;
+  (*in)++;
 
-        fwrite(chunk->data, 1, BLOCK_SIZE, file);
-    }
+  return value;
+}
 
-    fclose(file);
+static void extent_reader_init(ExtentReader *reader, Value *list) {
+  assert(NULL != reader && NULL != list && NULL != list->data);
 
-    return IMFFS_OK;
+  reader->next = list->data;
+  reader->stop = reader->next + list->num;
+  reader->end = 0;
 }
 
-IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile) {
-    // Implementation to delete a file from IMFFS
-    // You need to free the blocks occupied by 'imffsfile' and update the Multimap and block_usage accordingly
+static Boolean extent_read(ExtentReader *reader, Extent *extent) {
+  assert(NULL != reader && NULL != extent);
 
-    // Find the file info in the files_and_chunks Multimap
-    int key_index = find_key_index(fs->files_and_chunks, imffsfile);
-    if (key_index == -1) {
-        fprintf(stderr, "File not found: %s\n", imffsfile);
-        return IMFFS_ERROR;  // File not found
-    }
+  uint64_t zigzag;
 
-    // Get the file info
-    FileInfo *info;
-    mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&info, 1);
+  if (reader->next >= reader->stop) {
+    return FALSE;
+  }
 
-    // Iterate through chunks and free blocks
-    for (int i = 0; i < info->size; ++i) {
-        Chunk *chunk;
-        mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&chunk, 1);
+  zigzag = get_varint(&reader->next);
+  extent->start = reader->end + (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+  extent->count = get_varint(&reader->next);
+  extent->offset = 0;
+  if (0 == extent->count) {
+    extent->offset = (uint32_t)get_varint(&reader->next);
+  } else {
+    reader->end = extent->start + extent->count;
+  }
+  assert(reader->next <= reader->stop);
 
-        int block_index = i;
-        fs->block_usage[block_index] = 0;
+  return TRUE;
+}
 
-        // Free the block data
-        free(chunk->data);
+// adds a chunk of count blocks, or a packed tail if count is 0
+static Boolean extent_write(ExtentWriter *writer, uint64_t start, uint64_t count, uint32_t offset) {
+  assert(NULL != writer);
 
-        // Free the chunk structure
-        free(chunk);
+  int64_t delta = (int64_t)(start - writer->end);
+  uint8_t *bytes;
+
+  if (writer->length + MAX_EXTENT_BYTES > writer->capacity) {
+    bytes = realloc(writer->bytes, writer->capacity * 2 + MAX_EXTENT_BYTES);
+    if (NULL == bytes) {
+      return FALSE;
     }
+    writer->bytes = bytes;
+    writer->capacity = writer->capacity * 2 + MAX_EXTENT_BYTES;
+  }
 
-    // Remove the file from the Multimap
-    mm_remove_key(fs->files_and_chunks, imffsfile);
+  writer->length += put_varint(&writer->bytes[writer->length], ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+  writer->length += put_varint(&writer->bytes[writer->length], count);
+  if (0 == count) {
+    writer->length += put_varint(&writer->bytes[writer->length], offset);
+  } else {
+    writer->end = start + count;
+  }
 
-    return IMFFS_OK;
+  return TRUE;
 }
 
-IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew) {
-    // Implementation to rename a file in IMFFS
-    // You need to update the Multimap to reflect the new filename
+// hands the list, trimmed to size, over to list
+static Boolean extent_writer_finish(ExtentWriter *writer, Value *list) {
+  assert(NULL != writer && NULL != list);
 
-    // Find the file info in the files_and_chunks Multimap
-    int key_index = find_key_index(fs->files_and_chunks, imffsold);
-    if (key_index == -1) {
-        fprintf(stderr, "File not found: %s\n", imffsold);
-        return IMFFS_ERROR;  // File not found
-    }
+  uint8_t *bytes = realloc(writer->bytes, writer->length > 0 ? writer->length : 1);
 
-    // Get the file info
-    FileInfo *info;
-    mm_get_values(fs->files_and_chunks, imffsold, (Value *)&info, 1);
+  list->num = writer->length;
+  list->data = NULL != bytes ? bytes : writer->bytes;
+  writer->bytes = NULL;
+  writer->length = 0;
+  writer->capacity = 0;
+  writer->end = 0;
 
-    // Update the filename in the Multimap
-    mm_remove_key(fs->files_and_chunks, imffsold);
+  return NULL != list->data;
+}
 
-    // Create new FileInfo with the new filename
-    FileInfo *new_info = create_file_info(imffsnew, info->size);
+static Boolean get_extents(IMFFSPtr fs, File *file, Value *list) {
+  assert(NULL != fs && NULL != file && NULL != list);
 
-    // Insert the new file info into the Multimap
-    mm_insert_value(fs->files_and_chunks, imffsnew, 1, new_info);
+  return 1 == mm_get_values(fs->index, file, list, 1);
+}
 
-    return IMFFS_OK;
+// frees the lists in an index before it's destroyed, but not the files
+static void free_extent_lists(Multimap *index) {
+  assert(NULL != index);
+
+  void *key;
+  Value list;
+
+  if (mm_get_first_key(index, &key) > 0) {
+    do {
+      if (!((File *)key)->inlined && 1 == mm_get_values(index, key, &list, 1)) {
+        free(list.data);
+      }
+    } while (mm_get_next_key(index, &key) > 0);
+  }
 }
 
-IMFFSResult imffs_dir(IMFFSPtr fs) {
-    printf("Files in IMFFS:\n");
+static void stream_init(BlockStream *stream, Value *list) {
+  assert(NULL != stream && NULL != list);
 
-    // Check if files_and_chunks Multimap is NULL
-    if (fs->files_and_chunks == NULL) {
-        printf("Error: Files_and_chunks Multimap is NULL\n");
-        return IMFFS_ERROR;
-    }
+  extent_reader_init(&stream->reader, list);
+  stream->at = 0;
+  stream->available = 0;
+  stream->checked = 0;
+}
 
-    // Iterate through files_and_chunks Multimap
-    void *key;
-    int key_count = mm_get_first_key(fs->files_and_chunks, &key);
+// on to the next chunk if this one's used up; FALSE if there isn't one
+static Boolean stream_fill(IMFFSPtr fs, BlockStream *stream) {
+  assert(NULL != fs && NULL != stream);
 
-    printf("Got first key with count: %d\n", key_count);
+  Extent extent;
 
-    while (key_count > 0) {
-        printf("Inside the loop\n");
+  if (0 == stream->available) {
+    if (!extent_read(&stream->reader, &extent)) {
+      return FALSE;
+    }
+    assert(extent.count > 0);
+    stream->at = extent.start << fs->block_shift;
+    stream->available = extent.count << fs->block_shift;
+    stream->checked = stream->at;
+  }
 
-        // Get the values associated with the current key
-        FileInfo **info_array;
-        int values_count = mm_get_values(fs->files_and_chunks, key, (Value *)(&info_array), key_count);
+  return TRUE;
+}
 
-        // Check if the values were retrieved successfully
-        if (values_count > 0 && info_array != NULL) {
-            // Iterate through the values
-            for (int i = 0; i < values_count; ++i) {
-                FileInfo *info = info_array[i];
+// verifies the blocks the next len bytes in this chunk are in, apart from
+// the ones that already were
+static Boolean stream_check(IMFFSPtr fs, BlockStream *stream, uint64_t len) {
+  assert(NULL != fs && NULL != stream && len <= stream->available);
 
-                if (info != NULL) {
-                    printf("Filename: %s, Size: %u bytes\n", info->filename, info->size);
-                    // Free the allocated FileInfo structure
-                    free(info);
-                } else {
-                    printf("Error: Unable to retrieve info or info is NULL\n");
-                    // Handle this case as needed
-                }
-            }
+  if (stream->checked < (stream->at & ~(uint64_t)(fs->block_size - 1))) {
+    stream->checked = stream->at & ~(uint64_t)(fs->block_size - 1);
+  }
+  while (stream->checked < stream->at + len) {
+    if (!verify_block(fs, stream->checked >> fs->block_shift)) {
+      return FALSE;
+    }
+    stream->checked += fs->block_size;
+  }
 
-            // Free the allocated array of FileInfo pointers
-            free(info_array);
-        } else {
-            printf("Error: Unable to retrieve values or info_array is NULL\n");
-            // Handle this case as needed
-        }
+  return TRUE;
+}
 
-        // Get the next key
-        key_count = mm_get_next_key(fs->files_and_chunks, &key);
+// Moves len bytes on, copying them to out unless it's NULL. Returns FALSE
+// if the file's blocks end first.
+static Boolean stream_read(IMFFSPtr fs, BlockStream *stream, uint8_t *out, uint64_t len) {
+  assert(NULL != fs && NULL != stream);
 
-        printf("Got next key with count: %d\n", key_count);
+  uint64_t length;
+
+  while (len > 0) {
+    if (!stream_fill(fs, stream)) {
+      return FALSE;
     }
+    length = len < stream->available ? len : stream->available;
+    if (NULL != out) {
+      if (!stream_check(fs, stream, length)) {
+        return FALSE;
+      }
+      memcpy(out, &fs->data[stream->at], length);
+      out += length;
+    }
+    stream->at += length;
+    stream->available -= length;
+    len -= length;
+  }
 
-    printf("Exited the loop\n");
+  return TRUE;
+}
 
-    // Additional debug print
-    printf("After the loop, before returning\n");
+// len bytes from the stream: where they are if they're all in one chunk,
+// otherwise copied to scratch
+static const uint8_t *stream_next(IMFFSPtr fs, BlockStream *stream, uint64_t len, uint8_t *scratch) {
+  assert(NULL != fs && NULL != stream && NULL != scratch);
 
-    return IMFFS_OK;
+  const uint8_t *at;
+
+  if (len > 0 && !stream_fill(fs, stream)) {
+    return NULL;
+  }
+  if (len <= stream->available) {
+    if (!stream_check(fs, stream, len)) {
+      return NULL;
+    }
+    at = &fs->data[stream->at];
+    stream->at += len;
+    stream->available -= len;
+    return at;
+  }
+  return stream_read(fs, stream, scratch, len) ? scratch : NULL;
 }
 
-*/
-IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile) {
-  assert(validate_fs(fs));
-  assert(NULL != diskfile);
-  assert(NULL != imffsfile);
+// the length of the next group and whether it's stored as it is; FALSE at the end
+static Boolean stream_group(IMFFSPtr fs, BlockStream *stream, uint32_t *length, Boolean *stored) {
+  assert(NULL != length && NULL != stored);
 
-  FILE *in;
-  IMFFSResult result = IMFFS_OK;
-  uint32_t cluster_start, prev_free_block, next_free_block, blocks_in_cluster;
-  uint8_t *block_data;
-  Boolean eof, first;
-  File *file = NULL;
+  uint8_t scratch[GROUP_HEADER];
+  const uint8_t *header = stream_next(fs, stream, GROUP_HEADER, scratch);
+  uint32_t value;
 
-  if (NULL == fs || NULL == diskfile || NULL == imffsfile) {
-    return IMFFS_INVALID;
+  if (NULL == header) {
+    return FALSE;
   }
+  value = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+  *stored = 0 != (value & GROUP_STORED);
+  *length = value & ~GROUP_STORED;
 
-  in = fopen(diskfile, "r");
-  if (NULL == in) {
-    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
-    result = IMFFS_ERROR;
-  } else {
+  return TRUE;
+}
 
-    file = malloc(sizeof(File));
-    if (NULL != file) {
-      file->byte_len = 0;
-      file->name = malloc(strlen(imffsfile) + 1);
-      if (NULL == file->name) {
-        free(file);
-        file = NULL;
-      } else {
-        strcpy(file->name, imffsfile);
-      }
+// bytes a compressed file takes in its blocks, with the group headers
+static uint64_t compressed_length(IMFFSPtr fs, File *file, Value *list) {
+  assert(NULL != file && file->compressed);
+
+  BlockStream stream;
+  uint64_t length = 0;
+  uint32_t group;
+  Boolean stored;
+
+  stream_init(&stream, list);
+  for (uint64_t left = file->byte_len; left > 0 && stream_group(fs, &stream, &group, &stored);
+       left -= left < COMPRESS_GROUP ? left : COMPRESS_GROUP) {
+    length += GROUP_HEADER + group;
+    if (!stream_read(fs, &stream, NULL, group)) {
+      break;
     }
-    if (NULL == file) {
-      fprintf(stderr, "Error: not enough memory to create file '%s'.\n", imffsfile);
-      result = IMFFS_ERROR;
-    } else {
+  }
 
-      if (mm_count_values(fs->index, file) > 0) {
-        fprintf(stderr, "Error: file '%s' already exists on device.\n", imffsfile);
-        result = IMFFS_ERROR;
-      } else {
+  return length;
+}
 
-        eof = FALSE;
-        first = TRUE;
-        cluster_start = 0;
-        prev_free_block = 0;
-        next_free_block = 0;
-        blocks_in_cluster = 0;
-
-        while (!eof && IMFFS_OK == result && find_next_free_block(fs->used, fs->block_count, &next_free_block)) {
-          block_data = &fs->data[next_free_block * BYTES_PER_BLOCK];
-          file->byte_len += fread(block_data, 1, BYTES_PER_BLOCK, in);
-          if (ferror(in)) {
-            fprintf(stderr, "Error reading from input file '%s'.\n", diskfile);
-            result = IMFFS_ERROR;
-          } else {
-            if (first) {
-              first = FALSE;
-              cluster_start = next_free_block;
-            } else if (next_free_block > prev_free_block + 1) {
-              if (mm_insert_value(fs->index, file, blocks_in_cluster, &fs->data[cluster_start * BYTES_PER_BLOCK]) <= 0) {
-                fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
-                result = IMFFS_ERROR;
-              }
-              blocks_in_cluster = 0;
-              cluster_start = next_free_block;
-            }
-            prev_free_block = next_free_block;
-            fs->used[next_free_block] = BLOCK_USED;
-            blocks_in_cluster++;
+// chunks in the list, counting a packed tail; an inline file has one
+static int file_chunks(File *file, Value *list) {
+  assert(NULL != file && NULL != list);
 
-            eof = feof(in);
-          }
-        }
+  ExtentReader reader;
+  Extent extent;
+  int chunks = 0;
 
-        if (IMFFS_OK == result && !eof) {
-          fprintf(stderr, "Error: not enough free space on device to save '%s'.\n", imffsfile);
-          result = IMFFS_ERROR;
-        }
+  if (file->inlined) {
+    return 1;
+  }
+  extent_reader_init(&reader, list);
+  while (extent_read(&reader, &extent)) {
+    chunks++;
+  }
 
-        if (blocks_in_cluster > 0) {
-          if (mm_insert_value(fs->index, file, blocks_in_cluster, &fs->data[cluster_start * BYTES_PER_BLOCK]) <= 0) {
-            fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
-            result = IMFFS_ERROR;
-          }
-        }
+  return chunks;
+}
 
-        if (IMFFS_ERROR == result) {
-          if (mm_count_values(fs->index, file) > 0) {
-            result = imffs_delete(fs, imffsfile);
-            if (IMFFS_OK != result) {
-              result = IMFFS_ERROR;
-            }
-          }
-        }
-      }
-      if (IMFFS_OK != result && NULL != file) {
-        if (NULL != file->name) {
-          free(file->name);
-        }
-        free(file);
-      }
+// bytes of the file in its packed tail, 0 if it doesn't have one
+static uint32_t tail_length(IMFFSPtr fs, File *file) {
+  assert(NULL != fs && NULL != file);
+
+  return file->packed ? file->byte_len & (fs->block_size - 1) : 0;
+}
+
+static TailHeader *tail_header(IMFFSPtr fs, uint64_t block) {
+  assert(block < fs->block_count);
+
+  return (TailHeader *)&fs->data[block << fs->block_shift];
+}
+
+// space for a tail of len bytes in the open tail block, or a new one; at is
+// its offset from the start of the device
+static Boolean tail_alloc(IMFFSPtr fs, uint32_t len, uint64_t *at) {
+  assert(validate_fs(fs));
+  assert(len > 0 && len <= fs->block_size - sizeof(TailHeader));
+  assert(NULL != at);
+
+  TailHeader *header = NULL;
+  uint64_t pos = 0;
+
+  if (fs->open_tail < fs->block_count) {
+    header = tail_header(fs, fs->open_tail);
+    if (header->fill + len > fs->block_size) {
+      // what's left of it is wasted until the next defrag
+      fs->open_tail = fs->block_count;
+      header = NULL;
     }
+  }
 
-    fclose(in);
+  if (NULL == header) {
+    if (0 == fs->block_count || !find_free_block(fs, &pos)) {
+      return FALSE;
+    }
+    fs->used[pos] = BLOCK_TAIL;
+    fs->used_count++;
+    fs->open_tail = pos;
+    header = tail_header(fs, pos);
+    header->live = 0;
+    header->fill = sizeof(TailHeader);
   }
 
-  return result;
+  *at = (fs->open_tail << fs->block_shift) + header->fill;
+  header->fill += len;
+  header->live += len;
+
+  return TRUE;
 }
 
-IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile) {
+static void tail_release(IMFFSPtr fs, uint64_t at, uint32_t len) {
   assert(validate_fs(fs));
-  assert(NULL != diskfile);
-  assert(NULL != imffsfile);
 
-  IMFFSResult result = IMFFS_OK;
-  FILE *out;
-  File temp_file = { imffsfile, 0 }, *file;
-  Value  *values;
-  int num_values;
-  uint32_t length, length_remaining;
+  uint64_t pos = at >> fs->block_shift;
+  TailHeader *header = tail_header(fs, pos);
+
+  assert(BLOCK_TAIL == fs->used[pos]);
+  assert(header->live >= len);
+  header->live -= len;
+  if (0 == header->live) {
+    fs->used[pos] = BLOCK_FREE;
+    fs->used_count--;
+    mark_changed(fs, pos, FALSE);
+    if (pos == fs->open_tail) {
+      fs->open_tail = fs->block_count;
+    }
+  } else {
+    block_changed(fs, pos);
+  }
+}
 
-  if (NULL == fs || NULL == diskfile || NULL == imffsfile) {
-    return IMFFS_INVALID;
+// 64 bits at a time; block sizes are all multiples of 8
+static uint64_t hash_block(const uint8_t *block, uint32_t len) {
+  assert(NULL != block && 0 == len % 8);
+
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len, word;
+
+  for (uint32_t i = 0; i < len; i += 8) {
+    memcpy(&word, &block[i], 8);
+    word *= 0xbf58476d1ce4e5b9ULL;
+    word ^= word >> 31;
+    hash = (hash ^ word) * 0x94d049bb133111ebULL;
   }
+  hash ^= hash >> 29;
 
-  num_values = mm_count_values(fs->index, &temp_file);
-  if (num_values <= 0) {
-    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
-    result = IMFFS_ERROR;
+  return hash;
+}
 
-  } else if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
-    assert(NULL != file);
-    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
-    result = IMFFS_ERROR;
-    
-  } else if (NULL == (out = fopen(diskfile, "w"))) {
-    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
-    result = IMFFS_ERROR;
+static Boolean dedup_grow(IMFFSPtr fs) {
+  assert(validate_fs(fs));
 
-  } else {
-    values = malloc(sizeof(Value) * num_values);
+  uint64_t capacity = fs->dedup_capacity > 0 ? fs->dedup_capacity * 2 : MIN_DEDUP_ENTRIES;
+  DedupEntry *table = calloc(capacity, sizeof(DedupEntry)), *old = fs->dedup_table;
+  uint64_t slot;
 
-    if (NULL == values || num_values != mm_get_values(fs->index, file, values, num_values)) {
-      fprintf(stderr, "Error: unable read from file '%s'.\n", imffsfile);
-      result = IMFFS_ERROR;
-    } else {
-      
-      length_remaining = file->byte_len;
-
-      for (int i = 0; i < num_values && IMFFS_OK == result; i++) {
-        assert(values[i].num > 0);
-        assert(values[i].data != NULL);
-        
-        // one cluster at a time
-        length = values[i].num * BYTES_PER_BLOCK;
-        if (length_remaining < length) {
-          length = length_remaining;
-        }
-        fwrite(values[i].data, length, 1, out);
-        length_remaining -= length;
-        if (ferror(out)) {
-          fprintf(stderr, "Error writing to file '%s'.\n", diskfile);
-          result = IMFFS_ERROR;
-        }
+  if (NULL == table) {
+    return FALSE;
+  }
+  for (uint64_t i = 0; i < fs->dedup_capacity; i++) {
+    if (0 != old[i].block) {
+      slot = old[i].hash & (capacity - 1);
+      while (0 != table[slot].block) {
+        slot = (slot + 1) & (capacity - 1);
       }
-      
-      assert(IMFFS_OK != result || 0 == length_remaining);
+      table[slot] = old[i];
     }
-
-    free(values);
-    fclose(out);
   }
+  free(old);
+  fs->dedup_table = table;
+  fs->dedup_capacity = capacity;
 
-
-  return result;
+  return TRUE;
 }
 
-IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile) {
+// at most half full; without room it's just not shared
+static void dedup_insert(IMFFSPtr fs, uint64_t hash, uint64_t block) {
   assert(validate_fs(fs));
-  assert(NULL != imffsfile);
-  
-  IMFFSResult result = IMFFS_OK;
-  int num_values;
-  Value *values = NULL;
-  
-  File temp_file = { imffsfile, 0 };
-  File *file;
 
-  if (NULL == fs || NULL == imffsfile) {
-    return IMFFS_INVALID;
+  uint64_t slot;
+
+  if (2 * (fs->dedup_count + 1) <= fs->dedup_capacity || dedup_grow(fs)) {
+    slot = hash & (fs->dedup_capacity - 1);
+    while (0 != fs->dedup_table[slot].block) {
+      slot = (slot + 1) & (fs->dedup_capacity - 1);
+    }
+    fs->dedup_table[slot].hash = hash;
+    fs->dedup_table[slot].block = block + 1;
+    fs->dedup_count++;
   }
-  
-  num_values = mm_count_values(fs->index, &temp_file);
+}
 
-  if (num_values <= 0) {
-    fprintf(stderr, "Error: file not found '%s'.\n", imffsfile);
-    result = IMFFS_ERROR;
+// Shares a newly read block with an earlier one with the same contents if
+// there is one, and returns the block the file should use: the earlier one,
+// with one more reference, or the new one, now in the table but still free
+// for use_blocks.
+static uint64_t dedup_block(IMFFSPtr fs, uint64_t block) {
+  assert(validate_fs(fs));
+  assert(fs->dedup && NULL != fs->refs && BLOCK_FREE == fs->used[block]);
+
+#ifdef IMFFS_METRICS
+  uint64_t hash_start = metrics_now_ns();
+#endif
+  uint64_t hash = hash_block(block_address(fs, block), fs->block_size), slot, found;
+
+  METRICS_COUNT(fs, hash_ns, metrics_now_ns() - hash_start);
+  METRICS_COUNT(fs, blocks_hashed, 1);
+  METRICS_COUNT(fs, bytes_hashed, fs->block_size);
+  if (fs->dedup_capacity > 0) {
+    slot = hash & (fs->dedup_capacity - 1);
+    while (0 != fs->dedup_table[slot].block) {
+      found = fs->dedup_table[slot].block - 1;
+      if (hash == fs->dedup_table[slot].hash && fs->refs[found] < UINT32_MAX &&
+          0 == memcmp(block_address(fs, found), block_address(fs, block), fs->block_size)) {
+        METRICS_COUNT(fs, dedup_hits, 1);
+        fs->refs[found]++;
+        mark_changed(fs, found, FALSE);
+        return found;
+      }
+      slot = (slot + 1) & (fs->dedup_capacity - 1);
+    }
+  }
 
-  } else if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
-    assert(NULL != file);
-    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
-    result = IMFFS_ERROR;
+  dedup_insert(fs, hash, block);
 
-  } else {
+  return block;
+}
 
-    values = malloc(sizeof(Value) * num_values);
+// the slot the block is in, found by its contents, or dedup_capacity if
+// it isn't in the table
+static uint64_t dedup_find(IMFFSPtr fs, uint64_t block) {
+  assert(validate_fs(fs));
 
-    if (NULL == values || num_values != mm_get_values(fs->index, file, values, num_values)) {
-      result = IMFFS_ERROR;
-    } else {
-      
-      restore_free_space(fs, values, num_values);
-      
-      if (num_values != mm_remove_key(fs->index, file)) {
-        result = IMFFS_ERROR;
-      } else {
-        free(file->name);
-        free(file);
-      }
-    }
+  uint64_t slot, mask = fs->dedup_capacity - 1;
 
-    if (IMFFS_ERROR == result) {
-      fprintf(stderr, "Error: unable to delete '%s'.\n", imffsfile);
-    }
+  if (0 == fs->dedup_capacity) {
+    return fs->dedup_capacity;
+  }
 
+  slot = hash_block(block_address(fs, block), fs->block_size) & mask;
+  while (0 != fs->dedup_table[slot].block && block + 1 != fs->dedup_table[slot].block) {
+    slot = (slot + 1) & mask;
   }
-  free(values);
 
-  return result;
+  return 0 != fs->dedup_table[slot].block ? slot : fs->dedup_capacity;
 }
 
-IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew) {
+// takes a block that's being freed out of the table, if it's there
+static void dedup_forget(IMFFSPtr fs, uint64_t block) {
   assert(validate_fs(fs));
-  assert(NULL != imffsold);
-  assert(NULL != imffsnew);
 
-  IMFFSResult result = IMFFS_OK;
+  uint64_t slot = dedup_find(fs, block), next, home, mask = fs->dedup_capacity - 1;
 
-  if (NULL == fs || NULL == imffsold || NULL == imffsnew) {
-    return IMFFS_INVALID;
+  if (slot == fs->dedup_capacity) {
+    return;
   }
 
-  File new_file = { imffsnew, 0 };
-  File *file = find_matching_file(fs->index, imffsold);
+  // shift back any later entries that would no longer be found
+  next = (slot + 1) & mask;
+  while (0 != fs->dedup_table[next].block) {
+    home = fs->dedup_table[next].hash & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      fs->dedup_table[slot] = fs->dedup_table[next];
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+  fs->dedup_table[slot].block = 0;
+  fs->dedup_count--;
+}
 
-  if (NULL == file) {
-    fprintf(stderr, "Error: file '%s' doesn't exist.\n", imffsold);
-    result = IMFFS_ERROR;
+// from now on every used block has a count of the files using it, starting
+// with the ones in use; dedup and clones both need them
+static Boolean count_refs(IMFFSPtr fs) {
+  assert(validate_fs(fs));
 
-  } else if (0 != mm_count_values(fs->index, &new_file)) {
-    fprintf(stderr, "Error: file '%s' already exists.\n", imffsnew);
-    result = IMFFS_ERROR;
+  if (NULL == fs->refs) {
+    fs->refs = calloc(fs->block_count + 1, sizeof(uint32_t));
+    METRICS_COUNT(fs, allocations, 1);
+    if (NULL == fs->refs) {
+      return FALSE;
+    }
+    for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+      fs->refs[pos] = BLOCK_USED == fs->used[pos] ? 1 : 0;
+    }
+  }
 
-  } else {
+  return TRUE;
+}
 
-    
-    Value *values = NULL;
-    char *temp_name;
-    int count = make_values_array(fs->index, file, &values, -1);
-    if (count < 0) {
-      result = IMFFS_ERROR;
-    } else {
+// one file stops using the block, which is freed when no file uses it
+static void release_block(IMFFSPtr fs, uint64_t block) {
+  assert(validate_fs(fs));
+  assert(block < fs->block_count && BLOCK_USED == fs->used[block]);
 
-      if (mm_get_values(fs->index, file, values, count) != count || 
-          mm_remove_key(fs->index, file) != count) {
-        result = IMFFS_ERROR;    
-      } else {
-        
-        temp_name = malloc(strlen(imffsnew) + 1);
-        if (NULL == temp_name) {
-          result = IMFFS_OK;
-        } else {
-          
-          strcpy(temp_name, imffsnew);
-          free(file->name);
-          file->name = temp_name;
-          
-          for (int i = 0; i < count; i++) {
-            if (mm_insert_value(fs->index, file, values[i].num, values[i].data) <= 0) {
-              result = IMFFS_ERROR;
-            }
-          }
-        }
-      }
-      
-      free(values);
+  mark_changed(fs, block, FALSE);
+  if (NULL != fs->refs) {
+    assert(fs->refs[block] > 0);
+    if (--fs->refs[block] > 0) {
+      return;
     }
-    
-    if (IMFFS_OK != result) {
-      fprintf(stderr, "Error: unable to rename '%s' to '%s'.\n", imffsold, imffsnew);
+    dedup_forget(fs, block);
+  }
+  fs->used[block] = BLOCK_FREE;
+  fs->used_count--;
+}
+
+static Boolean page_free(IMFFSPtr fs, uint64_t first, uint64_t blocks) {
+  for (uint64_t block = first; block < first + blocks && block < fs->block_count; block++) {
+    if (BLOCK_FREE != fs->used[block]) {
+      return FALSE;
     }
   }
 
-  return result;
+  return TRUE;
 }
 
-static uint32_t count_and_maybe_print_blocks(Multimap *index, File *file, Boolean print) {
-  assert(NULL != index && NULL != file);
-  
-  int num_values;
-  Value *values;
-  uint32_t blocks = 0;
-  
-  num_values = mm_count_values(index, file);
-  if (num_values > 0) {
-    values = malloc(sizeof(Value) * num_values);
-    if (num_values == mm_get_values(index, file, values, num_values)) {
-      for (int i = 0; i < num_values; i++) {
-        assert(values[i].num > 0);
-        blocks += values[i].num;
-        if (print) {
-          printf("          | %6u | %6d | %p\n", values[i].num, i, values[i].data);
-        }
-      }
+// Gives the pages from block first up to end that only hold free blocks
+// back to the OS, which maps zeroed ones in again when they're next written.
+// Returns how many bytes that was.
+static uint64_t trim_blocks(IMFFSPtr fs, uint64_t first, uint64_t end) {
+  assert(first <= end && end <= fs->block_count);
+
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t per_page = page > fs->block_size ? page / fs->block_size : 1; // blocks are page aligned
+  uint64_t pos = first / per_page * per_page, start, trimmed = 0;
+
+  while (pos < end) {
+    while (pos < end && !page_free(fs, pos, per_page)) {
+      pos += per_page;
+    }
+    start = pos;
+    while (pos < end && page_free(fs, pos, per_page)) {
+      pos += per_page;
+    }
+    // the last page can run past the last block, but not past the mapping
+    if (pos > start) {
+#ifdef MADV_DONTNEED
+      madvise(&fs->data[start << fs->block_shift], (pos - start) << fs->block_shift,
+              NULL != fs->shared ? SHARED_TRIM : MADV_DONTNEED);
+#endif
+      trimmed += (pos - start) << fs->block_shift;
     }
-    free(values);
   }
 
-  return blocks;
+  return trimmed;
 }
 
-static IMFFSResult imffs_dir_both(IMFFSPtr fs, Boolean full) {
-  assert(validate_fs(fs));
+// The directory imffs_share publishes, for readers in other processes: the
+// number of files, then where each one's entry is from the start of the
+// directory, in the index's order, so a reader can binary search it. An
+// entry is a header, the name with its terminator, and then the extent
+// list, or an inline file's contents. It has no pointers, so it means the
+// same wherever it's mapped; every number is read with memcpy.
+typedef struct {
+  uint64_t byte_len;
+  uint64_t etag;
+  uint32_t flags;     // as in images: 1 inline, 2 packed, 4 compressed, 8 spilled
+  uint32_t name_len;  // without the terminator
+  uint64_t data_len;  // extent list or contents that follow the name
+} SharedEntry;
+
+// Before blocks readers may be using are changed or freed: they'll look
+// again once share_changes has published the directory that goes with them.
+static void share_begin(IMFFSPtr fs) {
+  if (NULL != fs->shared) {
+    shared_write_begin(fs->shared);
+    fs->shared_changed = TRUE;
+  }
+}
 
-  void *key;
-  File *file;
-  uint32_t total_bytes = 0, blocks;
-  int chunks;
-  
-  if (NULL == fs) {
-    return IMFFS_INVALID;
+// a file's extent list, or contents, for its entry in the directory
+static void shared_data(IMFFSPtr fs, File *file, Value *list) {
+  list->num = file->inlined ? file->byte_len : 0;
+  list->data = file->data;
+  if (!file->inlined && !file->spilled && !get_extents(fs, file, list)) {
+    list->num = 0;
   }
+}
 
-  printf("----------+--------+--------+------------\n");
+// bytes of an entry with a name of name_len bytes and data_len of data
+static uint64_t shared_entry_length(uint64_t name_len, uint64_t data_len) {
+  return sizeof(SharedEntry) + name_len + 1 + data_len;
+}
 
-  printf("    Bytes | Blocks | Chunks | Filename\n");
+// writes file's entry at at, and returns where the next one goes
+static uint64_t put_shared_entry(uint8_t *directory, uint64_t at, File *file, Value *list) {
+  SharedEntry entry;
+
+  entry.byte_len = file->byte_len;
+  entry.etag = file->etag;
+  entry.flags = (file->inlined ? 1 : 0) | (file->packed ? 2 : 0) | (file->compressed ? 4 : 0) |
+                (file->spilled ? 8 : 0);
+  entry.name_len = strlen(file->name);
+  entry.data_len = list->num;
+  memcpy(&directory[at], &entry, sizeof(SharedEntry));
+  at += sizeof(SharedEntry);
+  memcpy(&directory[at], file->name, entry.name_len + 1);
+  at += entry.name_len + 1;
+  memcpy(&directory[at], list->data, entry.data_len);
+
+  return at + entry.data_len;
+}
 
-  printf("----------+--------+--------+------------\n");
+// Lays the whole directory out again, with room for the offsets of twice
+// as many files as there are, and no space in it that isn't used.
+static void share_all(IMFFSPtr fs) {
+  assert(NULL != fs && NULL != fs->shared);
 
+  Value list;
+  File *file;
+  void *key;
+  uint8_t *directory;
+  uint64_t count, slots, length, at, i = 0;
+
+  count = mm_count_keys(fs->index);
+  slots = 2 * count > MIN_SHARED_SLOTS ? 2 * count : MIN_SHARED_SLOTS;
+  length = (slots + 1) * sizeof(uint64_t);
   if (mm_get_first_key(fs->index, &key) > 0) {
     do {
-
       file = key;
+      shared_data(fs, file, &list);
+      length += shared_entry_length(strlen(file->name), list.num);
+    } while (mm_get_next_key(fs->index, &key) > 0);
+  }
 
-      if (full) {
-        blocks = count_and_maybe_print_blocks(fs->index, file, TRUE);
-      } else {
-        blocks = count_and_maybe_print_blocks(fs->index, file, FALSE);
-      }
+  if (NULL == (directory = shared_directory_reserve(fs->shared, length))) {
+    // readers see no files rather than the wrong ones
+    fprintf(stderr, "Error: not enough shared memory to publish the directory.\n");
+    directory = shared_directory_reserve(fs->shared, sizeof(uint64_t));
+    count = 0;
+    memcpy(directory, &count, sizeof(uint64_t));
+    fs->shared_slots = 0;
+    fs->shared_length = sizeof(uint64_t);
+    fs->shared_garbage = 0;
+    return;
+  }
 
-      chunks = mm_count_values(fs->index, file);
-      printf("%9u | %6u | %6d | %s\n", file->byte_len, blocks, chunks, file->name);
-      total_bytes += file->byte_len;
-      
-      if (full) {
-        printf("----------+--------+--------+------------\n");
-      }
-      
+  memcpy(directory, &count, sizeof(uint64_t));
+  at = (slots + 1) * sizeof(uint64_t);
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      file = key;
+      shared_data(fs, file, &list);
+      memcpy(&directory[(++i) * sizeof(uint64_t)], &at, sizeof(uint64_t));
+      at = put_shared_entry(directory, at, file, &list);
     } while (mm_get_next_key(fs->index, &key) > 0);
+  }
+  assert(at == length && i == count);
 
-    if (!full) {
-      printf("----------+--------+--------+------------\n");
+  fs->shared_slots = slots;
+  fs->shared_length = length;
+  fs->shared_garbage = 0;
+  METRICS_COUNT(fs, published_bytes, length);
+}
+
+// Publishes the file called name as it is now, or that it's gone: its
+// entry goes after the others, its offset replaces the old one's, and the
+// old entry is left where it was. FALSE if it can't be, because there's no
+// room for another offset or the directory can't grow, which share_all
+// fixes.
+static Boolean share_file(IMFFSPtr fs, char *name) {
+  assert(NULL != fs && NULL != fs->shared && NULL != name);
+
+  File probe = { name, 0 }, *file = NULL;
+  SharedEntry entry;
+  Value list;
+  void *key;
+  uint8_t *directory = shared_directory_reserve(fs->shared, fs->shared_length);
+  uint64_t count, low = 0, high, middle, at, length;
+  size_t name_len = strlen(name);
+  int order = 1;
+
+  if (NULL == directory || 0 == fs->shared_slots) {
+    return FALSE;
+  }
+  if (mm_get_key(fs->index, &probe, &key) > 0) {
+    file = key;
+  }
+
+  // where its offset is, or goes
+  memcpy(&count, directory, sizeof(uint64_t));
+  high = count;
+  while (0 != order && low < high) {
+    middle = low + (high - low) / 2;
+    memcpy(&at, &directory[(middle + 1) * sizeof(uint64_t)], sizeof(uint64_t));
+    memcpy(&entry, &directory[at], sizeof(SharedEntry));
+    order = compare_shared_name(name, name_len, &directory[at + sizeof(SharedEntry)], entry.name_len);
+    if (order < 0) {
+      high = middle;
+    } else if (order > 0) {
+      low = middle + 1;
+    } else {
+      low = middle;
+      fs->shared_garbage += shared_entry_length(entry.name_len, entry.data_len);
     }
   }
 
-  // printf("%s\n", fs->used);
-  printf("\nTotal bytes: %u\n", total_bytes);
-  
-  return IMFFS_OK;
-}
+  if (NULL == file) {
+    if (0 == order) {
+      memmove(&directory[(low + 1) * sizeof(uint64_t)], &directory[(low + 2) * sizeof(uint64_t)],
+              (count - low - 1) * sizeof(uint64_t));
+      count--;
+      memcpy(directory, &count, sizeof(uint64_t));
+    }
+    return TRUE;
+  }
 
-IMFFSResult imffs_dir(IMFFSPtr fs) {
-  return imffs_dir_both(fs, FALSE);
-}
+  shared_data(fs, file, &list);
+  length = shared_entry_length(name_len, list.num);
+  if ((0 != order && count == fs->shared_slots) ||
+      NULL == (directory = shared_directory_reserve(fs->shared, fs->shared_length + length))) {
+    return FALSE;
+  }
+  if (0 != order) {
+    memmove(&directory[(low + 2) * sizeof(uint64_t)], &directory[(low + 1) * sizeof(uint64_t)],
+            (count - low) * sizeof(uint64_t));
+    count++;
+    memcpy(directory, &count, sizeof(uint64_t));
+  }
+  memcpy(&directory[(low + 1) * sizeof(uint64_t)], &fs->shared_length, sizeof(uint64_t));
+  put_shared_entry(directory, fs->shared_length, file, &list);
+  fs->shared_length += length;
+  METRICS_COUNT(fs, published_bytes, length);
 
-IMFFSResult imffs_fulldir(IMFFSPtr fs) {
-  return imffs_dir_both(fs, TRUE);
+  return TRUE;
 }
 
-IMFFSResult imffs_defrag(IMFFSPtr fs) {
+// Publishes the directory again, if anything changed, at the end of each
+// operation: just the entries of the files it changed, unless it changed
+// more than it named, or enough of the directory isn't used any more that
+// it's time to lay it out again.
+static void share_changes(IMFFSPtr fs) {
+  assert(NULL != fs);
 
-  assert(validate_fs(fs));
-  
-  
-  IMFFSResult result = IMFFS_OK;
-  File **owners = NULL;
-  uint32_t owner_count;
-  Value *values = NULL;
-  int count = 0, value_size = -1;
-  File *file = NULL;
-  void *key;
-  uint8_t pos, buffer[BYTES_PER_BLOCK];
-  
-  owners = calloc(fs->block_count, sizeof(File *));
-  if (NULL == owners) {
-    fprintf(stderr, "Code 1 ");
-    result = IMFFS_ERROR;
-  } else {
+  Boolean all;
 
+  if (NULL == fs->shared || !fs->shared_changed) {
+    return;
+  }
+  shared_write_begin(fs->shared);
 
-    owner_count = 0;
-    if (mm_get_first_key(fs->index, &key) > 0) {
-      do {
-        file = key;
-        
-        count = make_values_array(fs->index, file, &values, value_size);
-        if (count < 0) {
-          fprintf(stderr, "Code 2 ");
-          result = IMFFS_ERROR;
-        } else {
-          value_size = count;
-        }
-        
-        if (result == IMFFS_OK) {
-          if (count != mm_get_values(fs->index, file, values, value_size)) {
+  all = fs->shared_all || 0 == fs->shared_pending_count;
+  for (uint32_t i = 0; i < fs->shared_pending_count; i++) {
+    all = all || !share_file(fs, fs->shared_pending[i]);
+    free(fs->shared_pending[i]);
+  }
+  if (all || fs->shared_garbage > fs->shared_length / 2) {
+    share_all(fs);
+  }
 
-            assert(FALSE);
-            fprintf(stderr, "Code 3 ");
-            result = IMFFS_ERROR;
-          } else {
-            
-            for (int i = 0; i < count; i++) {
-              pos = block_ptr_to_index(fs->data, values[i].data);
-              for (int j = 0; j < values[i].num; j++) {
-                owners[pos + j] = file;
-              }
-            }
+  shared_write_end(fs->shared, fs->shared_length);
+  fs->shared_changed = FALSE;
+  fs->shared_all = FALSE;
+  fs->shared_pending_count = 0;
+  METRICS_COUNT(fs, publishes, 1);
+}
+
+static void restore_free_space(IMFFSPtr fs, File *file, Value *list) {
+  assert(validate_fs(fs));
+  assert(NULL != file && NULL != list);
+
+  ExtentReader reader;
+  Extent extent;
+
+  share_begin(fs);
+  extent_reader_init(&reader, list);
+  while (extent_read(&reader, &extent)) {
+    if (0 == extent.count) {
+      tail_release(fs, (extent.start << fs->block_shift) + extent.offset, tail_length(fs, file));
+    }
+
+    for (uint64_t j = 0; j < extent.count; j++) {
+      release_block(fs, extent.start + j);
+    }
+    // small chunks are left for imffs_trim, so deletes don't make a system call each
+    if (extent.count << fs->block_shift >= TRIM_MIN_BYTES) {
+      METRICS_COUNT(fs, trimmed_bytes, trim_blocks(fs, extent.start, extent.start + extent.count));
+    }
+  }
+}
+
+// The blocks are an anonymous mapping rather than a malloc, so a page is
+// only committed when a block in it is first written, and creating a
+// device takes the same time at any size. Regions of a huge page or more
+// are aligned to one and ask for transparent huge pages, which cut the
+// faults to fill them and the TLB misses copying in and out of them.
+// what a mapping of that many bytes of blocks takes, in whole pages
+static size_t mapped_length(size_t bytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  return ((bytes > 0 ? bytes : 1) + page - 1) / page * page;
+}
+
+static uint8_t *map_blocks(size_t bytes) {
+  size_t length = mapped_length(bytes);
+  size_t extra = length >= HUGE_PAGE ? HUGE_PAGE : 0;
+  uint8_t *region = mmap(NULL, length + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uint8_t *start;
+
+  if (MAP_FAILED == region) {
+    return NULL;
+  }
+
+  // keep the huge-page-aligned length bytes, and unmap what's left on each side
+  start = 0 == extra ? region : (uint8_t *)(((uintptr_t)region + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+  if (start > region) {
+    munmap(region, start - region);
+  }
+  if (region + extra > start) {
+    munmap(start + length, region + extra - start);
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (extra > 0) {
+    madvise(start, length, MADV_HUGEPAGE); // only advice: without it the pages are small
+  }
+#endif
+
+  return start;
+}
+
+static void unmap_blocks(uint8_t *data, size_t bytes) {
+  if (NULL != data) {
+    munmap(data, mapped_length(bytes));
+  }
+}
+
+// Makes the mapping of the blocks bigger. With mremap the pages already
+// there are moved, not copied, if it can't grow where it is; extents are
+// block numbers, so where the blocks are doesn't matter.
+static uint8_t *grow_mapping(uint8_t *data, size_t old_bytes, size_t new_bytes) {
+  size_t old_length = mapped_length(old_bytes), new_length = mapped_length(new_bytes);
+  uint8_t *grown;
+
+  if (new_length <= old_length) {
+    return data;
+  }
+#ifdef MREMAP_MAYMOVE
+  grown = mremap(data, old_length, new_length, MREMAP_MAYMOVE);
+  if (MAP_FAILED == grown) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (new_length >= HUGE_PAGE) {
+    madvise(grown, new_length, MADV_HUGEPAGE);
+  }
+#endif
+#else
+  grown = map_blocks(new_bytes);
+  if (NULL == grown) {
+    return NULL;
+  }
+  memcpy(grown, data, old_bytes);
+  unmap_blocks(data, old_bytes);
+#endif
+
+  return grown;
+}
+
+// Gives back the end of the mapping, past the last block that's kept
+static void shrink_mapping(uint8_t *data, size_t old_bytes, size_t new_bytes) {
+  size_t old_length = mapped_length(old_bytes), new_length = mapped_length(new_bytes);
+
+  if (new_length < old_length) {
+    munmap(data + new_length, old_length - new_length);
+  }
+}
+
+IMFFSResult imffs_create(uint64_t block_count, uint32_t block_size, IMFFSPtr *fs) {
+  assert(NULL != fs);
+
+  uint8_t block_shift = 0;
+
+  while (block_shift < 31 && (1U << block_shift) < block_size) {
+    block_shift++;
+  }
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  } else if (block_size < IMFFS_MIN_BLOCK_SIZE || block_size > IMFFS_MAX_BLOCK_SIZE || (1U << block_shift) != block_size) {
+    *fs = NULL;
+    fprintf(stderr, "Error: the block size must be a power of two from %d to %d bytes.\n",
+            IMFFS_MIN_BLOCK_SIZE, IMFFS_MAX_BLOCK_SIZE);
+    return IMFFS_INVALID;
+  } else if (block_count > (SIZE_MAX - 1) / block_size || block_count > INT64_MAX) {
+    // the byte size of the device wouldn't fit in a size_t
+    *fs = NULL;
+    fprintf(stderr, "Error: a filesystem of %llu blocks is too large.\n", (unsigned long long)block_count);
+    return IMFFS_FATAL;
+  } else {
+
+    *fs = malloc(sizeof(struct IMFFS));
+    if (NULL == *fs) {
+      fprintf(stderr, "Error: not enough memory to create filesystem.\n");
+      return IMFFS_FATAL;
+    } else {
+
+      (*fs)->data = map_blocks((size_t)block_count * block_size);
+
+      (*fs)->used = malloc(block_count + 1);
+      if (NULL != (*fs)->used) {
+        memset((*fs)->used, BLOCK_FREE, block_count);
+        (*fs)->used[block_count] = '\0';
+      }
+
+      (*fs)->used_count = 0;
+      (*fs)->block_count = block_count;
+      (*fs)->block_size = block_size;
+      (*fs)->block_shift = block_shift;
+      (*fs)->inline_limit = block_size - 1 < IMFFS_MAX_INLINE_SIZE ? block_size - 1 : IMFFS_MAX_INLINE_SIZE;
+      (*fs)->tail_packing = FALSE;
+      (*fs)->open_tail = block_count;
+      (*fs)->dedup = FALSE;
+      (*fs)->compression = FALSE;
+      (*fs)->checksums = NULL;
+      (*fs)->refs = NULL;
+      (*fs)->dedup_table = NULL;
+      (*fs)->dedup_capacity = 0;
+      (*fs)->dedup_count = 0;
+      (*fs)->journal = NULL;
+      (*fs)->seq = 0;
+      (*fs)->cache = FALSE;
+      (*fs)->coldest = NULL;
+      (*fs)->hottest = NULL;
+      (*fs)->backing = NULL;
+      (*fs)->shared = NULL;
+      (*fs)->shared_changed = FALSE;
+      (*fs)->shared_all = FALSE;
+      (*fs)->shared_pending_count = 0;
+      (*fs)->shared_slots = 0;
+      (*fs)->shared_length = 0;
+      (*fs)->shared_garbage = 0;
+      (*fs)->shared_name = NULL;
+      memset(&(*fs)->dirty, 0, sizeof(Dirty));
+      (*fs)->tracer = NULL;
+      (*fs)->tracer_context = NULL;
+#ifdef IMFFS_METRICS
+      memset(&(*fs)->metrics, 0, sizeof(Metrics));
+#endif
+      (*fs)->index = mm_create(block_count, compare_files_by_name, compare_always_greater);
+
+      if (NULL == (*fs)->data || NULL == (*fs)->used || NULL == (*fs)->index) {
+        fprintf(stderr, "Error: not enough memory to create filesystem data.\n");
+        unmap_blocks((*fs)->data, (size_t)block_count * block_size);
+        free((*fs)->used);
+        if (NULL != (*fs)->index) {
+          mm_destroy((*fs)->index);
+        }
+        free(*fs);
+        *fs = NULL;
+        return IMFFS_FATAL;
+      }
+    }
+  }
+
+  return IMFFS_OK;
+}
+
+
+/*
+
+
+IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile) {
+    // Implementation to load a file from IMFFS to the system
+    // You need to read the content of 'imffsfile' in IMFFS and save it to 'diskfile'
+    // Use the Multimap and block_usage to retrieve the file content
+
+    // Find the file info in the files_and_chunks Multimap
+    int key_index = find_key_index(fs->files_and_chunks, imffsfile);
+    if (key_index == -1) {
+        fprintf(stderr, "File not found: %s\n", imffsfile);
+        return IMFFS_ERROR;  // File not found
+    }
+
+    // Get the file info
+    FileInfo *info;
+    mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&info, 1);
+
+    FILE *file = fopen(diskfile, "wb");
+    if (file == NULL) {
+        perror("Error opening file");
+        return IMFFS_ERROR;
+    }
+
+    for (int i = 0; i < info->size; ++i) {
+        Chunk *chunk;
+        mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&chunk, 1);
+
+        fwrite(chunk->data, 1, BLOCK_SIZE, file);
+    }
+
+    fclose(file);
+
+    return IMFFS_OK;
+}
+
+IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile) {
+    // Implementation to delete a file from IMFFS
+    // You need to free the blocks occupied by 'imffsfile' and update the Multimap and block_usage accordingly
+
+    // Find the file info in the files_and_chunks Multimap
+    int key_index = find_key_index(fs->files_and_chunks, imffsfile);
+    if (key_index == -1) {
+        fprintf(stderr, "File not found: %s\n", imffsfile);
+        return IMFFS_ERROR;  // File not found
+    }
+
+    // Get the file info
+    FileInfo *info;
+    mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&info, 1);
+
+    // Iterate through chunks and free blocks
+    for (int i = 0; i < info->size; ++i) {
+        Chunk *chunk;
+        mm_get_values(fs->files_and_chunks, imffsfile, (Value *)&chunk, 1);
+
+        int block_index = i;
+        fs->block_usage[block_index] = 0;
+
+        // Free the block data
+        free(chunk->data);
+
+        // Free the chunk structure
+        free(chunk);
+    }
+
+    // Remove the file from the Multimap
+    mm_remove_key(fs->files_and_chunks, imffsfile);
+
+    return IMFFS_OK;
+}
+
+IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew) {
+    // Implementation to rename a file in IMFFS
+    // You need to update the Multimap to reflect the new filename
+
+    // Find the file info in the files_and_chunks Multimap
+    int key_index = find_key_index(fs->files_and_chunks, imffsold);
+    if (key_index == -1) {
+        fprintf(stderr, "File not found: %s\n", imffsold);
+        return IMFFS_ERROR;  // File not found
+    }
+
+    // Get the file info
+    FileInfo *info;
+    mm_get_values(fs->files_and_chunks, imffsold, (Value *)&info, 1);
+
+    // Update the filename in the Multimap
+    mm_remove_key(fs->files_and_chunks, imffsold);
+
+    // Create new FileInfo with the new filename
+    FileInfo *new_info = create_file_info(imffsnew, info->size);
+
+    // Insert the new file info into the Multimap
+    mm_insert_value(fs->files_and_chunks, imffsnew, 1, new_info);
+
+    return IMFFS_OK;
+}
+
+IMFFSResult imffs_dir(IMFFSPtr fs) {
+    printf("Files in IMFFS:\n");
+
+    // Check if files_and_chunks Multimap is NULL
+    if (fs->files_and_chunks == NULL) {
+        printf("Error: Files_and_chunks Multimap is NULL\n");
+        return IMFFS_ERROR;
+    }
+
+    // Iterate through files_and_chunks Multimap
+    void *key;
+    int key_count = mm_get_first_key(fs->files_and_chunks, &key);
+
+    printf("Got first key with count: %d\n", key_count);
+
+    while (key_count > 0) {
+        printf("Inside the loop\n");
+
+        // Get the values associated with the current key
+        FileInfo **info_array;
+        int values_count = mm_get_values(fs->files_and_chunks, key, (Value *)(&info_array), key_count);
+
+        // Check if the values were retrieved successfully
+        if (values_count > 0 && info_array != NULL) {
+            // Iterate through the values
+            for (int i = 0; i < values_count; ++i) {
+                FileInfo *info = info_array[i];
+
+                if (info != NULL) {
+                    printf("Filename: %s, Size: %u bytes\n", info->filename, info->size);
+                    // Free the allocated FileInfo structure
+                    free(info);
+                } else {
+                    printf("Error: Unable to retrieve info or info is NULL\n");
+                    // Handle this case as needed
+                }
+            }
+
+            // Free the allocated array of FileInfo pointers
+            free(info_array);
+        } else {
+            printf("Error: Unable to retrieve values or info_array is NULL\n");
+            // Handle this case as needed
+        }
+
+        // Get the next key
+        key_count = mm_get_next_key(fs->files_and_chunks, &key);
+
+        printf("Got next key with count: %d\n", key_count);
+    }
+
+    printf("Exited the loop\n");
+
+    // Additional debug print
+    printf("After the loop, before returning\n");
+
+    return IMFFS_OK;
+}
+
+*/
+// feeds the next bytes of a file being saved to its etag
+static void hash_content(IMFFSPtr fs, XXH64State *content, const uint8_t *data, size_t len) {
+#ifdef IMFFS_METRICS
+  uint64_t etag_start = metrics_now_ns();
+#endif
+  xxh64_update(content, data, len);
+  METRICS_COUNT(fs, etag_ns, metrics_now_ns() - etag_start);
+  METRICS_COUNT(fs, etag_bytes, len);
+}
+
+// the next bytes of a file being saved: hashed for its etag, and added to
+// its journal record
+static void save_content(IMFFSPtr fs, XXH64State *content, const uint8_t *data, size_t len) {
+  hash_content(fs, content, data, len);
+  if (NULL != fs->journal) {
+    journal_put(fs->journal, data, len);
+  }
+}
+
+// Commits the journal record built since journal_begin. A change that
+// can't be logged has still been made, but won't survive a crash, so it's
+// fatal.
+static IMFFSResult commit_record(IMFFSPtr fs) {
+  assert(NULL != fs && NULL != fs->journal);
+
+#ifdef IMFFS_METRICS
+  uint64_t journal_start = metrics_now_ns();
+#endif
+  int failed = journal_commit(fs->journal);
+
+  METRICS_COUNT(fs, journal_ns, metrics_now_ns() - journal_start);
+  if (0 != failed) {
+    return IMFFS_FATAL;
+  }
+  fs->seq = journal_seq(fs->journal);
+
+  return IMFFS_OK;
+}
+
+// logs a record with just names in it
+static IMFFSResult log_names(IMFFSPtr fs, RecordType type, char *name, char *other) {
+  assert(NULL != fs);
+
+  if (NULL == fs->journal) {
+    return IMFFS_OK;
+  }
+  journal_begin(fs->journal, type);
+  if (NULL != name) {
+    journal_put_string(fs->journal, name);
+  }
+  if (NULL != other) {
+    journal_put_string(fs->journal, other);
+  }
+
+  return commit_record(fs);
+}
+
+// the settings that change how later saves are stored, which a replay has to
+// use for them too
+static IMFFSResult log_settings(IMFFSPtr fs) {
+  assert(NULL != fs);
+
+  if (NULL == fs->journal) {
+    return IMFFS_OK;
+  }
+  journal_begin(fs->journal, RECORD_SETTINGS);
+  journal_put_number(fs->journal, fs->inline_limit);
+  journal_put_number(fs->journal, fs->tail_packing);
+  journal_put_number(fs->journal, fs->dedup);
+  journal_put_number(fs->journal, fs->compression);
+  journal_put_number(fs->journal, NULL != fs->checksums);
+
+  return commit_record(fs);
+}
+
+static FILE *open_traced(IMFFSPtr fs, char *diskfile, char *mode, char *imffsfile) {
+  FILE *file;
+
+  TRACE_BEGIN(fs, "open", imffsfile);
+  file = fopen(diskfile, mode);
+  TRACE_END(fs, "open", imffsfile, 0, 0);
+
+  return file;
+}
+
+// adds a chunk of consecutive blocks to the file's list
+static Boolean add_extent(IMFFSPtr fs, ExtentWriter *list, uint64_t start, uint64_t count) {
+  assert(NULL != fs && NULL != list);
+  assert(count > 0 && start + count <= fs->block_count);
+
+  METRICS_COUNT(fs, allocations, list->length + MAX_EXTENT_BYTES > list->capacity ? 1 : 0);
+  return extent_write(list, start, count, 0);
+}
+
+// adds count blocks from start to the file's current cluster, first ending
+// it with add_extent if they don't follow on from it
+static Boolean add_to_cluster(IMFFSPtr fs, ExtentWriter *list, uint64_t *cluster_start, uint64_t *blocks_in_cluster,
+                              uint64_t start, uint64_t count, uint32_t *extents) {
+  assert(NULL != cluster_start && NULL != blocks_in_cluster && NULL != extents);
+
+  Boolean added = TRUE;
+
+  if (*blocks_in_cluster > 0 && start != *cluster_start + *blocks_in_cluster) {
+    added = add_extent(fs, list, *cluster_start, *blocks_in_cluster);
+    (*extents)++;
+    *blocks_in_cluster = 0;
+  }
+  if (0 == *blocks_in_cluster) {
+    *cluster_start = start;
+  }
+  *blocks_in_cluster += count;
+
+  return added;
+}
+
+// marks free blocks a file is about to use, once their contents are in
+// them; blocks it shares with dedup are already used
+static void use_blocks(IMFFSPtr fs, uint64_t start, uint64_t count) {
+  assert(start + count <= fs->block_count);
+
+  if (BLOCK_FREE == fs->used[start]) {
+    memset(&fs->used[start], BLOCK_USED, count);
+    fs->used_count += count;
+    for (uint64_t j = 0; j < count; j++) {
+      if (NULL != fs->refs) {
+        fs->refs[start + j] = 1;
+      }
+      block_changed(fs, start + j);
+    }
+  }
+}
+
+// keeps a block of a compressed file once it's full, zero padded if it's
+// the last one, or shares one that's the same with dedup on
+static Boolean keep_block(IMFFSPtr fs, uint64_t block, uint32_t fill, ExtentWriter *writer, uint64_t *cluster_start,
+                          uint64_t *blocks_in_cluster, uint32_t *extents) {
+  assert(NULL != fs && BLOCK_FREE == fs->used[block]);
+
+  memset(block_address(fs, block) + fill, 0, fs->block_size - fill);
+  if (fs->dedup) {
+    block = dedup_block(fs, block);
+  }
+  use_blocks(fs, block, 1);
+
+  return add_to_cluster(fs, writer, cluster_start, blocks_in_cluster, block, 1, extents);
+}
+
+// Saves the rest of in as compressed groups, written one after the other
+// into free blocks. An empty file still gets a block.
+static IMFFSResult save_compressed(IMFFSPtr fs, FILE *in, char *diskfile, File *file, ExtentWriter *writer,
+                                   uint64_t *cluster_start, uint64_t *blocks_in_cluster, uint64_t *blocks,
+                                   uint32_t *extents, XXH64State *content) {
+  assert(NULL != fs && NULL != in && NULL != file && file->compressed);
+
+  IMFFSResult result = IMFFS_OK;
+  uint8_t *raw = malloc(COMPRESS_GROUP), *group = malloc(GROUP_HEADER + LZ_BOUND(COMPRESS_GROUP));
+  uint64_t block = 0, next_free_block = 0;
+  uint32_t fill = 0, length, header, copy;
+  size_t bytes_read;
+  Boolean eof = FALSE, filling = FALSE;
+
+  METRICS_COUNT(fs, allocations, 2);
+  if (NULL == raw || NULL == group) {
+    fprintf(stderr, "Error: not enough memory to create file '%s'.\n", file->name);
+    result = IMFFS_ERROR;
+  }
+
+  while (IMFFS_OK == result && !eof) {
+    TRACE_BEGIN(fs, "copy", file->name);
+    bytes_read = fread(raw, 1, COMPRESS_GROUP, in);
+    TRACE_END(fs, "copy", file->name, 0, 0);
+    if (ferror(in)) {
+      fprintf(stderr, "Error reading from input file '%s'.\n", diskfile);
+      result = IMFFS_ERROR;
+      break;
+    }
+    eof = bytes_read < COMPRESS_GROUP;
+    if (0 == bytes_read) {
+      break;
+    }
+    save_content(fs, content, raw, bytes_read);
+
+    // a group that doesn't get smaller is stored as it is
+    TRACE_BEGIN(fs, "compress", file->name);
+#ifdef IMFFS_METRICS
+    uint64_t compress_start = metrics_now_ns();
+#endif
+    length = lz_compress(raw, bytes_read, &group[GROUP_HEADER], bytes_read - 1);
+    header = length;
+    if (0 == length) {
+      memcpy(&group[GROUP_HEADER], raw, bytes_read);
+      length = bytes_read;
+      header = length | GROUP_STORED;
+    }
+    for (int i = 0; i < GROUP_HEADER; i++) {
+      group[i] = header >> (8 * i);
+    }
+    METRICS_COUNT(fs, compress_ns, metrics_now_ns() - compress_start);
+    METRICS_COUNT(fs, compress_in, bytes_read);
+    METRICS_COUNT(fs, compress_out, GROUP_HEADER + length);
+    TRACE_END(fs, "compress", file->name, 0, 0);
+
+    file->byte_len += bytes_read;
+    length += GROUP_HEADER;
+
+    for (uint32_t done = 0; done < length && IMFFS_OK == result; done += copy) {
+      if (!filling) {
+        if (next_free_block >= fs->block_count || !find_free_block(fs, &next_free_block)) {
+          fprintf(stderr, "Error: not enough free space on device to save '%s'.\n", file->name);
+          result = IMFFS_ERROR;
+          break;
+        }
+        // a block that dedup shares is still free, and is filled again
+        block = next_free_block;
+        fill = 0;
+        filling = TRUE;
+      }
+
+      copy = fs->block_size - fill < length - done ? fs->block_size - fill : length - done;
+      memcpy(block_address(fs, block) + fill, &group[done], copy);
+      fill += copy;
+
+      if (fs->block_size == fill) {
+        if (!keep_block(fs, block, fill, writer, cluster_start, blocks_in_cluster, extents)) {
+          fprintf(stderr, "Error writing to file '%s'.\n", file->name);
+          result = IMFFS_ERROR;
+        }
+        (*blocks)++;
+        filling = FALSE;
+      }
+    }
+  }
+
+  if (IMFFS_OK == result && !filling && 0 == *blocks) {
+    if (!find_free_block(fs, &next_free_block)) {
+      fprintf(stderr, "Error: not enough free space on device to save '%s'.\n", file->name);
+      result = IMFFS_ERROR;
+    }
+    block = next_free_block;
+    fill = 0;
+    filling = TRUE;
+  }
+  if (IMFFS_OK == result && filling) {
+    if (!keep_block(fs, block, fill, writer, cluster_start, blocks_in_cluster, extents)) {
+      fprintf(stderr, "Error writing to file '%s'.\n", file->name);
+      result = IMFFS_ERROR;
+    }
+    (*blocks)++;
+  }
+
+  free(raw);
+  free(group);
+
+  return result;
+}
+
+// Copies length bytes of a compressed file from offset to buffer, or writes
+// them to out if buffer is NULL, decompressing only the groups they're in.
+static IMFFSResult read_compressed(IMFFSPtr fs, File *file, Value *list, uint64_t offset, uint64_t length,
+                                   uint8_t *buffer, FILE *out) {
+  assert(NULL != fs && NULL != file && file->compressed);
+  assert(NULL != buffer || NULL != out);
+  assert(offset + length <= file->byte_len);
+
+  IMFFSResult result = IMFFS_OK;
+  BlockStream stream;
+  uint8_t *scratch = malloc(LZ_BOUND(COMPRESS_GROUP)), *group = malloc(COMPRESS_GROUP);
+  const uint8_t *from;
+  uint64_t group_start = 0, skip, wanted;
+  uint32_t group_length, packed_length;
+  Boolean stored;
+  int64_t unpacked;
+
+  METRICS_COUNT(fs, allocations, 2);
+  if (NULL == scratch || NULL == group) {
+    fprintf(stderr, "Error: not enough memory to read file '%s'.\n", file->name);
+    result = IMFFS_ERROR;
+  }
+
+  stream_init(&stream, list);
+  while (IMFFS_OK == result && length > 0) {
+    group_length = file->byte_len - group_start < COMPRESS_GROUP ? file->byte_len - group_start : COMPRESS_GROUP;
+    if (!stream_group(fs, &stream, &packed_length, &stored) ||
+        packed_length > (stored ? COMPRESS_GROUP : LZ_BOUND(COMPRESS_GROUP))) {
+      result = IMFFS_ERROR;
+      break;
+    }
+
+    if (offset >= group_start + group_length) {
+      // ends before the range starts
+      if (!stream_read(fs, &stream, NULL, packed_length)) {
+        result = IMFFS_ERROR;
+      }
+    } else if (NULL == (from = stream_next(fs, &stream, packed_length, scratch))) {
+      result = IMFFS_ERROR;
+    } else {
+      if (!stored) {
+#ifdef IMFFS_METRICS
+        uint64_t decompress_start = metrics_now_ns();
+#endif
+        unpacked = lz_decompress(from, packed_length, group, COMPRESS_GROUP);
+        METRICS_COUNT(fs, decompress_ns, metrics_now_ns() - decompress_start);
+        METRICS_COUNT(fs, decompress_out, group_length);
+        if (unpacked != group_length) {
+          result = IMFFS_ERROR;
+          break;
+        }
+        from = group;
+      }
+
+      skip = offset > group_start ? offset - group_start : 0;
+      wanted = group_length - skip < length ? group_length - skip : length;
+      if (NULL != buffer) {
+        memcpy(buffer, &from[skip], wanted);
+        buffer += wanted;
+      } else {
+        fwrite(&from[skip], wanted, 1, out);
+      }
+      offset += wanted;
+      length -= wanted;
+    }
+    group_start += group_length;
+  }
+  if (IMFFS_ERROR == result && NULL != scratch && NULL != group) {
+    fprintf(stderr, "Error: file '%s' is damaged.\n", file->name);
+  }
+
+  free(scratch);
+  free(group);
+
+  return result;
+}
+
+// Saves what's left of in as imffsfile; regular and size_hint say whether
+// it's a regular file and how big it was when it was opened. The contents
+// are added to a journal record as they're read, which is committed once
+// the file is in the index.
+static IMFFSResult save_stream(IMFFSPtr fs, FILE *in, char *diskfile, char *imffsfile, Boolean regular,
+                               uint64_t size_hint, uint64_t *blocks_saved, uint32_t *extents_saved,
+                               uint64_t *bytes_saved) {
+  assert(validate_fs(fs));
+  assert(NULL != in && NULL != diskfile && NULL != imffsfile);
+  assert(NULL != blocks_saved && NULL != extents_saved && NULL != bytes_saved);
+
+  IMFFSResult result = IMFFS_OK;
+  uint64_t cluster_start, next_free_block, blocks_in_cluster, blocks = 0;
+  uint32_t run, wanted, max_run, piece, extents = 0;
+  uint64_t block;
+  size_t bytes_read, inline_len = 0;
+  Boolean eof, inlined = FALSE;
+  File *file = NULL;
+  XXH64State content;
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  Value list = { 0, NULL };
+  uint64_t tail = 0;
+  uint32_t tail_len;
+  uint8_t small[IMFFS_MAX_INLINE_SIZE + 1];
+
+  max_run = MAX_RUN_BYTES / fs->block_size > 0 ? MAX_RUN_BYTES / fs->block_size : 1;
+  xxh64_init(&content, 0);
+  if (NULL != fs->journal) {
+    journal_begin(fs->journal, RECORD_SAVE);
+    journal_put_string(fs->journal, imffsfile);
+    journal_put_number(fs->journal, regular);
+    journal_put_number(fs->journal, size_hint);
+  }
+
+  // tiny files go in their File record instead of blocks
+  if (regular && fs->inline_limit > 0 && size_hint <= fs->inline_limit) {
+    TRACE_BEGIN(fs, "copy", imffsfile);
+    inline_len = fread(small, 1, fs->inline_limit + 1, in);
+    TRACE_END(fs, "copy", imffsfile, 0, 0);
+    inlined = inline_len <= fs->inline_limit && !ferror(in);
+    if (!inlined) {
+      // it grew, or couldn't be read: start again with blocks
+      inline_len = 0;
+      rewind(in);
+    }
+  }
+
+  file = malloc(sizeof(File) + inline_len);
+  METRICS_COUNT(fs, allocations, 2);
+  if (NULL != file) {
+    file->byte_len = 0;
+    file->inlined = inlined;
+    file->packed = FALSE;
+    file->compressed = FALSE;
+    file->etag = 0;
+    file->spilled = FALSE;
+    file->backing = 0;
+    file->backing_len = 0;
+    file->pins = 0;
+    file->name = malloc(strlen(imffsfile) + 1);
+    if (NULL == file->name) {
+      free(file);
+      file = NULL;
+    } else {
+      strcpy(file->name, imffsfile);
+    }
+  }
+  if (NULL == file) {
+    fprintf(stderr, "Error: not enough memory to create file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else {
+
+    if (mm_count_values(fs->index, file) > 0) {
+      fprintf(stderr, "Error: file '%s' already exists on device.\n", imffsfile);
+      result = IMFFS_ERROR;
+    } else if (inlined) {
+
+      memcpy(file->data, small, inline_len);
+      file->byte_len = inline_len;
+      save_content(fs, &content, small, inline_len);
+      file->etag = xxh64_digest(&content);
+      TRACE_BEGIN(fs, "index insert", imffsfile);
+      METRICS_COUNT(fs, allocations, 1);
+      if (mm_insert_value(fs->index, file, 0, file->data) <= 0) {
+        fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
+        result = IMFFS_ERROR;
+      }
+      TRACE_END(fs, "index insert", imffsfile, 0, 1);
+      extents = 1;
+
+    } else {
+
+      eof = FALSE;
+      cluster_start = 0;
+      next_free_block = 0;
+      blocks_in_cluster = 0;
+
+      if (fs->compression && size_hint > 0) {
+        file->compressed = TRUE;
+        result = save_compressed(fs, in, diskfile, file, &writer, &cluster_start, &blocks_in_cluster, &blocks, &extents,
+                                 &content);
+        eof = TRUE;
+      }
+
+      // one run of free blocks at a time
+      while (!eof && IMFFS_OK == result && next_free_block < fs->block_count &&
+             find_free_block(fs, &next_free_block)) {
+
+        TRACE_BEGIN(fs, "reserve", imffsfile);
+        wanted = max_run;
+        if (size_hint > file->byte_len && (size_hint - file->byte_len) >> fs->block_shift < max_run) {
+          wanted = ((size_hint - file->byte_len) >> fs->block_shift) + 1;
+        }
+        run = 1;
+        while (run < wanted && next_free_block + run < fs->block_count && BLOCK_FREE == fs->used[next_free_block + run]) {
+          run++;
+        }
+        METRICS_COUNT(fs, blocks_scanned, run - 1);
+        TRACE_END(fs, "reserve", imffsfile, run, 0);
+
+        TRACE_BEGIN(fs, "copy", imffsfile);
+        bytes_read = fread(&fs->data[next_free_block * fs->block_size], 1, (size_t)run * fs->block_size, in);
+        TRACE_END(fs, "copy", imffsfile, run, 0);
+
+        if (ferror(in)) {
+          fprintf(stderr, "Error reading from input file '%s'.\n", diskfile);
+          result = IMFFS_ERROR;
+        } else {
+          // a short read is the end of the file, which always ends with a
+          // partial (possibly empty) block
+          if (bytes_read < (size_t)run * fs->block_size) {
+            eof = TRUE;
+            run = (bytes_read >> fs->block_shift) + 1;
+          }
+          file->byte_len += bytes_read;
+          save_content(fs, &content, block_address(fs, next_free_block), bytes_read);
+
+          for (uint32_t i = 0; i < run && IMFFS_OK == result; i += piece) {
+            block = next_free_block + i;
+            piece = run - i;
+            if (fs->dedup) {
+              // one block at a time, each either new or one that's already there;
+              // the partial last block is padded so it can match too, unless
+              // it's about to become a packed tail
+              piece = 1;
+              if (eof && i == run - 1) {
+                memset(block_address(fs, block) + (bytes_read - ((size_t)i << fs->block_shift)), 0,
+                       fs->block_size - (bytes_read - ((size_t)i << fs->block_shift)));
+              }
+              if (!eof || i < run - 1 || !fs->tail_packing) {
+                block = dedup_block(fs, block);
+              }
+            }
+            use_blocks(fs, block, piece);
+            if (!add_to_cluster(fs, &writer, &cluster_start, &blocks_in_cluster, block, piece, &extents)) {
+              fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
+              result = IMFFS_ERROR;
+            }
+            blocks += piece;
+          }
+          // blocks that turned out to be duplicates are still free, and
+          // are used for what's read next
+          if (!fs->dedup) {
+            next_free_block += run;
+          }
+        }
+      }
+
+      if (IMFFS_OK == result && !eof) {
+        fprintf(stderr, "Error: not enough free space on device to save '%s'.\n", imffsfile);
+        result = IMFFS_ERROR;
+      }
+
+      // move the partial last block into a shared tail block, or drop it
+      // if it's empty; an empty file keeps its block
+      tail_len = file->byte_len & (fs->block_size - 1);
+      if (IMFFS_OK == result && fs->tail_packing && !file->compressed && file->byte_len > 0 &&
+          tail_len <= fs->block_size - sizeof(TailHeader)) {
+        assert(blocks_in_cluster > 0);
+        TRACE_BEGIN(fs, "pack", imffsfile);
+        if (0 == tail_len || tail_alloc(fs, tail_len, &tail)) {
+          uint64_t last = cluster_start + blocks_in_cluster - 1;
+          if (tail_len > 0) {
+            memcpy(&fs->data[tail], block_address(fs, last), tail_len);
+            block_changed(fs, tail >> fs->block_shift);
+          }
+          fs->used[last] = BLOCK_FREE;
+          fs->used_count--;
+          mark_changed(fs, last, FALSE);
+          if (NULL != fs->refs) {
+            fs->refs[last] = 0;
+          }
+          blocks_in_cluster--;
+          blocks--;
+          file->packed = TRUE;
+        }
+        TRACE_END(fs, "pack", imffsfile, file->packed && tail_len > 0 ? 1 : 0, 0);
+      }
+
+      if (blocks_in_cluster > 0) {
+        if (!add_extent(fs, &writer, cluster_start, blocks_in_cluster)) {
+          fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
+          result = IMFFS_ERROR;
+        }
+        extents++;
+      }
+
+      if (file->packed && tail_len > 0) {
+        // always the file's last extent
+        if (!extent_write(&writer, tail >> fs->block_shift, 0, tail & (fs->block_size - 1))) {
+          tail_release(fs, tail, tail_len);
+          file->packed = FALSE;
+          if (IMFFS_OK == result) {
+            fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
+            result = IMFFS_ERROR;
+          }
+        } else {
+          extents++;
+        }
+      }
+      extent_writer_finish(&writer, &list);
+      file->etag = xxh64_digest(&content);
+
+      if (IMFFS_OK == result) {
+        TRACE_BEGIN(fs, "index insert", imffsfile);
+        METRICS_COUNT(fs, allocations, 1);
+        if (mm_insert_value(fs->index, file, list.num, list.data) <= 0) {
+          fprintf(stderr, "Error writing to file '%s'.\n", imffsfile);
+          result = IMFFS_ERROR;
+        }
+        TRACE_END(fs, "index insert", imffsfile, blocks, extents);
+      }
+
+      if (IMFFS_ERROR == result) {
+        // the save still failed, but the blocks it had are free again
+        if (NULL != list.data) {
+          restore_free_space(fs, file, &list);
+        }
+        free(list.data);
+      }
+    }
+    if (IMFFS_OK != result && NULL != file) {
+      free(file->name);
+      free(file);
+    }
+  }
+
+  *blocks_saved = blocks;
+  *extents_saved = extents;
+  *bytes_saved = IMFFS_OK == result ? file->byte_len : 0;
+  if (IMFFS_OK == result) {
+    cache_link(fs, file);
+    mark_file(fs, imffsfile);
+  }
+  if (NULL != fs->journal) {
+    if (IMFFS_OK == result) {
+      result = commit_record(fs);
+    } else {
+      journal_abort(fs->journal);
+    }
+  }
+
+  return result;
+}
+
+// Tiering: with a backing file, a file's contents can be moved there to
+// free its blocks, spilling it, and read back into free blocks when it's
+// next used, faulting it in. A spilled file stays in the index with an
+// empty extent list, and its bytes are at backing in the backing file, as
+// they were stored: a compressed file's groups and all. Both are logged,
+// so a replay puts every file in the blocks it had.
+
+// the bytes a file takes where it's stored, in its blocks or the backing file
+static uint64_t stored_length(IMFFSPtr fs, File *file, Value *list) {
+  assert(NULL != fs && NULL != file && NULL != list);
+
+  if (file->spilled) {
+    return file->backing_len;
+  }
+  return file->compressed ? compressed_length(fs, file, list) : file->byte_len;
+}
+
+static IMFFSResult spill_file(IMFFSPtr fs, File *file) {
+  assert(validate_fs(fs) && NULL != fs->backing);
+  assert(NULL != file && !file->inlined && !file->spilled);
+
+  IMFFSResult result = IMFFS_OK;
+  ExtentReader reader;
+  Extent extent;
+  Value list;
+  uint64_t stored, offset, left, length;
+  uint8_t *from, *empty;
+
+  if (!get_extents(fs, file, &list)) {
+    fprintf(stderr, "Error: unable to spill '%s'.\n", file->name);
+    return IMFFS_ERROR;
+  }
+  stored = stored_length(fs, file, &list);
+  offset = backing_alloc(fs->backing, stored);
+
+  // the chunks in order, as a load copies them out
+  left = stored;
+  extent_reader_init(&reader, &list);
+  while (IMFFS_OK == result && left > 0 && extent_read(&reader, &extent)) {
+    if (0 == extent.count) {
+      from = &fs->data[(extent.start << fs->block_shift) + extent.offset];
+      length = left;
+    } else {
+      from = block_address(fs, extent.start);
+      length = extent.count << fs->block_shift < left ? extent.count << fs->block_shift : left;
+    }
+    if (!verify_blocks(fs, extent.start, extent.count > 0 ? extent.count : 1)) {
+      fprintf(stderr, "Error: file '%s' is damaged.\n", file->name);
+      result = IMFFS_ERROR;
+    } else if (0 != backing_write(fs->backing, offset + stored - left, from, length)) {
+      fprintf(stderr, "Error writing to the backing file.\n");
+      result = IMFFS_ERROR;
+    }
+    left -= length;
+  }
+  if (IMFFS_OK == result && left > 0) {
+    fprintf(stderr, "Error: file '%s' is damaged.\n", file->name);
+    result = IMFFS_ERROR;
+  }
+
+  // the empty list goes in before the blocks are freed, so failing leaves it as it was
+  if (IMFFS_OK == result) {
+    empty = malloc(1);
+    METRICS_COUNT(fs, allocations, 2);
+    if (NULL == empty || 1 != mm_remove_key(fs->index, file)) {
+      result = IMFFS_ERROR;
+    } else if (mm_insert_value(fs->index, file, 0, empty) <= 0) {
+      mm_insert_value(fs->index, file, list.num, list.data);
+      result = IMFFS_ERROR;
+    }
+    if (IMFFS_OK != result) {
+      fprintf(stderr, "Error: not enough memory to spill '%s'.\n", file->name);
+      free(empty);
+    }
+  }
+  if (IMFFS_OK != result) {
+    backing_release(fs->backing, offset, stored);
+    return result;
+  }
+
+  restore_free_space(fs, file, &list);
+  free(list.data);
+  cache_unlink(fs, file);
+  file->packed = FALSE;
+  file->spilled = TRUE;
+  file->backing = offset;
+  file->backing_len = stored;
+  METRICS_COUNT(fs, spills, 1);
+  METRICS_COUNT(fs, spilled_bytes, stored);
+  mark_file(fs, file->name);
+
+  return log_names(fs, RECORD_SPILL, file->name, NULL);
+}
+
+// reads a spilled file back into free blocks, the last one zero padded
+static IMFFSResult fault_in(IMFFSPtr fs, File *file) {
+  assert(validate_fs(fs) && NULL != fs->backing);
+  assert(NULL != file && file->spilled);
+
+  IMFFSResult result = IMFFS_OK;
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  Value list, new_list = { 0, NULL };
+  uint64_t count = (file->backing_len + fs->block_size - 1) >> fs->block_shift, *blocks, run, done = 0, length;
+  uint64_t cluster_start = 0, blocks_in_cluster = 0;
+  uint32_t extents = 0;
+  Boolean listed = TRUE;
+
+  blocks = malloc(count * sizeof(uint64_t) + 1);
+  METRICS_COUNT(fs, allocations, 1);
+  if (NULL == blocks || !get_extents(fs, file, &list)) {
+    fprintf(stderr, "Error: not enough memory to bring back '%s'.\n", file->name);
+    free(blocks);
+    return IMFFS_ERROR;
+  }
+  if (!reserve_blocks(fs, 0, count, blocks)) {
+    fprintf(stderr, "Error: not enough free space on device to bring back '%s'.\n", file->name);
+    free(blocks);
+    return IMFFS_ERROR;
+  }
+
+  // a run of consecutive blocks at a time
+  for (uint64_t i = 0; IMFFS_OK == result && i < count; i += run) {
+    for (run = 1; i + run < count && blocks[i + run] == blocks[i] + run; run++) {
+    }
+    length = run << fs->block_shift < file->backing_len - done ? run << fs->block_shift : file->backing_len - done;
+    if (0 != backing_read(fs->backing, file->backing + done, block_address(fs, blocks[i]), length)) {
+      fprintf(stderr, "Error reading '%s' from the backing file.\n", file->name);
+      result = IMFFS_ERROR;
+    } else {
+      memset(block_address(fs, blocks[i]) + length, 0, (run << fs->block_shift) - length);
+      listed = add_to_cluster(fs, &writer, &cluster_start, &blocks_in_cluster, blocks[i], run, &extents) && listed;
+    }
+    done += length;
+  }
+  if (IMFFS_OK == result && blocks_in_cluster > 0) {
+    listed = add_extent(fs, &writer, cluster_start, blocks_in_cluster) && listed;
+  }
+  extent_writer_finish(&writer, &new_list);
+  if (IMFFS_OK == result && (!listed || !replace_extents(fs, file, &list, &new_list))) {
+    fprintf(stderr, "Error: not enough memory to bring back '%s'.\n", file->name);
+    result = IMFFS_ERROR;
+  }
+
+  if (IMFFS_OK != result) {
+    free(new_list.data);
+    for (uint64_t i = 0; i < count; i++) {
+      fs->used[blocks[i]] = BLOCK_FREE;
+    }
+    fs->used_count -= count;
+  } else {
+    for (uint64_t i = 0; i < count; i++) {
+      if (NULL != fs->refs) {
+        fs->refs[blocks[i]] = 1;
+      }
+      block_changed(fs, blocks[i]);
+    }
+    backing_release(fs->backing, file->backing, file->backing_len);
+    file->spilled = FALSE;
+    cache_link(fs, file);
+    METRICS_COUNT(fs, faults, 1);
+    METRICS_COUNT(fs, faulted_bytes, file->backing_len);
+    mark_file(fs, file->name);
+    result = log_names(fs, RECORD_FAULT, file->name, NULL);
+  }
+  free(blocks);
+
+  return result;
+}
+
+// blocks a regular file of size bytes could take: an upper bound, before
+// dedup or compression
+static uint64_t blocks_to_save(IMFFSPtr fs, uint64_t size) {
+  assert(NULL != fs);
+
+  if (0 != fs->inline_limit && size <= fs->inline_limit) {
+    return 0;
+  }
+  if (fs->compression) {
+    // each group that doesn't get smaller still has a header
+    size += (size / COMPRESS_GROUP + 1) * sizeof(uint32_t);
+  }
+
+  return (size >> fs->block_shift) + 1;
+}
+
+// Frees blocks until needed more are free, and a key in the index if
+// new_key, taking them from the least recently used files: they're spilled
+// if there's a backing file, and in cache mode evicted (deleted) once
+// there's nothing left to spill. Both are logged, so a replay doesn't
+// depend on which files were used since.
+static IMFFSResult make_room(IMFFSPtr fs, uint64_t needed, Boolean new_key) {
+  assert(validate_fs(fs));
+
+  IMFFSResult result = IMFFS_OK;
+  File *file = fs->coldest, *next;
+  Value list;
+  Boolean short_blocks, short_key;
+  uint64_t bytes;
+  char *name;
+
+  while (IMFFS_OK == result && NULL != file) {
+    short_blocks = fs->block_count - fs->used_count < needed;
+    short_key = new_key && (uint64_t)mm_count_keys(fs->index) >= fs->block_count;
+    if (!short_blocks && (!short_key || !fs->cache)) {
+      break;
+    }
+    next = file->newer;
+
+    if (short_blocks && NULL != fs->backing && !file->inlined && get_extents(fs, file, &list) && list.num > 0) {
+      TRACE_BEGIN(fs, "spill", file->name);
+      result = spill_file(fs, file);
+      TRACE_END(fs, "spill", file->name, 0, 0);
+    } else if (fs->cache && (short_key || NULL == fs->backing)) {
+      // delete_file frees the file's own copy of its name
+      name = malloc(strlen(file->name) + 1);
+      METRICS_COUNT(fs, allocations, 1);
+      if (NULL == name) {
+        fprintf(stderr, "Error: not enough memory to evict a file.\n");
+        result = IMFFS_ERROR;
+      } else {
+        strcpy(name, file->name);
+        bytes = file->byte_len;
+        TRACE_BEGIN(fs, "evict", name);
+        result = delete_file(fs, name);
+        TRACE_END(fs, "evict", name, 0, 0);
+        METRICS_COUNT(fs, evictions, 1);
+        METRICS_COUNT(fs, evicted_bytes, bytes);
+        free(name);
+      }
+    }
+    file = next;
+  }
+
+  return result;
+}
+
+// Makes a file that's about to be used a hit in memory, faulting it in if
+// it was spilled, with colder files spilled to make room if need be. If
+// streamed isn't NULL, an uncompressed file that doesn't fit can be left
+// where it is, to be read from the backing file, and *streamed says so.
+static IMFFSResult bring_back(IMFFSPtr fs, File *file, Boolean *streamed) {
+  assert(validate_fs(fs));
+  assert(NULL != file);
+
+  IMFFSResult result = IMFFS_OK;
+  uint64_t count;
+
+  if (NULL != streamed) {
+    *streamed = FALSE;
+  }
+  if (!file->spilled) {
+    METRICS_COUNT(fs, memory_hits, 1);
+    return IMFFS_OK;
+  }
+
+  METRICS_COUNT(fs, backing_hits, 1);
+  if (NULL == fs->backing) {
+    fprintf(stderr, "Error: '%s' is in a backing file that isn't attached.\n", file->name);
+    return IMFFS_ERROR;
+  }
+  count = (file->backing_len + fs->block_size - 1) >> fs->block_shift;
+  if (fs->block_count - fs->used_count < count) {
+    if (NULL != streamed && !file->compressed) {
+      *streamed = TRUE;
+      return IMFFS_OK;
+    }
+    result = make_room(fs, count, FALSE);
+  }
+  if (IMFFS_OK == result) {
+    TRACE_BEGIN(fs, "fault", file->name);
+    result = fault_in(fs, file);
+    TRACE_END(fs, "fault", file->name, count, 1);
+  }
+
+  return result;
+}
+
+// copies length bytes of an uncompressed spilled file from offset straight
+// from the backing file, to buffer, or to out if it's NULL
+static IMFFSResult read_spilled(IMFFSPtr fs, File *file, uint64_t offset, uint64_t length, uint8_t *buffer,
+                                FILE *out) {
+  assert(validate_fs(fs) && NULL != fs->backing);
+  assert(NULL != file && file->spilled && !file->compressed);
+  assert(NULL != buffer || NULL != out);
+  assert(offset + length <= file->byte_len);
+
+  uint8_t *chunk = buffer;
+  uint64_t wanted;
+
+  if (NULL == buffer) {
+    chunk = malloc(SPILL_CHUNK);
+    METRICS_COUNT(fs, allocations, 1);
+    if (NULL == chunk) {
+      fprintf(stderr, "Error: not enough memory to read file '%s'.\n", file->name);
+      return IMFFS_ERROR;
+    }
+  }
+
+  while (length > 0) {
+    wanted = NULL != buffer || length < SPILL_CHUNK ? length : SPILL_CHUNK;
+    if (0 != backing_read(fs->backing, file->backing + offset, chunk, wanted)) {
+      fprintf(stderr, "Error reading '%s' from the backing file.\n", file->name);
+      break;
+    }
+    if (NULL != out) {
+      fwrite(chunk, wanted, 1, out);
+    }
+    offset += wanted;
+    length -= wanted;
+  }
+  if (NULL == buffer) {
+    free(chunk);
+  }
+
+  return 0 == length ? IMFFS_OK : IMFFS_ERROR;
+}
+
+// a save once in is open: makes room for a regular file of size bytes, then saves it
+static IMFFSResult save_opened(IMFFSPtr fs, FILE *in, char *diskfile, char *imffsfile, Boolean regular, uint64_t size,
+                               uint64_t *blocks, uint32_t *extents, uint64_t *bytes) {
+  IMFFSResult result = IMFFS_OK;
+  uint64_t needed;
+
+  if ((fs->cache || NULL != fs->backing) && regular) {
+    // nothing is made room for a file the device couldn't hold if it were
+    // empty, or that's already there
+    needed = blocks_to_save(fs, size);
+    if (needed <= fs->block_count && NULL == find_matching_file(fs->index, imffsfile)) {
+      result = make_room(fs, needed, TRUE);
+    }
+  }
+  if (IMFFS_OK == result) {
+    result = save_stream(fs, in, diskfile, imffsfile, regular, regular ? size : 0, blocks, extents, bytes);
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != diskfile);
+  assert(NULL != imffsfile);
+
+  FILE *in;
+  IMFFSResult result = IMFFS_OK;
+  uint64_t blocks = 0, bytes = 0;
+  uint32_t extents = 0;
+  struct stat st;
+  Boolean regular;
+
+  if (NULL == fs || NULL == diskfile || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "save", imffsfile);
+
+  if (NULL == (in = open_traced(fs, diskfile, "r", imffsfile))) {
+    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
+    result = IMFFS_ERROR;
+  } else {
+    // the size is only a hint: the file may still change while it's being read
+    regular = 0 == fstat(fileno(in), &st) && S_ISREG(st.st_mode);
+    result = save_opened(fs, in, diskfile, imffsfile, regular, regular ? (uint64_t)st.st_size : 0, &blocks, &extents,
+                         &bytes);
+    fclose(in);
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "save", imffsfile, blocks, extents);
+  METRICS_END(fs, METRIC_SAVE, result, bytes);
+
+  return result;
+}
+
+IMFFSResult imffs_put(IMFFSPtr fs, char *imffsfile, const void *buffer, uint64_t length) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+  assert(NULL != buffer || 0 == length);
+
+  FILE *in;
+  IMFFSResult result = IMFFS_OK;
+  uint64_t blocks = 0, bytes = 0;
+  uint32_t extents = 0;
+
+  if (NULL == fs || NULL == imffsfile || (NULL == buffer && length > 0)) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "save", imffsfile);
+
+  // read like a regular file of that size; not every fmemopen takes an empty buffer
+  in = length > 0 ? fmemopen((void *)buffer, length, "r") : fopen("/dev/null", "r");
+  if (NULL == in) {
+    fprintf(stderr, "Error: not enough memory to save '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else {
+    result = save_opened(fs, in, imffsfile, imffsfile, TRUE, length, &blocks, &extents, &bytes);
+    fclose(in);
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "save", imffsfile, blocks, extents);
+  METRICS_END(fs, METRIC_SAVE, result, bytes);
+
+  return result;
+}
+
+IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile) {
+  assert(validate_fs(fs));
+  assert(NULL != diskfile);
+  assert(NULL != imffsfile);
+
+  IMFFSResult result = IMFFS_OK;
+  FILE *out;
+  File temp_file = { imffsfile, 0 }, *file;
+  ExtentReader reader;
+  Extent extent;
+  Value list;
+  int num_values, chunks = 0;
+  uint64_t length, length_remaining, blocks = 0;
+  uint8_t *from;
+  Boolean streamed;
+
+  if (NULL == fs || NULL == diskfile || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "load", imffsfile);
+
+  num_values = mm_count_values(fs->index, &temp_file);
+  if (num_values <= 0) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    assert(NULL != file);
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+    
+  } else if (IMFFS_OK != (result = bring_back(fs, file, &streamed))) {
+    // already reported
+
+  } else if (!get_extents(fs, file, &list)) {
+    fprintf(stderr, "Error: unable read from file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else if (NULL == (out = open_traced(fs, diskfile, "w", imffsfile))) {
+    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
+    result = IMFFS_ERROR;
+
+  } else {
+
+    cache_touch(fs, file);
+    length_remaining = file->byte_len;
+    extent_reader_init(&reader, &list);
+
+    TRACE_BEGIN(fs, "copy", imffsfile);
+    if (streamed) {
+      result = read_spilled(fs, file, 0, file->byte_len, NULL, out);
+      length_remaining = 0;
+      chunks = 1;
+    } else if (file->inlined) {
+      fwrite(file->data, length_remaining, 1, out);
+      length_remaining = 0;
+      chunks = 1;
+    } else if (file->compressed) {
+      result = read_compressed(fs, file, &list, 0, file->byte_len, NULL, out);
+      length_remaining = 0;
+      chunks = file_chunks(file, &list);
+    }
+    while (IMFFS_OK == result && !file->compressed && !ferror(out) && extent_read(&reader, &extent)) {
+      assert(extent.count > 0 || file->packed);
+
+      // one cluster at a time, then a packed tail
+      if (0 == extent.count) {
+        from = &fs->data[(extent.start << fs->block_shift) + extent.offset];
+        length = length_remaining;
+      } else {
+        from = block_address(fs, extent.start);
+        length = extent.count << fs->block_shift;
+      }
+      if (length_remaining < length) {
+        length = length_remaining;
+      }
+      if (!verify_blocks(fs, extent.start, extent.count > 0 ? extent.count : 1)) {
+        fprintf(stderr, "Error: file '%s' is damaged.\n", imffsfile);
+        result = IMFFS_ERROR;
+        break;
+      }
+      fwrite(from, length, 1, out);
+      length_remaining -= length;
+      blocks += extent.count;
+      chunks++;
+    }
+    if (ferror(out)) {
+      fprintf(stderr, "Error writing to file '%s'.\n", diskfile);
+      result = IMFFS_ERROR;
+    }
+    TRACE_END(fs, "copy", imffsfile, blocks, chunks);
+
+    assert(IMFFS_OK != result || 0 == length_remaining);
+
+    fclose(out);
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "load", imffsfile, blocks, chunks);
+  METRICS_END(fs, METRIC_LOAD, result, IMFFS_OK == result ? file->byte_len : 0);
+
+  return result;
+}
+
+static IMFFSResult delete_file(IMFFSPtr fs, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+  
+  IMFFSResult result = IMFFS_OK;
+  int num_values;
+  Value list;
+  
+  File temp_file = { imffsfile, 0 };
+  File *file;
+
+  num_values = mm_count_values(fs->index, &temp_file);
+
+  if (num_values <= 0) {
+    fprintf(stderr, "Error: file not found '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    assert(NULL != file);
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else if (!get_extents(fs, file, &list) || num_values != mm_remove_key(fs->index, file)) {
+    fprintf(stderr, "Error: unable to delete '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else {
+
+    restore_free_space(fs, file, &list);
+    if (!file->inlined) {
+      free(list.data);
+    }
+    if (file->spilled && NULL != fs->backing) {
+      backing_release(fs->backing, file->backing, file->backing_len);
+    }
+    cache_unlink(fs, file);
+    free(file->name);
+    free(file);
+    mark_file(fs, imffsfile);
+    result = log_names(fs, RECORD_DELETE, imffsfile, NULL);
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_read(IMFFSPtr fs, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                       uint64_t *bytes_read) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+  assert(NULL != buffer || 0 == length);
+  assert(NULL != bytes_read);
+
+  IMFFSResult result = IMFFS_OK;
+  File *file;
+  ExtentReader reader;
+  Extent extent;
+  Value list;
+  uint64_t pos = 0, copied = 0, chunk_length, skip, wanted;
+  const uint8_t *from;
+  Boolean streamed;
+
+  if (NULL == fs || NULL == imffsfile || (NULL == buffer && length > 0) || NULL == bytes_read) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "read", imffsfile);
+  *bytes_read = 0;
+
+  if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else if (IMFFS_OK != (result = bring_back(fs, file, &streamed))) {
+    // already reported
+
+  } else if (!get_extents(fs, file, &list)) {
+    fprintf(stderr, "Error: unable read from file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+
+  } else {
+
+    cache_touch(fs, file);
+    if (offset > file->byte_len) {
+      offset = file->byte_len;
+    }
+    if (length > file->byte_len - offset) {
+      length = file->byte_len - offset;
+    }
+
+    if (streamed) {
+      result = read_spilled(fs, file, offset, length, buffer, NULL);
+    } else if (file->inlined) {
+      memcpy(buffer, &file->data[offset], length);
+    } else if (file->compressed) {
+      result = read_compressed(fs, file, &list, offset, length, buffer, NULL);
+    } else {
+      // chunks before offset are skipped, then a packed tail is the last one
+      extent_reader_init(&reader, &list);
+      while (copied < length && extent_read(&reader, &extent)) {
+        if (0 == extent.count) {
+          from = &fs->data[(extent.start << fs->block_shift) + extent.offset];
+          chunk_length = tail_length(fs, file);
+        } else {
+          from = block_address(fs, extent.start);
+          chunk_length = extent.count << fs->block_shift;
+        }
+        if (offset < pos + chunk_length) {
+          skip = offset - pos;
+          wanted = chunk_length - skip < length - copied ? chunk_length - skip : length - copied;
+          // only the blocks the range is in
+          if (0 == extent.count ? !verify_block(fs, extent.start) :
+              !verify_blocks(fs, extent.start + (skip >> fs->block_shift),
+                             ((skip + wanted - 1) >> fs->block_shift) - (skip >> fs->block_shift) + 1)) {
+            fprintf(stderr, "Error: file '%s' is damaged.\n", imffsfile);
+            result = IMFFS_ERROR;
+            break;
+          }
+          memcpy((uint8_t *)buffer + copied, &from[skip], wanted);
+          copied += wanted;
+          offset += wanted;
+        }
+        pos += chunk_length;
+      }
+      assert(IMFFS_OK != result || copied == length);
+    }
+
+    if (IMFFS_OK == result) {
+      *bytes_read = length;
+    }
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "read", imffsfile, 0, 0);
+  METRICS_END(fs, METRIC_READ, result, *bytes_read);
+
+  return result;
+}
+
+IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+
+  IMFFSResult result;
+
+  if (NULL == fs || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "delete", imffsfile);
+  result = delete_file(fs, imffsfile);
+  share_changes(fs);
+  TRACE_END(fs, "delete", imffsfile, 0, 0);
+  METRICS_END(fs, METRIC_DELETE, result, 0);
+
+  return result;
+}
+
+IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsold);
+  assert(NULL != imffsnew);
+
+  IMFFSResult result = IMFFS_OK;
+
+  if (NULL == fs || NULL == imffsold || NULL == imffsnew) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "rename", imffsold);
+
+  File new_file = { imffsnew, 0 };
+  File *file = find_matching_file(fs->index, imffsold);
+
+  if (NULL == file) {
+    fprintf(stderr, "Error: file '%s' doesn't exist.\n", imffsold);
+    result = IMFFS_ERROR;
+
+  } else if (0 != mm_count_values(fs->index, &new_file)) {
+    fprintf(stderr, "Error: file '%s' already exists.\n", imffsnew);
+    result = IMFFS_ERROR;
+
+  } else {
+
+    char *temp_name;
+    Value list;
+
+    // the extents don't change, only where the file is in the index
+    if (!get_extents(fs, file, &list) || 1 != mm_remove_key(fs->index, file)) {
+      result = IMFFS_ERROR;
+    } else {
+
+      temp_name = malloc(strlen(imffsnew) + 1);
+      METRICS_COUNT(fs, allocations, 2);
+      if (NULL != temp_name) {
+        strcpy(temp_name, imffsnew);
+        free(file->name);
+        file->name = temp_name;
+      }
+
+      // without memory for the new name it's put back as it was
+      if (mm_insert_value(fs->index, file, list.num, list.data) <= 0 || NULL == temp_name) {
+        result = IMFFS_ERROR;
+      }
+    }
+    
+    if (IMFFS_OK != result) {
+      fprintf(stderr, "Error: unable to rename '%s' to '%s'.\n", imffsold, imffsnew);
+    } else {
+      mark_file(fs, imffsold);
+      mark_file(fs, imffsnew);
+      result = log_names(fs, RECORD_RENAME, imffsold, imffsnew);
+    }
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "rename", imffsnew, 0, 0);
+  METRICS_END(fs, METRIC_RENAME, result, 0);
+
+  return result;
+}
+
+static uint64_t count_and_maybe_print_blocks(IMFFSPtr fs, File *file, Boolean print, int *chunks) {
+  assert(NULL != fs && NULL != file && NULL != chunks);
+  
+  ExtentReader reader;
+  Extent extent;
+  Value list;
+  uint64_t blocks = 0;
+  
+  *chunks = 0;
+  if (!get_extents(fs, file, &list)) {
+    return 0;
+  }
+  if (file->inlined) {
+    if (print) {
+      printf("          | %6d | %6d | %p\n", 0, 0, (void *)file->data);
+    }
+    *chunks = 1;
+  }
+  if (file->spilled && print) {
+    printf("          |  spill | %6d | backing file +%llu, %llu bytes\n", 0, (unsigned long long)file->backing,
+           (unsigned long long)file->backing_len);
+  }
+
+  extent_reader_init(&reader, &list);
+  while (extent_read(&reader, &extent)) {
+    blocks += extent.count;
+    if (print && 0 == extent.count) {
+      printf("          |   tail | %6d | %p (block %llu +%u, %u bytes)\n", *chunks,
+             (void *)&fs->data[(extent.start << fs->block_shift) + extent.offset],
+             (unsigned long long)extent.start, extent.offset, tail_length(fs, file));
+    } else if (print) {
+      printf("          | %6lld | %6d | %p\n", (long long)extent.count, *chunks, (void *)block_address(fs, extent.start));
+    }
+    (*chunks)++;
+  }
+
+  return blocks;
+}
+
+static IMFFSResult imffs_dir_both(IMFFSPtr fs, Boolean full) {
+  assert(validate_fs(fs));
+
+  void *key;
+  File *file;
+  Value list;
+  uint64_t total_bytes = 0, stored_bytes = 0, blocks, stored;
+  Boolean compressed = FALSE;
+  int chunks;
+  
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "dir", NULL);
+
+  printf("----------+--------+--------+------------\n");
+
+  printf("    Bytes | Blocks | Chunks | Filename\n");
+
+  printf("----------+--------+--------+------------\n");
+
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+
+      file = key;
+
+      if (full) {
+        blocks = count_and_maybe_print_blocks(fs, file, TRUE, &chunks);
+      } else {
+        blocks = count_and_maybe_print_blocks(fs, file, FALSE, &chunks);
+      }
+
+      // a compressed file also shows how much it takes
+      stored = file->byte_len;
+      if (file->compressed && get_extents(fs, file, &list)) {
+        stored = stored_length(fs, file, &list);
+        compressed = TRUE;
+        printf("%9llu | %6llu | %6d | %s (compressed to %llu bytes)\n", (unsigned long long)file->byte_len,
+               (unsigned long long)blocks, chunks, file->name, (unsigned long long)stored);
+      } else if (full) {
+        printf("%9llu | %6llu | %6d | %s (etag %016llx)\n", (unsigned long long)file->byte_len,
+               (unsigned long long)blocks, chunks, file->name, (unsigned long long)file->etag);
+      } else {
+        printf("%9llu | %6llu | %6d | %s\n", (unsigned long long)file->byte_len, (unsigned long long)blocks, chunks, file->name);
+      }
+      total_bytes += file->byte_len;
+      stored_bytes += stored;
+      
+      if (full) {
+        printf("----------+--------+--------+------------\n");
+      }
+      
+    } while (mm_get_next_key(fs->index, &key) > 0);
+
+    if (!full) {
+      printf("----------+--------+--------+------------\n");
+    }
+  }
+
+  // printf("%s\n", fs->used);
+  printf("\nTotal bytes: %llu\n", (unsigned long long)total_bytes);
+  if (compressed) {
+    printf("Stored bytes: %llu\n", (unsigned long long)stored_bytes);
+  }
+
+  TRACE_END(fs, "dir", NULL, 0, 0);
+  METRICS_END(fs, METRIC_DIR, IMFFS_OK, 0);
+  
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_dir(IMFFSPtr fs) {
+  return imffs_dir_both(fs, FALSE);
+}
+
+IMFFSResult imffs_fulldir(IMFFSPtr fs) {
+  return imffs_dir_both(fs, TRUE);
+}
+
+IMFFSResult imffs_list(IMFFSPtr fs, IMFFSLister lister, void *context) {
+  assert(validate_fs(fs));
+  assert(NULL != lister);
+
+  File *file;
+  void *key;
+
+  if (NULL == fs || NULL == lister) {
+    return IMFFS_INVALID;
+  }
+
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      file = key;
+      lister(file->name, file->byte_len, context);
+    } while (mm_get_next_key(fs->index, &key) > 0);
+  }
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_stat(IMFFSPtr fs, char *imffsfile, IMFFSStat *stat) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+  assert(NULL != stat);
+
+  IMFFSResult result = IMFFS_OK;
+  File *file;
+  Value list;
+  int chunks;
+
+  if (NULL == fs || NULL == imffsfile || NULL == stat) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "stat", imffsfile);
+
+  if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else {
+    stat->byte_len = file->byte_len;
+    stat->etag = file->etag;
+    stat->blocks = count_and_maybe_print_blocks(fs, file, FALSE, &chunks);
+    stat->extents = chunks;
+    stat->stored_bytes = file->byte_len;
+    if ((file->compressed || file->spilled) && get_extents(fs, file, &list)) {
+      stat->stored_bytes = stored_length(fs, file, &list);
+    }
+    stat->inlined = file->inlined;
+    stat->packed = file->packed;
+    stat->compressed = file->compressed;
+    stat->spilled = file->spilled;
+  }
+
+  TRACE_END(fs, "stat", imffsfile, 0, 0);
+  METRICS_END(fs, METRIC_STAT, result, 0);
+
+  return result;
+}
+
+// the etag the file would have if it were saved now, with its size
+static IMFFSResult hash_disk_file(IMFFSPtr fs, FILE *in, char *diskfile, uint64_t *etag, uint64_t *len) {
+  assert(NULL != fs && NULL != in && NULL != etag && NULL != len);
+
+  IMFFSResult result = IMFFS_OK;
+  XXH64State content;
+  uint8_t *buffer = malloc(MAX_RUN_BYTES);
+  size_t bytes_read;
+
+  METRICS_COUNT(fs, allocations, 1);
+  xxh64_init(&content, 0);
+  *len = 0;
+  if (NULL == buffer) {
+    fprintf(stderr, "Error: not enough memory to read external file '%s'.\n", diskfile);
+    result = IMFFS_ERROR;
+  }
+  while (IMFFS_OK == result && (bytes_read = fread(buffer, 1, MAX_RUN_BYTES, in)) > 0) {
+    hash_content(fs, &content, buffer, bytes_read);
+    *len += bytes_read;
+  }
+  if (IMFFS_OK == result && ferror(in)) {
+    fprintf(stderr, "Error reading from input file '%s'.\n", diskfile);
+    result = IMFFS_ERROR;
+  }
+  *etag = xxh64_digest(&content);
+  free(buffer);
+
+  return result;
+}
+
+// a name no file has, for the new copy of a file while the old one is kept
+static void staging_name(IMFFSPtr fs, char *name) {
+  assert(NULL != fs && NULL != name);
+
+  snprintf(name, MAX_STAGING_NAME, "%s", TEMP_FILE);
+  for (uint32_t i = 1; NULL != find_matching_file(fs->index, name); i++) {
+    snprintf(name, MAX_STAGING_NAME, "%s%u", TEMP_FILE, i);
+  }
+}
+
+IMFFSResult imffs_update(IMFFSPtr fs, char *diskfile, char *imffsfile, int *changed) {
+  assert(validate_fs(fs));
+  assert(NULL != diskfile);
+  assert(NULL != imffsfile);
+  assert(NULL != changed);
+
+  IMFFSResult result = IMFFS_OK;
+  File *file;
+  FILE *in;
+  struct stat st;
+  uint64_t etag = 0, len = 0;
+  char staged[MAX_STAGING_NAME];
+
+  if (NULL == fs || NULL == diskfile || NULL == imffsfile || NULL == changed) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "update", imffsfile);
+  *changed = 1;
+
+  if (NULL != (file = find_matching_file(fs->index, imffsfile))) {
+    if (NULL == (in = open_traced(fs, diskfile, "r", imffsfile))) {
+      fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
+      result = IMFFS_ERROR;
+    } else {
+      // a file of another size has changed without reading it, and one
+      // that isn't a regular file can't be read twice
+      if (0 == fstat(fileno(in), &st) && S_ISREG(st.st_mode) && (uint64_t)st.st_size == file->byte_len) {
+        TRACE_BEGIN(fs, "hash", imffsfile);
+        result = hash_disk_file(fs, in, diskfile, &etag, &len);
+        TRACE_END(fs, "hash", imffsfile, 0, 0);
+        *changed = IMFFS_OK != result || len != file->byte_len || etag != file->etag;
+      }
+      fclose(in);
+    }
+  }
+
+  // the new copy is saved before the old one goes, so a failed save
+  // leaves the file as it was
+  if (IMFFS_OK == result && *changed) {
+    if (NULL == file) {
+      result = imffs_save(fs, diskfile, imffsfile);
+    } else {
+      // making room for the new copy mustn't evict the old one
+      cache_unlink(fs, file);
+      file->pins++;
+      staging_name(fs, staged);
+      result = imffs_save(fs, diskfile, staged);
+      file->pins--;
+      cache_link(fs, file);
+      if (IMFFS_OK == result) {
+        result = delete_file(fs, imffsfile);
+      }
+      if (IMFFS_OK == result) {
+        result = imffs_rename(fs, staged, imffsfile);
+      }
+    }
+  }
+  METRICS_COUNT(fs, unchanged_saves, *changed ? 0 : 1);
+
+  share_changes(fs);
+  TRACE_END(fs, "update", imffsfile, 0, 0);
+  METRICS_END(fs, METRIC_UPDATE, result, len);
+
+  return result;
+}
+
+// swaps a file's extent list for a new one, and frees the old one
+static Boolean replace_extents(IMFFSPtr fs, File *file, Value *old_list, Value *new_list) {
+  assert(validate_fs(fs));
+  assert(NULL != file && NULL != old_list && NULL != new_list);
+
+  METRICS_COUNT(fs, allocations, 1);
+  if (1 != mm_remove_key(fs->index, file)) {
+    return FALSE;
+  }
+  if (mm_insert_value(fs->index, file, new_list->num, new_list->data) <= 0) {
+    // put back as it was
+    mm_insert_value(fs->index, file, old_list->num, old_list->data);
+    return FALSE;
+  }
+  if (!file->inlined) {
+    free(old_list->data);
+  }
+
+  return TRUE;
+}
+
+IMFFSResult imffs_clone(IMFFSPtr fs, char *imffssrc, char *imffsdst) {
+  assert(validate_fs(fs));
+  assert(NULL != imffssrc);
+  assert(NULL != imffsdst);
+
+  IMFFSResult result = IMFFS_OK;
+  File *src, *dst = NULL, new_file = { imffsdst, 0 };
+  ExtentReader reader;
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  Extent extent;
+  Value list, copy = { 0, NULL };
+  uint64_t blocks = 0, tail = 0;
+  uint32_t tail_len = 0, extents = 0;
+
+  if (NULL == fs || NULL == imffssrc || NULL == imffsdst) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "clone", imffssrc);
+
+  if (NULL == (src = find_matching_file(fs->index, imffssrc))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffssrc);
+    result = IMFFS_ERROR;
+  } else if (0 != mm_count_values(fs->index, &new_file)) {
+    fprintf(stderr, "Error: file '%s' already exists.\n", imffsdst);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK != (result = bring_back(fs, src, NULL))) {
+    // already reported
+  } else if (!get_extents(fs, src, &list) || (!src->inlined && !count_refs(fs))) {
+    fprintf(stderr, "Error: unable to clone '%s'.\n", imffssrc);
+    result = IMFFS_ERROR;
+  } else {
+
+    // a block shared by as many files as a count holds can't be shared again
+    extent_reader_init(&reader, &list);
+    while (IMFFS_OK == result && !src->inlined && extent_read(&reader, &extent)) {
+      for (uint64_t j = 0; j < extent.count; j++) {
+        if (UINT32_MAX == fs->refs[extent.start + j]) {
+          fprintf(stderr, "Error: '%s' is shared by too many files to clone.\n", imffssrc);
+          result = IMFFS_ERROR;
+          break;
+        }
+      }
+    }
+
+    dst = malloc(sizeof(File) + (src->inlined ? src->byte_len : 0));
+    METRICS_COUNT(fs, allocations, 3);
+    if (NULL != dst) {
+      memcpy(dst, src, sizeof(File) + (src->inlined ? src->byte_len : 0));
+      dst->spilled = FALSE;
+      dst->pins = 0;
+      dst->name = malloc(strlen(imffsdst) + 1);
+      if (NULL != dst->name) {
+        strcpy(dst->name, imffsdst);
+      }
+    }
+
+    // the list is copied as it is, except that a packed tail is copied to
+    // a tail of its own
+    tail_len = tail_length(fs, src);
+    if (IMFFS_OK == result && (NULL == dst || NULL == dst->name)) {
+      fprintf(stderr, "Error: not enough memory to clone '%s'.\n", imffssrc);
+      result = IMFFS_ERROR;
+    }
+    if (IMFFS_OK != result) {
+      // nothing to undo
+    } else if (src->inlined) {
+      copy.data = dst->data;
+      extents = 1;
+    } else if (tail_len > 0 && !tail_alloc(fs, tail_len, &tail)) {
+      fprintf(stderr, "Error: not enough free space on device to clone '%s'.\n", imffssrc);
+      result = IMFFS_ERROR;
+    } else {
+      extent_reader_init(&reader, &list);
+      while (IMFFS_OK == result && extent_read(&reader, &extent)) {
+        if (0 == extent.count) {
+          memcpy(&fs->data[tail], &fs->data[(extent.start << fs->block_shift) + extent.offset], tail_len);
+          block_changed(fs, tail >> fs->block_shift);
+          extent.start = tail >> fs->block_shift;
+          extent.offset = tail & (fs->block_size - 1);
+        }
+        if (!extent_write(&writer, extent.start, extent.count, extent.offset)) {
+          fprintf(stderr, "Error: not enough memory to clone '%s'.\n", imffssrc);
+          result = IMFFS_ERROR;
+        }
+        blocks += extent.count;
+        extents++;
+      }
+      extent_writer_finish(&writer, &copy);
+      if (IMFFS_OK != result && tail_len > 0) {
+        tail_release(fs, tail, tail_len);
+      }
+    }
+
+    if (IMFFS_OK == result) {
+      METRICS_COUNT(fs, allocations, 1);
+      if (mm_insert_value(fs->index, dst, copy.num, copy.data) <= 0) {
+        fprintf(stderr, "Error: unable to clone '%s'.\n", imffssrc);
+        if (tail_len > 0) {
+          tail_release(fs, tail, tail_len);
+        }
+        result = IMFFS_ERROR;
+      }
+    }
+
+    // only now that nothing can fail are the blocks shared
+    if (IMFFS_OK == result && !src->inlined) {
+      extent_reader_init(&reader, &list);
+      while (extent_read(&reader, &extent)) {
+        for (uint64_t j = 0; j < extent.count; j++) {
+          fs->refs[extent.start + j]++;
+          mark_changed(fs, extent.start + j, FALSE);
+        }
+      }
+      METRICS_COUNT(fs, cloned_blocks, blocks);
+    }
+
+    if (IMFFS_OK != result) {
+      if (!src->inlined) {
+        free(copy.data);
+      }
+      if (NULL != dst) {
+        free(dst->name);
+        free(dst);
+      }
+    } else {
+      cache_link(fs, dst);
+      mark_file(fs, imffsdst);
+      result = log_names(fs, RECORD_CLONE, imffssrc, imffsdst);
+    }
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "clone", imffsdst, blocks, extents);
+  METRICS_END(fs, METRIC_CLONE, result, 0);
+
+  return result;
+}
+
+// marks count free blocks used, looking from near to the end of the device
+// and then from the start; none are marked if there aren't that many
+static Boolean reserve_blocks(IMFFSPtr fs, uint64_t near, uint64_t count, uint64_t *blocks) {
+  assert(validate_fs(fs));
+  assert(NULL != blocks || 0 == count);
+
+  uint64_t found = 0, pos, stop = fs->block_count;
+
+  // past the end, as after a file in the last block, is the start
+  if (near >= fs->block_count) {
+    near = 0;
+  }
+  pos = near;
+
+  while (found < count) {
+    if (pos >= stop || !find_free_block(fs, &pos) || pos >= stop) {
+      if (stop != fs->block_count || 0 == near) {
+        break;
+      }
+      // once round, up to where it started
+      stop = near;
+      pos = 0;
+      continue;
+    }
+    fs->used[pos] = BLOCK_USED;
+    fs->used_count++;
+    mark_changed(fs, pos, FALSE);
+    blocks[found++] = pos++;
+  }
+
+  if (found < count) {
+    for (uint64_t i = 0; i < found; i++) {
+      fs->used[blocks[i]] = BLOCK_FREE;
+    }
+    fs->used_count -= found;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// the etag of a file stored in whole blocks, from its contents
+static uint64_t hash_blocks(IMFFSPtr fs, uint64_t byte_len, Value *list) {
+  assert(validate_fs(fs));
+  assert(NULL != list);
+
+  XXH64State content;
+  ExtentReader reader;
+  Extent extent;
+  uint64_t left = byte_len, len;
+
+  xxh64_init(&content, 0);
+  extent_reader_init(&reader, list);
+  while (left > 0 && extent_read(&reader, &extent)) {
+    len = extent.count << fs->block_shift < left ? extent.count << fs->block_shift : left;
+    hash_content(fs, &content, block_address(fs, extent.start), len);
+    left -= len;
+  }
+
+  return xxh64_digest(&content);
+}
+
+// copies the part of [offset, offset + length) that's in block index of a
+// file to where that block is stored
+static void write_piece(IMFFSPtr fs, uint64_t block, uint64_t index, uint64_t offset, const uint8_t *buffer,
+                        uint64_t length) {
+  uint64_t first = index << fs->block_shift, from, to;
+
+  from = offset > first ? offset : first;
+  to = offset + length < first + fs->block_size ? offset + length : first + fs->block_size;
+  if (from < to) {
+    memcpy(block_address(fs, block) + (from - first), &buffer[from - offset], to - from);
+  }
+}
+
+IMFFSResult imffs_write(IMFFSPtr fs, char *imffsfile, uint64_t offset, const void *buffer, uint64_t length) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+  assert(NULL != buffer || 0 == length);
+
+  IMFFSResult result = IMFFS_OK;
+  File *file;
+  ExtentReader reader;
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  Extent extent;
+  Value list, new_list = { 0, NULL };
+  uint64_t new_len, kept, needed, first, last, index = 0, shared = 0, chunks = 0, near = 0, used = 0, block;
+  uint64_t cluster_start = 0, blocks_in_cluster = 0, extra_len = 0, piece, *fresh = NULL, *sources = NULL;
+  uint32_t extents = 0;
+  const uint8_t *extra = NULL, *bytes = buffer;
+  Boolean listed = TRUE;
+
+  if (NULL == fs || NULL == imffsfile || (NULL == buffer && length > 0)) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "write", imffsfile);
+
+  if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (file->compressed) {
+    fprintf(stderr, "Error: compressed file '%s' can't be written.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (offset > file->byte_len || length > UINT64_MAX - offset) {
+    fprintf(stderr, "Error: can't write past the end of '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK != (result = bring_back(fs, file, NULL))) {
+    // already reported
+  } else if (!get_extents(fs, file, &list)) {
+    fprintf(stderr, "Error: unable to write to '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (length > 0 && file->inlined && offset + length <= file->byte_len) {
+    memcpy(&file->data[offset], bytes, length);
+    file->etag = xxh64(file->data, file->byte_len, 0);
+  } else if (length > 0) {
+
+    // Afterwards the file is in whole blocks, the last one partial, like a
+    // file saved without inlining or tail packing. Blocks it shares that
+    // the write touches are copied first, and an inline file's contents or
+    // a packed tail go at the start of the first new blocks.
+    new_len = offset + length > file->byte_len ? offset + length : file->byte_len;
+    needed = (new_len >> fs->block_shift) + 1;
+    first = offset >> fs->block_shift;
+    last = (offset + length - 1) >> fs->block_shift;
+    extent_reader_init(&reader, &list);
+    while (extent_read(&reader, &extent)) {
+      for (uint64_t j = 0; j < extent.count; j++, index++) {
+        if (index >= first && index <= last) {
+          if (NULL != fs->refs && fs->refs[extent.start + j] > 1) {
+            shared++;
+          }
+          // a damaged block isn't checksummed again as if it were whole
+          if (!verify_block(fs, extent.start + j)) {
+            result = IMFFS_ERROR;
+          }
+        }
+      }
+      if (extent.count > 0) {
+        near = extent.start + extent.count;
+      } else {
+        extra = &fs->data[(extent.start << fs->block_shift) + extent.offset];
+        extra_len = tail_length(fs, file);
+        if (!verify_block(fs, extent.start)) {
+          result = IMFFS_ERROR;
+        }
+      }
+      chunks++;
+    }
+    if (file->inlined) {
+      extra = file->data;
+      extra_len = file->byte_len;
+    }
+    kept = index;
+    assert(needed >= kept);
+
+    // the blocks reserved, then the shared ones the first of them copy
+    fresh = malloc((shared + shared + needed - kept) * sizeof(uint64_t) + 1);
+    sources = NULL != fresh ? &fresh[shared + needed - kept] : NULL;
+    writer.capacity = (chunks + shared + 3) * MAX_EXTENT_BYTES;
+    writer.bytes = malloc(writer.capacity);
+    METRICS_COUNT(fs, allocations, 2);
+    if (IMFFS_OK != result) {
+      fprintf(stderr, "Error: file '%s' is damaged.\n", imffsfile);
+    } else if (NULL == fresh || NULL == writer.bytes) {
+      fprintf(stderr, "Error: not enough memory to write to '%s'.\n", imffsfile);
+      result = IMFFS_ERROR;
+    } else if (!reserve_blocks(fs, near, shared + needed - kept, fresh)) {
+      fprintf(stderr, "Error: not enough free space on device to write to '%s'.\n", imffsfile);
+      result = IMFFS_ERROR;
+    } else {
+
+      // The new list goes in before any block changes, so that when it
+      // can't, giving the reserved blocks back leaves the file as it was:
+      // the file's own blocks, with the ones the write touches split out,
+      // and copies of the shared ones it touches
+      index = 0;
+      extent_reader_init(&reader, &list);
+      while (extent_read(&reader, &extent)) {
+        if (0 == extent.count) {
+          continue;
+        }
+        if (index + extent.count <= first || index > last) {
+          listed = add_to_cluster(fs, &writer, &cluster_start, &blocks_in_cluster, extent.start, extent.count,
+                                  &extents) && listed;
+          index += extent.count;
+          continue;
+        }
+        for (uint64_t j = 0; j < extent.count; j++, index++) {
+          block = extent.start + j;
+          if (index >= first && index <= last && NULL != fs->refs && fs->refs[block] > 1) {
+            sources[used] = block;
+            block = fresh[used++];
+          }
+          listed = add_to_cluster(fs, &writer, &cluster_start, &blocks_in_cluster, block, 1, &extents) && listed;
+        }
+      }
+      assert(used == shared);
+      // then new blocks
+      for (; index < needed; index++) {
+        listed = add_to_cluster(fs, &writer, &cluster_start, &blocks_in_cluster, fresh[used++], 1, &extents) && listed;
+      }
+      assert(used == shared + needed - kept);
+      if (blocks_in_cluster > 0) {
+        listed = add_extent(fs, &writer, cluster_start, blocks_in_cluster) && listed;
+        extents++;
+      }
+      extent_writer_finish(&writer, &new_list);
+
+      share_begin(fs);
+      if (!listed || !replace_extents(fs, file, &list, &new_list)) {
+        // only without memory for the list
+        fprintf(stderr, "Error: unable to write to '%s'.\n", imffsfile);
+        free(new_list.data);
+        for (uint64_t i = 0; i < used; i++) {
+          fs->used[fresh[i]] = BLOCK_FREE;
+        }
+        fs->used_count -= used;
+        result = IMFFS_ERROR;
+      } else {
+
+        // now the blocks the write touches, with what was inline or in the
+        // tail going in the first new ones
+        index = 0;
+        used = 0;
+        extent_reader_init(&reader, &new_list);
+        while (extent_read(&reader, &extent)) {
+          if (index + extent.count <= kept && (index + extent.count <= first || index > last)) {
+            index += extent.count;
+            continue;
+          }
+          for (uint64_t j = 0; j < extent.count; j++, index++) {
+            block = extent.start + j;
+            if (index < kept && (index < first || index > last)) {
+              continue;
+            }
+            if (index < kept && used < shared && block == fresh[used]) {
+              // copy on write: only this file's copy changes
+              memcpy(block_address(fs, block), block_address(fs, sources[used]), fs->block_size);
+              fs->refs[sources[used]]--;
+              mark_changed(fs, sources[used], FALSE);
+              used++;
+              fs->refs[block] = 1;
+              METRICS_COUNT(fs, cow_blocks, 1);
+            } else if (index < kept) {
+              // it won't have the contents it was found by any more
+              dedup_forget(fs, block);
+            } else {
+              // an inline file can be longer than a block, so its contents
+              // go a block at a time, in list order
+              piece = (index - kept) << fs->block_shift;
+              if (piece < extra_len) {
+                memcpy(block_address(fs, block), &extra[piece],
+                       extra_len - piece < fs->block_size ? extra_len - piece : fs->block_size);
+              }
+              if (NULL != fs->refs) {
+                fs->refs[block] = 1;
+              }
+            }
+            write_piece(fs, block, index, offset, bytes, length);
+            block_changed(fs, block);
+          }
+        }
+        used = shared + needed - kept;
+
+        if (file->packed && extra_len > 0) {
+          tail_release(fs, extra - fs->data, extra_len);
+        }
+        file->byte_len = new_len;
+        file->inlined = FALSE;
+        file->packed = FALSE;
+        file->etag = hash_blocks(fs, new_len, &new_list);
+      }
+    }
+  }
+
+  free(fresh);
+  free(writer.bytes);
+
+  if (IMFFS_OK == result) {
+    cache_touch(fs, file);
+    mark_file(fs, imffsfile);
+  }
+  if (IMFFS_OK == result && NULL != fs->journal) {
+    journal_begin(fs->journal, RECORD_WRITE);
+    journal_put_string(fs->journal, imffsfile);
+    journal_put_number(fs->journal, offset);
+    journal_put(fs->journal, buffer, length);
+    result = commit_record(fs);
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "write", imffsfile, used, extents);
+  METRICS_END(fs, METRIC_WRITE, result, IMFFS_OK == result ? length : 0);
+
+  return result;
+}
+
+// where a file's blocks start, for putting files in the order defrag moves them
+typedef struct {
+  uint64_t first;
+  uint64_t file;
+} FirstBlock;
+
+static int compare_first_blocks(const void *a, const void *b) {
+  const FirstBlock *x = a, *y = b;
+
+  if (x->first != y->first) {
+    return x->first < y->first ? -1 : 1;
+  }
+  return x->file < y->file ? -1 : x->file > y->file;
+}
+
+IMFFSResult imffs_defrag(IMFFSPtr fs) {
+
+  assert(validate_fs(fs));
+  
+  
+  IMFFSResult result = IMFFS_OK;
+  uint64_t *new_pos = NULL;
+  uint8_t *moved = NULL;
+  uint64_t owner_count, count, next;
+  File *file = NULL;
+  void *key;
+  uint8_t *buffer = NULL, *from, *to, *swap;
+  uint32_t block_size, *refs = NULL, *checksums = NULL;
+  uint64_t bytes_moved = 0;
+  File **files = NULL;
+  FirstBlock *order = NULL, *tail_order = NULL;
+  uint64_t file_count, *tail_offsets = NULL;
+  uint8_t *tails = NULL;
+  uint64_t tail_bytes = 0, tail, run_start, run_count, tail_count = 0, group_len, end;
+  Multimap *index = NULL;
+  ExtentReader reader;
+  ExtentWriter writer = { NULL, 0, 0, 0 };
+  Extent extent;
+  Value list;
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "defrag", NULL);
+
+  // every file's blocks may move
+  share_begin(fs);
+  
+  block_size = fs->block_size;
+
+  // packed tails are copied out, and repacked after the blocks are compacted
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      tail_bytes += tail_length(fs, key);
+    } while (mm_get_next_key(fs->index, &key) > 0);
+  }
+
+  // the files in index order, with where each one's tail ends up
+  file_count = mm_count_keys(fs->index);
+  files = malloc(file_count * sizeof(File *) + 1);
+  order = malloc(file_count * sizeof(FirstBlock) + 1);
+  tail_offsets = malloc(file_count * sizeof(uint64_t) + 1);
+  tail_order = malloc(file_count * sizeof(FirstBlock) + 1);
+  new_pos = malloc(fs->block_count * sizeof(uint64_t) + 1);
+  moved = calloc(fs->block_count + 1, 1);
+  buffer = malloc(2 * block_size);
+  tails = malloc(tail_bytes + 1);
+  if (NULL != fs->refs) {
+    refs = calloc(fs->block_count + 1, sizeof(uint32_t));
+  }
+  if (NULL != fs->checksums) {
+    checksums = calloc(fs->block_count + 1, sizeof(uint32_t));
+  }
+  index = mm_create(fs->block_count, compare_files_by_name, compare_always_greater);
+  METRICS_COUNT(fs, allocations, 11);
+  if (NULL == new_pos || NULL == moved || NULL == buffer || NULL == files || NULL == order ||
+      NULL == tail_offsets || NULL == tail_order || NULL == tails || NULL == index || (NULL != fs->refs && NULL == refs) ||
+      (NULL != fs->checksums && NULL == checksums)) {
+    fprintf(stderr, "Code 1 ");
+    result = IMFFS_ERROR;
+  } else {
+
+
+    // files go in the order their first blocks are in, and each block goes
+    // after the one before it in the first file that uses it: without shared
+    // blocks every file ends up as one chunk
+    TRACE_BEGIN(fs, "plan", NULL);
+    owner_count = 0;
+    count = 0;
+    tail_bytes = 0;
+    if (mm_get_first_key(fs->index, &key) > 0) {
+      do {
+        file = key;
+        files[count] = file;
+        tail_offsets[count] = UINT64_MAX;
+        count++;
+        if (file->inlined) {
+          // no blocks, it stays as it is
+          continue;
+        }
+
+        if (!get_extents(fs, file, &list)) {
+          fprintf(stderr, "Code 2 ");
+          result = IMFFS_ERROR;
+          continue;
+        }
+        extent_reader_init(&reader, &list);
+        while (extent_read(&reader, &extent)) {
+          if (0 == extent.count) {
+            memcpy(&tails[tail_bytes], &fs->data[(extent.start << fs->block_shift) + extent.offset], tail_length(fs, file));
+            tail_offsets[count - 1] = tail_bytes;
+            tail_bytes += tail_length(fs, file);
+            tail_order[tail_count].first = extent.start;
+            tail_order[tail_count].file = count - 1;
+            tail_count++;
+          } else if (0 == owner_count || order[owner_count - 1].file != count - 1) {
+            order[owner_count].first = extent.start;
+            order[owner_count].file = count - 1;
+            owner_count++;
+          }
+        }
+      } while (IMFFS_OK == result && mm_get_next_key(fs->index, &key) > 0);
+    }
+    qsort(order, owner_count, sizeof(FirstBlock), compare_first_blocks);
+
+    for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+      new_pos[pos] = UINT64_MAX;
+    }
+    next = 0;
+    for (count = 0; count < owner_count && IMFFS_OK == result; count++) {
+      get_extents(fs, files[order[count].file], &list);
+      extent_reader_init(&reader, &list);
+      while (extent_read(&reader, &extent)) {
+        for (uint64_t j = 0; j < extent.count; j++) {
+          assert(BLOCK_USED == fs->used[extent.start + j]);
+          if (UINT64_MAX == new_pos[extent.start + j]) {
+            new_pos[extent.start + j] = next++;
+          }
+        }
+      }
+    }
+    TRACE_END(fs, "plan", NULL, next, owner_count);
+  }
+
+  if (IMFFS_OK == result) {
+
+    // each block moves at most once: follow it to where it goes, taking the
+    // block that was there along to where that one goes, until a free
+    // block or the start of the cycle
+    TRACE_BEGIN(fs, "move", NULL);
+    for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+      if (UINT64_MAX == new_pos[pos] || pos == new_pos[pos] || moved[pos]) {
+        continue;
+      }
+      from = buffer;
+      to = buffer + block_size;
+      memcpy(from, block_address(fs, pos), block_size);
+      moved[pos] = 1;
+      for (uint64_t curr = pos, dest = new_pos[pos]; ; curr = dest, dest = new_pos[curr]) {
+        Boolean last = UINT64_MAX == new_pos[dest] || moved[dest];
+
+        if (!last) {
+          memcpy(to, block_address(fs, dest), block_size);
+          moved[dest] = 1;
+        }
+        memcpy(block_address(fs, dest), from, block_size);
+        bytes_moved += block_size;
+        if (last) {
+          break;
+        }
+        swap = from;
+        from = to;
+        to = swap;
+      }
+    }
+    TRACE_END(fs, "move", NULL, next, 0);
+
+    // every block that moved, and every one that's no longer used, is
+    // changed, and so is every file's extent list
+    for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+      if (UINT64_MAX != new_pos[pos] && pos != new_pos[pos]) {
+        mark_changed(fs, new_pos[pos], TRUE);
+      }
+      if (pos >= next && BLOCK_FREE != fs->used[pos]) {
+        mark_changed(fs, pos, FALSE);
+      }
+    }
+    fs->dirty.all_files = TRUE;
+    memset(fs->used, BLOCK_USED, next);
+    memset(&fs->used[next], BLOCK_FREE, fs->block_count - next);
+    fs->used_count = next;
+    if (NULL != fs->refs) {
+      for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+        if (UINT64_MAX != new_pos[pos]) {
+          refs[new_pos[pos]] = fs->refs[pos];
+        }
+      }
+      free(fs->refs);
+      fs->refs = refs;
+      refs = NULL;
+    }
+    if (NULL != fs->checksums) {
+      // the contents moved with them, so their checksums did too
+      for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+        if (UINT64_MAX != new_pos[pos]) {
+          checksums[new_pos[pos]] = fs->checksums[pos];
+        }
+      }
+      free(fs->checksums);
+      fs->checksums = checksums;
+      checksums = NULL;
+    }
+    for (uint64_t slot = 0; slot < fs->dedup_capacity; slot++) {
+      if (0 != fs->dedup_table[slot].block) {
+        fs->dedup_table[slot].block = new_pos[fs->dedup_table[slot].block - 1] + 1;
+      }
+    }
+
+    // Tails are repacked a tail block's worth at a time, in the order of
+    // the blocks they were in, and a block's worth only starts a new tail
+    // block when it doesn't fit in the open one, so the tails never take
+    // more blocks than they did
+    fs->open_tail = fs->block_count;
+    qsort(tail_order, tail_count, sizeof(FirstBlock), compare_first_blocks);
+    for (count = 0; count < tail_count && IMFFS_OK == result; count = end) {
+      group_len = 0;
+      for (end = count; end < tail_count && tail_order[end].first == tail_order[count].first; end++) {
+        group_len += tail_length(fs, files[tail_order[end].file]);
+      }
+      if (fs->open_tail < fs->block_count && tail_header(fs, fs->open_tail)->fill + group_len > block_size) {
+        fs->open_tail = fs->block_count;
+      }
+      for (; count < end && IMFFS_OK == result; count++) {
+        file = files[tail_order[count].file];
+        if (!tail_alloc(fs, tail_length(fs, file), &tail)) {
+          fprintf(stderr, "Code 7 ");
+          result = IMFFS_ERROR;
+        } else {
+          memcpy(&fs->data[tail], &tails[tail_offsets[tail_order[count].file]], tail_length(fs, file));
+          block_changed(fs, tail >> fs->block_shift);
+          tail_offsets[tail_order[count].file] = tail;
+        }
+      }
+    }
+
+    // every file's blocks are renumbered, with its tail after all of them
+    TRACE_BEGIN(fs, "index insert", NULL);
+    for (count = 0; count < file_count && IMFFS_OK == result; count++) {
+      file = files[count];
+      if (file->inlined) {
+        list.num = 0;
+        list.data = file->data;
+      } else {
+        run_count = 0;
+        get_extents(fs, file, &list);
+        extent_reader_init(&reader, &list);
+        while (extent_read(&reader, &extent) && IMFFS_OK == result) {
+          for (uint64_t j = 0; j < extent.count && IMFFS_OK == result; j++) {
+            if (run_count > 0 && new_pos[extent.start + j] == run_start + run_count) {
+              run_count++;
+            } else {
+              if (run_count > 0 && !extent_write(&writer, run_start, run_count, 0)) {
+                fprintf(stderr, "Code 5 ");
+                result = IMFFS_ERROR;
+              }
+              run_start = new_pos[extent.start + j];
+              run_count = 1;
+            }
           }
         }
-        
-        owner_count++;
-      } while (result == IMFFS_OK && mm_get_next_key(fs->index, &key) > 0);
+        if (run_count > 0 && !extent_write(&writer, run_start, run_count, 0)) {
+          fprintf(stderr, "Code 5 ");
+          result = IMFFS_ERROR;
+        }
+        tail = tail_offsets[count];
+        if (UINT64_MAX != tail && !extent_write(&writer, tail >> fs->block_shift, 0, tail & (block_size - 1))) {
+          fprintf(stderr, "Code 8 ");
+          result = IMFFS_ERROR;
+        }
+        extent_writer_finish(&writer, &list);
+      }
+
+      METRICS_COUNT(fs, allocations, 2);
+      if (NULL == list.data || mm_insert_value(index, file, list.num, list.data) <= 0) {
+        fprintf(stderr, "Code 6 ");
+        result = IMFFS_ERROR;
+        if (!file->inlined) {
+          free(list.data);
+        }
+      }
+    }
+    TRACE_END(fs, "index insert", NULL, 0, owner_count);
+
+    if (IMFFS_OK == result) {
+      free_extent_lists(fs->index);
+      mm_destroy(fs->index);
+      fs->index = index;
+      index = NULL;
+    }
+  }
+  
+  if (IMFFS_OK != result) {
+    fprintf(stderr, "Error: unable to defragment file system.\n");
+  }
+  if (NULL != index) {
+    free_extent_lists(index);
+    mm_destroy(index);
+  }
+  
+  free(new_pos);
+  free(moved);
+  free(buffer);
+  free(files);
+  free(order);
+  free(tail_order);
+  free(refs);
+  free(checksums);
+  free(tail_offsets);
+  free(tails);
+
+  // where everything goes only depends on where it was, so a replay does
+  // the same moves
+  if (IMFFS_OK == result) {
+    result = log_names(fs, RECORD_DEFRAG, NULL, NULL);
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "defrag", NULL, bytes_moved >> fs->block_shift, 0);
+  METRICS_END(fs, METRIC_DEFRAG, result, bytes_moved);
+
+  return result;
+}
+
+IMFFSResult imffs_trim(IMFFSPtr fs, uint64_t *trimmed) {
+  assert(validate_fs(fs));
+  assert(NULL != trimmed);
+
+  if (NULL == fs || NULL == trimmed) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "trim", NULL);
+
+  *trimmed = trim_blocks(fs, 0, fs->block_count);
+  METRICS_COUNT(fs, trimmed_bytes, *trimmed);
+
+  TRACE_END(fs, "trim", NULL, *trimmed >> fs->block_shift, 0);
+  METRICS_END(fs, METRIC_TRIM, IMFFS_OK, *trimmed);
+
+  return IMFFS_OK;
+}
+
+// Makes room for more blocks, all free. The arrays are grown first, since
+// being bigger than they need to be does no harm if the rest can't be.
+static IMFFSResult grow_blocks(IMFFSPtr fs, uint64_t block_count) {
+  assert(validate_fs(fs));
+  assert(block_count > fs->block_count);
+
+  uint64_t old_count = fs->block_count;
+  uint8_t *used, *data = NULL;
+  uint32_t *refs, *checksums;
+  Boolean grown = TRUE;
+
+  if (NULL != (used = realloc(fs->used, block_count + 1))) {
+    fs->used = used;
+  } else {
+    grown = FALSE;
+  }
+  if (NULL != fs->refs) {
+    if (NULL != (refs = realloc(fs->refs, block_count * sizeof(uint32_t)))) {
+      fs->refs = refs;
+    } else {
+      grown = FALSE;
+    }
+  }
+  if (NULL != fs->checksums) {
+    if (NULL != (checksums = realloc(fs->checksums, block_count * sizeof(uint32_t)))) {
+      fs->checksums = checksums;
+    } else {
+      grown = FALSE;
+    }
+  }
+  METRICS_COUNT(fs, allocations, 1 + (NULL != fs->refs) + (NULL != fs->checksums));
+  if (!grown ||
+      NULL == (data = grow_mapping(fs->data, (size_t)old_count * fs->block_size, (size_t)block_count * fs->block_size))) {
+    fprintf(stderr, "Error: not enough memory to grow the filesystem to %llu blocks.\n", (unsigned long long)block_count);
+    return IMFFS_FATAL;
+  }
+
+  fs->data = data;
+  memset(&fs->used[old_count], BLOCK_FREE, block_count - old_count);
+  fs->used[block_count] = '\0';
+  if (NULL != fs->refs) {
+    memset(&fs->refs[old_count], 0, (block_count - old_count) * sizeof(uint32_t));
+  }
+  if (NULL != fs->checksums) {
+    memset(&fs->checksums[old_count], 0, (block_count - old_count) * sizeof(uint32_t));
+  }
+  fs->block_count = block_count;
+
+  return IMFFS_OK;
+}
+
+// Drops the blocks from block_count on, which have to be free
+static void shrink_blocks(IMFFSPtr fs, uint64_t block_count) {
+  assert(validate_fs(fs));
+  assert(block_count < fs->block_count);
+
+  uint8_t *used;
+  uint32_t *refs, *checksums;
+
+  shrink_mapping(fs->data, (size_t)fs->block_count * fs->block_size, (size_t)block_count * fs->block_size);
+  fs->used[block_count] = '\0';
+  // a smaller realloc can still fail, but the old arrays are as good
+  if (NULL != (used = realloc(fs->used, block_count + 1))) {
+    fs->used = used;
+  }
+  if (NULL != fs->refs && block_count > 0 && NULL != (refs = realloc(fs->refs, block_count * sizeof(uint32_t)))) {
+    fs->refs = refs;
+  }
+  if (NULL != fs->checksums && block_count > 0 &&
+      NULL != (checksums = realloc(fs->checksums, block_count * sizeof(uint32_t)))) {
+    fs->checksums = checksums;
+  }
+  fs->block_count = block_count;
+}
+
+IMFFSResult imffs_resize(IMFFSPtr fs, uint64_t block_count) {
+  assert(validate_fs(fs));
+
+  IMFFSResult result = IMFFS_OK;
+  uint64_t old_count, used = 0, past_end = 0;
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "resize", NULL);
+
+  old_count = fs->block_count;
+  for (uint64_t pos = 0; pos < old_count; pos++) {
+    if (BLOCK_FREE != fs->used[pos]) {
+      used++;
+      past_end += pos >= block_count;
+    }
+  }
+
+  if (NULL != fs->shared) {
+    fprintf(stderr, "Error: a shared filesystem can't be resized.\n");
+    result = IMFFS_ERROR;
+  } else if (block_count > (SIZE_MAX - 1) / fs->block_size || block_count > INT64_MAX) {
+    fprintf(stderr, "Error: a filesystem of %llu blocks is too large.\n", (unsigned long long)block_count);
+    result = IMFFS_FATAL;
+  } else if (used > block_count || mm_count_keys(fs->index) > (int64_t)block_count) {
+    fprintf(stderr, "Error: the files don't fit in %llu blocks.\n", (unsigned long long)block_count);
+    result = IMFFS_ERROR;
+  } else if (past_end > 0 && IMFFS_OK != (result = imffs_defrag(fs))) {
+    // blocks past the new end are moved by compacting everything in front of them
+  } else if (block_count > old_count) {
+    result = grow_blocks(fs, block_count);
+  } else if (block_count < old_count) {
+    // the defrag can still have left some, when the tails didn't pack as tightly
+    for (uint64_t pos = block_count; pos < old_count && IMFFS_OK == result; pos++) {
+      if (BLOCK_FREE != fs->used[pos]) {
+        fprintf(stderr, "Error: the files don't fit in %llu blocks.\n", (unsigned long long)block_count);
+        result = IMFFS_ERROR;
+      }
+    }
+    if (IMFFS_OK == result) {
+      shrink_blocks(fs, block_count);
+    }
+  }
+
+  if (IMFFS_OK == result && block_count != old_count) {
+    if (fs->open_tail >= old_count || fs->open_tail >= block_count) {
+      fs->open_tail = block_count; // still none
+    }
+    mm_set_max_keys(fs->index, block_count);
+    // an incremental checkpoint can't change the shape of the one before
+    stop_dirty(fs);
+    if (NULL != fs->journal) {
+      journal_begin(fs->journal, RECORD_RESIZE);
+      journal_put_number(fs->journal, block_count);
+      result = commit_record(fs);
+    }
+  }
+
+  TRACE_END(fs, "resize", NULL, block_count > old_count ? block_count - old_count : old_count - block_count, 0);
+  METRICS_END(fs, METRIC_RESIZE, result, 0);
+
+  return result;
+}
+
+IMFFSResult imffs_usage(IMFFSPtr fs, IMFFSUsage *usage) {
+  assert(validate_fs(fs));
+  assert(NULL != usage);
+
+  void *key;
+  File *file;
+  Value list;
+  uint64_t run = 0;
+  int chunks;
+
+  if (NULL == fs || NULL == usage) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "usage", NULL);
+
+  memset(usage, 0, sizeof(IMFFSUsage));
+  usage->block_size = fs->block_size;
+  usage->block_count = fs->block_count;
+  usage->metadata_bytes = sizeof(struct IMFFS) + fs->block_count + 1 + mm_memory_used(fs->index);
+  if (NULL != fs->refs) {
+    usage->metadata_bytes += (fs->block_count + 1) * sizeof(uint32_t) + fs->dedup_capacity * sizeof(DedupEntry);
+  }
+  if (NULL != fs->checksums) {
+    usage->metadata_bytes += (fs->block_count + 1) * sizeof(uint32_t);
+  }
+  if (NULL != fs->dirty.bits) {
+    usage->metadata_bytes += ((fs->block_count >> 6) + 1 + fs->dirty.capacity) * sizeof(uint64_t) +
+                             mm_memory_used(fs->dirty.names);
+  }
+
+  for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+    if (BLOCK_FREE == fs->used[pos]) {
+      run++;
+      if (run > usage->largest_free_run) {
+        usage->largest_free_run = run;
+      }
+    } else {
+      usage->used_blocks++;
+      if (BLOCK_TAIL == fs->used[pos]) {
+        usage->tail_blocks++;
+      } else if (NULL != fs->refs) {
+        usage->shared_blocks += fs->refs[pos] - 1;
+      }
+      run = 0;
+    }
+  }
+
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      file = key;
+      if (!get_extents(fs, file, &list)) {
+        continue;
+      }
+      chunks = file_chunks(file, &list);
+      usage->file_count++;
+      usage->extent_count += chunks;
+      if ((uint64_t)chunks > usage->max_file_extents) {
+        usage->max_file_extents = chunks;
+      }
+      usage->total_bytes += file->byte_len;
+      if (file->compressed) {
+        usage->compressed_files++;
+      }
+      usage->stored_bytes += stored_length(fs, file, &list);
+      if (file->spilled) {
+        usage->spilled_files++;
+        usage->spilled_bytes += file->backing_len;
+      }
+      usage->metadata_bytes += sizeof(File) + strlen(file->name) + 1;
+      if (file->inlined) {
+        usage->inline_files++;
+        usage->metadata_bytes += file->byte_len;
+      } else {
+        usage->metadata_bytes += list.num;
+      }
+      if (tail_length(fs, file) > 0) {
+        usage->packed_tails++;
+      }
+    } while (mm_get_next_key(fs->index, &key) > 0);
+  }
+
+  assert(usage->used_blocks == fs->used_count);
+
+  TRACE_END(fs, "usage", NULL, usage->used_blocks, usage->extent_count);
+  METRICS_END(fs, METRIC_USAGE, IMFFS_OK, 0);
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_metrics_dump(IMFFSPtr fs, FILE *out) {
+  assert(validate_fs(fs));
+  assert(NULL != out);
+
+  if (NULL == fs || NULL == out) {
+    return IMFFS_INVALID;
+  }
+
+#ifdef IMFFS_METRICS
+  if (NULL != fs->journal) {
+    // the commit thread counts its own syncs
+    journal_stats(fs->journal, &fs->metrics.journal_records, &fs->metrics.journal_bytes, &fs->metrics.journal_syncs);
+  }
+  metrics_print(&fs->metrics, out);
+  return IMFFS_OK;
+#else
+  return IMFFS_NOT_IMPLEMENTED;
+#endif
+}
+
+IMFFSResult imffs_set_inline_limit(IMFFSPtr fs, uint32_t limit) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs || limit > IMFFS_MAX_INLINE_SIZE) {
+    return IMFFS_INVALID;
+  }
+
+  fs->inline_limit = limit;
+
+  return log_settings(fs);
+}
+
+IMFFSResult imffs_set_tail_packing(IMFFSPtr fs, int on) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  fs->tail_packing = on ? TRUE : FALSE;
+
+  return log_settings(fs);
+}
+
+IMFFSResult imffs_set_dedup(IMFFSPtr fs, int on) {
+  assert(validate_fs(fs));
+
+  IMFFSResult result = IMFFS_OK;
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  if (on && !count_refs(fs)) {
+    fprintf(stderr, "Error: not enough memory to turn on deduplication.\n");
+    result = IMFFS_ERROR;
+  }
+
+  if (IMFFS_OK == result) {
+    fs->dedup = on ? TRUE : FALSE;
+    if (!fs->dedup) {
+      // the blocks in it are shared only with files saved before
+      fs->dirty.dedup_dropped = TRUE;
+      free(fs->dedup_table);
+      fs->dedup_table = NULL;
+      fs->dedup_capacity = 0;
+      fs->dedup_count = 0;
+    }
+    result = log_settings(fs);
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_set_compression(IMFFSPtr fs, int on) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  fs->compression = on ? TRUE : FALSE;
+
+  return log_settings(fs);
+}
+
+// only how later saves go, so it isn't logged: the evictions are
+IMFFSResult imffs_set_cache(IMFFSPtr fs, int on) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  fs->cache = on ? TRUE : FALSE;
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_pin(IMFFSPtr fs, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+
+  File *file;
+
+  if (NULL == fs || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    return IMFFS_ERROR;
+  }
+  if (UINT32_MAX == file->pins) {
+    fprintf(stderr, "Error: '%s' is pinned too many times.\n", imffsfile);
+    return IMFFS_ERROR;
+  }
+  cache_unlink(fs, file);
+  file->pins++;
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_unpin(IMFFSPtr fs, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+
+  File *file;
+
+  if (NULL == fs || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    return IMFFS_ERROR;
+  }
+  if (0 == file->pins) {
+    fprintf(stderr, "Error: '%s' isn't pinned.\n", imffsfile);
+    return IMFFS_ERROR;
+  }
+  // back at the hot end, as if it had just been used
+  file->pins--;
+  cache_link(fs, file);
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_set_backing(IMFFSPtr fs, char *backingfile) {
+  assert(validate_fs(fs));
+  assert(NULL != backingfile);
+
+  IMFFSResult result = IMFFS_OK;
+  BackingRegion *regions;
+  uint64_t count = 0;
+  File *file;
+  void *key;
+
+  if (NULL == fs || NULL == backingfile) {
+    return IMFFS_INVALID;
+  }
+
+  if (NULL != fs->backing) {
+    fprintf(stderr, "Error: the filesystem already has a backing file.\n");
+    return IMFFS_ERROR;
+  }
+
+  // what files spilled before this was opened still refer to
+  regions = malloc(mm_count_keys(fs->index) * sizeof(BackingRegion) + 1);
+  METRICS_COUNT(fs, allocations, 1);
+  if (NULL == regions) {
+    fprintf(stderr, "Error: not enough memory to open backing file '%s'.\n", backingfile);
+    return IMFFS_ERROR;
+  }
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      file = key;
+      if (file->spilled) {
+        regions[count].offset = file->backing;
+        regions[count].length = file->backing_len;
+        count++;
+      }
+    } while (mm_get_next_key(fs->index, &key) > 0);
+  }
+  if (NULL == (fs->backing = backing_open(backingfile, regions, count))) {
+    result = IMFFS_ERROR;
+  }
+  free(regions);
+
+  return result;
+}
+
+IMFFSResult imffs_spill(IMFFSPtr fs, char *imffsfile) {
+  assert(validate_fs(fs));
+  assert(NULL != imffsfile);
+
+  IMFFSResult result = IMFFS_ERROR;
+  File *file;
+  uint64_t bytes = 0;
+
+  if (NULL == fs || NULL == imffsfile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "spill", imffsfile);
+
+  if (NULL == fs->backing) {
+    fprintf(stderr, "Error: there's no backing file to spill '%s' to.\n", imffsfile);
+  } else if (NULL == (file = find_matching_file(fs->index, imffsfile))) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+  } else if (file->inlined) {
+    fprintf(stderr, "Error: '%s' is inline, so it has no blocks to spill.\n", imffsfile);
+  } else if (file->spilled) {
+    fprintf(stderr, "Error: '%s' is already spilled.\n", imffsfile);
+  } else if (file->pins > 0) {
+    fprintf(stderr, "Error: '%s' is pinned.\n", imffsfile);
+  } else if (IMFFS_OK == (result = spill_file(fs, file))) {
+    bytes = file->backing_len;
+  }
+
+  share_changes(fs);
+  TRACE_END(fs, "spill", imffsfile, 0, 0);
+  METRICS_END(fs, METRIC_SPILL, result, bytes);
+
+  return result;
+}
+
+IMFFSResult imffs_share(IMFFSPtr fs, char *name) {
+  assert(validate_fs(fs));
+  assert(NULL != name);
+
+  Shared *shared;
+  uint8_t *blocks;
+  char *copy;
+
+  if (NULL == fs || NULL == name) {
+    return IMFFS_INVALID;
+  }
+
+  if (NULL != fs->shared) {
+    fprintf(stderr, "Error: the filesystem is already shared.\n");
+    return IMFFS_ERROR;
+  }
+  if (NULL == (copy = strdup(name))) {
+    fprintf(stderr, "Error: not enough memory to share the filesystem.\n");
+    return IMFFS_ERROR;
+  }
+  if (NULL == (shared = shared_create(name, fs->block_count, fs->block_size))) {
+    free(copy);
+    return IMFFS_ERROR;
+  }
+
+  // only the blocks in use are copied, so free ones take no shared memory
+  blocks = shared_blocks(shared);
+  for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+    if (BLOCK_FREE != fs->used[pos]) {
+      memcpy(&blocks[pos << fs->block_shift], block_address(fs, pos), fs->block_size);
+    }
+  }
+  unmap_blocks(fs->data, (size_t)fs->block_count * fs->block_size);
+  fs->data = blocks;
+  fs->shared = shared;
+  fs->shared_name = copy;
+  fs->shared_changed = TRUE;
+  share_changes(fs);
+
+  return IMFFS_OK;
+}
+
+struct IMFFS_READER {
+  Shared *shared;
+  const uint8_t *blocks;
+  uint64_t block_count;
+  uint8_t block_shift;
+  uint8_t *entry;              // the data of the last file looked up, copied out of the directory
+  uint64_t entry_capacity;
+  const uint8_t *entry_data;   // and where it was in the directory
+};
+
+IMFFSResult imffs_reader_open(char *name, IMFFSReaderPtr *reader) {
+  assert(NULL != name && NULL != reader);
+
+  uint32_t block_size;
+
+  if (NULL == name || NULL == reader) {
+    return IMFFS_INVALID;
+  }
+
+  *reader = calloc(1, sizeof(struct IMFFS_READER));
+  if (NULL == *reader) {
+    fprintf(stderr, "Error: not enough memory to open a reader.\n");
+    return IMFFS_FATAL;
+  }
+  if (NULL == ((*reader)->shared = shared_attach(name))) {
+    free(*reader);
+    *reader = NULL;
+    return IMFFS_ERROR;
+  }
+
+  (*reader)->blocks = shared_blocks((*reader)->shared);
+  shared_shape((*reader)->shared, &(*reader)->block_count, &block_size);
+  while ((*reader)->block_shift < 31 && (1U << (*reader)->block_shift) < block_size) {
+    (*reader)->block_shift++;
+  }
+
+  return IMFFS_OK;
+}
+
+// strcasecmp of name and the len bytes of a name in the directory, which
+// may be changing and so can't be relied on to end where it should
+static int compare_shared_name(const char *name, size_t name_len, const uint8_t *other, uint64_t len) {
+  int order = strncasecmp(name, (const char *)other, name_len < len ? name_len : len);
+
+  if (0 != order || name_len == len) {
+    return order;
+  }
+  return name_len < len ? -1 : 1;
+}
+
+// Copies imffsfile's entry out of the directory, with its extent list or
+// contents into the reader's buffer, between shared_read_begin and
+// shared_read_retry. What's read may be torn, so every offset is checked
+// against the directory, and nothing found can be trusted until
+// shared_read_retry says nothing changed. Returns IMFFS_ERROR if it isn't
+// there, and IMFFS_FATAL without the memory for its data.
+static IMFFSResult reader_find(IMFFSReaderPtr reader, char *imffsfile, SharedEntry *entry, Value *data) {
+  const uint8_t *directory;
+  uint64_t length, count, low = 0, high, middle, at, capacity;
+  size_t name_len = strlen(imffsfile);
+  uint8_t *grown;
+  int order;
+
+  directory = shared_directory(reader->shared, &length);
+  if (NULL == directory || length < sizeof(uint64_t)) {
+    return IMFFS_ERROR;
+  }
+  memcpy(&count, directory, sizeof(uint64_t));
+  if (count >= length / sizeof(uint64_t)) {
+    return IMFFS_ERROR;
+  }
+
+  high = count;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    memcpy(&at, &directory[(middle + 1) * sizeof(uint64_t)], sizeof(uint64_t));
+    if (at > length || length - at < sizeof(SharedEntry)) {
+      return IMFFS_ERROR;
+    }
+    memcpy(entry, &directory[at], sizeof(SharedEntry));
+    at += sizeof(SharedEntry);
+    if (entry->name_len >= length - at) {
+      return IMFFS_ERROR;
+    }
+    order = compare_shared_name(imffsfile, name_len, &directory[at], entry->name_len);
+    if (order < 0) {
+      high = middle;
+    } else if (order > 0) {
+      low = middle + 1;
+    } else {
+      at += entry->name_len + 1;
+      if (entry->data_len > length - at) {
+        return IMFFS_ERROR;
+      }
+      if (entry->data_len > reader->entry_capacity) {
+        capacity = entry->data_len > 2 * reader->entry_capacity ? entry->data_len : 2 * reader->entry_capacity;
+        if (NULL == (grown = realloc(reader->entry, capacity))) {
+          return IMFFS_FATAL;
+        }
+        reader->entry = grown;
+        reader->entry_capacity = capacity;
+      }
+      memcpy(reader->entry, &directory[at], entry->data_len);
+      reader->entry_data = &directory[at];
+      data->num = entry->data_len;
+      data->data = reader->entry;
+      return IMFFS_OK;
+    }
+  }
+
+  return IMFFS_ERROR;
+}
+
+// Copies length bytes from offset in the run of the file's chunks, as
+// they're stored, to out. FALSE if the chunks end first.
+static Boolean reader_copy(IMFFSReaderPtr reader, SharedEntry *entry, Value *list, uint64_t offset, uint8_t *out,
+                           uint64_t length) {
+  ExtentReader extents;
+  Extent extent;
+  uint64_t chunk, from, wanted;
+
+  extent_reader_init(&extents, list);
+  while (length > 0 && extent_read(&extents, &extent)) {
+    chunk = extent.count > 0 ? extent.count << reader->block_shift
+                             : entry->byte_len & (((uint64_t)1 << reader->block_shift) - 1);
+    if (extent.start >= reader->block_count || (extent.count > 0 && extent.count > reader->block_count - extent.start)) {
+      return FALSE;
+    }
+    if (offset >= chunk) {
+      offset -= chunk;
+      continue;
+    }
+    from = (extent.start << reader->block_shift) + extent.offset + offset;
+    wanted = chunk - offset < length ? chunk - offset : length;
+    memcpy(out, &reader->blocks[from], wanted);
+    out += wanted;
+    length -= wanted;
+    offset = 0;
+  }
+
+  return 0 == length;
+}
+
+// Copies the compressed groups that hold length bytes from offset to
+// scratch, grown as it needs to be, and sets first to where the first of
+// them starts in the file. FALSE if the groups don't make sense.
+static Boolean reader_groups(IMFFSReaderPtr reader, SharedEntry *entry, Value *list, uint64_t offset, uint64_t length,
+                             uint8_t **scratch, uint64_t *scratch_len, uint64_t *first) {
+  uint64_t at = 0, begin = 0, group_start = 0;
+  uint32_t group_length, value, packed_length;
+  uint8_t header[GROUP_HEADER], *grown;
+
+  *first = 0;
+  *scratch_len = 0;
+  while (group_start < entry->byte_len && group_start < offset + length) {
+    group_length = entry->byte_len - group_start < COMPRESS_GROUP ? entry->byte_len - group_start : COMPRESS_GROUP;
+    if (!reader_copy(reader, entry, list, at, header, GROUP_HEADER)) {
+      return FALSE;
+    }
+    value = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    packed_length = value & ~GROUP_STORED;
+    if (packed_length > (value & GROUP_STORED ? COMPRESS_GROUP : LZ_BOUND(COMPRESS_GROUP))) {
+      return FALSE;
+    }
+    if (offset >= group_start + group_length) {
+      begin = at + GROUP_HEADER + packed_length;
+      *first = group_start + group_length;
+    }
+    at += GROUP_HEADER + packed_length;
+    group_start += group_length;
+  }
+
+  if (at > begin) {
+    if (NULL == (grown = realloc(*scratch, at - begin))) {
+      return FALSE;
+    }
+    *scratch = grown;
+    *scratch_len = at - begin;
+  }
+  return reader_copy(reader, entry, list, begin, *scratch, *scratch_len);
+}
+
+// decompresses length bytes from offset out of the groups reader_groups copied
+static Boolean reader_decompress(SharedEntry *entry, const uint8_t *scratch, uint64_t scratch_len, uint64_t first,
+                                 uint64_t offset, uint8_t *out, uint64_t length) {
+  uint8_t *group = malloc(COMPRESS_GROUP);
+  const uint8_t *from;
+  uint64_t at = 0, skip, wanted;
+  uint32_t group_length, value, packed_length;
+
+  while (NULL != group && length > 0 && scratch_len - at >= GROUP_HEADER) {
+    group_length = entry->byte_len - first < COMPRESS_GROUP ? entry->byte_len - first : COMPRESS_GROUP;
+    value = scratch[at] | (scratch[at + 1] << 8) | (scratch[at + 2] << 16) | ((uint32_t)scratch[at + 3] << 24);
+    packed_length = value & ~GROUP_STORED;
+    at += GROUP_HEADER;
+    if (packed_length > scratch_len - at) {
+      break;
+    }
+    from = &scratch[at];
+    if (0 == (value & GROUP_STORED)) {
+      if (lz_decompress(from, packed_length, group, COMPRESS_GROUP) != group_length) {
+        break;
+      }
+      from = group;
+    }
+
+    skip = offset > first ? offset - first : 0;
+    wanted = group_length - skip < length ? group_length - skip : length;
+    memcpy(out, &from[skip], wanted);
+    out += wanted;
+    offset += wanted;
+    length -= wanted;
+    at += packed_length;
+    first += group_length;
+  }
+  free(group);
+
+  return 0 == length;
+}
+
+IMFFSResult imffs_reader_read(IMFFSReaderPtr reader, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                              uint64_t *bytes_read) {
+  assert(NULL != reader && NULL != imffsfile && NULL != bytes_read);
+  assert(NULL != buffer || 0 == length);
+
+  IMFFSResult result;
+  SharedEntry entry;
+  Value data;
+  uint8_t *scratch = NULL;
+  uint64_t seq, wanted = 0, scratch_len = 0, first = 0;
+  Boolean copied = FALSE;
+
+  if (NULL == reader || NULL == imffsfile || NULL == bytes_read || (NULL == buffer && length > 0)) {
+    return IMFFS_INVALID;
+  }
+
+  *bytes_read = 0;
+  // a copy is only kept once nothing it came from changed while it was made
+  do {
+    seq = shared_read_begin(reader->shared);
+    result = reader_find(reader, imffsfile, &entry, &data);
+    if (shared_read_retry(reader->shared, seq)) {
+      continue; // the extent list has to be whole before it's followed
+    }
+    if (IMFFS_OK == result) {
+      wanted = offset < entry.byte_len ? (entry.byte_len - offset < length ? entry.byte_len - offset : length) : 0;
+      if (entry.flags & 8) {
+        copied = FALSE;
+      } else if (entry.flags & 1) {
+        copied = entry.data_len == entry.byte_len;
+        if (copied) {
+          memcpy(buffer, &((uint8_t *)data.data)[offset < entry.byte_len ? offset : 0], wanted);
+        }
+      } else if (entry.flags & 4) {
+        copied = reader_groups(reader, &entry, &data, offset, wanted, &scratch, &scratch_len, &first);
+      } else {
+        copied = reader_copy(reader, &entry, &data, offset, buffer, wanted);
+      }
+    }
+  } while (shared_read_retry(reader->shared, seq));
+
+  if (IMFFS_FATAL == result) {
+    fprintf(stderr, "Error: not enough memory to read file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK != result) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+  } else if (entry.flags & 8) {
+    fprintf(stderr, "Error: '%s' is spilled, so only the filesystem itself can read it.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (!copied || ((entry.flags & 4) && !reader_decompress(&entry, scratch, scratch_len, first, offset,
+                                                                    buffer, wanted))) {
+    fprintf(stderr, "Error: file '%s' is damaged.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else {
+    *bytes_read = wanted;
+  }
+  free(scratch);
+
+  return result;
+}
+
+IMFFSResult imffs_reader_chunks(IMFFSReaderPtr reader, char *imffsfile, IMFFSChunk *chunks, uint32_t max_chunks,
+                                uint32_t *count, uint64_t *version) {
+  assert(NULL != reader && NULL != imffsfile && NULL != count && NULL != version);
+  assert(NULL != chunks || 0 == max_chunks);
+
+  IMFFSResult result;
+  SharedEntry entry;
+  Value data;
+  ExtentReader extents;
+  Extent extent;
+  uint64_t seq, left, length;
+  uint32_t found = 0;
+
+  if (NULL == reader || NULL == imffsfile || NULL == count || NULL == version || (NULL == chunks && max_chunks > 0)) {
+    return IMFFS_INVALID;
+  }
+
+  do {
+    seq = shared_read_begin(reader->shared);
+    result = reader_find(reader, imffsfile, &entry, &data);
+  } while (shared_read_retry(reader->shared, seq));
+
+  *count = 0;
+  *version = seq;
+  if (IMFFS_FATAL == result) {
+    fprintf(stderr, "Error: not enough memory to read file '%s'.\n", imffsfile);
+    return IMFFS_ERROR;
+  } else if (IMFFS_OK != result) {
+    fprintf(stderr, "Error: no such file '%s'.\n", imffsfile);
+    return IMFFS_ERROR;
+  } else if (entry.flags & (4 | 8)) {
+    fprintf(stderr, "Error: '%s' is %s, so it can't be read in place.\n", imffsfile,
+            entry.flags & 8 ? "spilled" : "compressed");
+    return IMFFS_ERROR;
+  }
+
+  if (entry.flags & 1) {
+    if (max_chunks > 0) {
+      chunks[0].data = reader->entry_data;
+      chunks[0].length = entry.byte_len;
+    }
+    found = 1;
+  } else {
+    left = entry.byte_len;
+    extent_reader_init(&extents, &data);
+    while (left > 0 && extent_read(&extents, &extent)) {
+      length = extent.count > 0 ? extent.count << reader->block_shift : left;
+      length = length < left ? length : left;
+      if (found < max_chunks) {
+        chunks[found].data = &reader->blocks[(extent.start << reader->block_shift) + extent.offset];
+        chunks[found].length = length;
+      }
+      found++;
+      left -= length;
+    }
+  }
+
+  *count = found;
+  if (found > max_chunks) {
+    fprintf(stderr, "Error: '%s' is in %u chunks, more than %u.\n", imffsfile, found, max_chunks);
+    return IMFFS_ERROR;
+  }
+
+  return IMFFS_OK;
+}
+
+int imffs_reader_changed(IMFFSReaderPtr reader, uint64_t version) {
+  assert(NULL != reader);
+
+  return NULL == reader || shared_read_retry(reader->shared, version);
+}
+
+IMFFSResult imffs_reader_stat(IMFFSReaderPtr reader, char *imffsfile, IMFFSStat *stat) {
+  assert(NULL != reader && NULL != imffsfile && NULL != stat);
+
+  IMFFSResult result;
+  SharedEntry entry;
+  Value data;
+  ExtentReader extents;
+  Extent extent;
+  uint64_t seq;
+
+  if (NULL == reader || NULL == imffsfile || NULL == stat) {
+    return IMFFS_INVALID;
+  }
+
+  do {
+    seq = shared_read_begin(reader->shared);
+    result = reader_find(reader, imffsfile, &entry, &data);
+  } while (shared_read_retry(reader->shared, seq));
+
+  if (IMFFS_OK != result) {
+    fprintf(stderr, "Error: %s '%s'.\n", IMFFS_FATAL == result ? "not enough memory to stat" : "no such file",
+            imffsfile);
+    return IMFFS_ERROR;
+  }
+
+  memset(stat, 0, sizeof(IMFFSStat));
+  stat->byte_len = entry.byte_len;
+  stat->etag = entry.etag;
+  stat->inlined = entry.flags & 1 ? 1 : 0;
+  stat->packed = entry.flags & 2 ? 1 : 0;
+  stat->compressed = entry.flags & 4 ? 1 : 0;
+  stat->spilled = entry.flags & 8 ? 1 : 0;
+  if (stat->inlined) {
+    stat->extents = 1;
+  } else if (!stat->spilled) {
+    extent_reader_init(&extents, &data);
+    while (extent_read(&extents, &extent)) {
+      stat->blocks += extent.count;
+      stat->extents++;
+    }
+  }
+  // a reader can't tell where a compressed file's last group ends
+  stat->stored_bytes = stat->compressed ? stat->blocks << reader->block_shift : stat->spilled ? 0 : entry.byte_len;
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_reader_close(IMFFSReaderPtr reader) {
+  if (NULL == reader) {
+    return IMFFS_INVALID;
+  }
+
+  shared_close(reader->shared);
+  free(reader->entry);
+  free(reader);
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_set_checksums(IMFFSPtr fs, int on) {
+  assert(validate_fs(fs));
+
+  IMFFSResult result = IMFFS_OK;
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  if (on && NULL == fs->checksums) {
+    fs->checksums = calloc(fs->block_count + 1, sizeof(uint32_t));
+    METRICS_COUNT(fs, allocations, 1);
+    if (NULL == fs->checksums) {
+      fprintf(stderr, "Error: not enough memory to turn on checksums.\n");
+      result = IMFFS_ERROR;
+    } else {
+      // the tables are made here, before scrub threads use them
+      crc32c_portable(0, NULL, 0);
+      for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+        if (BLOCK_FREE != fs->used[pos]) {
+          update_checksum(fs, pos);
+        }
+      }
+    }
+  } else if (!on) {
+    free(fs->checksums);
+    fs->checksums = NULL;
+  }
+  if (IMFFS_OK == result) {
+    result = log_settings(fs);
+  }
+
+  return result;
+}
+
+typedef struct {
+  IMFFSPtr fs;
+  uint64_t start;
+  uint64_t end;
+  uint64_t checked;
+  uint64_t bad;
+  uint64_t first_bad;
+} ScrubRange;
+
+static void *scrub_range(void *arg) {
+  ScrubRange *range = arg;
+  IMFFSPtr fs = range->fs;
+
+  for (uint64_t pos = range->start; pos < range->end; pos++) {
+    if (BLOCK_FREE != fs->used[pos]) {
+      range->checked++;
+      if (fs->checksums[pos] != crc32c(0, block_address(fs, pos), fs->block_size)) {
+        if (0 == range->bad) {
+          range->first_bad = pos;
+        }
+        range->bad++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+IMFFSResult imffs_scrub(IMFFSPtr fs, uint32_t threads, uint64_t *checked, uint64_t *bad) {
+  assert(validate_fs(fs));
+  assert(NULL != checked && NULL != bad);
+
+  IMFFSResult result = IMFFS_OK;
+  ScrubRange *ranges = NULL;
+  pthread_t *ids = NULL;
+  Boolean *started = NULL;
+  long cpus;
+
+  if (NULL == fs || NULL == checked || NULL == bad) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "scrub", NULL);
+  *checked = 0;
+  *bad = 0;
+
+  if (0 == threads) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  if (threads > MAX_SCRUB_THREADS) {
+    threads = MAX_SCRUB_THREADS;
+  }
+  if (threads > fs->block_count / MIN_SCRUB_BLOCKS) {
+    threads = fs->block_count / MIN_SCRUB_BLOCKS > 0 ? fs->block_count / MIN_SCRUB_BLOCKS : 1;
+  }
+
+  ranges = calloc(threads, sizeof(ScrubRange));
+  ids = calloc(threads, sizeof(pthread_t));
+  started = calloc(threads, sizeof(Boolean));
+  METRICS_COUNT(fs, allocations, 3);
+  if (NULL == fs->checksums) {
+    fprintf(stderr, "Error: checksums are off.\n");
+    result = IMFFS_ERROR;
+  } else if (NULL == ranges || NULL == ids || NULL == started) {
+    fprintf(stderr, "Error: not enough memory to scrub the device.\n");
+    result = IMFFS_ERROR;
+  } else {
+
+    // equal ranges of blocks; the calling thread does the first, and any
+    // range a thread can't be started for
+    for (uint32_t i = 0; i < threads; i++) {
+      ranges[i].fs = fs;
+      ranges[i].start = fs->block_count / threads * i;
+      ranges[i].end = i + 1 == threads ? fs->block_count : fs->block_count / threads * (i + 1);
+    }
+    for (uint32_t i = 1; i < threads; i++) {
+      started[i] = 0 == pthread_create(&ids[i], NULL, scrub_range, &ranges[i]);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+      if (!started[i]) {
+        scrub_range(&ranges[i]);
+      }
+    }
+    for (uint32_t i = 1; i < threads; i++) {
+      if (started[i]) {
+        pthread_join(ids[i], NULL);
+      }
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+      *checked += ranges[i].checked;
+      *bad += ranges[i].bad;
+      if (ranges[i].bad > 0) {
+        fprintf(stderr, "Error: %llu blocks from block %llu don't match their checksums.\n",
+                (unsigned long long)ranges[i].bad, (unsigned long long)ranges[i].first_bad);
+      }
+    }
+    METRICS_COUNT(fs, bytes_checksummed, *checked << fs->block_shift);
+    METRICS_COUNT(fs, checksum_errors, *bad);
+    if (*bad > 0) {
+      result = IMFFS_ERROR;
+    }
+  }
+
+  free(ranges);
+  free(ids);
+  free(started);
+
+  TRACE_END(fs, "scrub", NULL, *checked, threads);
+  METRICS_END(fs, METRIC_SCRUB, result, *checked << fs->block_shift);
+
+  return result;
+}
+
+// the records a journal replays, each done as it was the first time
+static int apply_record(uint8_t type, uint64_t seq, const uint8_t *payload, uint32_t length, void *context) {
+  IMFFSPtr fs = context;
+  IMFFSResult result = IMFFS_ERROR;
+  RecordReader reader;
+  char *name = NULL, *other = NULL;
+  uint64_t settings[5], size_hint, offset, blocks, bytes;
+  uint32_t extents;
+  Boolean regular;
+  FILE *in;
+  File *file;
+
+  assert(validate_fs(fs) && NULL == fs->journal);
+
+  record_reader_init(&reader, payload, length);
+  if (RECORD_SETTINGS == type) {
+    for (int i = 0; i < 5; i++) {
+      settings[i] = record_get_number(&reader);
+    }
+    if (!reader.failed && settings[0] <= IMFFS_MAX_INLINE_SIZE &&
+        IMFFS_OK == (result = imffs_set_inline_limit(fs, settings[0])) &&
+        IMFFS_OK == (result = imffs_set_tail_packing(fs, settings[1])) &&
+        IMFFS_OK == (result = imffs_set_dedup(fs, settings[2])) &&
+        IMFFS_OK == (result = imffs_set_compression(fs, settings[3]))) {
+      result = imffs_set_checksums(fs, settings[4]);
+    }
+  } else if (RECORD_SAVE == type) {
+    name = record_get_string(&reader);
+    regular = record_get_number(&reader) ? TRUE : FALSE;
+    size_hint = record_get_number(&reader);
+    if (NULL != name && !reader.failed) {
+      // the rest is the contents; not every fmemopen takes an empty buffer
+      if (reader.stop > reader.next) {
+        in = fmemopen((void *)reader.next, reader.stop - reader.next, "r");
+      } else {
+        in = fopen("/dev/null", "r");
+      }
+      if (NULL != in) {
+        result = save_stream(fs, in, name, name, regular, size_hint, &blocks, &extents, &bytes);
+        fclose(in);
+      }
+    }
+  } else if (RECORD_DELETE == type) {
+    if (NULL != (name = record_get_string(&reader))) {
+      result = imffs_delete(fs, name);
+    }
+  } else if (RECORD_RENAME == type || RECORD_CLONE == type) {
+    name = record_get_string(&reader);
+    other = record_get_string(&reader);
+    if (NULL != name && NULL != other) {
+      result = RECORD_RENAME == type ? imffs_rename(fs, name, other) : imffs_clone(fs, name, other);
+    }
+  } else if (RECORD_DEFRAG == type) {
+    result = imffs_defrag(fs);
+  } else if (RECORD_WRITE == type) {
+    name = record_get_string(&reader);
+    offset = record_get_number(&reader);
+    if (NULL != name && !reader.failed) {
+      result = imffs_write(fs, name, offset, reader.next, reader.stop - reader.next);
+    }
+  } else if (RECORD_RESIZE == type) {
+    blocks = record_get_number(&reader);
+    if (!reader.failed) {
+      result = imffs_resize(fs, blocks);
+    }
+  } else if (RECORD_SPILL == type || RECORD_FAULT == type) {
+    if (NULL != (name = record_get_string(&reader)) && NULL == fs->backing) {
+      fprintf(stderr, "Error: '%s' was spilled to a backing file that isn't attached.\n", name);
+    } else if (NULL != name && RECORD_SPILL == type) {
+      result = imffs_spill(fs, name);
+    } else if (NULL != name && NULL != (file = find_matching_file(fs->index, name)) && file->spilled) {
+      result = fault_in(fs, file);
+    }
+  }
+
+  free(name);
+  free(other);
+  if (IMFFS_OK != result) {
+    fprintf(stderr, "Error: journal record %llu can't be replayed.\n", (unsigned long long)seq);
+    return -1;
+  }
+  fs->seq = seq;
+  METRICS_COUNT(fs, replayed_records, 1);
+
+  return 0;
+}
+
+IMFFSResult imffs_journal(IMFFSPtr fs, char *journalfile, uint32_t commit_ms) {
+  assert(validate_fs(fs));
+  assert(NULL != journalfile);
+
+  IMFFSResult result = IMFFS_OK;
+  Journal *journal;
+
+  if (NULL == fs || NULL == journalfile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "replay", NULL);
+
+  if (NULL != fs->journal) {
+    fprintf(stderr, "Error: the filesystem already has a journal.\n");
+    result = IMFFS_ERROR;
+  } else if (NULL == (journal = journal_open(journalfile, fs->block_count, fs->block_size, commit_ms))) {
+    result = IMFFS_ERROR;
+  } else if (journal_replay(journal, fs->seq, apply_record, fs) < 0) {
+    journal_close(journal);
+    result = IMFFS_ERROR;
+  } else {
+    fs->seq = journal_seq(journal);
+    fs->journal = journal;
+  }
+
+  TRACE_END(fs, "replay", NULL, 0, 0);
+  METRICS_END(fs, METRIC_REPLAY, result, 0);
+
+  return result;
+}
+
+IMFFSResult imffs_journal_sync(IMFFSPtr fs) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  if (NULL != fs->journal && 0 != journal_sync(fs->journal)) {
+    fprintf(stderr, "Error: unable to write to the journal.\n");
+    return IMFFS_FATAL;
+  }
+
+  return IMFFS_OK;
+}
+
+// An image is written and read as one stream, with a CRC32C of all of it
+// at the end. Numbers are varints.
+typedef struct {
+  FILE *file;
+  uint32_t crc;
+  uint64_t bytes;
+  Boolean failed;
+  uint32_t id; // the CRC32C at the end, which names it to the checkpoint after it
+} ImageStream;
+
+static void image_put(ImageStream *image, const void *bytes, size_t length) {
+  if (!image->failed && length > 0) {
+    image->crc = crc32c(image->crc, bytes, length);
+    image->bytes += length;
+    image->failed = fwrite(bytes, 1, length, image->file) != length;
+  }
+}
+
+static void image_put_number(ImageStream *image, uint64_t value) {
+  uint8_t bytes[10];
+
+  image_put(image, bytes, put_varint(bytes, value));
+}
+
+static void image_get(ImageStream *image, void *bytes, size_t length) {
+  if (!image->failed && length > 0) {
+    image->failed = fread(bytes, 1, length, image->file) != length;
+    image->crc = crc32c(image->crc, bytes, length);
+    image->bytes += length;
+  }
+}
+
+static uint64_t image_get_number(ImageStream *image) {
+  uint64_t value = 0;
+  uint8_t byte = 0x80;
+
+  for (uint32_t shift = 0; !image->failed && shift < 64 && (byte & 0x80); shift += 7) {
+    image_get(image, &byte, 1);
+    value |= (uint64_t)(byte & 0x7f) << shift;
+  }
+  image->failed |= 0 != (byte & 0x80);
+
+  return image->failed ? 0 : value;
+}
+
+static void image_put_crc(ImageStream *image) {
+  uint8_t crc[4];
+
+  image->id = image->crc;
+  for (int i = 0; i < 4; i++) {
+    crc[i] = image->crc >> (8 * i);
+  }
+  image_put(image, crc, 4);
+}
+
+// FALSE if the CRC32C of everything before it isn't the one that follows
+static Boolean image_get_crc(ImageStream *image) {
+  uint32_t crc = image->crc;
+  uint8_t stored[4];
+
+  image->id = crc;
+  image_get(image, stored, 4);
+
+  return !image->failed && crc == ((uint32_t)stored[0] | (uint32_t)stored[1] << 8 | (uint32_t)stored[2] << 16 |
+                                   (uint32_t)stored[3] << 24);
+}
+
+// the last journal record, the settings and the open tail block
+static void image_put_state(IMFFSPtr fs, ImageStream *image) {
+  image_put_number(image, fs->seq);
+  image_put_number(image, fs->inline_limit);
+  image_put_number(image, fs->tail_packing);
+  image_put_number(image, fs->dedup);
+  image_put_number(image, fs->compression);
+  image_put_number(image, NULL != fs->checksums);
+  image_put_number(image, fs->open_tail);
+}
+
+static void image_put_name(ImageStream *image, char *name) {
+  image_put_number(image, strlen(name));
+  image_put(image, name, strlen(name));
+}
+
+// a file's record: its flags, size, etag and name, then its contents if
+// it's inline, where it is in the backing file if it's spilled, or its
+// extent list
+static void image_put_file(IMFFSPtr fs, ImageStream *image, File *file) {
+  Value list;
+
+  if (!get_extents(fs, file, &list)) {
+    image->failed = TRUE;
+    return;
+  }
+  image_put_number(image, file->inlined | file->packed << 1 | file->compressed << 2 | file->spilled << 3);
+  image_put_number(image, file->byte_len);
+  image_put_number(image, file->etag);
+  image_put_name(image, file->name);
+  if (file->inlined) {
+    image_put(image, file->data, file->byte_len);
+  } else if (file->spilled) {
+    image_put_number(image, file->backing);
+    image_put_number(image, file->backing_len);
+  } else {
+    image_put_number(image, list.num);
+    image_put(image, list.data, list.num);
+  }
+}
+
+// everything but the data of free blocks, which isn't in any file
+static void image_write(IMFFSPtr fs, ImageStream *image) {
+  assert(validate_fs(fs));
+
+  void *key;
+
+  image_put(image, IMAGE_MAGIC, strlen(IMAGE_MAGIC));
+  image_put_number(image, IMAGE_VERSION);
+  image_put_number(image, fs->block_count);
+  image_put_number(image, fs->block_size);
+  image_put_state(fs, image);
+  image_put(image, fs->used, fs->block_count);
+
+  image_put_number(image, NULL != fs->refs);
+  for (uint64_t pos = 0; NULL != fs->refs && pos < fs->block_count; pos++) {
+    image_put_number(image, fs->refs[pos]);
+  }
+
+  // the table as it is, so blocks are found in the same slots
+  image_put_number(image, fs->dedup_capacity);
+  image_put_number(image, fs->dedup_count);
+  for (uint64_t slot = 0; slot < fs->dedup_capacity; slot++) {
+    if (0 != fs->dedup_table[slot].block) {
+      image_put_number(image, slot);
+      image_put_number(image, fs->dedup_table[slot].hash);
+      image_put_number(image, fs->dedup_table[slot].block);
+    }
+  }
+
+  image_put_number(image, mm_count_keys(fs->index));
+  if (mm_get_first_key(fs->index, &key) > 0) {
+    do {
+      image_put_file(fs, image, key);
+    } while (!image->failed && mm_get_next_key(fs->index, &key) > 0);
+  }
+
+  for (uint64_t pos = 0; pos < fs->block_count; pos++) {
+    if (BLOCK_FREE != fs->used[pos]) {
+      image_put(image, block_address(fs, pos), fs->block_size);
+    }
+  }
+
+  image_put_crc(image);
+}
+
+// takes every file out of an index and frees them, lists and all
+static Boolean free_files(Multimap *index) {
+  assert(NULL != index);
+
+  void *key;
+  File *file;
+
+  free_extent_lists(index);
+  while (mm_get_first_key(index, &key) > 0) {
+    file = key;
+    if (mm_remove_key(index, file) <= 0) {
+      assert(FALSE);
+      return FALSE;
+    }
+    free(file->name);
+    free(file);
+  }
+
+  return TRUE;
+}
+
+// takes a file's record out of the index, leaving its blocks as they are
+static void drop_file(IMFFSPtr fs, File *file) {
+  assert(validate_fs(fs));
+  assert(NULL != file);
+
+  Value list;
+
+  if (get_extents(fs, file, &list) && !file->inlined) {
+    free(list.data);
+  }
+  mm_remove_key(fs->index, file);
+  cache_unlink(fs, file);
+  free(file->name);
+  free(file);
+}
+
+static void stop_dirty(IMFFSPtr fs) {
+  free(fs->dirty.bits);
+  free(fs->dirty.written);
+  free(fs->dirty.blocks);
+  if (NULL != fs->dirty.names) {
+    free_files(fs->dirty.names);
+    mm_destroy(fs->dirty.names);
+  }
+  memset(&fs->dirty, 0, sizeof(Dirty));
+}
+
+// Starts keeping what changes from now on, for an incremental checkpoint on
+// top of the one with this CRC. Without the memory for it, only full
+// checkpoints can be written.
+static void start_dirty(IMFFSPtr fs, uint32_t base) {
+  assert(validate_fs(fs));
+
+  Dirty *dirty = &fs->dirty;
+
+  if (NULL == dirty->bits) {
+    dirty->bits = calloc((fs->block_count >> 6) + 1, sizeof(uint64_t));
+    dirty->written = calloc((fs->block_count >> 6) + 1, sizeof(uint64_t));
+    dirty->names = mm_create(INT64_MAX, compare_files_by_name, compare_always_greater);
+    METRICS_COUNT(fs, allocations, 3);
+    if (NULL == dirty->bits || NULL == dirty->written || NULL == dirty->names) {
+      stop_dirty(fs);
+      return;
+    }
+  } else {
+    // only the words with listed blocks have bits set
+    for (uint64_t i = 0; i < dirty->count; i++) {
+      dirty->bits[dirty->blocks[i] >> 6] = 0;
+      dirty->written[dirty->blocks[i] >> 6] = 0;
     }
-    free(values);
+    free_files(dirty->names);
+  }
+  dirty->count = 0;
+  dirty->all_files = FALSE;
+  dirty->dedup_dropped = FALSE;
+  dirty->lost = FALSE;
+  dirty->base = base;
+}
 
-    
-    if (result == IMFFS_OK) {
-      Multimap *index = mm_create(fs->block_count, compare_files_by_name, compare_always_greater);
+static int compare_blocks(const void *a, const void *b) {
+  uint64_t block_a = *(const uint64_t *)a, block_b = *(const uint64_t *)b;
 
-      if (NULL == index) {
-        fprintf(stderr, "Code 4 ");
-        result = IMFFS_ERROR;
-      } else {
-        
-        uint32_t curr_file_block = 0;
-        count = 0;
-        while (count < owner_count) {
-          File *curr_file = NULL;
-          
-          for (uint32_t pos = curr_file_block; pos < fs->block_count && NULL == curr_file; pos++) {
-            if (NULL != owners[pos]) {
-              curr_file = owners[pos];
-            }
-          }
-          
-          uint32_t curr_blocks = (curr_file->byte_len) / BYTES_PER_BLOCK + 1;
-          uint8_t *from_ptr, *to_ptr;
-          for (uint32_t pos = curr_file_block; pos < fs->block_count && curr_blocks > 0; pos++) {
-            if (owners[pos] == curr_file) {
-
-              // compact
-              to_ptr = fs->data + curr_file_block * BYTES_PER_BLOCK;
-              from_ptr = fs->data + pos * BYTES_PER_BLOCK;
-              if (owners[curr_file_block] == NULL) {
-                
-                memcpy(to_ptr, from_ptr, BYTES_PER_BLOCK);
-                owners[curr_file_block] = curr_file;
-                owners[pos] = NULL;
-              } else if (owners[curr_file_block] != curr_file) {
-
-                memcpy(buffer, from_ptr, BYTES_PER_BLOCK);
-              
-                memmove(to_ptr + BYTES_PER_BLOCK, to_ptr, from_ptr - to_ptr);
-                memmove(&owners[curr_file_block + 1], &owners[curr_file_block], (pos - curr_file_block) * sizeof(File *));
-                // printf("moving %u from %d to %d\n", pos - curr_file_block, pos + 1, pos);
-                
-                // restore from temp buffer
-                memcpy(to_ptr, buffer, BYTES_PER_BLOCK);
-
-                // now this block is owned by this file
-                owners[curr_file_block] = curr_file;
-              }
-              
-              
-              curr_file_block++;
-              curr_blocks--;
-            }
-          }
-          
-          count++;
-        }
-        
-        uint32_t files_left = owner_count + 1;
-        uint32_t blocks_left = 0;
-        File *curr_file = NULL;
-        for (uint32_t pos = 0; pos < fs->block_count; pos++) {
-          if (0 == files_left) {
-            assert(NULL == owners[pos]);
-          } else if (0 == blocks_left) {
-            files_left--;
-            if (files_left > 0) {
-              curr_file = owners[pos];
-              blocks_left = (curr_file->byte_len) / BYTES_PER_BLOCK;
-            }
-          } else {
-            assert(curr_file == owners[pos]);
-            assert(blocks_left > 0);
-            blocks_left--;
-          }
-        }
-        
-        files_left = owner_count;
-        curr_file = owner_count > 0 ? owners[0] : NULL;
-        uint32_t curr_start = 0;
-        uint32_t chunk_size = 0;
-        for (uint32_t pos = 0; pos <= fs->block_count && IMFFS_OK == result; pos++) {
-          
-          if (NULL == curr_file) {
-            if (pos < fs->block_count) {
-              assert(NULL == owners[pos]);
-              fs->used[pos] = BLOCK_FREE;
-            }
-          } else if (pos == fs->block_count || owners[pos] != curr_file) {
-            if (mm_insert_value(index, curr_file, chunk_size, &fs->data[curr_start * BYTES_PER_BLOCK]) <= 0) {
-              fprintf(stderr, "Code 5 ");
-              result = IMFFS_ERROR;
-            } else if (pos < fs->block_count) {
-              curr_file = owners[pos];
-              curr_start = pos;
-              chunk_size = 0;
-            }
-          }
-          chunk_size++;
-        }
-        
-        if (IMFFS_OK == result) {
-          mm_destroy(fs->index);
-          fs->index = index;
+  return block_a < block_b ? -1 : block_a > block_b;
+}
+
+// Everything that changed since the last checkpoint: the changed blocks, in
+// order, each with its use, references, whether dedup can find it, and its
+// contents if they changed and it's used; then the files saved, changed or
+// removed, or after a defrag every file.
+static void delta_write(IMFFSPtr fs, ImageStream *image) {
+  assert(validate_fs(fs));
+
+  Dirty *dirty = &fs->dirty;
+  uint64_t block, prev = 0, flags;
+  void *key;
+  File *file;
+
+  image_put(image, DELTA_MAGIC, strlen(DELTA_MAGIC));
+  image_put_number(image, DELTA_VERSION);
+  image_put_number(image, fs->block_count);
+  image_put_number(image, fs->block_size);
+  image_put_number(image, dirty->base);
+  image_put_state(fs, image);
+  image_put_number(image, NULL != fs->refs);
+  image_put_number(image, dirty->dedup_dropped);
+
+  qsort(dirty->blocks, dirty->count, sizeof(uint64_t), compare_blocks);
+  image_put_number(image, dirty->count);
+  for (uint64_t i = 0; i < dirty->count; i++) {
+    block = dirty->blocks[i];
+    image_put_number(image, block - prev);
+    prev = block;
+    image_put(image, &fs->used[block], 1);
+    if (NULL != fs->refs) {
+      image_put_number(image, fs->refs[block]);
+    }
+    flags = BLOCK_USED == fs->used[block] && dedup_find(fs, block) < fs->dedup_capacity ? DELTA_DEDUP : 0;
+    if (BLOCK_FREE != fs->used[block] && 0 != (dirty->written[block >> 6] & 1ULL << (block & 63))) {
+      flags |= DELTA_CONTENTS;
+    }
+    image_put_number(image, flags);
+    if (flags & DELTA_CONTENTS) {
+      image_put(image, block_address(fs, block), fs->block_size);
+    }
+  }
+
+  // a file that's gone has just its name
+  image_put_number(image, dirty->all_files);
+  if (dirty->all_files) {
+    image_put_number(image, mm_count_keys(fs->index));
+    if (mm_get_first_key(fs->index, &key) > 0) {
+      do {
+        image_put_number(image, 1);
+        image_put_file(fs, image, key);
+      } while (!image->failed && mm_get_next_key(fs->index, &key) > 0);
+    }
+  } else {
+    image_put_number(image, mm_count_keys(dirty->names));
+    if (mm_get_first_key(dirty->names, &key) > 0) {
+      do {
+        file = find_matching_file(fs->index, ((File *)key)->name);
+        image_put_number(image, NULL != file);
+        if (NULL != file) {
+          image_put_file(fs, image, file);
         } else {
-          mm_destroy(index);
+          image_put_name(image, ((File *)key)->name);
         }
+      } while (!image->failed && mm_get_next_key(dirty->names, &key) > 0);
+    }
+  }
+
+  image_put_crc(image);
+}
+
+// Writes a checkpoint to a temporary file, which replaces path only once
+// it's all on disk, then empties the journal, whose changes are all in it,
+// and starts keeping changes for the next incremental checkpoint.
+static IMFFSResult write_checkpoint(IMFFSPtr fs, char *path, void (*writer)(IMFFSPtr, ImageStream *),
+                                    ImageStream *image) {
+  assert(validate_fs(fs));
+  assert(NULL != path && NULL != writer && NULL != image);
+
+  IMFFSResult result;
+  char *temp_name, *slash;
+  int dir;
+
+  // spilled files' bytes have to be on disk before anything refers to them
+  result = imffs_journal_sync(fs);
+  if (IMFFS_OK == result && NULL != fs->backing && 0 != backing_sync(fs->backing)) {
+    fprintf(stderr, "Error: unable to write to the backing file.\n");
+    result = IMFFS_ERROR;
+  }
+  temp_name = malloc(strlen(path) + strlen(TEMP_FILE) + 1);
+  METRICS_COUNT(fs, allocations, 1);
+  if (IMFFS_OK == result && NULL == temp_name) {
+    fprintf(stderr, "Error: not enough memory to write image '%s'.\n", path);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK == result && NULL == (image->file = fopen(strcat(strcpy(temp_name, path), TEMP_FILE), "w"))) {
+    fprintf(stderr, "Error: unable to open external file '%s'.\n", temp_name);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK == result) {
+    TRACE_BEGIN(fs, "copy", NULL);
+    writer(fs, image);
+    TRACE_END(fs, "copy", NULL, 0, 0);
+    if (0 != fflush(image->file) || 0 != fsync(fileno(image->file))) {
+      image->failed = TRUE;
+    }
+    if (0 != fclose(image->file) || image->failed || 0 != rename(temp_name, path)) {
+      fprintf(stderr, "Error writing to image '%s'.\n", path);
+      unlink(temp_name);
+      result = IMFFS_ERROR;
+    } else {
+      // and the rename is only on disk once its directory is
+      slash = strrchr(temp_name, '/');
+      if (NULL != slash) {
+        slash[1] = '\0';
+      }
+      dir = open(NULL != slash ? temp_name : ".", O_RDONLY);
+      if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+      }
+      start_dirty(fs, image->id);
+      if (NULL != fs->backing) {
+        backing_checkpointed(fs->backing);
+      }
+      if (NULL != fs->journal && 0 != journal_reset(fs->journal, fs->seq, fs->block_count)) {
+        fprintf(stderr, "Error: unable to empty the journal.\n");
+        result = IMFFS_FATAL;
       }
     }
   }
-  
-  if (IMFFS_OK != result) {
-    fprintf(stderr, "Error: unable to defragment file system.\n");
+  free(temp_name);
+
+  return result;
+}
+
+IMFFSResult imffs_checkpoint(IMFFSPtr fs, char *imagefile) {
+  assert(validate_fs(fs));
+  assert(NULL != imagefile);
+
+  IMFFSResult result;
+  ImageStream image = { NULL, 0, 0, FALSE, 0 };
+
+  if (NULL == fs || NULL == imagefile) {
+    return IMFFS_INVALID;
   }
-  
-  free(owners);
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "checkpoint", NULL);
+
+  result = write_checkpoint(fs, imagefile, image_write, &image);
+
+  TRACE_END(fs, "checkpoint", NULL, 0, 0);
+  METRICS_END(fs, METRIC_CHECKPOINT, result, IMFFS_OK == result ? image.bytes : 0);
 
   return result;
 }
 
-IMFFSResult imffs_destroy(IMFFSPtr fs) {
-  
+IMFFSResult imffs_checkpoint_incremental(IMFFSPtr fs, char *deltafile) {
+  assert(validate_fs(fs));
+  assert(NULL != deltafile);
+
   IMFFSResult result = IMFFS_OK;
-  File *file = NULL;
-  void *key;
-  while (IMFFS_OK == result && mm_get_first_key(fs->index, &key) > 0) {
-    file = key;
-    if (mm_remove_key(fs->index, file) <= 0) {
-      assert(FALSE);
-      result = IMFFS_ERROR;
-    }
+  ImageStream image = { NULL, 0, 0, FALSE, 0 };
+  uint64_t blocks;
+
+  if (NULL == fs || NULL == deltafile) {
+    return IMFFS_INVALID;
+  }
+
+  METRICS_BEGIN();
+  TRACE_BEGIN(fs, "delta", NULL);
+
+  blocks = fs->dirty.count;
+  if (NULL == fs->dirty.bits) {
+    fprintf(stderr, "Error: there's no checkpoint to build on.\n");
+    result = IMFFS_ERROR;
+  } else if (fs->dirty.lost) {
+    fprintf(stderr, "Error: not enough memory to keep every change, so a full checkpoint is needed.\n");
+    result = IMFFS_ERROR;
+  } else {
+    result = write_checkpoint(fs, deltafile, delta_write, &image);
+  }
+  if (IMFFS_OK == result) {
+    METRICS_COUNT(fs, delta_blocks, blocks);
+  }
+
+  TRACE_END(fs, "delta", NULL, blocks, 0);
+  METRICS_END(fs, METRIC_DELTA, result, IMFFS_OK == result ? image.bytes : 0);
+
+  return result;
+}
 
+// a name image_put_name wrote, which the caller frees; NULL if it isn't there
+static char *image_get_name(ImageStream *image) {
+  uint64_t length = image_get_number(image);
+  char *name = NULL;
+
+  if (!image->failed && length <= MAX_IMAGE_NAME && NULL != (name = malloc(length + 1))) {
+    image_get(image, name, length);
+    name[length] = '\0';
+  }
+  if (NULL == name || image->failed) {
+    free(name);
+    image->failed = TRUE;
+    name = NULL;
+  }
+
+  return name;
+}
+
+// reads a record image_put_file wrote into the index, in place of any file
+// already there with the same name
+static void image_get_file(IMFFSPtr fs, ImageStream *image) {
+  assert(validate_fs(fs));
+
+  uint64_t flags, byte_len, etag;
+  File *file = NULL, *old;
+  Value list;
+
+  flags = image_get_number(image);
+  byte_len = image_get_number(image);
+  etag = image_get_number(image);
+  if (!image->failed && (0 == (flags & 1) || byte_len <= IMFFS_MAX_INLINE_SIZE) && 9 != (flags & 9)) {
+    file = malloc(sizeof(File) + (flags & 1 ? byte_len : 0));
+  }
+  if (NULL == file || NULL == (file->name = image_get_name(image))) {
+    free(file);
+    image->failed = TRUE;
+    return;
+  }
+  file->inlined = flags & 1 ? TRUE : FALSE;
+  file->packed = flags & 2 ? TRUE : FALSE;
+  file->compressed = flags & 4 ? TRUE : FALSE;
+  file->spilled = flags & 8 ? TRUE : FALSE;
+  file->backing = 0;
+  file->backing_len = 0;
+  file->byte_len = byte_len;
+  file->etag = etag;
+  file->pins = 0;
+  list.num = 0;
+  list.data = file->data;
+  if (file->inlined) {
+    image_get(image, file->data, file->byte_len);
+  } else if (file->spilled) {
+    // checked against the backing file when it's attached
+    file->backing = image_get_number(image);
+    file->backing_len = image_get_number(image);
+    if (NULL == (list.data = malloc(1))) {
+      image->failed = TRUE;
+    }
+  } else {
+    list.num = image_get_number(image);
+    list.data = NULL;
+    if (!image->failed && (uint64_t)list.num <= (fs->block_count + 1) * MAX_EXTENT_BYTES &&
+        NULL != (list.data = malloc(list.num > 0 ? list.num : 1))) {
+      image_get(image, list.data, list.num);
+    } else {
+      image->failed = TRUE;
+    }
+  }
+  if (!image->failed && NULL != (old = find_matching_file(fs->index, file->name))) {
+    drop_file(fs, old);
+  }
+  if (image->failed || mm_insert_value(fs->index, file, list.num, list.data) <= 0) {
+    if (!file->inlined) {
+      free(list.data);
+    }
     free(file->name);
     free(file);
+    image->failed = TRUE;
+  } else {
+    cache_link(fs, file);
+  }
+}
+
+// reads what image_write wrote into a new filesystem of the right size
+static IMFFSResult image_read(ImageStream *image, IMFFSPtr *fs) {
+  assert(NULL != image && NULL != fs);
+
+  IMFFSResult result = IMFFS_OK;
+  char magic[sizeof(IMAGE_MAGIC) - 1];
+  uint64_t block_count, block_size, settings[5], file_count, slot;
+
+  image_get(image, magic, sizeof(magic));
+  if (image->failed || 0 != memcmp(magic, IMAGE_MAGIC, sizeof(magic)) || IMAGE_VERSION != image_get_number(image)) {
+    return IMFFS_ERROR;
+  }
+  block_count = image_get_number(image);
+  block_size = image_get_number(image);
+  if (image->failed || block_size > IMFFS_MAX_BLOCK_SIZE ||
+      IMFFS_OK != (result = imffs_create(block_count, block_size, fs))) {
+    return IMFFS_OK == result ? IMFFS_ERROR : result;
+  }
+
+  (*fs)->seq = image_get_number(image);
+  for (int i = 0; i < 5; i++) {
+    settings[i] = image_get_number(image);
+  }
+  (*fs)->inline_limit = settings[0] <= IMFFS_MAX_INLINE_SIZE ? settings[0] : 0;
+  (*fs)->tail_packing = settings[1] ? TRUE : FALSE;
+  (*fs)->compression = settings[3] ? TRUE : FALSE;
+  (*fs)->open_tail = image_get_number(image);
+  image_get(image, (*fs)->used, block_count);
+  if ((*fs)->open_tail > block_count) {
+    image->failed = TRUE;
+  }
+
+  if (image_get_number(image)) {
+    (*fs)->refs = calloc(block_count + 1, sizeof(uint32_t));
+    image->failed |= NULL == (*fs)->refs;
+    for (uint64_t pos = 0; !image->failed && pos < block_count; pos++) {
+      (*fs)->refs[pos] = image_get_number(image);
+    }
+  }
+  // the flag only goes on once there are counts for it to use
+  (*fs)->dedup = settings[2] && NULL != (*fs)->refs ? TRUE : FALSE;
+
+  (*fs)->dedup_capacity = image_get_number(image);
+  (*fs)->dedup_count = image_get_number(image);
+  if ((*fs)->dedup_capacity > 0) {
+    if (0 != ((*fs)->dedup_capacity & ((*fs)->dedup_capacity - 1)) || (*fs)->dedup_count >= (*fs)->dedup_capacity ||
+        (*fs)->dedup_capacity > 2 * block_count + MIN_DEDUP_ENTRIES ||
+        NULL == ((*fs)->dedup_table = calloc((*fs)->dedup_capacity, sizeof(DedupEntry)))) {
+      (*fs)->dedup_capacity = 0;
+      image->failed = TRUE;
+    }
+  }
+  for (uint64_t i = 0; !image->failed && i < (*fs)->dedup_count; i++) {
+    slot = image_get_number(image);
+    if (slot >= (*fs)->dedup_capacity) {
+      image->failed = TRUE;
+    } else {
+      (*fs)->dedup_table[slot].hash = image_get_number(image);
+      (*fs)->dedup_table[slot].block = image_get_number(image);
+      image->failed |= (*fs)->dedup_table[slot].block > block_count;
+    }
+  }
+
+  file_count = image_get_number(image);
+  for (uint64_t i = 0; !image->failed && i < file_count; i++) {
+    image_get_file(*fs, image);
+  }
+
+  for (uint64_t pos = 0; !image->failed && pos < block_count; pos++) {
+    if (BLOCK_FREE != (*fs)->used[pos]) {
+      image->failed |= BLOCK_USED != (*fs)->used[pos] && BLOCK_TAIL != (*fs)->used[pos];
+      (*fs)->used_count++;
+      image_get(image, block_address(*fs, pos), block_size);
+    }
+  }
+
+  if (!image_get_crc(image)) {
+    image->failed = TRUE;
+  }
+  if (!image->failed && settings[4]) {
+    result = imffs_set_checksums(*fs, 1);
+  }
+
+  if (image->failed || IMFFS_OK != result) {
+    imffs_destroy(*fs);
+    *fs = NULL;
+    return IMFFS_OK == result ? IMFFS_ERROR : result;
+  }
+  start_dirty(*fs, image->id);
+
+  return IMFFS_OK;
+}
+
+// Applies what delta_write wrote to the filesystem of the checkpoint before
+// it. A block's old dedup entry is found by its old contents, so it's taken
+// out before they're replaced.
+static IMFFSResult delta_read(IMFFSPtr fs, ImageStream *image) {
+  assert(validate_fs(fs));
+  assert(NULL != image);
+
+  IMFFSResult result = IMFFS_OK;
+  char magic[sizeof(DELTA_MAGIC) - 1], *name;
+  uint64_t seq, settings[5], open_tail, has_refs, count, block = 0, gap, refs, flags, all_files;
+  uint8_t use;
+  File *file;
+
+  image_get(image, magic, sizeof(magic));
+  if (image->failed || 0 != memcmp(magic, DELTA_MAGIC, sizeof(magic)) || DELTA_VERSION != image_get_number(image) ||
+      fs->block_count != image_get_number(image) || fs->block_size != image_get_number(image) ||
+      NULL == fs->dirty.bits || fs->dirty.base != image_get_number(image)) {
+    return IMFFS_ERROR;
+  }
+
+  seq = image_get_number(image);
+  for (int i = 0; i < 5; i++) {
+    settings[i] = image_get_number(image);
+  }
+  open_tail = image_get_number(image);
+  has_refs = image_get_number(image);
+  if (image_get_number(image)) {
+    free(fs->dedup_table);
+    fs->dedup_table = NULL;
+    fs->dedup_capacity = 0;
+    fs->dedup_count = 0;
+  }
+  // counts are never dropped once there are some
+  if (open_tail > fs->block_count || (has_refs ? !count_refs(fs) : NULL != fs->refs)) {
+    image->failed = TRUE;
+  }
+
+  count = image_get_number(image);
+  image->failed |= count > fs->block_count;
+  for (uint64_t i = 0; !image->failed && i < count; i++) {
+    gap = image_get_number(image);
+    image_get(image, &use, 1);
+    refs = has_refs ? image_get_number(image) : 0;
+    flags = image_get_number(image);
+    if (image->failed || (i > 0 && 0 == gap) || gap >= fs->block_count - block || refs > UINT32_MAX ||
+        (BLOCK_FREE != use && BLOCK_USED != use && BLOCK_TAIL != use) || (BLOCK_FREE == use && 0 != flags)) {
+      image->failed = TRUE;
+      break;
+    }
+    block += gap;
+    if (BLOCK_USED == fs->used[block]) {
+      dedup_forget(fs, block);
+    }
+    if (BLOCK_FREE == fs->used[block] && BLOCK_FREE != use) {
+      fs->used_count++;
+    } else if (BLOCK_FREE != fs->used[block] && BLOCK_FREE == use) {
+      fs->used_count--;
+    }
+    fs->used[block] = use;
+    if (NULL != fs->refs) {
+      fs->refs[block] = refs;
+    }
+    if (flags & DELTA_CONTENTS) {
+      image_get(image, block_address(fs, block), fs->block_size);
+      update_checksum(fs, block);
+    }
+    if ((flags & DELTA_DEDUP) && BLOCK_USED == use) {
+      dedup_insert(fs, hash_block(block_address(fs, block), fs->block_size), block);
+    }
+  }
+
+  all_files = image_get_number(image);
+  if (all_files) {
+    image->failed |= !free_files(fs->index);
+    fs->coldest = NULL;
+    fs->hottest = NULL;
+  }
+  count = image_get_number(image);
+  for (uint64_t i = 0; !image->failed && i < count; i++) {
+    if (image_get_number(image)) {
+      image_get_file(fs, image);
+    } else if (NULL != (name = image_get_name(image))) {
+      if (NULL != (file = find_matching_file(fs->index, name))) {
+        drop_file(fs, file);
+      }
+      free(name);
+    }
+  }
+
+  if (!image_get_crc(image)) {
+    image->failed = TRUE;
+  }
+  if (!image->failed) {
+    fs->seq = seq;
+    fs->inline_limit = settings[0] <= IMFFS_MAX_INLINE_SIZE ? settings[0] : 0;
+    fs->tail_packing = settings[1] ? TRUE : FALSE;
+    fs->dedup = settings[2] && NULL != fs->refs ? TRUE : FALSE;
+    if (!fs->dedup) {
+      free(fs->dedup_table);
+      fs->dedup_table = NULL;
+      fs->dedup_capacity = 0;
+      fs->dedup_count = 0;
+    }
+    fs->compression = settings[3] ? TRUE : FALSE;
+    fs->open_tail = open_tail;
+    result = imffs_set_checksums(fs, settings[4] ? 1 : 0);
+  }
+  if (image->failed) {
+    result = IMFFS_ERROR;
+  }
+  if (IMFFS_OK == result) {
+    start_dirty(fs, image->id);
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_open_image(char *imagefile, IMFFSPtr *fs) {
+  assert(NULL != imagefile);
+  assert(NULL != fs);
+
+  IMFFSResult result;
+  ImageStream image = { NULL, 0, 0, FALSE, 0 };
+
+  if (NULL == imagefile || NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  *fs = NULL;
+  if (NULL == (image.file = fopen(imagefile, "r"))) {
+    fprintf(stderr, "Error: unable to open image '%s'.\n", imagefile);
+    return IMFFS_ERROR;
+  }
+  result = image_read(&image, fs);
+  if (IMFFS_ERROR == result) {
+    fprintf(stderr, "Error: '%s' isn't an image, or is damaged.\n", imagefile);
+  }
+  fclose(image.file);
+
+  return result;
+}
+
+IMFFSResult imffs_open_checkpoints(char *imagefile, char **deltafiles, uint32_t delta_count, IMFFSPtr *fs) {
+  assert(NULL != imagefile);
+  assert(NULL != deltafiles || 0 == delta_count);
+  assert(NULL != fs);
+
+  IMFFSResult result;
+  ImageStream image;
+
+  if (NULL == imagefile || (NULL == deltafiles && delta_count > 0) || NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  result = imffs_open_image(imagefile, fs);
+  for (uint32_t i = 0; IMFFS_OK == result && i < delta_count; i++) {
+    memset(&image, 0, sizeof(ImageStream));
+    if (NULL == (image.file = fopen(deltafiles[i], "r"))) {
+      fprintf(stderr, "Error: unable to open checkpoint '%s'.\n", deltafiles[i]);
+      result = IMFFS_ERROR;
+    } else {
+      result = delta_read(*fs, &image);
+      if (IMFFS_ERROR == result) {
+        fprintf(stderr, "Error: '%s' isn't the next checkpoint of '%s', or is damaged.\n", deltafiles[i], imagefile);
+      }
+      fclose(image.file);
+    }
+  }
+  if (IMFFS_OK != result && NULL != *fs) {
+    imffs_destroy(*fs);
+    *fs = NULL;
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_compact(char *imagefile, char **deltafiles, uint32_t delta_count, char *newimage) {
+  assert(NULL != newimage);
+
+  IMFFSResult result;
+  IMFFSPtr fs = NULL;
+
+  if (NULL == newimage) {
+    return IMFFS_INVALID;
+  }
+
+  result = imffs_open_checkpoints(imagefile, deltafiles, delta_count, &fs);
+  if (IMFFS_OK == result) {
+    result = imffs_checkpoint(fs, newimage);
+    imffs_destroy(fs);
+  }
+
+  return result;
+}
+
+IMFFSResult imffs_set_tracer(IMFFSPtr fs, IMFFSTracer tracer, void *context) {
+  assert(validate_fs(fs));
+
+  if (NULL == fs) {
+    return IMFFS_INVALID;
+  }
+
+  fs->tracer = tracer;
+  fs->tracer_context = NULL == tracer ? NULL : context;
+
+  return IMFFS_OK;
+}
+
+IMFFSResult imffs_destroy(IMFFSPtr fs) {
+  
+  IMFFSResult result = IMFFS_OK;
 
+  if (!free_files(fs->index)) {
+    result = IMFFS_ERROR;
   }
   
-  free(fs->data);
+  if (NULL != fs->shared) {
+    for (uint32_t i = 0; i < fs->shared_pending_count; i++) {
+      free(fs->shared_pending[i]);
+    }
+    // readers still attached keep what they have
+    shared_close(fs->shared);
+    shared_unlink(fs->shared_name);
+    free(fs->shared_name);
+  } else {
+    unmap_blocks(fs->data, (size_t)fs->block_count * fs->block_size);
+  }
   free(fs->used);
+  free(fs->refs);
+  free(fs->dedup_table);
+  free(fs->checksums);
+  stop_dirty(fs);
   mm_destroy(fs->index);
+  backing_close(fs->backing);
+  if (0 != journal_close(fs->journal)) {
+    fprintf(stderr, "Error: unable to write to the journal.\n");
+    result = IMFFS_ERROR;
+  }
   
   free(fs);
 
@@ -1,6 +1,7 @@
 #ifndef _A5_IMMFS
 #define _A5_IMMFS
 
+#include <stdio.h>
 #include <stdint.h>
 
 typedef struct IMFFS *IMFFSPtr;
@@ -14,22 +15,299 @@ typedef enum {
   IMFFS_NOT_IMPLEMENTED = 4
 } IMFFSResult;
 
-IMFFSResult imffs_create(uint32_t block_count, IMFFSPtr *fs);
+// A snapshot of how the device is used, see imffs_usage
+typedef struct {
+  uint32_t block_size;
+  uint64_t block_count;
+  uint64_t used_blocks;
+  uint64_t largest_free_run; // longest run of consecutive free blocks
+  uint64_t file_count;
+  uint64_t inline_files;     // files stored in their record instead of blocks
+  uint64_t packed_tails;     // files whose last partial block is in a tail block
+  uint64_t tail_blocks;      // blocks shared by packed tails, also in used_blocks
+  uint64_t shared_blocks;    // blocks saved by dedup: extra uses of blocks over all files
+  uint64_t compressed_files;
+  uint64_t stored_bytes;     // total_bytes as stored, after compression
+  uint64_t spilled_files;    // files in the backing file instead of blocks, see imffs_set_backing
+  uint64_t spilled_bytes;    // what they take there, also in stored_bytes
+  uint64_t extent_count;     // chunks over all files, an inline file has one
+  uint64_t max_file_extents; // chunks in the most fragmented file
+  uint64_t total_bytes;
+  uint64_t metadata_bytes;   // used map, index and file records, not the blocks
+} IMFFSUsage;
+
+#define IMFFS_DEFAULT_BLOCK_SIZE 256
+#define IMFFS_MIN_BLOCK_SIZE 64
+#define IMFFS_MAX_BLOCK_SIZE (1024 * 1024)
+#define IMFFS_MAX_INLINE_SIZE 4096
+
+// Block counts, file sizes and offsets are all 64-bit, so a volume can be
+// as large as memory allows. Returns IMFFS_FATAL if the device doesn't fit.
+// block_size must be a power of two from IMFFS_MIN_BLOCK_SIZE to
+// IMFFS_MAX_BLOCK_SIZE bytes, otherwise returns IMFFS_INVALID.
+IMFFSResult imffs_create(uint64_t block_count, uint32_t block_size, IMFFSPtr *fs);
 
 IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile);
 
+// saves length bytes from buffer as imffsfile, like imffs_save of a regular file holding them
+IMFFSResult imffs_put(IMFFSPtr fs, char *imffsfile, const void *buffer, uint64_t length);
+
 IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile);
 
+// Copies up to length bytes of the file, starting at offset, to buffer, and
+// sets bytes_read to how many there were: fewer at the end of the file.
+IMFFSResult imffs_read(IMFFSPtr fs, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                       uint64_t *bytes_read);
+
 IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile);
 
 IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew);
 
 IMFFSResult imffs_dir(IMFFSPtr fs);
 
+// fulldir also shows each file's etag
 IMFFSResult imffs_fulldir(IMFFSPtr fs);
 
+// calls lister with every file's name and size, in the order dir lists them
+typedef void (*IMFFSLister)(const char *name, uint64_t byte_len, void *context);
+IMFFSResult imffs_list(IMFFSPtr fs, IMFFSLister lister, void *context);
+
+// What imffs_stat reports about one file. The etag is an XXH64 of the
+// contents, taken as the file is saved, so two files (or a file and an
+// upstream copy hashed the same way) can be compared without reading them.
+typedef struct {
+  uint64_t byte_len;
+  uint64_t stored_bytes; // after compression
+  uint64_t blocks;
+  uint32_t extents;      // chunks, an inline file has one
+  uint64_t etag;
+  int inlined;
+  int packed;
+  int compressed;
+  int spilled;           // in the backing file, with no blocks
+} IMFFSStat;
+
+IMFFSResult imffs_stat(IMFFSPtr fs, char *imffsfile, IMFFSStat *stat);
+
+// Saves diskfile as imffsfile, replacing it if it's already there, unless
+// it has the same contents: then nothing is written and changed is set to
+// 0. Only a regular file of the same size is read to compare it. While a file is
+// replaced there has to be room for both copies.
+IMFFSResult imffs_update(IMFFSPtr fs, char *diskfile, char *imffsfile, int *changed);
+
+// Makes imffsdst a copy of imffssrc that shares its blocks, each with a
+// count of the files using it, so no data is copied: only the extent list,
+// and a packed tail or an inline file's contents. A shared block is only
+// copied when a write changes it.
+IMFFSResult imffs_clone(IMFFSPtr fs, char *imffssrc, char *imffsdst);
+
+// Copies length bytes from buffer into the file at offset, which can be up
+// to its size, so writing at the end appends. Only blocks the write touches
+// are changed, and any of them shared with another file are copied first.
+// Growing an inline file, or writing to a packed one, moves it into blocks
+// of its own; compressed files can't be written.
+IMFFSResult imffs_write(IMFFSPtr fs, char *imffsfile, uint64_t offset, const void *buffer, uint64_t length);
+
 IMFFSResult imffs_defrag(IMFFSPtr fs);
 
+// Changes the number of blocks of a live filesystem. Growing adds free
+// blocks at the end; shrinking defragments first if any blocks past the new
+// end are in use, and fails with IMFFS_ERROR if the files, or their number,
+// won't fit. Files can be read throughout, and the next checkpoint after a
+// resize has to be a full one.
+IMFFSResult imffs_resize(IMFFSPtr fs, uint64_t block_count);
+
+// Gives every page of the device that only holds free blocks back to the
+// OS, so the process's resident memory follows the files, and sets trimmed
+// to how many bytes that was. Deleting a file gives back the pages of any
+// of its chunks of 2 MB or more by itself.
+IMFFSResult imffs_trim(IMFFSPtr fs, uint64_t *trimmed);
+
+IMFFSResult imffs_usage(IMFFSPtr fs, IMFFSUsage *usage);
+
+// Files of up to limit bytes are saved inline, in the file's own record,
+// without using any blocks. By default that's every file smaller than one
+// block, up to IMFFS_MAX_INLINE_SIZE; 0 turns it off. Only affects later saves.
+IMFFSResult imffs_set_inline_limit(IMFFSPtr fs, uint32_t limit);
+
+// Tail packing: when on, the partial last block of a saved file is copied
+// into a tail block shared with other files' tails, and its own block is
+// freed. Off by default; only affects later saves, and imffs_defrag repacks
+// the tails that are already packed.
+IMFFSResult imffs_set_tail_packing(IMFFSPtr fs, int on);
+
+// Deduplication: when on, each block a save reads is hashed and, if a block
+// with the same contents is already on the device, the file uses that one
+// instead. Blocks are freed when the last file using them is deleted. Off
+// by default and only affects later saves; blocks already shared stay shared.
+IMFFSResult imffs_set_dedup(IMFFSPtr fs, int on);
+
+// Compression: when on, files saved from regular files are compressed in
+// groups of 64 KB, each on its own, so reading part of a file only
+// decompresses the groups it needs; a group that doesn't get smaller is
+// stored as it is. Off by default and only affects later saves, so it can
+// be chosen file by file; dir shows how many bytes a compressed file takes.
+IMFFSResult imffs_set_compression(IMFFSPtr fs, int on);
+
+// Cache mode: when on, saving a regular file that doesn't fit first evicts
+// (deletes) the least recently used files that aren't pinned until it does,
+// instead of failing. Saving, loading, reading or writing a file makes it
+// the most recently used, and every step is constant time. Off by default;
+// it isn't kept in images, and neither are the order of use or the pins.
+IMFFSResult imffs_set_cache(IMFFSPtr fs, int on);
+
+// A pinned file is never evicted. Pins nest: a file pinned twice is evicted
+// again once it's been unpinned twice, and is then the most recently used.
+IMFFSResult imffs_pin(IMFFSPtr fs, char *imffsfile);
+IMFFSResult imffs_unpin(IMFFSPtr fs, char *imffsfile);
+
+// Tiering: with a backing file attached, saving a regular file that doesn't
+// fit first spills the least recently used files that aren't pinned: their
+// contents move to the backing file, as they were stored, and their blocks
+// are freed, but they stay in the index. Loading, reading, writing or
+// cloning a spilled file brings it back into free blocks, spilling colder
+// files if it has to; a load or read of an uncompressed one that doesn't
+// fit is served straight from the backing file instead. In cache mode,
+// files are only evicted once there's nothing left to spill.
+//
+// Images keep where spilled files are, so the same backing file has to be
+// attached again, before imffs_journal, to use them. Space in it that's
+// freed is only reused after the next checkpoint, which the last one may
+// still refer to.
+IMFFSResult imffs_set_backing(IMFFSPtr fs, char *backingfile);
+
+// spills imffsfile now, whether or not there's room for it
+IMFFSResult imffs_spill(IMFFSPtr fs, char *imffsfile);
+
+// Sharing: imffs_share moves the blocks into the POSIX shared memory object
+// called name (e.g. "/imffs"), replacing one that's there, and publishes a
+// directory of the files beside them, again after every operation that
+// changes a file. Other processes open a reader on it and look files up
+// and read them without the filesystem's process doing anything: this one
+// stays the only writer, and is never held up by them. Readers retry
+// whatever the writer changed under them. A shared filesystem can't be
+// resized, and destroying it removes the object, though readers still
+// attached keep what they had.
+IMFFSResult imffs_share(IMFFSPtr fs, char *name);
+
+typedef struct IMFFS_READER *IMFFSReaderPtr;
+
+// A reader is for one thread at a time; open one per thread.
+IMFFSResult imffs_reader_open(char *name, IMFFSReaderPtr *reader);
+
+// stored_bytes of a compressed file is the whole blocks it takes
+IMFFSResult imffs_reader_stat(IMFFSReaderPtr reader, char *imffsfile, IMFFSStat *stat);
+
+// the same as imffs_read, for files that aren't spilled
+IMFFSResult imffs_reader_read(IMFFSReaderPtr reader, char *imffsfile, uint64_t offset, void *buffer, uint64_t length,
+                              uint64_t *bytes_read);
+
+typedef struct {
+  const void *data;
+  uint64_t length;
+} IMFFSChunk;
+
+// Zero copy: sets chunks to where the file's contents are in shared memory,
+// in order, count to how many there are, and version to check them with.
+// They can be used as they are, until the next call with this reader, but
+// the writer may change them at any time: whatever was done with them only
+// counts if imffs_reader_changed(reader, version) is 0 afterwards, and has
+// to be done again otherwise. Returns IMFFS_ERROR, with count set, if there
+// are more than max_chunks, and for compressed or spilled files.
+IMFFSResult imffs_reader_chunks(IMFFSReaderPtr reader, char *imffsfile, IMFFSChunk *chunks, uint32_t max_chunks,
+                                uint32_t *count, uint64_t *version);
+int imffs_reader_changed(IMFFSReaderPtr reader, uint64_t version);
+
+IMFFSResult imffs_reader_close(IMFFSReaderPtr reader);
+
+// Checksums: when on, every block has a CRC32C, taken when it's written and
+// verified before a load or read uses it; a block that doesn't match fails
+// the load. Turning them on checksums the blocks already in use, and
+// turning them off drops them.
+IMFFSResult imffs_set_checksums(IMFFSPtr fs, int on);
+
+// Verifies every block in use against its checksum, split over threads
+// (0 for one per CPU). checked and bad are set to the number of blocks
+// verified and how many of them didn't match; returns IMFFS_ERROR if any
+// didn't, or if checksums are off.
+IMFFSResult imffs_scrub(IMFFSPtr fs, uint32_t threads, uint64_t *checked, uint64_t *bad);
+
+// Persistence: an image is a copy of the whole filesystem in one file, and
+// a journal is a write-ahead log of every change made since the image was
+// written. Saves log the file's contents; deletes, renames, clones and
+// defrags only log what was done, and writes the bytes written. Replaying
+// the journal onto the image gets back everything that was committed
+// before a crash, without writing an image after every change.
+
+// Writes the filesystem to imagefile, replacing it only once the new one is
+// on disk, and empties the journal, if there is one.
+IMFFSResult imffs_checkpoint(IMFFSPtr fs, char *imagefile);
+
+// Creates a filesystem from an image imffs_checkpoint wrote, with the same
+// shape, files and settings.
+IMFFSResult imffs_open_image(char *imagefile, IMFFSPtr *fs);
+
+// Incremental checkpoints: after a checkpoint, or opening one, every block
+// whose contents, use or sharing changes is kept track of, and so is every
+// file that's saved, written, renamed or deleted. An incremental checkpoint
+// writes only those blocks and files to deltafile, so it takes time in
+// proportion to what changed rather than to the size of the device, and
+// empties the journal like a full one. Returns IMFFS_ERROR if there's been
+// no checkpoint to build on.
+IMFFSResult imffs_checkpoint_incremental(IMFFSPtr fs, char *deltafile);
+
+// Opens imagefile and applies the incremental checkpoints written after it,
+// which have to be in the order they were written.
+IMFFSResult imffs_open_checkpoints(char *imagefile, char **deltafiles, uint32_t delta_count, IMFFSPtr *fs);
+
+// Merges an image and the incremental checkpoints after it into one image,
+// newimage, which can be imagefile itself. A journal emptied by the last of
+// them goes on from the new image.
+IMFFSResult imffs_compact(char *imagefile, char **deltafiles, uint32_t delta_count, char *newimage);
+
+// Logs every later change to journalfile, creating it if it isn't there,
+// after replaying the changes already in it that fs doesn't have yet. fs
+// has to be either new, for a journal that has never been emptied, or
+// opened from the last image written with the journal attached.
+//
+// With commit_ms of 0, each change is synced to disk before it returns.
+// Otherwise changes are committed in groups: the first change in a group
+// waits up to commit_ms for others to join it, and they're all written
+// with one fdatasync by a thread of its own, so a crash can lose the last
+// commit_ms of changes, but no more, and never only part of one. Changes
+// that can't be logged are still made, but return IMFFS_FATAL.
+IMFFSResult imffs_journal(IMFFSPtr fs, char *journalfile, uint32_t commit_ms);
+
+// waits until every change so far is on disk
+IMFFSResult imffs_journal_sync(IMFFSPtr fs);
+
+// Tracing: a tracer installed with imffs_set_tracer is called at the start
+// and end of every operation and of its phases. Events with the same name
+// nest, so "save" contains "open", "reserve", "copy" and "index insert".
+typedef enum {
+  IMFFS_TRACE_BEGIN,
+  IMFFS_TRACE_END
+} IMFFSTracePhase;
+
+typedef struct {
+  IMFFSTracePhase phase;
+  const char *name;      // operation or phase, e.g. "save" or "reserve"
+  const char *file;      // IMFFS file involved, NULL if none
+  uint64_t timestamp_ns; // CLOCK_MONOTONIC
+  uint64_t blocks;       // blocks reserved, copied or moved (END events)
+  uint32_t extents;      // chunks touched (END events)
+} IMFFSTraceEvent;
+
+typedef void (*IMFFSTracer)(const IMFFSTraceEvent *event, void *context);
+
+// NULL removes the tracer
+IMFFSResult imffs_set_tracer(IMFFSPtr fs, IMFFSTracer tracer, void *context);
+
+// Prints call counts, bytes moved, latency percentiles and internal
+// counters. Only available when built with -DIMFFS_METRICS, otherwise
+// returns IMFFS_NOT_IMPLEMENTED.
+IMFFSResult imffs_metrics_dump(IMFFSPtr fs, FILE *out);
+
 IMFFSResult imffs_destroy(IMFFSPtr fs);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,587 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "a5_journal.h"
+#include "a5_crc.h"
+
+#define JOURNAL_MAGIC "IMFFSJN1"
+#define HEADER_BYTES 32            // magic, block count, block size, 4 spare bytes, base
+#define FRAME_BYTES 17             // payload length, CRC32C, sequence number, type
+#define FLUSH_BYTES (4 << 20)      // a group this big is written without waiting for the interval
+#define MAX_PENDING_BYTES (64 << 20) // commits wait for the thread past this
+
+struct JOURNAL {
+  int fd;
+  uint64_t block_count;
+  uint32_t block_size;
+  uint64_t base; // records up to this one are in an image
+  uint64_t seq;  // last record committed
+
+  // the record being built, its frame first
+  uint8_t *record;
+  size_t record_length;
+  size_t record_capacity;
+  int record_failed;
+
+  // group commit: records committed but not yet written, and the buffer
+  // the thread is writing from while more are committed
+  uint32_t commit_ms;
+  uint8_t *pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  uint64_t pending_seq;
+  uint8_t *writing;
+  size_t writing_capacity;
+  uint64_t durable_seq;
+  int flush;    // write what's pending now, without waiting out the interval
+  int stopping;
+  int failed;   // a write or fdatasync failed, so nothing after it is durable
+  int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t written;
+
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t syncs;
+};
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static int write_all(int fd, const uint8_t *bytes, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = write(fd, bytes, length);
+    if (written < 0 && EINTR == errno) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    bytes += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, uint8_t *bytes, size_t length, off_t offset) {
+  ssize_t got;
+
+  while (length > 0) {
+    got = pread(fd, bytes, length, offset);
+    if (got < 0 && EINTR == errno) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    bytes += got;
+    length -= got;
+    offset += got;
+  }
+
+  return 0;
+}
+
+static int write_header(Journal *journal) {
+  uint8_t header[HEADER_BYTES] = { 0 };
+
+  memcpy(header, JOURNAL_MAGIC, 8);
+  put_u64(&header[8], journal->block_count);
+  put_u32(&header[16], journal->block_size);
+  put_u64(&header[24], journal->base);
+
+  return HEADER_BYTES == pwrite(journal->fd, header, HEADER_BYTES, 0) ? 0 : -1;
+}
+
+// writes each group of pending records with one fdatasync
+static void *commit_thread(void *arg) {
+  Journal *journal = arg;
+  uint8_t *swap;
+  size_t length, capacity;
+  uint64_t seq;
+  struct timespec deadline;
+  int result;
+
+  pthread_mutex_lock(&journal->lock);
+  while (!journal->stopping || journal->pending_length > 0) {
+    if (0 == journal->pending_length) {
+      pthread_cond_wait(&journal->wake, &journal->lock);
+      continue;
+    }
+
+    // the first record of a group waits out the interval for others to join
+    if (!journal->flush && !journal->stopping) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += journal->commit_ms / 1000;
+      deadline.tv_nsec += (long)(journal->commit_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (!journal->flush && !journal->stopping &&
+             ETIMEDOUT != pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline)) {
+      }
+    }
+
+    swap = journal->writing;
+    capacity = journal->writing_capacity;
+    journal->writing = journal->pending;
+    journal->writing_capacity = journal->pending_capacity;
+    journal->pending = swap;
+    journal->pending_capacity = capacity;
+    length = journal->pending_length;
+    journal->pending_length = 0;
+    seq = journal->pending_seq;
+    journal->flush = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    result = write_all(journal->fd, journal->writing, length);
+    if (0 == result) {
+      result = fdatasync(journal->fd);
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    if (0 != result) {
+      journal->failed = 1;
+    } else {
+      journal->durable_seq = seq;
+      journal->syncs++;
+    }
+    pthread_cond_broadcast(&journal->written);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  return NULL;
+}
+
+Journal *journal_open(const char *path, uint64_t block_count, uint32_t block_size, uint32_t commit_ms) {
+  assert(NULL != path);
+
+  Journal *journal = calloc(1, sizeof(Journal));
+  uint8_t header[HEADER_BYTES];
+  struct stat st;
+
+  if (NULL == journal) {
+    fprintf(stderr, "Error: not enough memory to open journal '%s'.\n", path);
+    return NULL;
+  }
+  journal->block_count = block_count;
+  journal->block_size = block_size;
+  journal->commit_ms = commit_ms;
+
+  if ((journal->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || 0 != fstat(journal->fd, &st)) {
+    fprintf(stderr, "Error: unable to open journal '%s'.\n", path);
+  } else if (st.st_size < HEADER_BYTES) {
+    // new, or it never got as far as its header
+    if (0 != ftruncate(journal->fd, 0) || 0 != write_header(journal) || 0 != fdatasync(journal->fd)) {
+      fprintf(stderr, "Error: unable to write journal '%s'.\n", path);
+    } else {
+      journal->running = -1;
+    }
+  } else if (0 != read_all(journal->fd, header, HEADER_BYTES, 0) || 0 != memcmp(header, JOURNAL_MAGIC, 8)) {
+    fprintf(stderr, "Error: '%s' isn't a journal.\n", path);
+  } else if (get_u64(&header[8]) != block_count || get_u32(&header[16]) != block_size) {
+    fprintf(stderr, "Error: journal '%s' is for a device of %llu blocks of %u bytes.\n", path,
+            (unsigned long long)get_u64(&header[8]), get_u32(&header[16]));
+  } else {
+    journal->base = get_u64(&header[24]);
+    journal->running = -1;
+  }
+
+  if (-1 != journal->running) {
+    if (journal->fd >= 0) {
+      close(journal->fd);
+    }
+    free(journal);
+    return NULL;
+  }
+
+  journal->running = 0;
+  journal->seq = journal->base;
+  journal->durable_seq = journal->base;
+  lseek(journal->fd, 0, SEEK_END);
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+  pthread_cond_init(&journal->written, NULL);
+  if (commit_ms > 0) {
+    journal->running = 0 == pthread_create(&journal->thread, NULL, commit_thread, journal);
+    if (!journal->running) {
+      // every commit is synced on its own instead
+      journal->commit_ms = 0;
+    }
+  }
+
+  return journal;
+}
+
+int64_t journal_replay(Journal *journal, uint64_t base, JournalApply apply, void *context) {
+  assert(NULL != journal && NULL != apply);
+
+  uint8_t frame[FRAME_BYTES], *payload = NULL, *grown;
+  size_t capacity = 0;
+  uint32_t length;
+  uint64_t seq;
+  off_t offset = HEADER_BYTES, end = lseek(journal->fd, 0, SEEK_END);
+  int64_t applied = 0;
+
+  if (base < journal->base) {
+    fprintf(stderr, "Error: the journal starts after record %llu, but the image only has up to %llu.\n",
+            (unsigned long long)journal->base, (unsigned long long)base);
+    return -1;
+  }
+
+  while (applied >= 0 && offset + FRAME_BYTES <= end && 0 == read_all(journal->fd, frame, FRAME_BYTES, offset)) {
+    length = get_u32(frame);
+    seq = get_u64(&frame[8]);
+    if ((uint64_t)length > (uint64_t)(end - offset - FRAME_BYTES) || seq != journal->seq + 1) {
+      break;
+    }
+    if (length > capacity) {
+      grown = realloc(payload, length);
+      if (NULL == grown) {
+        fprintf(stderr, "Error: not enough memory to replay the journal.\n");
+        applied = -1;
+        break;
+      }
+      payload = grown;
+      capacity = length;
+    }
+    if (0 != read_all(journal->fd, payload, length, offset + FRAME_BYTES) ||
+        get_u32(&frame[4]) != crc32c(crc32c(0, &frame[8], FRAME_BYTES - 8), payload, length)) {
+      break;
+    }
+
+    if (seq > base && 0 != apply(frame[16], seq, payload, length, context)) {
+      applied = -1;
+      break;
+    }
+    journal->seq = seq;
+    offset += FRAME_BYTES + length;
+    if (seq > base) {
+      applied++;
+    }
+  }
+  free(payload);
+
+  if (applied >= 0) {
+    // a torn record at the end was never committed
+    if (offset < end && (0 != ftruncate(journal->fd, offset) || 0 != fdatasync(journal->fd))) {
+      fprintf(stderr, "Error: unable to cut off the end of the journal.\n");
+      applied = -1;
+    }
+    if (applied >= 0 && journal->seq < base) {
+      // the image has everything in it and more, so the next record
+      // follows on from the image instead
+      journal->base = base;
+      journal->seq = base;
+      offset = HEADER_BYTES;
+      if (0 != ftruncate(journal->fd, offset) || 0 != write_header(journal) || 0 != fdatasync(journal->fd)) {
+        fprintf(stderr, "Error: unable to empty the journal.\n");
+        applied = -1;
+      }
+    }
+    journal->durable_seq = journal->seq;
+    lseek(journal->fd, offset, SEEK_SET);
+  }
+
+  return applied;
+}
+
+static int reserve(uint8_t **bytes, size_t *capacity, size_t needed) {
+  uint8_t *grown;
+  size_t size = *capacity > 0 ? *capacity : 256;
+
+  if (needed <= *capacity) {
+    return 0;
+  }
+  while (size < needed) {
+    size *= 2;
+  }
+  if (NULL == (grown = realloc(*bytes, size))) {
+    return -1;
+  }
+  *bytes = grown;
+  *capacity = size;
+
+  return 0;
+}
+
+void journal_begin(Journal *journal, uint8_t type) {
+  assert(NULL != journal);
+
+  journal->record_failed = reserve(&journal->record, &journal->record_capacity, FRAME_BYTES);
+  journal->record_length = FRAME_BYTES;
+  if (!journal->record_failed) {
+    journal->record[16] = type;
+  }
+}
+
+void journal_put(Journal *journal, const void *bytes, size_t length) {
+  assert(NULL != journal && (NULL != bytes || 0 == length));
+
+  if (!journal->record_failed && length > 0) {
+    journal->record_failed = reserve(&journal->record, &journal->record_capacity, journal->record_length + length);
+    if (!journal->record_failed) {
+      memcpy(&journal->record[journal->record_length], bytes, length);
+      journal->record_length += length;
+    }
+  }
+}
+
+void journal_put_number(Journal *journal, uint64_t value) {
+  uint8_t bytes[10];
+  size_t length = 0;
+
+  while (value >= 0x80) {
+    bytes[length++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  bytes[length++] = (uint8_t)value;
+  journal_put(journal, bytes, length);
+}
+
+void journal_put_string(Journal *journal, const char *string) {
+  assert(NULL != string);
+
+  journal_put_number(journal, strlen(string));
+  journal_put(journal, string, strlen(string));
+}
+
+int journal_commit(Journal *journal) {
+  assert(NULL != journal);
+
+  size_t length = journal->record_length;
+  int result = 0;
+
+  if (journal->record_failed || length - FRAME_BYTES > UINT32_MAX) {
+    fprintf(stderr, "Error: not enough memory for a journal record.\n");
+    return -1;
+  }
+
+  put_u32(journal->record, length - FRAME_BYTES);
+  put_u64(&journal->record[8], journal->seq + 1);
+  put_u32(&journal->record[4], crc32c(0, &journal->record[8], length - 8));
+
+  if (0 == journal->commit_ms) {
+    if (0 != write_all(journal->fd, journal->record, length) || 0 != fdatasync(journal->fd)) {
+      result = -1;
+    } else {
+      journal->durable_seq = journal->seq + 1;
+      journal->syncs++;
+    }
+  } else {
+    pthread_mutex_lock(&journal->lock);
+    if (0 != reserve(&journal->pending, &journal->pending_capacity, journal->pending_length + length)) {
+      result = -1;
+    } else {
+      memcpy(&journal->pending[journal->pending_length], journal->record, length);
+      journal->pending_length += length;
+      journal->pending_seq = journal->seq + 1;
+      if (journal->pending_length >= FLUSH_BYTES) {
+        journal->flush = 1;
+      }
+      pthread_cond_signal(&journal->wake);
+      while (journal->pending_length >= MAX_PENDING_BYTES && !journal->failed) {
+        pthread_cond_wait(&journal->written, &journal->lock);
+      }
+    }
+    result = journal->failed ? -1 : result;
+    pthread_mutex_unlock(&journal->lock);
+  }
+
+  if (0 != result) {
+    fprintf(stderr, "Error: unable to write to the journal.\n");
+  } else {
+    journal->seq++;
+    journal->records++;
+    journal->bytes += length;
+  }
+  journal->record_length = 0;
+
+  return result;
+}
+
+void journal_abort(Journal *journal) {
+  assert(NULL != journal);
+
+  journal->record_length = 0;
+  journal->record_failed = 0;
+}
+
+int journal_sync(Journal *journal) {
+  assert(NULL != journal);
+
+  int result;
+
+  if (!journal->running) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  journal->flush = 1;
+  pthread_cond_signal(&journal->wake);
+  while (journal->durable_seq < journal->seq && !journal->failed) {
+    pthread_cond_wait(&journal->written, &journal->lock);
+  }
+  result = journal->failed ? -1 : 0;
+  pthread_mutex_unlock(&journal->lock);
+
+  return result;
+}
+
+int journal_reset(Journal *journal, uint64_t seq, uint64_t block_count) {
+  assert(NULL != journal);
+
+  if (0 != journal_sync(journal)) {
+    return -1;
+  }
+  journal->base = seq;
+  journal->block_count = block_count;
+  if (0 != ftruncate(journal->fd, HEADER_BYTES) || 0 != write_header(journal) || 0 != fdatasync(journal->fd)) {
+    return -1;
+  }
+  lseek(journal->fd, HEADER_BYTES, SEEK_SET);
+  if (journal->seq < seq) {
+    journal->seq = seq;
+    journal->durable_seq = seq;
+  }
+
+  return 0;
+}
+
+uint64_t journal_seq(Journal *journal) {
+  assert(NULL != journal);
+
+  return journal->seq;
+}
+
+void journal_stats(Journal *journal, uint64_t *records, uint64_t *bytes, uint64_t *syncs) {
+  assert(NULL != journal && NULL != records && NULL != bytes && NULL != syncs);
+
+  *records = journal->records;
+  *bytes = journal->bytes;
+  pthread_mutex_lock(&journal->lock);
+  *syncs = journal->syncs;
+  pthread_mutex_unlock(&journal->lock);
+}
+
+int journal_close(Journal *journal) {
+  int result = 0;
+
+  if (NULL == journal) {
+    return 0;
+  }
+
+  if (journal->running) {
+    pthread_mutex_lock(&journal->lock);
+    journal->stopping = 1;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+  }
+  result = journal->failed ? -1 : 0;
+  if (0 != close(journal->fd)) {
+    result = -1;
+  }
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->wake);
+  pthread_cond_destroy(&journal->written);
+  free(journal->record);
+  free(journal->pending);
+  free(journal->writing);
+  free(journal);
+
+  return result;
+}
+
+void record_reader_init(RecordReader *reader, const uint8_t *payload, uint32_t length) {
+  assert(NULL != reader && (NULL != payload || 0 == length));
+
+  reader->next = payload;
+  reader->stop = payload + length;
+  reader->failed = 0;
+}
+
+uint64_t record_get_number(RecordReader *reader) {
+  assert(NULL != reader);
+
+  uint64_t value = 0;
+  uint32_t shift = 0;
+
+  while (reader->next < reader->stop && shift < 64) {
+    value |= (uint64_t)(*reader->next & 0x7f) << shift;
+    shift += 7;
+    if (0 == (*reader->next++ & 0x80)) {
+      return value;
+    }
+  }
+  reader->failed = 1;
+
+  return 0;
+}
+
+const uint8_t *record_get_bytes(RecordReader *reader, uint64_t length) {
+  assert(NULL != reader);
+
+  const uint8_t *bytes = reader->next;
+
+  if (reader->failed || length > (uint64_t)(reader->stop - reader->next)) {
+    reader->failed = 1;
+    return NULL;
+  }
+  reader->next += length;
+
+  return bytes;
+}
+
+char *record_get_string(RecordReader *reader) {
+  uint64_t length = record_get_number(reader);
+  const uint8_t *bytes = record_get_bytes(reader, length);
+  char *string = NULL;
+
+  if (NULL != bytes && NULL != (string = malloc(length + 1))) {
+    memcpy(string, bytes, length);
+    string[length] = '\0';
+  }
+
+  return string;
+}
@@ -0,0 +1,76 @@
+#ifndef _A5_JOURNAL
+#define _A5_JOURNAL
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A write-ahead log of records, each a type, a sequence number and a
+// payload, framed with its length and a CRC32C so that a record torn by a
+// crash is found and cut off. Records are built with journal_begin,
+// journal_put and journal_commit. With a commit interval, committed records
+// wait in memory and a thread writes everything committed in each interval
+// with one fdatasync (group commit); without one, every commit is written
+// and synced before it returns.
+//
+// The file starts with a header giving the shape of the device it's for,
+// and the sequence number of the last record already in an image, which a
+// replay skips up to.
+
+typedef struct JOURNAL Journal;
+
+// Opens the journal at path, creating it if it isn't there. Returns NULL,
+// with an error, if it can't be opened or is for a device of another shape.
+Journal *journal_open(const char *path, uint64_t block_count, uint32_t block_size, uint32_t commit_ms);
+
+// Called for each record; returns 0 to go on, anything else to stop
+typedef int (*JournalApply)(uint8_t type, uint64_t seq, const uint8_t *payload, uint32_t length, void *context);
+
+// Calls apply for the records after base, in order, up to the first torn or
+// damaged one, which is cut off with everything after it; a journal with
+// nothing after base is emptied, to start again after it. Returns the
+// number of records applied, or -1 if apply stopped, the file couldn't be
+// read, or it starts after base, so records would be missed.
+int64_t journal_replay(Journal *journal, uint64_t base, JournalApply apply, void *context);
+
+// a record is built in memory, one field at a time
+void journal_begin(Journal *journal, uint8_t type);
+void journal_put(Journal *journal, const void *bytes, size_t length);
+void journal_put_number(Journal *journal, uint64_t value); // a varint
+void journal_put_string(Journal *journal, const char *string);
+
+// 0 when the record is in the journal (or waiting for the next group
+// commit), -1 if it couldn't be built or written
+int journal_commit(Journal *journal);
+void journal_abort(Journal *journal);
+
+// writes and syncs everything committed so far; 0 on success
+int journal_sync(Journal *journal);
+
+// empties the journal after a checkpoint has everything up to seq, for a
+// device that's block_count blocks by then, which a resize can change
+int journal_reset(Journal *journal, uint64_t seq, uint64_t block_count);
+
+// the last sequence number committed
+uint64_t journal_seq(Journal *journal);
+
+// records and bytes committed, and the fdatasyncs they took
+void journal_stats(Journal *journal, uint64_t *records, uint64_t *bytes, uint64_t *syncs);
+
+// syncs, and stops the commit thread
+int journal_close(Journal *journal);
+
+// reading back a record's fields
+typedef struct {
+  const uint8_t *next;
+  const uint8_t *stop;
+  int failed; // set once a field runs past the end
+} RecordReader;
+
+void record_reader_init(RecordReader *reader, const uint8_t *payload, uint32_t length);
+uint64_t record_get_number(RecordReader *reader);
+// a copy, NUL terminated, that the caller frees; NULL if it's not there
+char *record_get_string(RecordReader *reader);
+// the next length bytes where they are, NULL if there aren't that many
+const uint8_t *record_get_bytes(RecordReader *reader, uint64_t length);
+
+#endif
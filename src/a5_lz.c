@@ -0,0 +1,200 @@
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "a5_lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define LAST_LITERALS 5  // a block always ends with at least this many literals
+#define MATCH_LIMIT 12   // and no match starts in the last this many bytes
+#define SKIP_SHIFT 6     // step further ahead the longer nothing matches
+#define WILD_COPY 16
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static uint32_t hash4(uint32_t value) {
+  return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// 15 in the token, then 255s and the rest
+static uint32_t put_length(uint8_t *out, uint32_t length) {
+  uint32_t written = 0;
+
+  while (length >= 255) {
+    out[written++] = 255;
+    length -= 255;
+  }
+  out[written++] = length;
+
+  return written;
+}
+
+// writes one sequence, with no match if match_length is 0; returns the
+// number of bytes written, 0 if there isn't room
+static uint32_t emit(uint8_t *out, uint32_t room, const uint8_t *literals, uint32_t literal_length,
+                     uint32_t offset, uint32_t match_length) {
+  uint32_t written = 1;
+  uint8_t *token = out;
+
+  if (1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1 > room) {
+    return 0;
+  }
+
+  *token = (literal_length < 15 ? literal_length : 15) << 4;
+  if (literal_length >= 15) {
+    written += put_length(&out[written], literal_length - 15);
+  }
+  memcpy(&out[written], literals, literal_length);
+  written += literal_length;
+
+  if (match_length > 0) {
+    assert(match_length >= MIN_MATCH && offset > 0 && offset <= MAX_OFFSET);
+    out[written++] = offset & 0xff;
+    out[written++] = offset >> 8;
+    match_length -= MIN_MATCH;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) {
+      written += put_length(&out[written], match_length - 15);
+    }
+  }
+
+  return written;
+}
+
+uint32_t lz_compress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t capacity) {
+  assert(NULL != in || 0 == len);
+  assert(NULL != out);
+
+  uint32_t table[1 << HASH_BITS];
+  uint32_t pos = 1, anchor = 0, written = 0, candidate, match_length, misses = 0, n, h;
+
+  if (len > MATCH_LIMIT + 1) {
+    memset(table, 0, sizeof(table));
+    table[hash4(read32(in))] = 0;
+
+    while (pos < len - MATCH_LIMIT) {
+      h = hash4(read32(&in[pos]));
+      candidate = table[h];
+      table[h] = pos;
+
+      if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(&in[candidate]) != read32(&in[pos])) {
+        pos += 1 + (misses++ >> SKIP_SHIFT);
+        continue;
+      }
+      misses = 0;
+
+      while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+        pos--;
+        candidate--;
+      }
+      match_length = MIN_MATCH;
+      while (pos + match_length < len - LAST_LITERALS && in[candidate + match_length] == in[pos + match_length]) {
+        match_length++;
+      }
+
+      if (0 == (n = emit(&out[written], capacity - written, &in[anchor], pos - anchor, pos - candidate, match_length))) {
+        return 0;
+      }
+      written += n;
+      pos += match_length;
+      anchor = pos;
+
+      // so the next match can start inside this one
+      if (pos < len - MATCH_LIMIT) {
+        table[hash4(read32(&in[pos - 2]))] = pos - 2;
+      }
+    }
+  }
+
+  if (0 == (n = emit(&out[written], capacity - written, &in[anchor], len - anchor, 0, 0))) {
+    return 0;
+  }
+
+  return written + n;
+}
+
+int64_t lz_decompress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t capacity) {
+  assert(NULL != in || 0 == len);
+  assert(NULL != out || 0 == capacity);
+
+  uint32_t pos = 0, written = 0, literal_length, match_length, offset;
+  uint8_t token, byte;
+
+  while (pos < len) {
+    token = in[pos++];
+
+    literal_length = token >> 4;
+    if (15 == literal_length) {
+      do {
+        if (pos >= len) {
+          return -1;
+        }
+        byte = in[pos++];
+        literal_length += byte;
+      } while (255 == byte);
+    }
+    if (literal_length > len - pos || literal_length > capacity - written) {
+      return -1;
+    }
+    if (literal_length <= WILD_COPY && len - pos >= WILD_COPY && capacity - written >= WILD_COPY) {
+      // most runs of literals are short: one fixed size copy is faster
+      memcpy(&out[written], &in[pos], WILD_COPY);
+    } else {
+      memcpy(&out[written], &in[pos], literal_length);
+    }
+    pos += literal_length;
+    written += literal_length;
+
+    // the last sequence has no match
+    if (pos == len) {
+      break;
+    }
+
+    if (len - pos < 2) {
+      return -1;
+    }
+    offset = in[pos] | (in[pos + 1] << 8);
+    pos += 2;
+    if (0 == offset || offset > written) {
+      return -1;
+    }
+    match_length = token & 15;
+    if (15 == match_length) {
+      do {
+        if (pos >= len) {
+          return -1;
+        }
+        byte = in[pos++];
+        match_length += byte;
+      } while (255 == byte);
+    }
+    match_length += MIN_MATCH;
+    if (match_length > capacity - written) {
+      return -1;
+    }
+
+    if (offset >= 8 && capacity - written >= match_length + 8) {
+      // 8 bytes at a time, possibly past the end of the match: what's
+      // copied there is overwritten by the next sequence
+      for (uint32_t i = 0; i < match_length; i += 8) {
+        memcpy(&out[written + i], &out[written + i - offset], 8);
+      }
+    } else if (offset >= match_length) {
+      memcpy(&out[written], &out[written - offset], match_length);
+    } else {
+      // the match overlaps what it's copying, which repeats it
+      for (uint32_t i = 0; i < match_length; i++) {
+        out[written + i] = out[written + i - offset];
+      }
+    }
+    written += match_length;
+  }
+
+  return written;
+}
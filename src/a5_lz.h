@@ -0,0 +1,23 @@
+#ifndef _A5_LZ
+#define _A5_LZ
+
+#include <stdint.h>
+
+// A byte-oriented LZ77 codec in the style of the LZ4 block format: each
+// sequence is a token (literal length and match length, 4 bits each), the
+// literals, and a 16-bit offset back to the match. Greedy matching with a
+// small hash table keeps compression cheap, and decoding is little more
+// than memcpy.
+
+// the most lz_compress can write for len bytes of input
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Returns the number of bytes written to out, or 0 if they don't fit in
+// capacity bytes.
+uint32_t lz_compress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t capacity);
+
+// Returns the number of bytes written to out, or -1 if in isn't valid
+// compressed data or decompresses to more than capacity bytes.
+int64_t lz_decompress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t capacity);
+
+#endif
@@ -6,12 +6,27 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "a5_imffs.h"
+#include "a5_server.h"
+#include "a5_trace.h"
 
 #define DEFAULT_BLOCK_COUNT 64
+#define DEFAULT_TRACE_EVENTS 65536
 #define MAX_COMMAND 1024
+#define MAX_DELTAS 64 // incremental checkpoints given with -D, or to "compact"
+#define MAX_READER_CHUNKS 1024 // a file in more is copied out, not written straight from shared memory
 #define WHITESPACE " \t"
+#define PIPELINE_DEPTH 256 // lines read ahead of the one running, with -p
+#define PIPELINE_CHUNK (64 * 1024) // read from the input at a time
+#define PREFETCH_CHUNK (1024 * 1024)
 
 #define HANDLE_RESULT(e) handle_result(e, #e)
 
@@ -47,40 +62,622 @@ int handle_result(IMFFSResult result, char *action) {
   return modified_result;
 }
 
-int interactive_imffs(uint32_t block_count) {
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// size of a file on disk, 0 if it can't be determined
+static uint64_t disk_file_size(char *name) {
+  struct stat st;
+  if (0 != stat(name, &st)) {
+    return 0;
+  }
+  return (uint64_t)st.st_size;
+}
+
+// writes a disk file's contents into a file at offset, for "write"
+static IMFFSResult write_from_disk(IMFFSPtr fs, char *imffsfile, uint64_t offset, char *diskfile) {
+  IMFFSResult result = IMFFS_ERROR;
+  uint64_t size = disk_file_size(diskfile);
+  uint8_t *buffer = malloc(size + 1);
+  FILE *in = fopen(diskfile, "r");
+
+  if (NULL == in) {
+    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
+  } else if (NULL == buffer) {
+    fprintf(stderr, "Error: not enough memory to read external file '%s'.\n", diskfile);
+  } else if (fread(buffer, 1, size, in) != size) {
+    fprintf(stderr, "Error reading from input file '%s'.\n", diskfile);
+  } else {
+    result = imffs_write(fs, imffsfile, offset, buffer, size);
+  }
+  if (NULL != in) {
+    fclose(in);
+  }
+  free(buffer);
+
+  return result;
+}
+
+// trace on [events] | trace dump file.json | trace off
+// returns 1 if the arguments were wrong and help should be shown
+static int trace_command(IMFFSPtr fs, TraceRing **ring, char *action, char *arg) {
+  int help = 0, written;
+  long capacity = DEFAULT_TRACE_EVENTS;
+  char *end_p;
+  FILE *out;
+
+  if (0 == strcasecmp("on", action)) {
+    if (NULL != arg) {
+      capacity = strtol(arg, &end_p, 10);
+    }
+    if (NULL != arg && ('\0' != *end_p || capacity <= 0 || capacity > UINT32_MAX)) {
+      help = 1;
+    } else {
+      imffs_set_tracer(fs, NULL, NULL);
+      trace_ring_destroy(*ring);
+      *ring = trace_ring_create(capacity);
+      if (NULL == *ring) {
+        fprintf(stderr, "Error: not enough memory to trace %ld events.\n", capacity);
+      } else {
+        HANDLE_RESULT(imffs_set_tracer(fs, trace_ring_record, *ring));
+      }
+    }
+  } else if (0 == strcasecmp("off", action) && NULL == arg) {
+    imffs_set_tracer(fs, NULL, NULL);
+    trace_ring_destroy(*ring);
+    *ring = NULL;
+  } else if (0 == strcasecmp("dump", action) && NULL != arg) {
+    if (NULL == *ring) {
+      printf("Tracing is off, use \"trace on\" first.\n");
+    } else if (NULL == (out = fopen(arg, "w"))) {
+      fprintf(stderr, "Error: unable to open external file '%s'.\n", arg);
+    } else {
+      written = trace_ring_dump_json(*ring, out);
+      if (fclose(out) != 0 || written < 0) {
+        fprintf(stderr, "Error writing to file '%s'.\n", arg);
+      } else {
+        printf("Wrote %d of %llu events to %s\n", written, (unsigned long long)trace_ring_count(*ring), arg);
+      }
+    }
+  } else {
+    help = 1;
+  }
+
+  return help;
+}
+
+// how the filesystem is made, from the command line
+typedef struct {
+  uint64_t block_count;
+  uint32_t block_size;
+  long inline_limit; // -1 for the filesystem's default
+  int tail_packing;
+  int dedup;
+  int compression;
+  int checksums;
+  int cache;         // saves evict the least recently used files to make room
+  char *backing;     // cold files are spilled to it to make room, NULL for none
+  char *shared;      // shared memory object the blocks are moved to for readers, NULL for none
+  char *image;       // opened instead of a new filesystem if it's there, and what "checkpoint" writes
+  char *deltas[MAX_DELTAS]; // incremental checkpoints applied to the image, in order
+  uint32_t delta_count;
+  char *journal;     // every change is logged to it, NULL for none
+  uint32_t commit_ms; // group commit interval for the journal, 0 to sync every change
+} ShellOptions;
+
+// opens the image if there is one, or creates a new filesystem, attaches
+// the backing file, replays and attaches the journal, changes the settings
+// asked for, then shares it
+static int open_imffs(ShellOptions *options, IMFFSPtr *fs) {
+  int result;
+  struct stat st;
+
+  if (NULL != options->image && 0 == stat(options->image, &st)) {
+    result = HANDLE_RESULT(imffs_open_checkpoints(options->image, options->deltas, options->delta_count, fs));
+  } else if (options->delta_count > 0) {
+    fprintf(stderr, "Error: there's no image '%s' for the incremental checkpoints.\n",
+            NULL != options->image ? options->image : "");
+    return -1;
+  } else {
+    // printf("Creating a file system with %u blocks.\n", block_count);
+    result = HANDLE_RESULT(imffs_create(options->block_count, options->block_size, fs));
+  }
+  if (NULL == *fs) {
+    return -1;
+  }
+  // spilled files in the image, or the journal, are in it
+  if (!result && NULL != options->backing) {
+    result = HANDLE_RESULT(imffs_set_backing(*fs, options->backing));
+  }
+  if (!result && NULL != options->journal && IMFFS_OK != imffs_journal(*fs, options->journal, options->commit_ms)) {
+    // changes made without it would be lost, or logged after a gap
+    fprintf(stderr, "Error: unable to use journal '%s'.\n", options->journal);
+    result = 1;
+  }
+  if (!result && options->inline_limit >= 0) {
+    result = HANDLE_RESULT(imffs_set_inline_limit(*fs, options->inline_limit));
+  }
+  if (!result && options->tail_packing) {
+    result = HANDLE_RESULT(imffs_set_tail_packing(*fs, options->tail_packing));
+  }
+  if (!result && options->dedup) {
+    result = HANDLE_RESULT(imffs_set_dedup(*fs, options->dedup));
+  }
+  if (!result && options->compression) {
+    result = HANDLE_RESULT(imffs_set_compression(*fs, options->compression));
+  }
+  if (!result && options->checksums) {
+    result = HANDLE_RESULT(imffs_set_checksums(*fs, options->checksums));
+  }
+  if (!result && options->cache) {
+    result = HANDLE_RESULT(imffs_set_cache(*fs, options->cache));
+  }
+  if (!result && NULL != options->shared) {
+    result = HANDLE_RESULT(imffs_share(*fs, options->shared));
+  }
+
+  return result;
+}
+
+// Copies imffsfile out of shared memory to diskfile, for the reader shell.
+// Its chunks are written as they are, and again if it changed meanwhile.
+static IMFFSResult reader_load(IMFFSReaderPtr reader, char *imffsfile, char *diskfile, uint64_t *bytes) {
+  IMFFSResult result;
+  IMFFSStat stat;
+  IMFFSChunk chunks[MAX_READER_CHUNKS];
+  uint32_t count;
+  uint64_t version;
+  uint8_t *buffer = NULL;
+  FILE *out;
+
+  *bytes = 0;
+  if (IMFFS_OK != (result = imffs_reader_stat(reader, imffsfile, &stat))) {
+    return result;
+  }
+  if (NULL == (out = fopen(diskfile, "w"))) {
+    fprintf(stderr, "Error: unable to open external file '%s'.\n", diskfile);
+    return IMFFS_ERROR;
+  }
+
+  if (!stat.compressed && !stat.spilled && stat.extents <= MAX_READER_CHUNKS) {
+    do {
+      rewind(out);
+      *bytes = 0;
+      result = imffs_reader_chunks(reader, imffsfile, chunks, MAX_READER_CHUNKS, &count, &version);
+      for (uint32_t i = 0; IMFFS_OK == result && i < count; i++) {
+        fwrite(chunks[i].data, 1, chunks[i].length, out);
+        *bytes += chunks[i].length;
+      }
+    } while (IMFFS_OK == result && imffs_reader_changed(reader, version));
+    // a copy written again can be shorter
+    if (IMFFS_OK == result && (0 != fflush(out) || 0 != ftruncate(fileno(out), *bytes))) {
+      result = IMFFS_ERROR;
+    }
+  } else if (NULL == (buffer = malloc(stat.byte_len + 1))) {
+    fprintf(stderr, "Error: not enough memory to read file '%s'.\n", imffsfile);
+    result = IMFFS_ERROR;
+  } else if (IMFFS_OK == (result = imffs_reader_read(reader, imffsfile, 0, buffer, stat.byte_len, bytes))) {
+    fwrite(buffer, 1, *bytes, out);
+  }
+
+  if (0 != fclose(out) && IMFFS_OK == result) {
+    result = IMFFS_ERROR;
+  }
+  free(buffer);
+
+  return result;
+}
+
+// The reader shell, for -R: reads files from a filesystem another process
+// shares, without changing it.
+static int reader_imffs(char *name, FILE *in, int quiet) {
   int result = 0, len, help;
-  IMFFSPtr fs = NULL;
+  IMFFSReaderPtr reader = NULL;
+  IMFFSStat stat;
+  uint64_t bytes;
   char command[MAX_COMMAND], ch, *token, *token2;
-  
+
+  if (0 != HANDLE_RESULT(imffs_reader_open(name, &reader)) || NULL == reader) {
+    return 1;
+  }
+
   while (!result) {
-    if (NULL == fs) {
-      // printf("Creating a file system with %u blocks.\n", block_count);
-      result = HANDLE_RESULT(imffs_create(block_count, &fs));
-      if (NULL == fs) {
-        result = -1;
+    if (!quiet) {
+      printf("> ");
+    }
+    if (NULL == fgets(command, MAX_COMMAND, in)) {
+      if (!quiet) {
+        printf("\n\nQuitting on EOF.\n");
+      }
+      result = 1;
+      continue;
+    }
+    len = strlen(command);
+    ch = command[len - 1];
+    if (ch != '\n' && !feof(in)) {
+      printf("Command exceeds %d characters, unable to process.\n", MAX_COMMAND-1);
+      while (ch != '\n' && ch != EOF) {
+        ch = fgetc(in);
+      }
+      continue;
+    }
+    if (ch == '\n') {
+      command[len - 1] = '\0';
+    }
+
+    token = strtok(command, WHITESPACE);
+    help = 0;
+    if (NULL == token) {
+      help = 1;
+    } else if (0 == strcasecmp("load", token)) {
+      token = strtok(NULL, WHITESPACE);
+      token2 = strtok(NULL, WHITESPACE);
+      if (NULL == token || NULL == token2 || NULL != strtok(NULL, "")) {
+        help = 1;
+      } else {
+        HANDLE_RESULT(reader_load(reader, token, token2, &bytes));
+      }
+    } else if (0 == strcasecmp("stat", token)) {
+      token = strtok(NULL, WHITESPACE);
+      if (NULL == token || NULL != strtok(NULL, "")) {
+        help = 1;
+      } else if (0 == HANDLE_RESULT(imffs_reader_stat(reader, token, &stat))) {
+        printf("%s: %llu bytes, %llu blocks, %u chunks, etag %016llx%s%s%s%s\n", token,
+               (unsigned long long)stat.byte_len, (unsigned long long)stat.blocks, stat.extents,
+               (unsigned long long)stat.etag, stat.inlined ? ", inline" : "", stat.packed ? ", packed" : "",
+               stat.compressed ? ", compressed" : "", stat.spilled ? ", spilled" : "");
+      }
+    } else if (0 == strcasecmp("quit", token) && NULL == strtok(NULL, "")) {
+      if (!quiet) {
+        printf("\nQuitting.\n");
       }
+      result = 1;
     } else {
+      if (0 != strcasecmp("help", token)) {
+        printf("Unknown command '%s'\n", token);
+      }
+      help = 1;
+    }
 
-      printf("> ");
-      if (NULL == fgets(command, MAX_COMMAND, stdin)) {
-        printf("\n\nQuitting on EOF.\n");
+    if (help) {
+      printf("\nCommands:\n\n");
+      printf("load imffsfile diskfile: copy from the shared IMFFS to your system\n");
+      printf("stat imffsfile: shows the file's size, blocks, chunks and etag (a hash of its contents)\n");
+      printf("help: lists the commands\n");
+      printf("quit: will quit the program\n\n");
+    }
+  }
+
+  imffs_reader_close(reader);
+
+  return 0;
+}
+
+// in:     where to read commands from
+// quiet:  don't print prompts or the quit message
+// timing: report the wall time of each command and a summary to stderr
+// With -p, piped commands are read ahead on one thread, and the disk files
+// that upcoming saves, updates and writes will read are read through on
+// another, so they're in the page cache by the time the shell gets to them
+// and its own reads don't wait for the disk. The shell still runs every
+// line itself, in order, so nothing it prints changes: reading a file ahead
+// only warms the cache, and one that changes in between, say by a load
+// before the save, is just read again.
+typedef struct {
+  int fd;
+  int stop_pipe[2];      // written once the shell is done, so a read of the input doesn't hold it up
+  pthread_t reader;
+  pthread_t prefetcher;
+  pthread_mutex_t lock;  // everything below
+  pthread_cond_t changed;
+  char lines[PIPELINE_DEPTH][MAX_COMMAND];
+  uint8_t too_long[PIPELINE_DEPTH]; // the line was cut off at MAX_COMMAND - 1 characters
+  uint64_t read;         // lines the reader has put in lines
+  uint64_t taken;        // lines the shell has taken
+  int ended;             // the reader is at the end of the input
+  int stopping;
+  uint64_t prefetched_files;
+  uint64_t prefetched_bytes;
+} Pipeline;
+
+// waits for room and adds a line; 0 if the shell is done
+static int pipeline_add(Pipeline *pipeline, char *line, size_t length, int too_long) {
+  int added = 0;
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (!pipeline->stopping && pipeline->read - pipeline->taken >= PIPELINE_DEPTH) {
+    pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+  }
+  if (!pipeline->stopping) {
+    memcpy(pipeline->lines[pipeline->read % PIPELINE_DEPTH], line, length);
+    pipeline->lines[pipeline->read % PIPELINE_DEPTH][length] = '\0';
+    pipeline->too_long[pipeline->read % PIPELINE_DEPTH] = too_long;
+    pipeline->read++;
+    pthread_cond_broadcast(&pipeline->changed);
+    added = 1;
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return added;
+}
+
+// Splits the input into lines the way fgets would: a line that doesn't end
+// within MAX_COMMAND - 1 characters is cut off there, and the rest of it
+// skipped.
+static void *read_lines(void *arg) {
+  Pipeline *pipeline = arg;
+  struct pollfd polled[2] = { { pipeline->fd, POLLIN, 0 }, { pipeline->stop_pipe[0], POLLIN, 0 } };
+  char *buffer = malloc(PIPELINE_CHUNK), line[MAX_COMMAND];
+  ssize_t have = 0, at = 0;
+  size_t length = 0;
+  int skipping = 0, more = NULL != buffer;
+
+  while (more) {
+    if (at == have) {
+      if (poll(polled, 2, -1) < 0 || (polled[1].revents & POLLIN)) {
+        break;
+      }
+      do {
+        have = read(pipeline->fd, buffer, PIPELINE_CHUNK);
+      } while (have < 0 && EINTR == errno);
+      at = 0;
+      if (have <= 0) {
+        // a last line without a newline
+        if (length > 0) {
+          pipeline_add(pipeline, line, length, 0);
+        }
+        break;
+      }
+    }
+    line[length] = buffer[at++];
+    if (skipping) {
+      skipping = '\n' != line[length];
+    } else if ('\n' == line[length++]) {
+      more = pipeline_add(pipeline, line, length, 0);
+      length = 0;
+    } else if (MAX_COMMAND - 1 == length) {
+      more = pipeline_add(pipeline, line, length, 1);
+      length = 0;
+      skipping = 1;
+    }
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->ended = 1;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->lock);
+  free(buffer);
+
+  return NULL;
+}
+
+// the disk file a command will read, if it's one worth reading ahead
+static char *upcoming_read(char *line) {
+  char *save_p, *token;
+
+  line[strcspn(line, "\n")] = '\0';
+  token = strtok_r(line, WHITESPACE, &save_p);
+  if (NULL == token) {
+    return NULL;
+  }
+  if (0 == strcasecmp("save", token) || 0 == strcasecmp("zsave", token) || 0 == strcasecmp("update", token)) {
+    return strtok_r(NULL, WHITESPACE, &save_p);
+  }
+  if (0 == strcasecmp("write", token) && NULL != strtok_r(NULL, WHITESPACE, &save_p) &&
+      NULL != strtok_r(NULL, WHITESPACE, &save_p)) {
+    return strtok_r(NULL, WHITESPACE, &save_p);
+  }
+
+  return NULL;
+}
+
+// reads a regular file through, to have it in the page cache; errors are the shell's to report
+static void prefetch_file(Pipeline *pipeline, char *name, uint8_t *buffer) {
+  struct stat st;
+  ssize_t got;
+  uint64_t bytes = 0;
+  int fd;
+
+  // Nothing else is opened: opening a FIFO would take its writer's data
+  // from the save, and a device could be read for good. It's checked again
+  // once open, in case something else was put there.
+  if (0 != stat(name, &st) || !S_ISREG(st.st_mode) || (fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    return;
+  }
+  if (0 == fstat(fd, &st) && S_ISREG(st.st_mode)) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (!__atomic_load_n(&pipeline->stopping, __ATOMIC_RELAXED) &&
+           (got = read(fd, buffer, PREFETCH_CHUNK)) > 0) {
+      bytes += got;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->prefetched_files++;
+    pipeline->prefetched_bytes += bytes;
+    pthread_mutex_unlock(&pipeline->lock);
+  }
+  close(fd);
+}
+
+// follows the reader, skipping lines the shell has already run
+static void *prefetch_files(void *arg) {
+  Pipeline *pipeline = arg;
+  uint8_t *buffer = malloc(PREFETCH_CHUNK);
+  char line[MAX_COMMAND], *file;
+  uint64_t next = 0;
+
+  while (NULL != buffer) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->stopping && !pipeline->ended && next >= pipeline->read) {
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    if (next < pipeline->taken) {
+      next = pipeline->taken;
+    }
+    if (pipeline->stopping || next >= pipeline->read) {
+      pthread_mutex_unlock(&pipeline->lock);
+      break;
+    }
+    strcpy(line, pipeline->lines[next % PIPELINE_DEPTH]);
+    next++;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (NULL != (file = upcoming_read(line))) {
+      prefetch_file(pipeline, file, buffer);
+    }
+  }
+  free(buffer);
+
+  return NULL;
+}
+
+// starts reading fd ahead; NULL, with an error, if it can't
+static Pipeline *pipeline_start(int fd) {
+  Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+
+  if (NULL == pipeline || 0 != pipe(pipeline->stop_pipe)) {
+    fprintf(stderr, "Error: unable to read commands ahead.\n");
+    free(pipeline);
+    return NULL;
+  }
+  pipeline->fd = fd;
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->changed, NULL);
+  if (0 != pthread_create(&pipeline->reader, NULL, read_lines, pipeline)) {
+    fprintf(stderr, "Error: unable to read commands ahead.\n");
+    close(pipeline->stop_pipe[0]);
+    close(pipeline->stop_pipe[1]);
+    free(pipeline);
+    return NULL;
+  }
+  if (0 != pthread_create(&pipeline->prefetcher, NULL, prefetch_files, pipeline)) {
+    // the lines are still read ahead, just not the files
+    pipeline->prefetcher = pipeline->reader;
+  }
+
+  return pipeline;
+}
+
+// the next line, like fgets; 0 at the end of the input
+static int pipeline_next(Pipeline *pipeline, char *command, int *too_long) {
+  int taken = 0;
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (!pipeline->ended && pipeline->taken == pipeline->read) {
+    pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+  }
+  if (pipeline->taken < pipeline->read) {
+    strcpy(command, pipeline->lines[pipeline->taken % PIPELINE_DEPTH]);
+    *too_long = pipeline->too_long[pipeline->taken % PIPELINE_DEPTH];
+    pipeline->taken++;
+    pthread_cond_broadcast(&pipeline->changed);
+    taken = 1;
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return taken;
+}
+
+static void pipeline_stop(Pipeline *pipeline, uint64_t *files, uint64_t *bytes) {
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->stopping = 1;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->lock);
+  if (1 != write(pipeline->stop_pipe[1], "", 1)) {
+    fprintf(stderr, "Error: unable to stop reading commands ahead.\n");
+  }
+
+  pthread_join(pipeline->reader, NULL);
+  if (!pthread_equal(pipeline->prefetcher, pipeline->reader)) {
+    pthread_join(pipeline->prefetcher, NULL);
+  }
+  *files = pipeline->prefetched_files;
+  *bytes = pipeline->prefetched_bytes;
+  close(pipeline->stop_pipe[0]);
+  close(pipeline->stop_pipe[1]);
+  pthread_mutex_destroy(&pipeline->lock);
+  pthread_cond_destroy(&pipeline->changed);
+  free(pipeline);
+}
+
+// the next command, from the pipeline if there is one; 0 at the end of the input
+static int next_command(FILE *in, Pipeline *pipeline, char *command, int *too_long) {
+  int len;
+  char ch;
+
+  if (NULL != pipeline) {
+    return pipeline_next(pipeline, command, too_long);
+  }
+  if (NULL == fgets(command, MAX_COMMAND, in)) {
+    return 0;
+  }
+  len = strlen(command);
+  ch = command[len - 1];
+  *too_long = ch != '\n' && !feof(in);
+  while (*too_long && ch != '\n' && ch != EOF) {
+    ch = fgetc(in);
+  }
+
+  return 1;
+}
+
+int interactive_imffs(ShellOptions *options, FILE *in, int quiet, int timing, int pipelined) {
+  int result = 0, len, help, op, too_long;
+  IMFFSPtr fs = NULL;
+  TraceRing *ring = NULL;
+  char command[MAX_COMMAND], line[MAX_COMMAND], ch, *token, *token2;
+  double start, elapsed, total_time = 0;
+  uint64_t bytes, total_bytes = 0, total_ops = 0, checked, bad, trimmed;
+  IMFFSStat stat;
+  int changed;
+  long long threads, offset, blocks;
+  char *deltas[MAX_DELTAS];
+  uint32_t count;
+  char *file_name;
+  char *end_p;
+  Pipeline *pipeline = NULL;
+  uint64_t prefetched_files = 0, prefetched_bytes = 0;
+  int read_ahead = 0;
+
+  // a terminal is read a line at a time, after each prompt
+  if (pipelined && !isatty(fileno(in))) {
+    pipeline = pipeline_start(fileno(in));
+  }
+
+  while (!result) {
+    if (NULL == fs) {
+      result = open_imffs(options, &fs);
+    } else {
+
+      if (!quiet) {
+        printf("> ");
+      }
+      if (!next_command(in, pipeline, command, &too_long)) {
+        if (!quiet) {
+          printf("\n\nQuitting on EOF.\n");
+        }
         result = 1;
       } else {
         len = strlen(command);
         ch = command[len - 1];
 
-        if (ch != '\n') {
+        if (too_long) {
           printf("Command exceeds %d characters, unable to process.\n", MAX_COMMAND-1);
-          while (ch != '\n') {
-            ch = fgetc(stdin);
-          }
         } else {
-          command[len - 1] = '\0';
+          if (ch == '\n') {
+            command[len - 1] = '\0';
+          }
+          strcpy(line, command);
           
           // printf("You entered: '%s'\n", command);
           token = strtok(command, WHITESPACE);
           
           help = 0;
+          op = 0;
+          bytes = 0;
+          start = now_seconds();
           if (NULL == token) {
             help = 1;
           } else if (0 == strcasecmp("save", token)) {
@@ -90,6 +687,36 @@ int interactive_imffs(uint32_t block_count) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_save(fs, token, token2));
+              op = 1;
+              bytes = disk_file_size(token);
+            }
+          } else if (0 == strcasecmp("zsave", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              // compressed whether or not -z was given
+              result = HANDLE_RESULT(imffs_set_compression(fs, 1));
+              if (!result) {
+                result = HANDLE_RESULT(imffs_save(fs, token, token2));
+              }
+              imffs_set_compression(fs, options->compression);
+              op = 1;
+              bytes = disk_file_size(token);
+            }
+          } else if (0 == strcasecmp("update", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_update(fs, token, token2, &changed));
+              if (!result && !changed) {
+                printf("'%s' is unchanged\n", token2);
+              }
+              op = 1;
+              bytes = disk_file_size(token);
             }
           } else if (0 == strcasecmp("load", token)) {
             token = strtok(NULL, WHITESPACE);
@@ -98,6 +725,8 @@ int interactive_imffs(uint32_t block_count) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_load(fs, token, token2));
+              op = 1;
+              bytes = disk_file_size(token2);
             }
           } else if (0 == strcasecmp("delete", token)) {
             token = strtok(NULL, WHITESPACE);
@@ -105,6 +734,7 @@ int interactive_imffs(uint32_t block_count) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_delete(fs, token));
+              op = 1;
             }
           } else if (0 == strcasecmp("rename", token)) {
             token = strtok(NULL, WHITESPACE);
@@ -113,24 +743,173 @@ int interactive_imffs(uint32_t block_count) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_rename(fs, token, token2));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("clone", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_clone(fs, token, token2));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("write", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            file_name = strtok(NULL, WHITESPACE);
+            if (NULL != token2) {
+              offset = strtoll(token2, &end_p, 10);
+            }
+            if (NULL == file_name || end_p == token2 || offset < 0 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(write_from_disk(fs, token, (uint64_t)offset, file_name));
+              op = 1;
+              bytes = disk_file_size(file_name);
+            }
+          } else if (0 == strcasecmp("stat", token)) {
+            token = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_stat(fs, token, &stat));
+              if (!result) {
+                printf("%s: %llu bytes, %llu blocks, %u chunks, etag %016llx%s%s%s\n", token,
+                       (unsigned long long)stat.byte_len, (unsigned long long)stat.blocks, stat.extents,
+                       (unsigned long long)stat.etag, stat.inlined ? ", inline" : "", stat.packed ? ", packed" : "",
+                       stat.spilled ? ", spilled" : "");
+                if (stat.compressed) {
+                  printf("  compressed to %llu bytes\n", (unsigned long long)stat.stored_bytes);
+                }
+              }
+              op = 1;
             }
           } else if (0 == strcasecmp("dir", token)) {
             if (NULL != strtok(NULL, "")) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_dir(fs));
+              op = 1;
             }
           } else if (0 == strcasecmp("fulldir", token)) {
             if (NULL != strtok(NULL, "")) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_fulldir(fs));
+              op = 1;
             }
           } else if (0 == strcasecmp("defrag", token)) {
             if (NULL != strtok(NULL, "")) {
               help = 1;
             } else {
               result = HANDLE_RESULT(imffs_defrag(fs));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("resize", token)) {
+            token = strtok(NULL, WHITESPACE);
+            if (NULL != token) {
+              blocks = strtoll(token, &end_p, 10);
+            }
+            if (NULL == token || end_p == token || blocks < 1 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_resize(fs, (uint64_t)blocks));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("scrub", token)) {
+            token = strtok(NULL, WHITESPACE);
+            threads = 0;
+            if (NULL != token) {
+              threads = strtoll(token, &end_p, 10);
+            }
+            if ((NULL != token && (end_p == token || threads < 1 || threads > UINT32_MAX)) || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_scrub(fs, (uint32_t)threads, &checked, &bad));
+              if (checked > 0) {
+                printf("Scrubbed %llu blocks: %llu bad\n", (unsigned long long)checked, (unsigned long long)bad);
+              }
+              op = 1;
+            }
+          } else if (0 == strcasecmp("trim", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_trim(fs, &trimmed));
+              printf("Trimmed %llu bytes of free blocks\n", (unsigned long long)trimmed);
+              op = 1;
+            }
+          } else if (0 == strcasecmp("pin", token) || 0 == strcasecmp("unpin", token)) {
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else if (0 == strcasecmp("pin", token)) {
+              result = HANDLE_RESULT(imffs_pin(fs, token2));
+            } else {
+              result = HANDLE_RESULT(imffs_unpin(fs, token2));
+            }
+            op = 1;
+          } else if (0 == strcasecmp("spill", token)) {
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_spill(fs, token2));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("checkpoint", token)) {
+            token = strtok(NULL, WHITESPACE);
+            if (NULL == token) {
+              token = options->image;
+            }
+            if (NULL == token || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_checkpoint(fs, token));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("delta", token)) {
+            token = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_checkpoint_incremental(fs, token));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("compact", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            count = 0;
+            while (count < MAX_DELTAS && NULL != (deltas[count] = strtok(NULL, WHITESPACE))) {
+              count++;
+            }
+            if (NULL == token || NULL == token2 || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_compact(token2, deltas, count, token));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("sync", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_journal_sync(fs));
+              op = 1;
+            }
+          } else if (0 == strcasecmp("metrics", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_metrics_dump(fs, stdout));
+            }
+          } else if (0 == strcasecmp("trace", token)) {
+            token = strtok(NULL, WHITESPACE);
+            token2 = strtok(NULL, WHITESPACE);
+            if (NULL == token || NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              help = trace_command(fs, &ring, token, token2);
             }
           } else if (0 == strcasecmp("help", token)) {
             help = 1;
@@ -146,15 +925,42 @@ int interactive_imffs(uint32_t block_count) {
             help = 1;
           }
           
+          if (op && timing) {
+            elapsed = now_seconds() - start;
+            total_time += elapsed;
+            total_bytes += bytes;
+            total_ops++;
+            fprintf(stderr, "time: %10.3f ms | %s\n", elapsed * 1000, line);
+          }
+          
           if (help) {
             printf("\nCommands:\n\n");
             printf("save diskfile imffsfile: copy from your system to IMFFS\n");
+            printf("zsave diskfile imffsfile: like \"save\", compressing the file\n");
+            printf("update diskfile imffsfile: like \"save\", replacing imffsfile unless it has the same contents\n");
             printf("load imffsfile diskfile: copy from IMFFS to your system\n");
             printf("delete imffsfile: remove the IMFFS file from the system, allowing the blocks to be used for other files\n");
             printf("rename imffsold imffsnew: rename the IMFFS file from imffsold to imffsnew, keeping all of the data intact\n");
+            printf("clone imffsold imffsnew: makes imffsnew a copy of imffsold that shares its blocks until either is written\n");
+            printf("write imffsfile offset diskfile: copies diskfile into imffsfile at offset, which can be its size to append\n");
+            printf("stat imffsfile: shows the file's size, blocks, chunks and etag (a hash of its contents)\n");
             printf("dir: will list all of the files and the number of bytes they occupy\n");
             printf("fulldir: is like \"dir\" except it shows a the files and details about all of the chunks they are stored in (where, and how big)\n");
             printf("defrag: is described below\n");
+            printf("resize blocks: grows or shrinks the filesystem to that many blocks, moving files out of the way\n");
+            printf("scrub [threads]: verifies every block against its checksum (needs -c), with one thread per CPU by default\n");
+            printf("trim: gives the memory of free blocks back to the OS\n");
+            printf("pin imffsfile: keeps the file from being evicted (with -L) or spilled (with -T) to make room until it's unpinned\n");
+            printf("unpin imffsfile: lets the file be evicted again once it's unpinned as many times as it was pinned\n");
+            printf("spill imffsfile: moves the file's contents to the backing file (needs -T), freeing its blocks until it's used\n");
+            printf("checkpoint [imagefile]: writes the whole filesystem to imagefile (the -i one by default) and empties the journal\n");
+            printf("delta deltafile: writes what changed since the last checkpoint to deltafile, and empties the journal\n");
+            printf("compact newimage imagefile [deltafile ...]: merges an image and its incremental checkpoints into newimage\n");
+            printf("sync: waits until every change so far is in the journal on disk (needs -j)\n");
+            printf("metrics: shows operation counts, latencies and internal counters (needs -DIMFFS_METRICS)\n");
+            printf("trace on [events]: records the last events (default %d) of every operation and its phases\n", DEFAULT_TRACE_EVENTS);
+            printf("trace dump file.json: writes the recorded events for chrome://tracing or ui.perfetto.dev\n");
+            printf("trace off: stops tracing and discards the events\n");
             printf("help: lists the commands\n");
             printf("quit: will quit the program\n\n");
           }
@@ -163,35 +969,196 @@ int interactive_imffs(uint32_t block_count) {
     }
   }
   
+  if (NULL != pipeline) {
+    pipeline_stop(pipeline, &prefetched_files, &prefetched_bytes);
+    read_ahead = 1;
+  }
+  if (timing) {
+    fprintf(stderr, "\n%llu operations in %.3f ms", (unsigned long long)total_ops, total_time * 1000);
+    if (total_time > 0) {
+      fprintf(stderr, ": %.1f ops/sec, %.1f bytes/sec", total_ops / total_time, total_bytes / total_time);
+    }
+    fprintf(stderr, " (%llu bytes moved)\n", (unsigned long long)total_bytes);
+    if (read_ahead) {
+      fprintf(stderr, "%llu files (%llu bytes) read ahead\n", (unsigned long long)prefetched_files,
+              (unsigned long long)prefetched_bytes);
+    }
+  }
+
   if (result >= 0) {
     result = HANDLE_RESULT(imffs_destroy(fs));
     if (result > 0) {
       result = 0;
     }
   }
+  trace_ring_destroy(ring);
   
   return result;
 }
 
+static Server *serving; // for the signal handler
+
+static void stop_serving(int signal) {
+  (void)signal;
+  server_stop(serving);
+}
+
+// The daemon, for -s: serves the filesystem on a socket until SIGINT or
+// SIGTERM, then destroys it.
+static int serve_imffs(ShellOptions *options, char *path, uint32_t workers, int quiet) {
+  int result;
+  IMFFSPtr fs = NULL;
+  struct sigaction action = { 0 };
+  uint64_t connections, requests;
+
+  result = open_imffs(options, &fs);
+  if (NULL == fs) {
+    return 1;
+  }
+  if (!result && NULL == (serving = server_create(fs, path, options->shared, workers))) {
+    result = 1;
+  }
+
+  if (!result) {
+    action.sa_handler = stop_serving;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    if (!quiet) {
+      printf("Serving on %s.\n", path);
+      fflush(stdout);
+    }
+    result = 0 != server_run(serving);
+    server_stats(serving, &connections, &requests);
+    if (!quiet) {
+      printf("Served %llu requests on %llu connections.\n", (unsigned long long)requests,
+             (unsigned long long)connections);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    server_destroy(serving);
+    serving = NULL;
+  }
+
+  if (0 != HANDLE_RESULT(imffs_destroy(fs))) {
+    result = 1;
+  }
+
+  return result;
+}
+
 int main(int argc, char *argv[]) {
   int result = 0;
   int opt;
-
-  uint32_t block_count = DEFAULT_BLOCK_COUNT;
-  long converted;
+  int quiet = 0, timing = 0, pipelined = 0;
+  char *script = NULL, *reader = NULL, *socket_path = NULL;
+  uint32_t workers = 0; // one per CPU
+  FILE *in = stdin;
+  ShellOptions options = { DEFAULT_BLOCK_COUNT, IMFFS_DEFAULT_BLOCK_SIZE, -1, 0, 0, 0, 0, 0, NULL, NULL, NULL, { NULL }, 0, NULL, 0 };
+  long long converted;
   char *end_p;
 
-  while ((0 == result) && (opt = getopt(argc, argv, "b:h")) != -1) {
+  while ((0 == result) && (opt = getopt(argc, argv, "b:B:I:PdzcLT:S:R:s:w:i:D:j:J:f:pqth")) != -1) {
     switch (opt) {
     case 'b':
-      converted = strtol(optarg, &end_p, 10);
-      if (end_p == optarg || converted < 1 || converted > UINT32_MAX) {
-        fprintf(stderr, "Number of blocks must be between 1 and %u\n", UINT32_MAX);
-        block_count = DEFAULT_BLOCK_COUNT;
+      converted = strtoll(optarg, &end_p, 10);
+      if (end_p == optarg || converted < 1) {
+        fprintf(stderr, "Number of blocks must be between 1 and %lld\n", (long long)INT64_MAX);
+        options.block_count = DEFAULT_BLOCK_COUNT;
+      } else {
+        options.block_count = (uint64_t)converted;
+      }
+      break;
+    case 'B':
+      // imffs_create checks that it's a power of two in range
+      converted = strtoll(optarg, &end_p, 10);
+      if (end_p == optarg || converted < IMFFS_MIN_BLOCK_SIZE || converted > IMFFS_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Block size must be between %d and %d\n", IMFFS_MIN_BLOCK_SIZE, IMFFS_MAX_BLOCK_SIZE);
+        result = -1;
       } else {
-        block_count = (uint32_t)converted;
+        options.block_size = (uint32_t)converted;
       }
       break;
+    case 'I':
+      converted = strtoll(optarg, &end_p, 10);
+      if (end_p == optarg || converted < 0 || converted > IMFFS_MAX_INLINE_SIZE) {
+        fprintf(stderr, "Inline limit must be between 0 and %d\n", IMFFS_MAX_INLINE_SIZE);
+        result = -1;
+      } else {
+        options.inline_limit = (long)converted;
+      }
+      break;
+    case 'P':
+      options.tail_packing = 1;
+      break;
+    case 'd':
+      options.dedup = 1;
+      break;
+    case 'z':
+      options.compression = 1;
+      break;
+    case 'c':
+      options.checksums = 1;
+      break;
+    case 'L':
+      options.cache = 1;
+      break;
+    case 'T':
+      options.backing = optarg;
+      break;
+    case 'S':
+      options.shared = optarg;
+      break;
+    case 'R':
+      reader = optarg;
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'w':
+      converted = strtoll(optarg, &end_p, 10);
+      if (end_p == optarg || converted < 1 || converted > 256) {
+        fprintf(stderr, "Workers must be between 1 and 256\n");
+        result = -1;
+      } else {
+        workers = (uint32_t)converted;
+      }
+      break;
+    case 'i':
+      options.image = optarg;
+      break;
+    case 'D':
+      if (options.delta_count == MAX_DELTAS) {
+        fprintf(stderr, "At most %d incremental checkpoints can be applied\n", MAX_DELTAS);
+        result = -1;
+      } else {
+        options.deltas[options.delta_count++] = optarg;
+      }
+      break;
+    case 'j':
+      options.journal = optarg;
+      break;
+    case 'J':
+      converted = strtoll(optarg, &end_p, 10);
+      if (end_p == optarg || converted < 0 || converted > 60000) {
+        fprintf(stderr, "Commit interval must be between 0 and 60000 ms\n");
+        result = -1;
+      } else {
+        options.commit_ms = (uint32_t)converted;
+      }
+      break;
+    case 'f':
+      script = optarg;
+      break;
+    case 'p':
+      pipelined = 1;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 't':
+      timing = 1;
+      break;
     case 'h':
       result = -1;
       break;
@@ -202,9 +1169,22 @@ int main(int argc, char *argv[]) {
   }
   
   if (result < 0 || argc > optind) {
-    fprintf(stderr, "Usage: %s [-b block_count]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-b block_count] [-B block_size] [-I inline_limit] [-P] [-d] [-z] [-c] [-L] [-T backingfile] [-S shmname] [-R shmname] [-s socket [-w workers]] [-i image] [-D delta]... [-j journal] [-J commit_ms] [-f script] [-p] [-q] [-t]\n", argv[0]);
+  } else if (NULL != socket_path) {
+    result = serve_imffs(&options, socket_path, workers, quiet);
+  } else if (NULL != script && NULL == (in = fopen(script, "r"))) {
+    fprintf(stderr, "Error: unable to open script '%s'.\n", script);
+    result = 1;
   } else {
-    result = interactive_imffs(block_count);
+    // a script file is never prompted for
+    if (NULL != reader) {
+      result = reader_imffs(reader, in, quiet || NULL != script);
+    } else {
+      result = interactive_imffs(&options, in, quiet || NULL != script, timing, pipelined);
+    }
+    if (stdin != in) {
+      fclose(in);
+    }
   }
   
   return result;
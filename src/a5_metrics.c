@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "a5_metrics.h"
+
+static char *Op_Names[NUM_METRIC_OPS] = { "save", "load", "delete", "rename", "dir", "defrag", "usage", "read", "scrub", "stat", "update", "clone", "write", "checkpt", "replay", "delta", "trim", "resize", "spill" };
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+  int msb, shift;
+
+  if (value < (2 << HISTOGRAM_SUB_BITS)) {
+    return value;
+  }
+  msb = 63 - __builtin_clzll(value);
+  shift = msb - HISTOGRAM_SUB_BITS;
+
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+static uint64_t bucket_lower_bound(int index) {
+  int shift;
+
+  if (index < (2 << HISTOGRAM_SUB_BITS)) {
+    return index;
+  }
+  shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+
+  return (uint64_t)((1 << HISTOGRAM_SUB_BITS) + (index & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+}
+
+void histogram_record(Histogram *h, uint64_t ns) {
+  assert(NULL != h);
+
+  int index = bucket_index(ns);
+  assert(index >= 0 && index < HISTOGRAM_BUCKETS);
+
+  h->buckets[index]++;
+  h->count++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+}
+
+uint64_t histogram_percentile(Histogram *h, double p) {
+  assert(NULL != h);
+  assert(p >= 0 && p <= 1);
+
+  uint64_t rank, seen = 0;
+
+  if (0 == h->count) {
+    return 0;
+  }
+
+  rank = (uint64_t)(p * (h->count - 1)) + 1;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      return bucket_lower_bound(i);
+    }
+  }
+
+  return h->max_ns;
+}
+
+void metrics_record(Metrics *m, MetricOp op, int failed, uint64_t bytes, uint64_t start_ns) {
+  assert(NULL != m);
+  assert(op >= 0 && op < NUM_METRIC_OPS);
+
+  OpMetrics *om = &m->ops[op];
+
+  om->calls++;
+  if (failed) {
+    om->errors++;
+  } else {
+    om->bytes += bytes;
+  }
+  histogram_record(&om->latency, metrics_now_ns() - start_ns);
+}
+
+void metrics_print(Metrics *m, FILE *out) {
+  assert(NULL != m && NULL != out);
+
+  OpMetrics *om;
+
+  fprintf(out, "----------+----------+--------+--------------+----------+----------+----------+----------+----------\n");
+  fprintf(out, "Operation |    Calls | Errors |        Bytes |  Mean us |   p50 us |   p90 us |   p99 us |   Max us\n");
+  fprintf(out, "----------+----------+--------+--------------+----------+----------+----------+----------+----------\n");
+
+  for (int i = 0; i < NUM_METRIC_OPS; i++) {
+    om = &m->ops[i];
+    fprintf(out, "%-9s | %8llu | %6llu | %12llu | %8.1f | %8.1f | %8.1f | %8.1f | %8.1f\n", Op_Names[i],
+            (unsigned long long)om->calls, (unsigned long long)om->errors, (unsigned long long)om->bytes,
+            om->latency.count > 0 ? om->latency.sum_ns / 1000.0 / om->latency.count : 0.0,
+            histogram_percentile(&om->latency, 0.50) / 1000.0, histogram_percentile(&om->latency, 0.90) / 1000.0,
+            histogram_percentile(&om->latency, 0.99) / 1000.0, om->latency.max_ns / 1000.0);
+  }
+
+  fprintf(out, "----------+----------+--------+--------------+----------+----------+----------+----------+----------\n");
+  fprintf(out, "\nMultimap comparisons: %llu\n", (unsigned long long)m->comparisons);
+  fprintf(out, "Allocations: %llu\n", (unsigned long long)m->allocations);
+  fprintf(out, "Blocks scanned for free space: %llu\n", (unsigned long long)m->blocks_scanned);
+  if (m->blocks_hashed > 0) {
+    fprintf(out, "Blocks deduplicated: %llu of %llu (ratio %.2f:1)\n", (unsigned long long)m->dedup_hits,
+            (unsigned long long)m->blocks_hashed,
+            m->blocks_hashed > m->dedup_hits ? (double)m->blocks_hashed / (m->blocks_hashed - m->dedup_hits) : 0.0);
+    fprintf(out, "Hashing: %.1f ms per GB\n", m->hash_ns / 1e6 / (m->bytes_hashed / 1e9));
+  }
+  if (m->compress_in > 0) {
+    fprintf(out, "Compressed: %llu bytes to %llu (ratio %.2f:1) at %.1f MB/s\n", (unsigned long long)m->compress_in,
+            (unsigned long long)m->compress_out, (double)m->compress_in / m->compress_out,
+            m->compress_ns > 0 ? m->compress_in * 1e3 / m->compress_ns : 0.0);
+  }
+  if (m->bytes_checksummed > 0) {
+    fprintf(out, "Checksummed: %llu bytes, %llu errors", (unsigned long long)m->bytes_checksummed,
+            (unsigned long long)m->checksum_errors);
+    if (m->checksum_ns > 0) {
+      fprintf(out, ", %.1f MB/s outside scrubs", m->bytes_checksummed * 1e3 / m->checksum_ns);
+    }
+    fprintf(out, "\n");
+  }
+  if (m->etag_bytes > 0) {
+    fprintf(out, "ETags: %llu bytes hashed at %.1f MB/s, %llu unchanged files not saved again\n",
+            (unsigned long long)m->etag_bytes, m->etag_ns > 0 ? m->etag_bytes * 1e3 / m->etag_ns : 0.0,
+            (unsigned long long)m->unchanged_saves);
+  }
+  if (m->cloned_blocks > 0 || m->cow_blocks > 0) {
+    fprintf(out, "Clones: %llu blocks shared, %llu copied on write\n", (unsigned long long)m->cloned_blocks,
+            (unsigned long long)m->cow_blocks);
+  }
+  if (m->journal_records > 0 || m->replayed_records > 0) {
+    fprintf(out, "Journal: %llu records, %llu bytes, %llu syncs, %.1f us per commit; %llu records replayed\n",
+            (unsigned long long)m->journal_records, (unsigned long long)m->journal_bytes,
+            (unsigned long long)m->journal_syncs, m->journal_records > 0 ? m->journal_ns / 1e3 / m->journal_records : 0.0,
+            (unsigned long long)m->replayed_records);
+  }
+  if (m->delta_blocks > 0) {
+    fprintf(out, "Incremental checkpoints: %llu changed blocks written\n", (unsigned long long)m->delta_blocks);
+  }
+  if (m->trimmed_bytes > 0) {
+    fprintf(out, "Trim: %llu bytes of free pages given back to the OS\n", (unsigned long long)m->trimmed_bytes);
+  }
+  if (m->evictions > 0) {
+    fprintf(out, "Cache: %llu files evicted, %llu bytes\n", (unsigned long long)m->evictions,
+            (unsigned long long)m->evicted_bytes);
+  }
+  if (m->backing_hits > 0 || m->spills > 0) {
+    fprintf(out, "Tiers: %.1f%% of uses in memory, %.1f%% in the backing file; %llu files spilled (%llu bytes), "
+            "%llu faulted in (%llu bytes)\n",
+            100.0 * m->memory_hits / (m->memory_hits + m->backing_hits > 0 ? m->memory_hits + m->backing_hits : 1),
+            100.0 * m->backing_hits / (m->memory_hits + m->backing_hits > 0 ? m->memory_hits + m->backing_hits : 1),
+            (unsigned long long)m->spills, (unsigned long long)m->spilled_bytes, (unsigned long long)m->faults,
+            (unsigned long long)m->faulted_bytes);
+  }
+  if (m->publishes > 0) {
+    fprintf(out, "Shared: %llu directories published, %llu bytes\n", (unsigned long long)m->publishes,
+            (unsigned long long)m->published_bytes);
+  }
+  if (m->decompress_out > 0) {
+    fprintf(out, "Decompressed: %llu bytes at %.1f MB/s\n", (unsigned long long)m->decompress_out,
+            m->decompress_ns > 0 ? m->decompress_out * 1e3 / m->decompress_ns : 0.0);
+  }
+}
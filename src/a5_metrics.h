@@ -0,0 +1,103 @@
+#ifndef _A5_METRICS
+#define _A5_METRICS
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// 32 ns are exact, above that each power of two is split into 16 buckets,
+// so any recorded value is within about 6% of its bucket.
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef enum {
+  METRIC_SAVE,
+  METRIC_LOAD,
+  METRIC_DELETE,
+  METRIC_RENAME,
+  METRIC_DIR,
+  METRIC_DEFRAG,
+  METRIC_USAGE,
+  METRIC_READ,
+  METRIC_SCRUB,
+  METRIC_STAT,
+  METRIC_UPDATE,
+  METRIC_CLONE,
+  METRIC_WRITE,
+  METRIC_CHECKPOINT,
+  METRIC_REPLAY,
+  METRIC_DELTA,
+  METRIC_TRIM,
+  METRIC_RESIZE,
+  METRIC_SPILL,
+  NUM_METRIC_OPS
+} MetricOp;
+
+typedef struct {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  Histogram latency;
+} OpMetrics;
+
+typedef struct {
+  OpMetrics ops[NUM_METRIC_OPS];
+  uint64_t comparisons;    // multimap key comparisons
+  uint64_t allocations;    // heap allocations, including multimap nodes
+  uint64_t blocks_scanned; // blocks examined looking for free space
+  uint64_t blocks_hashed;  // blocks saved with dedup on
+  uint64_t dedup_hits;     // of those, blocks that were already there
+  uint64_t bytes_hashed;
+  uint64_t hash_ns;        // time spent hashing them
+  uint64_t compress_in;    // bytes of compressed files saved
+  uint64_t compress_out;   // what they were compressed to
+  uint64_t compress_ns;
+  uint64_t decompress_out; // bytes decompressed by loads and reads
+  uint64_t decompress_ns;
+  uint64_t bytes_checksummed; // by saves, loads, reads and scrubs
+  uint64_t checksum_ns;       // not counting scrubs, which run in parallel
+  uint64_t checksum_errors;
+  uint64_t etag_bytes;      // hashed for etags, by saves and updates
+  uint64_t etag_ns;
+  uint64_t unchanged_saves; // updates skipped because the etag matched
+  uint64_t cloned_blocks;   // blocks shared by clones instead of copied
+  uint64_t cow_blocks;      // shared blocks copied because a write changed them
+  uint64_t journal_records; // committed to the journal
+  uint64_t journal_bytes;
+  uint64_t journal_syncs;   // fdatasyncs they took, fewer than records with group commit
+  uint64_t journal_ns;      // time spent committing them
+  uint64_t replayed_records;
+  uint64_t delta_blocks;    // changed blocks written by incremental checkpoints
+  uint64_t trimmed_bytes;   // free pages given back to the OS
+  uint64_t evictions;       // files cache mode deleted to make room for saves
+  uint64_t evicted_bytes;
+  uint64_t memory_hits;     // files used that were in memory
+  uint64_t backing_hits;    // files used that had been spilled to the backing file
+  uint64_t spills;          // files moved to the backing file
+  uint64_t spilled_bytes;
+  uint64_t faults;          // spilled files brought back into blocks
+  uint64_t faulted_bytes;
+  uint64_t publishes;       // directories published for readers in other processes
+  uint64_t published_bytes;
+} Metrics;
+
+uint64_t metrics_now_ns(void);
+
+void histogram_record(Histogram *h, uint64_t ns);
+
+// p in [0, 1]; returns the lower bound of the bucket holding that percentile
+uint64_t histogram_percentile(Histogram *h, double p);
+
+void metrics_record(Metrics *m, MetricOp op, int failed, uint64_t bytes, uint64_t start_ns);
+
+void metrics_print(Metrics *m, FILE *out);
+
+#endif
@@ -5,6 +5,8 @@
 
 #include "a5_multimap.h"
 
+#define INITIAL_KEYS 16
+
 typedef struct VALUE_NODE {
   Value value;
   struct VALUE_NODE *next;
@@ -17,18 +19,20 @@ typedef struct KEY_AND_VALUES {
 } KeyAndValues;
 
 struct MULTIMAP {
-  int num_keys;
-  int max_keys;
+  int64_t num_keys;
+  int64_t max_keys;
+  int64_t capacity; // length of keys, doubled up to max_keys as keys are added
   KeyAndValues *keys;
-  int trav_pos;
+  int64_t trav_pos;
 
   Compare compare_keys;
   Compare compare_values;
 };
 
 // Helper functions
-static int find_key_pos(void *key, KeyAndValues *keys, int num_keys, Compare compare_keys);
-static int insert_key_ordered(KeyAndValues *keys, int keys_length, void *key, Compare compare_keys);
+static int64_t find_key_pos(void *key, KeyAndValues *keys, int64_t num_keys, Compare compare_keys);
+static int64_t insert_key_ordered(KeyAndValues *keys, int64_t keys_length, void *key, Compare compare_keys);
+static int grow_keys(Multimap *mm);
 static int insert_value_ordered(KeyAndValues *key, ValueNode *node, Compare compare_values);
 
 #ifndef NDEBUG
@@ -37,13 +41,14 @@ static int validate_multimap(Multimap *mm)
   assert(NULL != mm);
   assert(NULL != mm->keys);
   assert(mm->max_keys >= 0);
-  assert(mm->num_keys >= 0 && mm->num_keys <= mm->max_keys);
+  assert(mm->capacity >= 0 && mm->capacity <= mm->max_keys);
+  assert(mm->num_keys >= 0 && mm->num_keys <= mm->capacity);
   assert(mm->trav_pos >= -1 && mm->trav_pos <= mm->max_keys);
   assert(NULL != mm->compare_keys);
 
   ValueNode *curr, *prev;
   int count;
-  for (int i = 0; i < mm->num_keys; i++) {
+  for (int64_t i = 0; i < mm->num_keys; i++) {
     assert(mm->keys[i].num_values > 0); // can't have a key with no values
     assert(NULL != mm->keys[i].head);
 
@@ -72,22 +77,24 @@ static int validate_multimap(Multimap *mm)
 }
 #endif
 
-Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
+Multimap *mm_create(int64_t max_keys, Compare compare_keys, Compare compare_values)
 {
   assert(max_keys >= 0);
   assert(NULL != compare_keys);
 
   Multimap *mm = NULL;
+  int64_t capacity = max_keys < INITIAL_KEYS ? max_keys : INITIAL_KEYS;
 
   if (max_keys >= 0 && NULL != compare_keys) {
     mm = malloc(sizeof(Multimap));
     if (NULL != mm) {
-      mm->keys = malloc(max_keys * sizeof(KeyAndValues));
+      mm->keys = malloc((capacity > 0 ? capacity : 1) * sizeof(KeyAndValues));
       if (NULL == mm->keys) {
         free(mm);
         mm = NULL;
       } else {
         mm->max_keys = max_keys;
+        mm->capacity = capacity;
         mm->num_keys = 0;
         mm->trav_pos = -1;
         mm->compare_keys = compare_keys;
@@ -100,19 +107,42 @@ Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
   return mm;
 }
 
-int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
+int mm_set_max_keys(Multimap *mm, int64_t max_keys)
+{
+  assert(validate_multimap(mm));
+
+  int result = -1;
+
+  if (NULL != mm && max_keys >= mm->num_keys) {
+    mm->max_keys = max_keys;
+    if (mm->capacity > max_keys) {
+      mm->capacity = max_keys; // the rest of the array is just not used
+    }
+    if (mm->trav_pos > max_keys) {
+      mm->trav_pos = max_keys;
+    }
+    result = 1;
+  }
+
+  assert(validate_multimap(mm));
+  return result;
+}
+
+int mm_insert_value(Multimap *mm, void *key, int64_t value_num, void *value_data)
 {
   assert(validate_multimap(mm));
   assert(NULL != key);
   // assert(NULL != value_str);
 
   int result = -1;
-  int pos;
+  int64_t pos;
   ValueNode *node;
 
   if (NULL != mm && NULL != key && NULL != value_data) {
+    // the node first, so that without memory for it nothing changes
+    node = malloc(sizeof(ValueNode));
     pos = find_key_pos(key, mm->keys, mm->num_keys, mm->compare_keys);
-    if (pos < 0 && mm->num_keys < mm->max_keys) {
+    if (NULL != node && pos < 0 && mm->num_keys < mm->max_keys && (mm->num_keys < mm->capacity || grow_keys(mm))) {
 
       pos = insert_key_ordered(mm->keys, mm->num_keys, key, mm->compare_keys);
       assert(pos >= 0 && pos < mm->max_keys);
@@ -123,19 +153,18 @@ int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
       }
     }
 
-    if (pos >= 0) {
+    if (NULL != node && pos >= 0) {
       assert(pos < mm->num_keys);
       // key was either already there, or successfully added
 
-      node = malloc(sizeof(ValueNode));
-      if (NULL != node) {
-        node->value.num = value_num;
+      node->value.num = value_num;
 
-        node->value.data = value_data;
-        result = insert_value_ordered(&mm->keys[pos], node, mm->compare_values);
-      }
+      node->value.data = value_data;
+      result = insert_value_ordered(&mm->keys[pos], node, mm->compare_values);
 
       assert(result > 0);
+    } else {
+      free(node);
     }
   }
 
@@ -143,11 +172,11 @@ int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
   return result;
 }
 
-int mm_count_keys(Multimap *mm)
+int64_t mm_count_keys(Multimap *mm)
 {
   assert(validate_multimap(mm));
 
-  int count = -1;
+  int64_t count = -1;
 
   if (NULL != mm) {
     count = mm->num_keys;
@@ -157,13 +186,29 @@ int mm_count_keys(Multimap *mm)
   return count;
 }
 
+int64_t mm_memory_used(Multimap *mm)
+{
+  assert(validate_multimap(mm));
+
+  int64_t bytes = -1;
+
+  if (NULL != mm) {
+    bytes = sizeof(Multimap) + mm->capacity * sizeof(KeyAndValues);
+    for (int64_t i = 0; i < mm->num_keys; i++) {
+      bytes += mm->keys[i].num_values * sizeof(ValueNode);
+    }
+  }
+
+  return bytes;
+}
+
 int mm_count_values(Multimap *mm, void *key)
 {
   assert(validate_multimap(mm));
   assert(NULL != key);
 
   int count = -1;
-  int pos;
+  int64_t pos;
 
   if (NULL != mm && NULL != key) {
     count = 0;
@@ -178,6 +223,29 @@ int mm_count_values(Multimap *mm, void *key)
   return count;
 }
 
+int mm_get_key(Multimap *mm, void *key, void **found)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != found);
+
+  int count = -1;
+  int64_t pos;
+
+  if (NULL != mm && NULL != key && NULL != found) {
+    count = 0;
+    pos = find_key_pos(key, mm->keys, mm->num_keys, mm->compare_keys);
+    if (pos >= 0) {
+      assert(pos < mm->num_keys);
+      *found = mm->keys[pos].key;
+      count = 1;
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
 int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
 {
   assert(validate_multimap(mm));
@@ -186,7 +254,7 @@ int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
   assert(max_values >= 0);
 
   int count = -1;
-  int pos;
+  int64_t pos;
   ValueNode *node;
 
   if (NULL != mm && NULL != key && NULL != values && max_values >= 0) {
@@ -214,7 +282,7 @@ int mm_remove_key(Multimap *mm, void *key)
   assert(NULL != key);
 
   int count = -1;
-  int pos;
+  int64_t pos;
   ValueNode *curr, *next;
 
   if (NULL != mm && NULL != key) {
@@ -233,7 +301,7 @@ int mm_remove_key(Multimap *mm, void *key)
         count++;
       }
 
-      for (int i = pos + 1; i < mm->num_keys; i++) {
+      for (int64_t i = pos + 1; i < mm->num_keys; i++) {
         mm->keys[i - 1] = mm->keys[i];
       }
       mm->num_keys--;
@@ -256,11 +324,11 @@ void mm_print(Multimap *mm)
   ValueNode *node;
 
   if (NULL != mm) {
-    for (int i = 0; i < mm->num_keys; i++) {
-      printf("[%3d] '%s' (%d):\n", i, (char *)mm->keys[i].key, mm->keys[i].num_values);
+    for (int64_t i = 0; i < mm->num_keys; i++) {
+      printf("[%3lld] '%s' (%d):\n", (long long)i, (char *)mm->keys[i].key, mm->keys[i].num_values);
       node = mm->keys[i].head;
       while (NULL != node) {
-        printf(" %9d '%s'\n", node->value.num, (char *)node->value.data);
+        printf(" %9lld '%s'\n", (long long)node->value.num, (char *)node->value.data);
         node = node->next;
       }
     }
@@ -279,7 +347,7 @@ int mm_destroy(Multimap *mm)
 
   if (NULL != mm) {
     count = mm->num_keys;
-    for (int i = 0; i < mm->num_keys; i++) {
+    for (int64_t i = 0; i < mm->num_keys; i++) {
       node = mm->keys[i].head;
       while (NULL != node) {
         next = node->next;
@@ -292,6 +360,7 @@ int mm_destroy(Multimap *mm)
 
     mm->num_keys = 0;
     mm->max_keys = 0;
+    mm->capacity = 0;
     mm->keys = NULL;
 
     free(mm);
@@ -354,16 +423,16 @@ int mm_get_next_key(Multimap *mm, void **key)
   return result;
 }
 
-static int find_key_pos(void *key, KeyAndValues *keys, int num_keys, Compare compare_keys)
+static int64_t find_key_pos(void *key, KeyAndValues *keys, int64_t num_keys, Compare compare_keys)
 {
   assert(NULL != key);
   assert(NULL != keys);
   assert(num_keys >= 0);
   assert(NULL != compare_keys);
 
-  int start = 0, end = num_keys - 1;
-  int mid, comp;
-  int pos = -1;
+  int64_t start = 0, end = num_keys - 1;
+  int64_t mid, pos = -1;
+  int comp;
 
   while (start <= end && pos < 0) {
     mid = (end - start) / 2 + start;
@@ -380,14 +449,14 @@ static int find_key_pos(void *key, KeyAndValues *keys, int num_keys, Compare com
   return pos;
 }
 
-static int insert_key_ordered(KeyAndValues *keys, int keys_length, void *key, Compare compare_keys)
+static int64_t insert_key_ordered(KeyAndValues *keys, int64_t keys_length, void *key, Compare compare_keys)
 {
   assert(NULL != keys);
   assert(keys_length >= 0);
   assert(NULL != key);
   assert(NULL != compare_keys);
 
-  int pos = 0;
+  int64_t pos = 0;
 
   while (pos < keys_length && compare_keys(key, keys[pos].key) >= 0) {
     pos++;
@@ -404,6 +473,27 @@ static int insert_key_ordered(KeyAndValues *keys, int keys_length, void *key, Co
   return pos;
 }
 
+// doubles the key array, up to max_keys; returns 0 if there's no memory
+static int grow_keys(Multimap *mm)
+{
+  assert(NULL != mm);
+  assert(mm->capacity < mm->max_keys);
+
+  int64_t capacity = mm->capacity > 0 ? mm->capacity * 2 : 1;
+  KeyAndValues *keys;
+
+  if (capacity > mm->max_keys) {
+    capacity = mm->max_keys;
+  }
+  keys = realloc(mm->keys, capacity * sizeof(KeyAndValues));
+  if (NULL != keys) {
+    mm->keys = keys;
+    mm->capacity = capacity;
+  }
+
+  return NULL != keys;
+}
+
 static int insert_value_ordered(KeyAndValues *key, ValueNode *node, Compare compare_values)
 {
   assert(NULL != key);
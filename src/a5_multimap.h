@@ -1,19 +1,32 @@
 #ifndef _A5_MULTIMAP
 #define _A5_MULTIMAP
 
-typedef struct VALUE { int num; void *data; } Value;
+#include <stdint.h>
+
+typedef struct VALUE { int64_t num; void *data; } Value;
 typedef struct MULTIMAP Multimap; // you need to define this yourself
 
 typedef int (*Compare)(void *a, void *b);
 
-Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values);
+// max_keys is a limit, not a preallocation: the key array grows as needed
+Multimap *mm_create(int64_t max_keys, Compare compare_keys, Compare compare_values);
+
+// changes the limit, which can't be below the number of keys already there;
+// returns 1, or -1 if it is
+int mm_set_max_keys(Multimap *mm, int64_t max_keys);
 
-int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data);
+int mm_insert_value(Multimap *mm, void *key, int64_t value_num, void *value_data);
 
-int mm_count_keys(Multimap *mm);
+int64_t mm_count_keys(Multimap *mm);
+
+// bytes allocated for the multimap itself, not including keys or value data
+int64_t mm_memory_used(Multimap *mm);
 
 int mm_count_values(Multimap *mm, void *key);
 
+// the key that's there equal to key, in found; 1 if there is one, else 0
+int mm_get_key(Multimap *mm, void *key, void **found);
+
 int mm_get_values(Multimap *mm, void *key, Value values[], int max_values);
 
 int mm_remove_key(Multimap *mm, void *key);
@@ -0,0 +1,49 @@
+#ifndef _A5_PROTOCOL
+#define _A5_PROTOCOL
+
+#include <stdint.h>
+
+// What a5_imffs -s serves over a Unix domain socket. Each request is a
+// header and then body_length bytes of body, and gets one response, also a
+// header and a body; a connection's responses come back in the order its
+// requests were sent, so a client can send several before reading any.
+// Numbers are in the host's byte order, since both ends are on the same
+// machine, and names in a body end with a NUL.
+//
+//   op        request body                         response body
+//   SAVE      diskfile, imffsfile                  -
+//   LOAD      imffsfile, diskfile                  -
+//   PUT       imffsfile, then the contents         -
+//   GET       imffsfile, u64 offset, u64 length    up to length bytes from offset
+//   DELETE    imffsfile                            -
+//   RENAME    imffsold, imffsnew                   -
+//   DIR       -                                    per file, u64 size then name
+//   STATS     -                                    an IMFFSUsage
+//
+// SAVE and LOAD use files on the server's side, PUT and GET carry the
+// contents; PUT fails on a name that's there, like SAVE. A response's
+// status is an IMFFSResult; a request that makes no sense gets
+// IMFFS_INVALID, and one with a longer body than PROTOCOL_MAX_BODY closes
+// the connection.
+
+#define PROTOCOL_MAX_BODY (64 * 1024 * 1024)
+
+typedef enum {
+  PROTOCOL_SAVE = 1,
+  PROTOCOL_LOAD,
+  PROTOCOL_PUT,
+  PROTOCOL_GET,
+  PROTOCOL_DELETE,
+  PROTOCOL_RENAME,
+  PROTOCOL_DIR,
+  PROTOCOL_STATS
+} ProtocolOp;
+
+typedef struct {
+  uint32_t body_length;
+  uint8_t op;          // a ProtocolOp in a request, an IMFFSResult in a response
+  uint8_t reserved[3];
+  uint64_t tag;        // the request's, copied into its response
+} ProtocolHeader;
+
+#endif
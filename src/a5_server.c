@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "a5_server.h"
+#include "a5_protocol.h"
+
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define READ_CHUNK (64 * 1024) // most read from a connection per event
+
+typedef struct {
+  uint8_t *bytes;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+typedef struct CONNECTION {
+  int fd;
+  Buffer in;       // read and not handed to a worker yet
+  Buffer request;  // the one a worker has
+  Buffer out;      // its response, and how much of it has been sent
+  size_t sent;
+  int busy;        // a worker has it: the loop leaves it alone, and epoll doesn't report it
+  int closed;      // the client hung up, or its socket failed
+  struct CONNECTION *next; // on the work queue or the done list
+  struct CONNECTION *older; // every connection, for shutting down
+  struct CONNECTION *newer;
+} Connection;
+
+typedef struct {
+  Server *server;
+  pthread_t thread;
+  IMFFSReaderPtr reader; // NULL unless the filesystem is shared
+} Worker;
+
+struct SERVER {
+  IMFFSPtr fs;
+  pthread_mutex_t fs_lock; // held for every call into fs
+  char *path;
+  int listen_fd;
+  int epoll_fd;
+  int stop_fd;  // eventfds: the loop is to stop,
+  int done_fd;  // and workers have put connections on the done list
+  Worker *workers;
+  uint32_t worker_count;
+  uint32_t started;
+  pthread_mutex_t lock; // the work queue, the done list and stopping
+  pthread_cond_t work;
+  Connection *queue_head;
+  Connection *queue_tail;
+  Connection *done;
+  int stopping;
+  Connection *newest;
+  uint64_t connections;
+  uint64_t requests;
+};
+
+// makes room for length bytes in all; -1 without the memory
+static int reserve(Buffer *buffer, size_t length) {
+  uint8_t *grown;
+  size_t capacity;
+
+  if (length <= buffer->capacity) {
+    return 0;
+  }
+  capacity = buffer->capacity > 0 ? buffer->capacity : READ_CHUNK;
+  while (capacity < length) {
+    capacity *= 2;
+  }
+  if (NULL == (grown = realloc(buffer->bytes, capacity))) {
+    return -1;
+  }
+  buffer->bytes = grown;
+  buffer->capacity = capacity;
+
+  return 0;
+}
+
+static int append(Buffer *buffer, const void *bytes, size_t length) {
+  if (0 != reserve(buffer, buffer->length + length)) {
+    return -1;
+  }
+  memcpy(&buffer->bytes[buffer->length], bytes, length);
+  buffer->length += length;
+
+  return 0;
+}
+
+// Waits for events on the connection again: one at a time, so nothing is
+// reported while a worker has it.
+static void watch(Server *server, Connection *conn, uint32_t events) {
+  struct epoll_event event = { events | EPOLLRDHUP | EPOLLONESHOT, { .ptr = conn } };
+
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static void close_connection(Server *server, Connection *conn) {
+  assert(!conn->busy);
+
+  close(conn->fd);
+  if (NULL != conn->older) {
+    conn->older->newer = conn->newer;
+  }
+  if (NULL != conn->newer) {
+    conn->newer->older = conn->older;
+  } else {
+    server->newest = conn->older;
+  }
+  free(conn->in.bytes);
+  free(conn->request.bytes);
+  free(conn->out.bytes);
+  free(conn);
+}
+
+// sends what it can of the response; -1 if the socket failed
+static int flush_output(Connection *conn) {
+  ssize_t sent;
+
+  while (conn->sent < conn->out.length) {
+    sent = send(conn->fd, &conn->out.bytes[conn->sent], conn->out.length - conn->sent, MSG_NOSIGNAL);
+    if (sent < 0 && EINTR == errno) {
+      continue;
+    }
+    if (sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+      return 0;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    conn->sent += sent;
+  }
+
+  return 0;
+}
+
+// reads what's there, up to READ_CHUNK; -1 once the client has hung up
+static int read_input(Connection *conn) {
+  ssize_t got;
+
+  if (0 != reserve(&conn->in, conn->in.length + READ_CHUNK)) {
+    return -1;
+  }
+  do {
+    got = recv(conn->fd, &conn->in.bytes[conn->in.length], READ_CHUNK, 0);
+  } while (got < 0 && EINTR == errno);
+  if (got < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+    return 0;
+  }
+  if (got <= 0) {
+    return -1;
+  }
+  conn->in.length += got;
+
+  return 0;
+}
+
+// Once the response is sent, hands the next request to the workers if it's
+// all been read, otherwise waits for more of it.
+static void next_request(Server *server, Connection *conn) {
+  ProtocolHeader header;
+  size_t length;
+
+  if (conn->sent < conn->out.length) {
+    watch(server, conn, EPOLLOUT);
+    return;
+  }
+  conn->out.length = conn->sent = 0;
+
+  if (conn->in.length >= sizeof(ProtocolHeader)) {
+    memcpy(&header, conn->in.bytes, sizeof(ProtocolHeader));
+    if (header.body_length > PROTOCOL_MAX_BODY) {
+      fprintf(stderr, "Error: a request of %u bytes is too long.\n", header.body_length);
+      close_connection(server, conn);
+      return;
+    }
+    length = sizeof(ProtocolHeader) + header.body_length;
+    if (conn->in.length >= length) {
+      if (0 != reserve(&conn->request, length)) {
+        fprintf(stderr, "Error: not enough memory for a request.\n");
+        close_connection(server, conn);
+        return;
+      }
+      memcpy(conn->request.bytes, conn->in.bytes, length);
+      conn->request.length = length;
+      memmove(conn->in.bytes, &conn->in.bytes[length], conn->in.length - length);
+      conn->in.length -= length;
+
+      conn->busy = 1;
+      conn->next = NULL;
+      pthread_mutex_lock(&server->lock);
+      if (NULL == server->queue_tail) {
+        server->queue_head = conn;
+      } else {
+        server->queue_tail->next = conn;
+      }
+      server->queue_tail = conn;
+      pthread_cond_signal(&server->work);
+      pthread_mutex_unlock(&server->lock);
+      return;
+    }
+  }
+
+  watch(server, conn, EPOLLIN);
+}
+
+static void serve_connection(Server *server, Connection *conn, uint32_t events) {
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && 0 != read_input(conn)) {
+    close_connection(server, conn);
+  } else if ((events & EPOLLOUT) && 0 != flush_output(conn)) {
+    close_connection(server, conn);
+  } else {
+    next_request(server, conn);
+  }
+}
+
+static void accept_connections(Server *server) {
+  struct epoll_event event = { EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, { NULL } };
+  Connection *conn;
+  int fd;
+
+  while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 || EINTR == errno) {
+    if (fd < 0) {
+      continue;
+    }
+    if (NULL == (conn = calloc(1, sizeof(Connection)))) {
+      fprintf(stderr, "Error: not enough memory for a connection.\n");
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    event.data.ptr = conn;
+    if (0 != epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->older = server->newest;
+    if (NULL != server->newest) {
+      server->newest->newer = conn;
+    }
+    server->newest = conn;
+    __atomic_add_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+  }
+  if (EAGAIN != errno && EWOULDBLOCK != errno) {
+    // out of descriptors: the others are accepted once some are closed
+    fprintf(stderr, "Error: unable to accept a connection.\n");
+  }
+}
+
+// takes back the connections workers are done with
+static void finish_requests(Server *server) {
+  Connection *conn, *next;
+  uint64_t count;
+
+  if (sizeof(count) != read(server->done_fd, &count, sizeof(count))) {
+    return;
+  }
+  pthread_mutex_lock(&server->lock);
+  conn = server->done;
+  server->done = NULL;
+  pthread_mutex_unlock(&server->lock);
+
+  for (; NULL != conn; conn = next) {
+    next = conn->next;
+    conn->busy = 0;
+    if (conn->closed) {
+      close_connection(server, conn);
+    } else {
+      next_request(server, conn);
+    }
+  }
+}
+
+// the next name in a request's body, NULL if it doesn't end in it
+static char *next_name(uint8_t **body, size_t *left) {
+  uint8_t *end = memchr(*body, '\0', *left);
+  char *name = (char *)*body;
+
+  if (NULL == end) {
+    return NULL;
+  }
+  *left -= end + 1 - *body;
+  *body = end + 1;
+
+  return name;
+}
+
+typedef struct {
+  Buffer *out;
+  int failed;
+} Listing;
+
+static void list_file(const char *name, uint64_t byte_len, void *context) {
+  Listing *listing = context;
+
+  listing->failed |= append(listing->out, &byte_len, sizeof(byte_len)) ||
+                     append(listing->out, name, strlen(name) + 1);
+}
+
+static IMFFSResult get_file(Worker *worker, char *name, uint64_t offset, uint64_t length, Buffer *out) {
+  Server *server = worker->server;
+  IMFFSResult result = IMFFS_ERROR;
+  uint64_t got = 0;
+
+  if (length > PROTOCOL_MAX_BODY) {
+    length = PROTOCOL_MAX_BODY;
+  }
+  if (0 != reserve(out, out->length + length)) {
+    fprintf(stderr, "Error: not enough memory to read file '%s'.\n", name);
+    return IMFFS_ERROR;
+  }
+  // the filesystem only has to be waited for if a reader can't read the file
+  if (NULL != worker->reader) {
+    result = imffs_reader_read(worker->reader, name, offset, &out->bytes[out->length], length, &got);
+  }
+  if (IMFFS_OK != result) {
+    pthread_mutex_lock(&server->fs_lock);
+    result = imffs_read(server->fs, name, offset, &out->bytes[out->length], length, &got);
+    pthread_mutex_unlock(&server->fs_lock);
+  }
+  if (IMFFS_OK == result) {
+    out->length += got;
+  }
+
+  return result;
+}
+
+// runs a request, and puts its response in the connection's output
+static void run_request(Worker *worker, Connection *conn) {
+  Server *server = worker->server;
+  ProtocolHeader header;
+  IMFFSResult result = IMFFS_INVALID;
+  IMFFSUsage usage;
+  Listing listing = { &conn->out, 0 };
+  uint8_t *body = &conn->request.bytes[sizeof(ProtocolHeader)];
+  size_t left = conn->request.length - sizeof(ProtocolHeader);
+  char *name = next_name(&body, &left), *other = NULL;
+  uint64_t numbers[2];
+
+  memcpy(&header, conn->request.bytes, sizeof(ProtocolHeader));
+  conn->out.length = conn->sent = 0;
+  if (0 != reserve(&conn->out, sizeof(ProtocolHeader))) {
+    conn->closed = 1;
+    return;
+  }
+  conn->out.length = sizeof(ProtocolHeader);
+
+  switch (header.op) {
+  case PROTOCOL_SAVE:
+  case PROTOCOL_LOAD:
+  case PROTOCOL_RENAME:
+    if (NULL != name && NULL != (other = next_name(&body, &left)) && 0 == left) {
+      pthread_mutex_lock(&server->fs_lock);
+      result = PROTOCOL_SAVE == header.op ? imffs_save(server->fs, name, other) :
+               PROTOCOL_LOAD == header.op ? imffs_load(server->fs, name, other) :
+                                            imffs_rename(server->fs, name, other);
+      pthread_mutex_unlock(&server->fs_lock);
+    }
+    break;
+  case PROTOCOL_PUT:
+    if (NULL != name) {
+      pthread_mutex_lock(&server->fs_lock);
+      result = imffs_put(server->fs, name, body, left);
+      pthread_mutex_unlock(&server->fs_lock);
+    }
+    break;
+  case PROTOCOL_GET:
+    if (NULL != name && sizeof(numbers) == left) {
+      memcpy(numbers, body, sizeof(numbers));
+      result = get_file(worker, name, numbers[0], numbers[1], &conn->out);
+    }
+    break;
+  case PROTOCOL_DELETE:
+    if (NULL != name && 0 == left) {
+      pthread_mutex_lock(&server->fs_lock);
+      result = imffs_delete(server->fs, name);
+      pthread_mutex_unlock(&server->fs_lock);
+    }
+    break;
+  case PROTOCOL_DIR:
+  case PROTOCOL_STATS:
+    if (sizeof(ProtocolHeader) == conn->request.length) {
+      pthread_mutex_lock(&server->fs_lock);
+      if (PROTOCOL_DIR == header.op) {
+        result = imffs_list(server->fs, list_file, &listing);
+      } else if (IMFFS_OK == (result = imffs_usage(server->fs, &usage))) {
+        listing.failed = append(&conn->out, &usage, sizeof(usage));
+      }
+      pthread_mutex_unlock(&server->fs_lock);
+      if (listing.failed) {
+        fprintf(stderr, "Error: not enough memory for a response.\n");
+        result = IMFFS_ERROR;
+      }
+    }
+    break;
+  }
+
+  if (IMFFS_OK != result) {
+    conn->out.length = sizeof(ProtocolHeader);
+  }
+  header.body_length = conn->out.length - sizeof(ProtocolHeader);
+  header.op = result;
+  memcpy(conn->out.bytes, &header, sizeof(ProtocolHeader));
+}
+
+static void *work(void *arg) {
+  Worker *worker = arg;
+  Server *server = worker->server;
+  Connection *conn;
+  uint64_t one = 1;
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (!server->stopping && NULL == server->queue_head) {
+      pthread_cond_wait(&server->work, &server->lock);
+    }
+    if (server->stopping) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    conn = server->queue_head;
+    server->queue_head = conn->next;
+    if (NULL == server->queue_head) {
+      server->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    run_request(worker, conn);
+    // the loop sends whatever doesn't go now
+    if (0 != flush_output(conn)) {
+      conn->closed = 1;
+    }
+    __atomic_add_fetch(&server->requests, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&server->lock);
+    conn->next = server->done;
+    server->done = conn;
+    pthread_mutex_unlock(&server->lock);
+    if (sizeof(one) != write(server->done_fd, &one, sizeof(one))) {
+      fprintf(stderr, "Error: unable to wake the event loop.\n");
+    }
+  }
+
+  return NULL;
+}
+
+Server *server_create(IMFFSPtr fs, const char *path, const char *shared, uint32_t workers) {
+  assert(NULL != fs && NULL != path);
+
+  Server *server = calloc(1, sizeof(Server));
+  struct sockaddr_un address = { AF_UNIX };
+  struct epoll_event event = { EPOLLIN, { NULL } };
+  struct stat st;
+  long cpus;
+  int failed = 0;
+
+  if (NULL == server) {
+    fprintf(stderr, "Error: not enough memory to start the server.\n");
+    return NULL;
+  }
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: the socket path '%s' is too long.\n", path);
+    free(server);
+    return NULL;
+  }
+  strcpy(address.sun_path, path);
+
+  if (0 == workers) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? cpus : 1;
+  }
+  server->worker_count = workers < MAX_WORKERS ? workers : MAX_WORKERS;
+  server->fs = fs;
+  server->listen_fd = server->epoll_fd = server->stop_fd = server->done_fd = -1;
+  pthread_mutex_init(&server->fs_lock, NULL);
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->work, NULL);
+
+  server->path = strdup(path);
+  server->workers = calloc(server->worker_count, sizeof(Worker));
+  if (NULL == server->path || NULL == server->workers) {
+    fprintf(stderr, "Error: not enough memory to start the server.\n");
+    failed = 1;
+  }
+  for (uint32_t i = 0; !failed && i < server->worker_count; i++) {
+    server->workers[i].server = server;
+    if (NULL != shared && IMFFS_OK != imffs_reader_open((char *)shared, &server->workers[i].reader)) {
+      failed = 1;
+    }
+  }
+
+  // a socket left by a server that's gone goes, but nothing else does
+  if (!failed && 0 == lstat(path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Error: '%s' is there and isn't a socket.\n", path);
+      failed = 1;
+    } else {
+      unlink(path);
+    }
+  }
+  if (!failed) {
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd >= 0 && 0 != bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address))) {
+      // server_destroy would unlink whatever is at path
+      close(server->listen_fd);
+      server->listen_fd = -1;
+    }
+    if (server->listen_fd < 0 || 0 != listen(server->listen_fd, SOMAXCONN)) {
+      fprintf(stderr, "Error: unable to listen on '%s'.\n", path);
+      failed = 1;
+    }
+  }
+  if (!failed) {
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->epoll_fd < 0 || server->stop_fd < 0 || server->done_fd < 0) {
+      failed = 1;
+    }
+    // these are told apart from connections by their addresses
+    event.data.ptr = &server->listen_fd;
+    failed = failed || 0 != epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+    event.data.ptr = &server->stop_fd;
+    failed = failed || 0 != epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->stop_fd, &event);
+    event.data.ptr = &server->done_fd;
+    failed = failed || 0 != epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->done_fd, &event);
+    if (failed) {
+      fprintf(stderr, "Error: unable to start the event loop.\n");
+    }
+  }
+
+  if (failed) {
+    server_destroy(server);
+    return NULL;
+  }
+
+  return server;
+}
+
+int server_run(Server *server) {
+  assert(NULL != server);
+
+  struct epoll_event events[MAX_EVENTS];
+  int count, result = 0, running = 1;
+
+  for (server->started = 0; server->started < server->worker_count; server->started++) {
+    if (0 != pthread_create(&server->workers[server->started].thread, NULL, work, &server->workers[server->started])) {
+      fprintf(stderr, "Error: unable to start a worker.\n");
+      running = 0;
+      result = -1;
+      break;
+    }
+  }
+
+  while (running) {
+    count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0 && EINTR != errno) {
+      fprintf(stderr, "Error: the event loop failed.\n");
+      result = -1;
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (&server->listen_fd == events[i].data.ptr) {
+        accept_connections(server);
+      } else if (&server->stop_fd == events[i].data.ptr) {
+        running = 0;
+      } else if (&server->done_fd == events[i].data.ptr) {
+        finish_requests(server);
+      } else {
+        serve_connection(server, events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+
+  // requests no worker has started are dropped with their connections
+  pthread_mutex_lock(&server->lock);
+  server->stopping = 1;
+  pthread_cond_broadcast(&server->work);
+  pthread_mutex_unlock(&server->lock);
+  for (uint32_t i = 0; i < server->started; i++) {
+    pthread_join(server->workers[i].thread, NULL);
+  }
+  server->started = 0;
+  while (NULL != server->newest) {
+    server->newest->busy = 0;
+    close_connection(server, server->newest);
+  }
+  server->queue_head = server->queue_tail = server->done = NULL;
+
+  return result;
+}
+
+void server_stop(Server *server) {
+  uint64_t one = 1;
+
+  // only a write, so it's safe in a signal handler
+  if (NULL != server && sizeof(one) != write(server->stop_fd, &one, sizeof(one))) {
+    return;
+  }
+}
+
+void server_stats(Server *server, uint64_t *connections, uint64_t *requests) {
+  assert(NULL != server && NULL != connections && NULL != requests);
+
+  *connections = __atomic_load_n(&server->connections, __ATOMIC_RELAXED);
+  *requests = __atomic_load_n(&server->requests, __ATOMIC_RELAXED);
+}
+
+void server_destroy(Server *server) {
+  if (NULL == server) {
+    return;
+  }
+  assert(0 == server->started);
+
+  if (server->listen_fd >= 0) {
+    close(server->listen_fd);
+    unlink(server->path);
+  }
+  if (server->epoll_fd >= 0) {
+    close(server->epoll_fd);
+  }
+  if (server->stop_fd >= 0) {
+    close(server->stop_fd);
+  }
+  if (server->done_fd >= 0) {
+    close(server->done_fd);
+  }
+  for (uint32_t i = 0; NULL != server->workers && i < server->worker_count; i++) {
+    if (NULL != server->workers[i].reader) {
+      imffs_reader_close(server->workers[i].reader);
+    }
+  }
+  pthread_mutex_destroy(&server->fs_lock);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->work);
+  free(server->workers);
+  free(server->path);
+  free(server);
+}
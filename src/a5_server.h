@@ -0,0 +1,40 @@
+#ifndef _A5_SERVER
+#define _A5_SERVER
+
+#include <stdint.h>
+
+#include "a5_imffs.h"
+
+// Serves a filesystem to local clients over a Unix domain socket, with the
+// protocol in a5_protocol.h. One thread runs an epoll loop that accepts
+// connections and reads and writes them without blocking; a request that's
+// been read in full goes to a pool of workers, which run it and start
+// sending its response. A connection has one request at a time with the
+// workers, so its responses stay in order.
+//
+// The filesystem isn't thread safe, so workers take turns with it. When
+// it's shared (see imffs_share), GETs are read through a reader of each
+// worker's own instead, without waiting for the others; only files the
+// reader can't read, like spilled ones, go through the filesystem.
+
+typedef struct SERVER Server;
+
+// Listens on path, replacing a socket that's there, with workers threads (0
+// for one per CPU); anything else at path is left alone, and the server
+// isn't created. shared is the name fs is shared under, NULL if it isn't.
+// Returns NULL, with an error, if it can't.
+Server *server_create(IMFFSPtr fs, const char *path, const char *shared, uint32_t workers);
+
+// Serves until server_stop; returns 0, or -1 if the event loop failed.
+int server_run(Server *server);
+
+// from any thread, or a signal handler
+void server_stop(Server *server);
+
+// connections accepted and requests served so far
+void server_stats(Server *server, uint64_t *connections, uint64_t *requests);
+
+// removes the socket; the filesystem is left to the caller
+void server_destroy(Server *server);
+
+#endif
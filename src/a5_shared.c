@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "a5_shared.h"
+
+#define SHARED_MAGIC "IMFFSSHM"
+#define SHARED_VERSION 1
+#define MIN_DIRECTORY (64 * 1024)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t block_count;
+  uint64_t blocks_offset;    // one page in
+  uint64_t directory_offset; // after the blocks, on a page
+  uint64_t seq;              // odd while the writer is changing things
+  uint64_t directory_capacity;
+  uint64_t directory_length;
+} SharedHeader;
+
+struct SHARED {
+  int fd;
+  int writer;
+  SharedHeader *header;       // the header page and the blocks
+  size_t mapped;
+  uint8_t *directory;         // mapped on its own, so it can move
+  uint64_t directory_mapped;
+};
+
+static uint64_t page_round(uint64_t length) {
+  uint64_t page = sysconf(_SC_PAGESIZE);
+
+  return (length + page - 1) / page * page;
+}
+
+static int map_directory(Shared *shared, uint64_t capacity) {
+  int prot = shared->writer ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *mapped;
+
+  mapped = mmap(NULL, capacity, prot, MAP_SHARED, shared->fd, shared->header->directory_offset);
+  if (MAP_FAILED == mapped) {
+    return -1;
+  }
+  if (NULL != shared->directory) {
+    munmap(shared->directory, shared->directory_mapped);
+  }
+  shared->directory = mapped;
+  shared->directory_mapped = capacity;
+
+  return 0;
+}
+
+Shared *shared_create(const char *name, uint64_t block_count, uint32_t block_size) {
+  assert(NULL != name);
+  assert(block_size > 0);
+
+  Shared *shared = calloc(1, sizeof(Shared));
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t directory_offset = page + page_round(block_count * block_size);
+  void *mapped;
+
+  if (NULL == shared) {
+    fprintf(stderr, "Error: not enough memory to share the filesystem.\n");
+    return NULL;
+  }
+  shared->writer = 1;
+
+  shm_unlink(name);
+  shared->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (shared->fd < 0 || 0 != ftruncate(shared->fd, directory_offset + MIN_DIRECTORY)) {
+    fprintf(stderr, "Error: unable to create shared memory '%s'.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+
+  mapped = mmap(NULL, directory_offset, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0);
+  if (MAP_FAILED == mapped) {
+    fprintf(stderr, "Error: unable to map shared memory '%s'.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+  shared->header = mapped;
+  shared->mapped = directory_offset;
+
+  // the object starts out zeroed, which is an even sequence number and an
+  // empty directory
+  memcpy(shared->header->magic, SHARED_MAGIC, sizeof(shared->header->magic));
+  shared->header->version = SHARED_VERSION;
+  shared->header->block_size = block_size;
+  shared->header->block_count = block_count;
+  shared->header->blocks_offset = page;
+  shared->header->directory_offset = directory_offset;
+  shared->header->directory_capacity = MIN_DIRECTORY;
+  if (0 != map_directory(shared, MIN_DIRECTORY)) {
+    fprintf(stderr, "Error: unable to map shared memory '%s'.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+  memset(shared->directory, 0, sizeof(uint64_t));
+  __atomic_store_n(&shared->header->directory_length, sizeof(uint64_t), __ATOMIC_RELEASE);
+
+  return shared;
+}
+
+Shared *shared_attach(const char *name) {
+  assert(NULL != name);
+
+  Shared *shared = calloc(1, sizeof(Shared));
+  SharedHeader header;
+  struct stat st;
+  void *mapped;
+
+  if (NULL == shared) {
+    fprintf(stderr, "Error: not enough memory to attach to '%s'.\n", name);
+    return NULL;
+  }
+
+  shared->fd = shm_open(name, O_RDONLY, 0);
+  if (shared->fd < 0 || 0 != fstat(shared->fd, &st)) {
+    fprintf(stderr, "Error: unable to open shared memory '%s'.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+  if ((uint64_t)st.st_size < sizeof(SharedHeader) ||
+      sizeof(SharedHeader) != pread(shared->fd, &header, sizeof(SharedHeader), 0) ||
+      0 != memcmp(header.magic, SHARED_MAGIC, sizeof(header.magic)) || SHARED_VERSION != header.version ||
+      0 == header.block_size || header.directory_offset > (uint64_t)st.st_size ||
+      header.directory_offset < header.blocks_offset + header.block_count * header.block_size) {
+    fprintf(stderr, "Error: '%s' isn't a shared filesystem.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+
+  mapped = mmap(NULL, header.directory_offset, PROT_READ, MAP_SHARED, shared->fd, 0);
+  if (MAP_FAILED == mapped) {
+    fprintf(stderr, "Error: unable to map shared memory '%s'.\n", name);
+    shared_close(shared);
+    return NULL;
+  }
+  shared->header = mapped;
+  shared->mapped = header.directory_offset;
+
+  return shared;
+}
+
+void *shared_blocks(Shared *shared) {
+  assert(NULL != shared);
+
+  return (uint8_t *)shared->header + shared->header->blocks_offset;
+}
+
+void shared_shape(Shared *shared, uint64_t *block_count, uint32_t *block_size) {
+  assert(NULL != shared && NULL != block_count && NULL != block_size);
+
+  *block_count = shared->header->block_count;
+  *block_size = shared->header->block_size;
+}
+
+void shared_write_begin(Shared *shared) {
+  assert(NULL != shared && shared->writer);
+
+  uint64_t seq = shared->header->seq;
+
+  // the number has to be seen to change before anything else does
+  if (0 == (seq & 1)) {
+    __atomic_store_n(&shared->header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+}
+
+uint8_t *shared_directory_reserve(Shared *shared, uint64_t length) {
+  assert(NULL != shared && shared->writer);
+  assert(shared->header->seq & 1);
+
+  uint64_t capacity = shared->directory_mapped;
+
+  if (length <= capacity) {
+    return shared->directory;
+  }
+  while (capacity < length) {
+    capacity *= 2;
+  }
+  capacity = page_round(capacity);
+  if (0 != ftruncate(shared->fd, shared->header->directory_offset + capacity) ||
+      0 != map_directory(shared, capacity)) {
+    return NULL;
+  }
+  __atomic_store_n(&shared->header->directory_capacity, capacity, __ATOMIC_RELAXED);
+
+  return shared->directory;
+}
+
+void shared_write_end(Shared *shared, uint64_t length) {
+  assert(NULL != shared && shared->writer);
+  assert(length <= shared->directory_mapped);
+
+  uint64_t seq = shared->header->seq;
+
+  __atomic_store_n(&shared->header->directory_length, length, __ATOMIC_RELAXED);
+  if (seq & 1) {
+    __atomic_store_n(&shared->header->seq, seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+uint64_t shared_read_begin(Shared *shared) {
+  assert(NULL != shared);
+
+  uint64_t seq;
+
+  while ((seq = __atomic_load_n(&shared->header->seq, __ATOMIC_ACQUIRE)) & 1) {
+    sched_yield();
+  }
+
+  return seq;
+}
+
+const uint8_t *shared_directory(Shared *shared, uint64_t *length) {
+  assert(NULL != shared && NULL != length);
+
+  uint64_t capacity = __atomic_load_n(&shared->header->directory_capacity, __ATOMIC_RELAXED);
+
+  *length = __atomic_load_n(&shared->header->directory_length, __ATOMIC_RELAXED);
+  // the object is grown before the capacity says so, and never shrinks
+  if (capacity > shared->directory_mapped && 0 != map_directory(shared, capacity)) {
+    return NULL;
+  }
+  if (*length > shared->directory_mapped) {
+    return NULL;
+  }
+
+  return shared->directory;
+}
+
+int shared_read_retry(Shared *shared, uint64_t seq) {
+  assert(NULL != shared);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&shared->header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void shared_close(Shared *shared) {
+  if (NULL == shared) {
+    return;
+  }
+  if (NULL != shared->directory) {
+    munmap(shared->directory, shared->directory_mapped);
+  }
+  if (NULL != shared->header) {
+    munmap(shared->header, shared->mapped);
+  }
+  if (shared->fd >= 0) {
+    close(shared->fd);
+  }
+  free(shared);
+}
+
+void shared_unlink(const char *name) {
+  assert(NULL != name);
+
+  shm_unlink(name);
+}
@@ -0,0 +1,63 @@
+#ifndef _A5_SHARED
+#define _A5_SHARED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A POSIX shared memory object holding a filesystem's blocks and a
+// directory of its files, so other processes can read them in place. It's
+// laid out as a header page, the blocks, and then the directory, which
+// grows at the end of the object.
+//
+// One process writes, any number read. The writer makes a sequence number
+// odd before it changes blocks that are published or the directory, and
+// even again once it's done; readers take the number before they look and
+// check it afterwards, and look again if it changed. Readers never block
+// the writer.
+//
+// A Shared that's attached is only for one thread at a time: it keeps its
+// own mapping of the directory, which is moved as the directory grows.
+
+typedef struct SHARED Shared;
+
+// Creates the object called name (replacing one that's there) with room for
+// block_count blocks of block_size bytes, and an empty directory. Returns
+// NULL, with an error, if it can't be made.
+Shared *shared_create(const char *name, uint64_t block_count, uint32_t block_size);
+
+// Attaches to the object called name, to read it. Returns NULL, with an
+// error, if it isn't there or isn't one of these.
+Shared *shared_attach(const char *name);
+
+// the blocks, block_count * block_size bytes; only the writer may change them
+void *shared_blocks(Shared *shared);
+void shared_shape(Shared *shared, uint64_t *block_count, uint32_t *block_size);
+
+// writer: readers will look again, until shared_write_end
+void shared_write_begin(Shared *shared);
+
+// Writer: room for a directory of length bytes, between shared_write_begin
+// and shared_write_end; what was there before is kept, though the pointer
+// may move. NULL if the object couldn't grow.
+uint8_t *shared_directory_reserve(Shared *shared, uint64_t length);
+
+// writer: publishes the first length bytes of the directory
+void shared_write_end(Shared *shared, uint64_t length);
+
+// reader: the sequence number to check with shared_read_retry
+uint64_t shared_read_begin(Shared *shared);
+
+// Reader: the directory and its length. What it points at may be changing,
+// so nothing from it is safe to act on until shared_read_retry says so.
+// NULL if it can't be mapped, or was caught growing.
+const uint8_t *shared_directory(Shared *shared, uint64_t *length);
+
+// reader: non-zero if the writer changed anything since shared_read_begin
+int shared_read_retry(Shared *shared, uint64_t seq);
+
+void shared_close(Shared *shared);
+
+// removes the object called name; processes attached to it keep it
+void shared_unlink(const char *name);
+
+#endif
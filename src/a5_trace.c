@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "a5_trace.h"
+
+#define TRACE_NAME_LENGTH 32
+
+typedef struct {
+  IMFFSTracePhase phase;
+  const char *name; // always a string literal from the library
+  char file[TRACE_NAME_LENGTH];
+  uint64_t timestamp_ns;
+  uint64_t blocks;
+  uint32_t extents;
+} TraceRecord;
+
+struct TRACE_RING {
+  TraceRecord *records;
+  uint32_t capacity;
+  uint64_t count; // events ever recorded; the ring holds the last capacity of them
+};
+
+TraceRing *trace_ring_create(uint32_t capacity) {
+  assert(capacity > 0);
+
+  TraceRing *ring = NULL;
+
+  if (capacity > 0) {
+    ring = malloc(sizeof(TraceRing));
+    if (NULL != ring) {
+      ring->records = malloc(capacity * sizeof(TraceRecord));
+      if (NULL == ring->records) {
+        free(ring);
+        ring = NULL;
+      } else {
+        ring->capacity = capacity;
+        ring->count = 0;
+      }
+    }
+  }
+
+  return ring;
+}
+
+void trace_ring_record(const IMFFSTraceEvent *event, void *context) {
+  assert(NULL != event && NULL != context);
+
+  TraceRing *ring = context;
+  TraceRecord *record = &ring->records[ring->count % ring->capacity];
+
+  record->phase = event->phase;
+  record->name = event->name;
+  record->timestamp_ns = event->timestamp_ns;
+  record->blocks = event->blocks;
+  record->extents = event->extents;
+  if (NULL == event->file) {
+    record->file[0] = '\0';
+  } else {
+    strncpy(record->file, event->file, TRACE_NAME_LENGTH - 1);
+    record->file[TRACE_NAME_LENGTH - 1] = '\0';
+  }
+
+  ring->count++;
+}
+
+uint64_t trace_ring_count(TraceRing *ring) {
+  assert(NULL != ring);
+  return ring->count;
+}
+
+static void print_json_string(FILE *out, const char *text) {
+  fputc('"', out);
+  for (; '\0' != *text; text++) {
+    if ('"' == *text || '\\' == *text) {
+      fprintf(out, "\\%c", *text);
+    } else if ((unsigned char)*text < 0x20) {
+      fprintf(out, "\\u%04x", *text);
+    } else {
+      fputc(*text, out);
+    }
+  }
+  fputc('"', out);
+}
+
+int trace_ring_dump_json(TraceRing *ring, FILE *out) {
+  assert(NULL != ring && NULL != out);
+
+  uint64_t first;
+  TraceRecord *record;
+  int written = 0;
+
+  if (NULL == ring || NULL == out) {
+    return -1;
+  }
+
+  first = ring->count > ring->capacity ? ring->count - ring->capacity : 0;
+
+  fprintf(out, "{\"traceEvents\":[\n");
+  for (uint64_t i = first; i < ring->count; i++) {
+    record = &ring->records[i % ring->capacity];
+    fprintf(out, "%s{\"name\":", written > 0 ? ",\n" : "");
+    print_json_string(out, record->name);
+    fprintf(out, ",\"cat\":\"imffs\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1",
+            IMFFS_TRACE_BEGIN == record->phase ? 'B' : 'E', record->timestamp_ns / 1000.0);
+    fprintf(out, ",\"args\":{\"file\":");
+    print_json_string(out, record->file);
+    fprintf(out, ",\"blocks\":%llu,\"extents\":%u}}", (unsigned long long)record->blocks, record->extents);
+    written++;
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  return ferror(out) ? -1 : written;
+}
+
+void trace_ring_destroy(TraceRing *ring) {
+  if (NULL != ring) {
+    free(ring->records);
+    free(ring);
+  }
+}
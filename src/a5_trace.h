@@ -0,0 +1,29 @@
+#ifndef _A5_TRACE
+#define _A5_TRACE
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "a5_imffs.h"
+
+// A built-in tracer that keeps the most recent events in a ring buffer and
+// writes them out in the Chrome trace event format (chrome://tracing or
+// https://ui.perfetto.dev). Install it with:
+//
+//   imffs_set_tracer(fs, trace_ring_record, ring);
+
+typedef struct TRACE_RING TraceRing;
+
+TraceRing *trace_ring_create(uint32_t capacity);
+
+// an IMFFSTracer; context is the TraceRing
+void trace_ring_record(const IMFFSTraceEvent *event, void *context);
+
+uint64_t trace_ring_count(TraceRing *ring);
+
+// returns the number of events written, -1 on error
+int trace_ring_dump_json(TraceRing *ring, FILE *out);
+
+void trace_ring_destroy(TraceRing *ring);
+
+#endif
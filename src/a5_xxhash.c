@@ -0,0 +1,146 @@
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "a5_xxhash.h"
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+#define PRIME5 0x27d4eb2f165667c5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return value;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t value) {
+  acc ^= round64(0, value);
+  return acc * PRIME1 + PRIME4;
+}
+
+// one 32-byte stripe, 8 bytes into each accumulator
+static void stripe(uint64_t v[4], const uint8_t *p) {
+  v[0] = round64(v[0], read64(p));
+  v[1] = round64(v[1], read64(p + 8));
+  v[2] = round64(v[2], read64(p + 16));
+  v[3] = round64(v[3], read64(p + 24));
+}
+
+void xxh64_init(XXH64State *state, uint64_t seed) {
+  assert(NULL != state);
+
+  state->total_len = 0;
+  state->v[0] = seed + PRIME1 + PRIME2;
+  state->v[1] = seed + PRIME2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME1;
+  state->buffered = 0;
+}
+
+void xxh64_update(XXH64State *state, const void *data, size_t len) {
+  assert(NULL != state);
+  assert(NULL != data || 0 == len);
+
+  const uint8_t *next = data;
+  uint32_t fill;
+
+  state->total_len += len;
+
+  // finish a stripe started by the last call
+  if (state->buffered > 0) {
+    fill = 32 - state->buffered < len ? 32 - state->buffered : len;
+    memcpy(&state->buffer[state->buffered], next, fill);
+    state->buffered += fill;
+    next += fill;
+    len -= fill;
+    if (32 == state->buffered) {
+      stripe(state->v, state->buffer);
+      state->buffered = 0;
+    }
+  }
+
+  while (len >= 32) {
+    stripe(state->v, next);
+    next += 32;
+    len -= 32;
+  }
+
+  if (len > 0) {
+    memcpy(state->buffer, next, len);
+    state->buffered = len;
+  }
+}
+
+uint64_t xxh64_digest(const XXH64State *state) {
+  assert(NULL != state);
+
+  const uint8_t *next = state->buffer;
+  uint32_t len = state->buffered;
+  uint64_t hash;
+
+  if (state->total_len >= 32) {
+    hash = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+    for (int i = 0; i < 4; i++) {
+      hash = merge_round(hash, state->v[i]);
+    }
+  } else {
+    // v[2] is still the seed
+    hash = state->v[2] + PRIME5;
+  }
+  hash += state->total_len;
+
+  while (len >= 8) {
+    hash ^= round64(0, read64(next));
+    hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    next += 8;
+    len -= 8;
+  }
+  if (len >= 4) {
+    hash ^= read32(next) * PRIME1;
+    hash = rotl(hash, 23) * PRIME2 + PRIME3;
+    next += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    hash ^= *next++ * PRIME5;
+    hash = rotl(hash, 11) * PRIME1;
+    len--;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+
+  return hash;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  XXH64State state;
+
+  xxh64_init(&state, seed);
+  xxh64_update(&state, data, len);
+
+  return xxh64_digest(&state);
+}
@@ -0,0 +1,25 @@
+#ifndef _A5_XXHASH
+#define _A5_XXHASH
+
+#include <stdint.h>
+#include <stddef.h>
+
+// XXH64, a fast non-cryptographic 64-bit hash, fed a piece at a time: the
+// result doesn't depend on how the data is split between xxh64_update calls.
+typedef struct {
+  uint64_t total_len;
+  uint64_t v[4];       // one accumulator per 8 bytes of each 32-byte stripe
+  uint8_t buffer[32];  // the start of a stripe that hasn't all arrived
+  uint32_t buffered;
+} XXH64State;
+
+void xxh64_init(XXH64State *state, uint64_t seed);
+
+void xxh64_update(XXH64State *state, const void *data, size_t len);
+
+uint64_t xxh64_digest(const XXH64State *state);
+
+// all at once
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif